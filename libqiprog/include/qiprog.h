@@ -49,6 +49,16 @@ enum qiprog_log_level {
 	QIPROG_LOG_SPEW = 5, /**< Print way too many messages. */
 };
 
+/**
+ * @brief Callback for messages, see @ref qiprog_set_log_cb
+ *
+ * @param[in] level Severity of the message
+ * @param[in] msg The message, without a trailing newline
+ * @param[in] user_data Pointer passed to @ref qiprog_set_log_cb()
+ */
+typedef void (*qiprog_log_cb) (enum qiprog_log_level level, const char *msg,
+			       void *user_data);
+
 /**
  * @brief Specify different bus types supported by QiProg devices.
  *
@@ -64,6 +74,17 @@ enum qiprog_bus {
 	QIPROG_BUS_AUD = (1 << 6),
 };
 
+/**
+ * @brief Instruction sets QiProg devices can execute
+ *
+ * These values may be OR'ed together to specify more than one instruction set
+ */
+enum qiprog_lang {
+	QIPROG_LANG_SPI = (1 << 0),
+	/** Bus cycle bytecode, see @ref qiprog_isa_op */
+	QIPROG_LANG_BUS = (1 << 1),
+};
+
 /**
  * @brief QiProg error codes
  */
@@ -74,6 +95,7 @@ typedef enum qiprog_error {
 	QIPROG_ERR_ARG = -3,		/**< Illegal argument passed */
 	QIPROG_ERR_TIMEOUT = -4,	/**< Programmer operation timed out */
 	QIPROG_ERR_LARGE_ARG = -5,	/**< Argument too large */
+	QIPROG_ERR_BUSY = -6,		/**< Another operation is in progress */
 
 	QIPROG_ERR_CHIP_TIMEOUT = -20,	/**< Flash chip operation timed out */
 	QIPROG_ERR_NO_RESPONSE = -21,	/**< Flash chip did not respond */
@@ -95,7 +117,7 @@ struct qiprog_capabilities {
 	 * Note that a QiProg device may not support any instruction set, in which case
 	 * capabilities.instruction_set = 0.
 	 *
-	 * This feature is in the TODO stage and should not be relied upon.
+	 * This is also the largest program the device accepts.
 	 */
 	uint32_t max_direct_data;
 	/**
@@ -105,6 +127,19 @@ struct qiprog_capabilities {
 	 * exactly 10 voltages.
 	 */
 	uint16_t voltages[10];
+	/**
+	 * bitwise OR of QIPROG_READ_CMD_BIT() of the read commands the device
+	 * can use on SPI, see @ref qiprog_set_read_command. The normal read
+	 * always works, so devices which do not know about read commands
+	 * report 0.
+	 */
+	uint16_t read_cmds;
+	/**
+	 * bitwise OR of QIPROG_BULK_ENCODING_BIT() of the encodings the device
+	 * can expand bulk writes from, besides raw data. See
+	 * @ref qiprog_bulk_encoding.
+	 */
+	uint16_t bulk_encodings;
 };
 
 /**
@@ -167,19 +202,368 @@ enum qiprog_write_subcmd {
 	QIPROG_WRITE_SUBCMD_CUSTOM = 0xff
 };
 
+/**
+ * @brief Commands used to read SPI chips, see @ref qiprog_set_read_command
+ *
+ * The faster commands move more bits per clock, and most chips allow a higher
+ * clock with them than with the normal read.
+ */
+enum qiprog_read_cmd {
+	/** Read (0x03), which every chip has */
+	QIPROG_READ_CMD_NORMAL = 0,
+	/** Fast read (0x0b), with a dummy byte after the address */
+	QIPROG_READ_CMD_FAST = 1,
+	/** Dual output fast read (0x3b), data on two lines */
+	QIPROG_READ_CMD_DUAL_OUTPUT = 2,
+	/** Quad I/O fast read (0xeb), address and data on four lines */
+	QIPROG_READ_CMD_QUAD_IO = 3,
+};
+
+/** Bit of a read command in @ref qiprog_capabilities.read_cmds */
+#define QIPROG_READ_CMD_BIT(cmd)	(1 << (cmd))
+
+/**
+ * @brief How bulk write data is sent to the programmer
+ *
+ * Drivers pick the encoding on their own, based on what the device lists in
+ * @ref qiprog_capabilities.bulk_encodings.
+ */
+enum qiprog_bulk_encoding {
+	/** Data is sent as it is written */
+	QIPROG_BULK_RAW = 0,
+	/** Data is run-length encoded, see doc/qiprog_protocol.md */
+	QIPROG_BULK_RLE = 1,
+};
+
+/** Bit of an encoding in @ref qiprog_capabilities.bulk_encodings */
+#define QIPROG_BULK_ENCODING_BIT(enc)	(1 << (enc))
+
+/**
+ * @brief Digests the programmer can compute, see @ref qiprog_checksum
+ */
+enum qiprog_checksum_algo {
+	/** CRC-32, as in zlib, 4 bytes */
+	QIPROG_CHECKSUM_CRC32 = 0x01,
+};
+
+/**
+ * @brief Opcodes of the @ref QIPROG_LANG_BUS instruction set
+ *
+ * A program is a sequence of instructions, each an opcode byte followed by its
+ * operands. There are 16 32-bit registers, r0 to r15, which start at 0. When
+ * an instruction takes two registers, they are packed in one byte with
+ * @ref QIPROG_ISA_REGS(). A lone register goes in the upper nibble. Immediate
+ * values and jump targets are LE coded. Jump targets are offsets from the start
+ * of the program. doc/qiprog_protocol.md lists the operands of each opcode.
+ */
+enum qiprog_isa_op {
+	/** Stop, and report success */
+	QIPROG_ISA_END = 0x00,
+	/** r = imm32 */
+	QIPROG_ISA_SET = 0x01,
+	/** d = s */
+	QIPROG_ISA_MOV = 0x02,
+	/** d = d + s */
+	QIPROG_ISA_ADD = 0x03,
+	/** d = d - s */
+	QIPROG_ISA_SUB = 0x04,
+	/** d = d & s */
+	QIPROG_ISA_AND = 0x05,
+	/** d = d | s */
+	QIPROG_ISA_OR = 0x06,
+	/** d = d ^ s */
+	QIPROG_ISA_XOR = 0x07,
+	/** r = r << imm8 */
+	QIPROG_ISA_SHL = 0x08,
+	/** r = r >> imm8 */
+	QIPROG_ISA_SHR = 0x09,
+	/** d = byte 's' of the program itself, for data stored after the code */
+	QIPROG_ISA_LDB = 0x0a,
+	/** d = 8/16/32-bit read of the chip at address s */
+	QIPROG_ISA_RD8 = 0x10,
+	QIPROG_ISA_RD16 = 0x11,
+	QIPROG_ISA_RD32 = 0x12,
+	/** 8/16/32-bit write of s to the chip at address d */
+	QIPROG_ISA_WR8 = 0x13,
+	QIPROG_ISA_WR16 = 0x14,
+	QIPROG_ISA_WR32 = 0x15,
+	/** Jump to target */
+	QIPROG_ISA_JMP = 0x20,
+	/** Jump to target if d == s */
+	QIPROG_ISA_BEQ = 0x21,
+	/** Jump to target if d != s */
+	QIPROG_ISA_BNE = 0x22,
+	/** r = r - 1, then jump to target if r != 0 */
+	QIPROG_ISA_DJNZ = 0x23,
+	/** Wait for imm32 microseconds */
+	QIPROG_ISA_DELAY = 0x28,
+	/** Append the low 8/16/32 bits of r to the output, LE coded */
+	QIPROG_ISA_OUT8 = 0x30,
+	QIPROG_ISA_OUT16 = 0x31,
+	QIPROG_ISA_OUT32 = 0x32,
+	/** Stop, and report failure */
+	QIPROG_ISA_FAIL = 0x3f,
+};
+
+/** Pack two register numbers for a @ref qiprog_isa_op instruction */
+#define QIPROG_ISA_REGS(d, s)	((((d) & 0xf) << 4) | ((s) & 0xf))
+
+/**
+ * @brief Operations which can be part of a batch
+ */
+enum qiprog_op_type {
+	QIPROG_OP_READ8 = 0x01,
+	QIPROG_OP_READ16 = 0x02,
+	QIPROG_OP_READ32 = 0x03,
+	QIPROG_OP_WRITE8 = 0x04,
+	QIPROG_OP_WRITE16 = 0x05,
+	QIPROG_OP_WRITE32 = 0x06,
+	/** Wait for 'addr' microseconds before the next operation */
+	QIPROG_OP_DELAY_US = 0x07,
+};
+
+/**
+ * @brief One operation in a batch, see @ref qiprog_exec_batch
+ */
+struct qiprog_op {
+	/** What to do, see @ref qiprog_op_type */
+	uint8_t type;
+	/** Address to access, or time to wait in microseconds */
+	uint32_t addr;
+	/** Value to write, or where the value read is stored */
+	uint32_t data;
+};
+
+/** Number of buckets in @ref qiprog_stats.ctrl_latency */
+#define QIPROG_LATENCY_BUCKETS	8
+
+/**
+ * @brief Performance counters of a device, see @ref qiprog_get_stats
+ */
+struct qiprog_stats {
+	/** Bytes moved by bulk reads and writes */
+	uint64_t bytes_in;
+	uint64_t bytes_out;
+	/** Bulk transfers which came back, in each direction */
+	uint32_t transfers_in;
+	uint32_t transfers_out;
+	/** Bulk transfers which moved less data than expected */
+	uint32_t short_transfers;
+	/** Bulk transfers which could not be submitted again */
+	uint32_t resubmit_failures;
+	/** Bulk operations continued from where they failed */
+	uint32_t bulk_retries;
+	/** Time from the start to the end of bulk operations, in microseconds */
+	uint64_t bulk_time_us;
+	/** Control requests sent, and how many of them failed */
+	uint32_t ctrl_requests;
+	uint32_t ctrl_errors;
+	/** Time spent in control requests, in microseconds */
+	uint64_t ctrl_time_us;
+	/**
+	 * Control requests by latency. Bucket i counts the requests which took
+	 * less than 128 << i microseconds, and more than the bucket before.
+	 * The last bucket counts all slower requests.
+	 */
+	uint32_t ctrl_latency[QIPROG_LATENCY_BUCKETS];
+	/** Bulk operations which did not need to set the address range first */
+	uint32_t set_address_saved;
+	/**
+	 * Time spent handling USB events, in microseconds. This is shared by
+	 * all devices of a context.
+	 */
+	uint64_t event_time_us;
+};
+
+/** Number of control requests counted in @ref qiprog_device_stats.reqs */
+#define QIPROG_STATS_NUM_REQS	0x40
+
+/**
+ * @brief Counters kept by the device itself, see @ref qiprog_get_device_stats
+ *
+ * Counters wrap around, so compare two readings by subtracting them.
+ */
+struct qiprog_device_stats {
+	/** The device has a clock. Without one, all times are 0. */
+	uint8_t timed;
+	/** Bulk packets received from the host, and sent to it */
+	uint32_t packets_rx;
+	uint32_t packets_tx;
+	/** Packets the USB stack could not take, and which were offered again */
+	uint32_t tx_retries;
+	/**
+	 * Times the device could not read ahead, because the host had not yet
+	 * taken the packets already read, and how long that lasted in
+	 * microseconds
+	 */
+	uint32_t starved;
+	uint32_t starved_us;
+	/**
+	 * Time spent reading, writing and erasing the chip, in microseconds.
+	 * This includes waiting for the chip to be ready.
+	 */
+	uint32_t read_us;
+	uint32_t write_us;
+	uint32_t erase_us;
+	/** Control requests received, by bRequest */
+	uint16_t reqs[QIPROG_STATS_NUM_REQS];
+	/** Control requests with a bRequest too large for 'reqs' */
+	uint32_t other_reqs;
+};
+
 /** Opaque QiProg context */
 struct qiprog_context;
 /** Opaque QiProg device */
 struct qiprog_device;
 
+/**
+ * @brief Events reported during asynchronous bulk operations
+ */
+enum qiprog_transfer_event {
+	/** Part of the data was transferred. More events will follow. */
+	QIPROG_TRANSFER_PROGRESS = 0,
+	/** The operation finished, successfully or not. This is the last event */
+	QIPROG_TRANSFER_COMPLETE = 1,
+};
+
+/**
+ * @brief Callback for asynchronous bulk operations
+ *
+ * @param[in] dev Device the operation was started on
+ * @param[in] event What happened, see @ref qiprog_transfer_event
+ * @param[in] status QIPROG_SUCCESS, or the error which ended the operation
+ * @param[in] done Number of bytes transferred so far
+ * @param[in] total Total number of bytes in the operation
+ * @param[in] user_data Pointer passed when the operation was started
+ */
+typedef void (*qiprog_transfer_cb) (struct qiprog_device *dev,
+				    enum qiprog_transfer_event event,
+				    qiprog_err status, uint32_t done,
+				    uint32_t total, void *user_data);
+
+/**
+ * @brief Changes reported to a @ref qiprog_hotplug_cb
+ */
+enum qiprog_hotplug_event {
+	/** A device was found */
+	QIPROG_DEVICE_ARRIVED = 1,
+	/** A device went away. Its handle stays valid, but operations fail. */
+	QIPROG_DEVICE_LEFT = 2,
+};
+
+/**
+ * @brief Callback for devices coming and going
+ *
+ * @param[in] ctx Context the device belongs to
+ * @param[in] dev The device
+ * @param[in] event What happened, see @ref qiprog_hotplug_event
+ * @param[in] user_data Pointer passed to @ref qiprog_set_hotplug_cb()
+ */
+typedef void (*qiprog_hotplug_cb) (struct qiprog_context *ctx,
+				   struct qiprog_device *dev,
+				   enum qiprog_hotplug_event event,
+				   void *user_data);
+
+/**
+ * @brief File descriptor to watch for QiProg events
+ */
+struct qiprog_pollfd {
+	/** The file descriptor */
+	int fd;
+	/** Events to wait for, as in poll(2): POLLIN, POLLOUT */
+	short events;
+};
+
+/**
+ * @brief A range of addresses on the chip
+ */
+struct qiprog_range {
+	uint32_t start;
+	uint32_t len;
+};
+
+/**
+ * @brief A range of the chip, and the memory it is read to or written from
+ */
+struct qiprog_segment {
+	/** Address of the range on the chip */
+	uint32_t addr;
+	/** Data to write, or where to store what is read */
+	void *data;
+	/** Number of bytes in the range */
+	uint32_t len;
+};
+
+/**
+ * @brief Consecutive erase blocks of the same size, see @ref qiprog_erase_op
+ */
+struct qiprog_erase_run {
+	/** Address of the first block */
+	uint32_t start;
+	/** Size of each block */
+	uint32_t size;
+	/** Number of blocks */
+	uint32_t count;
+};
+
+/**
+ * @brief One way a chip can erase, see @ref qiprog_plan_erase
+ */
+struct qiprog_erase_op {
+	enum qiprog_erase_type type;
+	/** Typical time to erase one block, in microseconds */
+	uint32_t time_us;
+	/** Blocks this operation erases */
+	const struct qiprog_erase_run *runs;
+	size_t num_runs;
+};
+
+/**
+ * @brief Consecutive blocks erased by the same operation
+ */
+struct qiprog_erase_step {
+	/** Index of the operation in the list given to the planner */
+	size_t op;
+	enum qiprog_erase_type type;
+	uint32_t block_size;
+	uint32_t start;
+	uint32_t len;
+};
+
+/**
+ * @brief Result of @ref qiprog_plan_erase
+ */
+struct qiprog_erase_plan {
+	struct qiprog_erase_step *steps;
+	size_t num_steps;
+	/** Bytes erased, which all need programming again */
+	uint64_t erased;
+	/** Estimated time of the erases and programming, in microseconds */
+	uint64_t time_us;
+};
+
 QIPROG_BEGIN_DECLS
 
 qiprog_err qiprog_init(struct qiprog_context **ctx);
 void qiprog_set_loglevel(enum qiprog_log_level level);
+void qiprog_set_log_cb(qiprog_log_cb cb, void *user_data);
+qiprog_err qiprog_set_log_ring(size_t size);
+size_t qiprog_read_log_ring(char *buf, size_t len);
 qiprog_err qiprog_exit(struct qiprog_context *ctx);
+size_t qiprog_get_pollfds(struct qiprog_context *ctx,
+			  struct qiprog_pollfd *fds, size_t max_fds);
+qiprog_err qiprog_handle_events_timeout(struct qiprog_context *ctx,
+					uint32_t timeout_ms);
+qiprog_err qiprog_start_event_thread(struct qiprog_context *ctx);
+qiprog_err qiprog_stop_event_thread(struct qiprog_context *ctx);
 size_t qiprog_get_device_list(struct qiprog_context *ctx,
 			      struct qiprog_device ***list);
+void qiprog_free_device_list(struct qiprog_device **list);
+qiprog_err qiprog_set_hotplug_cb(struct qiprog_context *ctx,
+				 qiprog_hotplug_cb cb, void *user_data);
 qiprog_err qiprog_open_device(struct qiprog_device *dev);
+qiprog_err qiprog_close_device(struct qiprog_device *dev);
+const char *qiprog_get_serial(struct qiprog_device *dev);
 qiprog_err qiprog_get_capabilities(struct qiprog_device *dev,
 				   struct qiprog_capabilities *caps);
 qiprog_err qiprog_set_bus(struct qiprog_device *dev, enum qiprog_bus bus);
@@ -190,6 +574,19 @@ qiprog_err qiprog_read(struct qiprog_device *dev, uint32_t where, void *dest,
 		       uint32_t n);
 qiprog_err qiprog_write(struct qiprog_device *dev, uint32_t where, void *src,
 			uint32_t n);
+qiprog_err qiprog_read_async(struct qiprog_device *dev, uint32_t where,
+			     void *dest, uint32_t n, qiprog_transfer_cb cb,
+			     void *user_data);
+qiprog_err qiprog_write_async(struct qiprog_device *dev, uint32_t where,
+			      void *src, uint32_t n, qiprog_transfer_cb cb,
+			      void *user_data);
+qiprog_err qiprog_readv(struct qiprog_device *dev,
+			const struct qiprog_segment *segs, size_t num_segs);
+qiprog_err qiprog_writev(struct qiprog_device *dev,
+			 const struct qiprog_segment *segs, size_t num_segs);
+qiprog_err qiprog_resume(struct qiprog_device *dev);
+qiprog_err qiprog_set_retries(struct qiprog_device *dev, uint8_t retries,
+			      uint32_t delay_ms);
 qiprog_err qiprog_set_erase_size(struct qiprog_device *dev, uint8_t chip_idx,
 				 enum qiprog_erase_type *types, uint32_t *sizes,
 				 size_t num_sizes);
@@ -208,8 +605,16 @@ qiprog_err qiprog_set_custom_write_command(struct qiprog_device *dev,
 					   uint8_t chip_idx,
 					   uint32_t *addr, uint8_t *data,
 					   size_t num_bytes);
+qiprog_err qiprog_set_read_command(struct qiprog_device *dev, uint8_t chip_idx,
+				   enum qiprog_read_cmd cmd);
 qiprog_err qiprog_set_chip_size(struct qiprog_device *dev, uint8_t chip_idx,
 				uint32_t size);
+qiprog_err qiprog_erase(struct qiprog_device *dev, uint8_t chip_idx,
+			uint32_t where, uint32_t n);
+qiprog_err qiprog_select_chip(struct qiprog_device *dev, uint8_t chip_idx);
+qiprog_err qiprog_write_chips(struct qiprog_device *dev, const uint8_t *chips,
+			      size_t num_chips, uint32_t where, void *src,
+			      uint32_t n, uint32_t chunk);
 qiprog_err qiprog_set_spi_timing(struct qiprog_device *dev,
 				 uint16_t tpu_read_us, uint32_t tces_ns);
 qiprog_err qiprog_read8(struct qiprog_device *dev, uint32_t addr,
@@ -225,6 +630,33 @@ qiprog_err qiprog_write16(struct qiprog_device *dev, uint32_t addr,
 qiprog_err qiprog_write32(struct qiprog_device *dev, uint32_t addr,
 			  uint32_t data);
 qiprog_err qiprog_set_vdd(struct qiprog_device *dev, uint16_t vdd_mv);
+qiprog_err qiprog_exec_batch(struct qiprog_device *dev, struct qiprog_op *ops,
+			     size_t num_ops);
+qiprog_err qiprog_run_program(struct qiprog_device *dev, void *prog,
+			      uint16_t len, void *out, uint16_t max_out,
+			      uint16_t *out_len);
+qiprog_err qiprog_checksum(struct qiprog_device *dev, uint32_t where,
+			   uint32_t n, uint32_t block_size,
+			   enum qiprog_checksum_algo algo, uint32_t *digests);
+uint32_t qiprog_crc32(uint32_t crc, const void *data, uint32_t n);
+qiprog_err qiprog_shadow_enable(struct qiprog_device *dev, uint32_t size,
+				uint32_t block_size);
+qiprog_err qiprog_shadow_disable(struct qiprog_device *dev);
+qiprog_err qiprog_shadow_invalidate(struct qiprog_device *dev, uint32_t where,
+				    uint32_t n);
+qiprog_err qiprog_get_stats(struct qiprog_device *dev,
+			    struct qiprog_stats *stats);
+qiprog_err qiprog_reset_stats(struct qiprog_device *dev);
+qiprog_err qiprog_get_device_stats(struct qiprog_device *dev,
+				   struct qiprog_device_stats *stats);
+qiprog_err qiprog_set_progress_cb(struct qiprog_device *dev,
+				  qiprog_transfer_cb cb, void *user_data);
+uint32_t qiprog_find_data(const void *data, uint32_t n, uint32_t min_gap,
+			  uint32_t *start);
+qiprog_err qiprog_plan_erase(const struct qiprog_erase_op *ops, size_t num_ops,
+			     const struct qiprog_range *dirty, size_t num_dirty,
+			     uint32_t program_ns, struct qiprog_erase_plan *plan);
+void qiprog_free_erase_plan(struct qiprog_erase_plan *plan);
 
 QIPROG_END_DECLS
 #endif				/* __QIPROG_H */
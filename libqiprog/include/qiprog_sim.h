@@ -0,0 +1,64 @@
+/*
+ * qiprog - Reference implementation of the QiProg protocol
+ *
+ * Copyright (C) 2013 Alexandru Gagniuc <mr.nuke.me@gmail.com>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+#ifndef __QIPROG_SIM_H
+#define __QIPROG_SIM_H
+
+#include <qiprog.h>
+
+/**
+ * @brief How long the simulated programmer takes to do things
+ *
+ * The simulator adds up the time each operation would take on real hardware.
+ * It only waits for 'scale' percent of that time, so that the host side can be
+ * profiled on its own with a scale of 0.
+ */
+struct qiprog_sim_timing {
+	/** Cost of every request, like a USB round trip, in microseconds */
+	uint32_t request_us;
+	/**
+	 * Time to read one byte from the chip, in nanoseconds. On SPI, it
+	 * follows from the clock and the read command instead.
+	 */
+	uint32_t read_ns;
+	/** Time to program one byte, in nanoseconds */
+	uint32_t program_ns;
+	/** Time to erase one erase block, in microseconds */
+	uint32_t erase_us;
+	/** Percentage of the modelled time the simulator really waits */
+	uint32_t scale;
+};
+
+QIPROG_BEGIN_DECLS
+
+qiprog_err qiprog_sim_set_timing(struct qiprog_device *dev,
+				 const struct qiprog_sim_timing *timing);
+qiprog_err qiprog_sim_get_timing(struct qiprog_device *dev,
+				 struct qiprog_sim_timing *timing);
+qiprog_err qiprog_sim_get_chip_time(struct qiprog_device *dev,
+				    uint64_t *time_us);
+
+QIPROG_END_DECLS
+
+#endif				/* __QIPROG_SIM_H */
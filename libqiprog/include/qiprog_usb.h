@@ -49,14 +49,103 @@ enum qiprog_usb_ctrl_req_type {
 	QIPROG_SET_ERASE_COMMAND = 0x06,
 	QIPROG_SET_WRITE_COMMAND = 0x07,
 	QIPROG_SET_CHIP_SIZE = 0x08,
+	QIPROG_ERASE = 0x09,
+	QIPROG_SET_CHECKSUM = 0x0a,
+	QIPROG_GET_CHECKSUM = 0x0b,
+	QIPROG_SET_BULK_ENCODING = 0x0c,
+	QIPROG_GET_STATS = 0x0d,
 	QIPROG_SET_SPI_TIMING = 0x20,
+	QIPROG_SET_READ_COMMAND = 0x21,
 	QIPROG_READ8 = 0x30,
 	QIPROG_READ16 = 0x31,
 	QIPROG_READ32 = 0x32,
 	QIPROG_WRITE8 = 0x33,
 	QIPROG_WRITE16 = 0x34,
 	QIPROG_WRITE32 = 0x35,
+	QIPROG_EXEC_BATCH = 0x36,
+	QIPROG_GET_BATCH_RESULT = 0x37,
 	QIPROG_SET_VDD = 0xf0,
 };
 
+/**
+ * @brief Maximum size of a batch, or of its results, in one control transfer
+ */
+#define QIPROG_BATCH_MAX_LEN	64
+
+/**
+ * @brief Size of an encoded batch operation, without the data written
+ */
+#define QIPROG_BATCH_OP_LEN	5
+
+/**
+ * @brief Number of data bytes a batch operation reads or writes
+ *
+ * @return 1, 2 or 4 for reads and writes, 0 for delays and invalid operations
+ */
+static inline uint8_t qiprog_op_width(uint8_t type)
+{
+	switch (type) {
+	case QIPROG_OP_READ8:
+	case QIPROG_OP_WRITE8:
+		return sizeof(uint8_t);
+	case QIPROG_OP_READ16:
+	case QIPROG_OP_WRITE16:
+		return sizeof(uint16_t);
+	case QIPROG_OP_READ32:
+	case QIPROG_OP_WRITE32:
+		return sizeof(uint32_t);
+	default:
+		return 0;
+	}
+}
+
+/**
+ * @brief Is the batch operation a read?
+ */
+static inline int qiprog_op_is_read(uint8_t type)
+{
+	return (type >= QIPROG_OP_READ8) && (type <= QIPROG_OP_READ32);
+}
+
+/**
+ * @brief Is the batch operation a write?
+ */
+static inline int qiprog_op_is_write(uint8_t type)
+{
+	return (type >= QIPROG_OP_WRITE8) && (type <= QIPROG_OP_WRITE32);
+}
+
+/**
+ * @brief Maximum size of the digests returned by one QIPROG_GET_CHECKSUM
+ */
+#define QIPROG_CHECKSUM_MAX_LEN	64
+
+/**
+ * @brief Size of the status header the device sends before program output
+ */
+#define QIPROG_ISA_HEADER_LEN	4
+
+/**
+ * @brief What QIPROG_GET_STATS returns, selected by wValue
+ */
+enum qiprog_usb_stats_page {
+	/** QIPROG_STATS_LEN bytes of counters, each LE32 */
+	QIPROG_STATS_COUNTERS = 0,
+	/**
+	 * One LE16 count for each bRequest, starting with the one in wIndex,
+	 * for as many as fit in wLength
+	 */
+	QIPROG_STATS_REQUESTS = 1,
+};
+
+/**
+ * @brief Size of the QIPROG_STATS_COUNTERS page
+ */
+#define QIPROG_STATS_LEN	0x28
+
+/**
+ * @brief The times in the QIPROG_STATS_COUNTERS page were measured
+ */
+#define QIPROG_STATS_TIMED	(1 << 0)
+
 #endif				/* __QIPROG_USB_H */
@@ -29,6 +29,7 @@
 #include "../src/qiprog_internal.h"
 
 typedef uint16_t (*qiprog_packet_io_cb) (void *data, uint16_t len);
+typedef uint32_t (*qiprog_clock_cb) (void);
 
 void qiprog_change_device(struct qiprog_device *new_dev);
 
@@ -40,6 +41,19 @@ qiprog_err qiprog_usb_dev_init(qiprog_packet_io_cb send_packet,
 			       qiprog_packet_io_cb recv_packet,
 			       uint16_t max_rx_packet, uint16_t max_tx_packet,
 			       uint8_t *bulk_buf);
+qiprog_err qiprog_usb_dev_init_buf(qiprog_packet_io_cb send_packet,
+				   qiprog_packet_io_cb recv_packet,
+				   uint16_t max_rx_packet,
+				   uint16_t max_tx_packet,
+				   uint8_t *bulk_buf, uint32_t bulk_buf_len);
+qiprog_err qiprog_usb_dev_set_write_bufs(uint8_t *buf, uint32_t buf_len,
+					 uint16_t unit);
+qiprog_err qiprog_usb_dev_init_isa(qiprog_packet_io_cb send_packet,
+				   qiprog_packet_io_cb recv_packet,
+				   uint16_t max_packet,
+				   uint8_t *prog_buf, uint16_t prog_buf_len,
+				   uint8_t *out_buf, uint16_t out_buf_len);
+void qiprog_usb_dev_set_clock(qiprog_clock_cb now_us);
 void qiprog_handle_events(void);
 
 #endif				/* __QIPROG_USB_DEV_H */
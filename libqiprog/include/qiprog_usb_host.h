@@ -27,5 +27,16 @@
 
 #include <qiprog_usb.h>
 #include <libusb.h>
+#include <stdbool.h>
+
+QIPROG_BEGIN_DECLS
+
+qiprog_err qiprog_usb_set_queue_depth(struct qiprog_device *dev,
+				      uint32_t depth);
+qiprog_err qiprog_usb_set_transfer_size(struct qiprog_device *dev,
+					uint32_t size);
+qiprog_err qiprog_usb_set_compression(struct qiprog_device *dev, bool enable);
+
+QIPROG_END_DECLS
 
 #endif				/* __QIPROG_USB_HOST_H */
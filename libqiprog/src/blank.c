@@ -0,0 +1,148 @@
+/*
+ * qiprog - Reference implementation of the QiProg protocol
+ *
+ * Copyright (C) 2013 Alexandru Gagniuc <mr.nuke.me@gmail.com>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+#include "qiprog_internal.h"
+
+/**
+ * @defgroup blank QiProg blank region detection
+ *
+ * @ingroup chip_io
+ *
+ * @brief Find the parts of an image which actually need to be written
+ *
+ * Erased flash reads back as all ones. Once a range is erased, any part of an
+ * image which is all 0xff is already on the chip, and does not need to be sent
+ * to the programmer, nor programmed. Firmware images are often mostly padding,
+ * so skipping it can save a good part of the write time.
+ *
+ * The scan is done one machine word at a time, which keeps it well below the
+ * cost of the transfer it saves.
+ */
+/** @{ */
+
+/* 0x0101...01 and 0x8080...80 for the width of a word */
+#define ONES	((uintptr_t)-1 / 0xff)
+#define HIGHS	(ONES * 0x80)
+
+/* True if any byte in the word is zero */
+#define HAS_ZERO_BYTE(w)	(((w) - ONES) & ~(w) & HIGHS)
+
+#define ERASED_BYTE	0xff
+#define ERASED_WORD	((uintptr_t)-1)
+
+/*
+ * Number of erased bytes at the start of the buffer
+ */
+static uint32_t blank_len(const uint8_t *data, uint32_t n)
+{
+	uint32_t i = 0;
+	const uintptr_t *word;
+
+	/* Get to a word boundary one byte at a time */
+	while ((i < n) && ((uintptr_t)(data + i) % sizeof(*word))) {
+		if (data[i] != ERASED_BYTE)
+			return i;
+		i++;
+	}
+
+	for (word = (const void *)(data + i); n - i >= sizeof(*word); word++) {
+		if (*word != ERASED_WORD)
+			break;
+		i += sizeof(*word);
+	}
+
+	while ((i < n) && (data[i] == ERASED_BYTE))
+		i++;
+
+	return i;
+}
+
+/*
+ * Number of bytes at the start of the buffer before the first erased byte
+ */
+static uint32_t data_len(const uint8_t *data, uint32_t n)
+{
+	uint32_t i = 0;
+	const uintptr_t *word;
+
+	while ((i < n) && ((uintptr_t)(data + i) % sizeof(*word))) {
+		if (data[i] == ERASED_BYTE)
+			return i;
+		i++;
+	}
+
+	/* An erased byte in the word is a zero byte in its complement */
+	for (word = (const void *)(data + i); n - i >= sizeof(*word); word++) {
+		if (HAS_ZERO_BYTE(~*word))
+			break;
+		i += sizeof(*word);
+	}
+
+	while ((i < n) && (data[i] != ERASED_BYTE))
+		i++;
+
+	return i;
+}
+
+/**
+ * @brief Find the first run of data which is not blank
+ *
+ * Looks for the first byte which is not in the erased state, and for the end of
+ * the run of data starting there. Blank gaps shorter than 'min_gap' are part of
+ * the run, since skipping over them costs more than sending them.
+ *
+ * To walk a whole image, call this again starting at the end of the last run.
+ * Everything between runs, and after the last run, is blank.
+ *
+ * @param[in] data Buffer to scan
+ * @param[in] n Size of buffer in bytes
+ * @param[in] min_gap Shortest blank gap to leave out of a run
+ * @param[out] start Offset of the first byte of the run in the buffer
+ *
+ * @return the length of the run in bytes, or 0 if the buffer is blank
+ */
+uint32_t qiprog_find_data(const void *data, uint32_t n, uint32_t min_gap,
+			  uint32_t *start)
+{
+	uint32_t pos, gap;
+	const uint8_t *buf = data;
+
+	pos = blank_len(buf, n);
+	*start = pos;
+
+	while (pos < n) {
+		pos += data_len(buf + pos, n - pos);
+		if (pos == n)
+			break;
+		gap = blank_len(buf + pos, n - pos);
+		/* Trailing blanks are never part of the run */
+		if ((gap >= min_gap) || (pos + gap == n))
+			break;
+		pos += gap;
+	}
+
+	return pos - *start;
+}
+
+/** @} */
@@ -0,0 +1,113 @@
+/*
+ * qiprog - Reference implementation of the QiProg protocol
+ *
+ * Copyright (C) 2013 Alexandru Gagniuc <mr.nuke.me@gmail.com>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+#include "qiprog_internal.h"
+
+/**
+ * @defgroup checksum QiProg checksums
+ *
+ * @ingroup chip_io
+ *
+ * @brief Compare the contents of a chip without reading it back
+ *
+ * The programmer can compute a digest of any range of the chip, or one digest
+ * per block of the range. Comparing those against digests of an image tells
+ * which blocks differ, for a fraction of the bus traffic of a full read back.
+ */
+/** @{ */
+
+/*
+ * CRC-32 of every nibble, for the reflected polynomial 0xedb88320. This is
+ * small enough for programmers, and fast enough for the host.
+ */
+static const uint32_t crc32_nibble[16] = {
+	0x00000000, 0x1db71064, 0x3b6e20c8, 0x26d930ac,
+	0x76dc4190, 0x6b6b51f4, 0x4db26158, 0x5005713c,
+	0xedb88320, 0xf00f9344, 0xd6d6a3e8, 0xcb61b38c,
+	0x9b64c2b0, 0x86d3d2d4, 0xa00ae278, 0xbdbdf21c,
+};
+
+/**
+ * @brief Update a CRC-32 with more data
+ *
+ * This is the CRC-32 of zlib, Ethernet and PNG. Start with a crc of 0, and
+ * feed the data in as many pieces as needed.
+ *
+ * @param[in] crc CRC-32 of the data before this piece, or 0
+ * @param[in] data Data to add
+ * @param[in] n Number of bytes in data
+ *
+ * @return The CRC-32 of all data so far
+ */
+uint32_t qiprog_crc32(uint32_t crc, const void *data, uint32_t n)
+{
+	const uint8_t *byte = data;
+
+	crc = ~crc;
+	while (n--) {
+		crc ^= *byte++;
+		crc = (crc >> 4) ^ crc32_nibble[crc & 0xf];
+		crc = (crc >> 4) ^ crc32_nibble[crc & 0xf];
+	}
+
+	return ~crc;
+}
+
+/**
+ * @brief Compute digests of a range of the flash chip on the programmer
+ *
+ * With a block_size of 0, a single digest of the range [where, where + n) is
+ * stored in digests[0]. Otherwise, the range is split in blocks of block_size
+ * bytes, the last one possibly shorter, and one digest per block is stored.
+ *
+ * @param[in] dev Device to operate on
+ * @param[in] where Address of the first byte
+ * @param[in] n Number of bytes to include
+ * @param[in] block_size Size of each block, or 0
+ * @param[in] algo Which digest to compute, see @ref qiprog_checksum_algo
+ * @param[out] digests Where to store the digests. It must have room for
+ *		       (n + block_size - 1) / block_size entries.
+ *
+ * @return QIPROG_SUCCESS on success, or a QIPROG_ERR code otherwise.
+ * QIPROG_ERR means the device can not compute digests; reading the range back
+ * is the only way to know what is on the chip.
+ */
+qiprog_err qiprog_checksum(struct qiprog_device *dev, uint32_t where,
+			   uint32_t n, uint32_t block_size,
+			   enum qiprog_checksum_algo algo, uint32_t *digests)
+{
+	QIPROG_RETURN_ON_BAD_DEV(dev);
+
+	if ((n == 0) || (digests == NULL))
+		return QIPROG_ERR_ARG;
+	if (algo != QIPROG_CHECKSUM_CRC32)
+		return QIPROG_ERR_ARG;
+	/* Not all drivers can compute digests */
+	if (!dev->drv->checksum)
+		return QIPROG_ERR;
+
+	return dev->drv->checksum(dev, where, n, block_size, algo, digests);
+}
+
+/** @} */
@@ -24,6 +24,8 @@
 
 #include "qiprog_internal.h"
 
+#include <string.h>
+
 /**
  * @ingroup discovery
  */
@@ -48,6 +50,26 @@ qiprog_err qiprog_open_device(struct qiprog_device *dev)
 	return dev->drv->dev_open(dev);
 }
 
+/**
+ * @brief Close a QiProg device
+ *
+ * Releases any resources acquired by @ref qiprog_open_device(). The device may
+ * be opened again later.
+ *
+ * @param[in] dev Device to operate on
+ *
+ * @return QIPROG_SUCCESS on success, or a QIPROG_ERR code otherwise.
+ */
+qiprog_err qiprog_close_device(struct qiprog_device *dev)
+{
+	QIPROG_RETURN_ON_BAD_DEV(dev);
+	qiprog_shadow_disable(dev);
+	/* Not all drivers need to release anything */
+	if (!dev->drv->dev_close)
+		return QIPROG_SUCCESS;
+	return dev->drv->dev_close(dev);
+}
+
 /**
  * @brief Query a device for its capabilities
  *
@@ -66,6 +88,8 @@ qiprog_err qiprog_get_capabilities(struct qiprog_device *dev,
 				   struct qiprog_capabilities *caps)
 {
 	QIPROG_RETURN_ON_BAD_DEV(dev);
+	/* Drivers which predate a field leave it at 0 */
+	memset(caps, 0, sizeof(*caps));
 	return dev->drv->get_capabilities(dev, caps);
 }
 
@@ -102,6 +126,8 @@ qiprog_err qiprog_get_capabilities(struct qiprog_device *dev,
 qiprog_err qiprog_set_bus(struct qiprog_device *dev, enum qiprog_bus bus)
 {
 	QIPROG_RETURN_ON_BAD_DEV(dev);
+	/* A different bus means a different chip */
+	qi_shadow_drop(dev);
 	return dev->drv->set_bus(dev, bus);
 }
 
@@ -132,16 +158,33 @@ qiprog_err qiprog_set_bus(struct qiprog_device *dev, enum qiprog_bus bus)
 qiprog_err qiprog_set_clock(struct qiprog_device *dev, uint32_t *clock_khz)
 {
 	QIPROG_RETURN_ON_BAD_DEV(dev);
+	/* Not all drivers can change the clock */
+	if (!dev->drv->set_clock)
+		return QIPROG_ERR;
 	return dev->drv->set_clock(dev, clock_khz);
 }
 
 /**
- * @brief TODO
+ * @brief Set the power-up and chip select timing of SPI chips
+ *
+ * TPU-READ is the time the chip needs after power-up before it can be read.
+ * TCES is the time from selecting the chip to the first clock edge. The
+ * defaults of 50 us and 100 ns suit most chips. Slow chips, or long wires, may
+ * need more.
+ *
+ * @param[in] dev Device to operate on
+ * @param[in] tpu_read_us TPU-READ, in microseconds
+ * @param[in] tces_ns TCES, in nanoseconds, up to 65535
+ *
+ * @return QIPROG_SUCCESS on success, or a QIPROG_ERR code otherwise.
  */
 qiprog_err qiprog_set_spi_timing(struct qiprog_device *dev,
 				 uint16_t tpu_read_us, uint32_t tces_ns)
 {
 	QIPROG_RETURN_ON_BAD_DEV(dev);
+	/* Not all drivers have an SPI bus */
+	if (!dev->drv->set_spi_timing)
+		return QIPROG_ERR;
 	return dev->drv->set_spi_timing(dev, tpu_read_us, tces_ns);
 }
 
@@ -153,13 +196,16 @@ qiprog_err qiprog_set_spi_timing(struct qiprog_device *dev,
  *
  * @param[in] dev Device to operate on
  * @param[in] vdd_mv voltage in millivolts. This must be supported by the
- *		     QiProg device
+ *		     QiProg device. 0 turns the supply off.
  *
  * @return QIPROG_SUCCESS on success, or a QIPROG_ERR code otherwise.
  */
 qiprog_err qiprog_set_vdd(struct qiprog_device *dev, uint16_t vdd_mv)
 {
 	QIPROG_RETURN_ON_BAD_DEV(dev);
+	/* Not all drivers can control the supply */
+	if (!dev->drv->set_vdd)
+		return QIPROG_ERR;
 	return dev->drv->set_vdd(dev, vdd_mv);
 }
 
@@ -204,6 +250,20 @@ qiprog_err qiprog_set_vdd(struct qiprog_device *dev, uint16_t vdd_mv)
  *	qiprog_write8(dev, control_regs_addr + sector_index, 0xd0);
  * @endcode
  *
+ * Every one of these calls is a round trip to the device. When a sequence is
+ * known in advance, it can be sent all at once with @ref qiprog_exec_batch(),
+ * which only pays for one or a few round trips:
+ * @code{.c}
+ *	struct qiprog_op ops[] = {
+ *		{QIPROG_OP_WRITE8, control_regs_addr, 0x30},
+ *		{QIPROG_OP_WRITE8, control_regs_addr + sector_index, 0xd0},
+ *		{QIPROG_OP_DELAY_US, 50, 0},
+ *		{QIPROG_OP_READ8, control_regs_addr, 0},
+ *	};
+ *	qiprog_exec_batch(dev, ops, 4);
+ *	// ops[3].data now holds the status register
+ * @endcode
+ *
  * @warning
  * Avoid using fine-grained IO for bulk operations. Do not try to read or write
  * the chip with this mechanism, as it it slow and inefficient.
@@ -265,22 +325,315 @@ qiprog_err qiprog_set_vdd(struct qiprog_device *dev, uint16_t vdd_mv)
 qiprog_err qiprog_read_chip_id(struct qiprog_device *dev,
 			       struct qiprog_chip_id ids[9])
 {
+	qiprog_err ret;
+
 	QIPROG_RETURN_ON_BAD_DEV(dev);
-	return dev->drv->read_chip_id(dev, ids);
+	ret = dev->drv->read_chip_id(dev, ids);
+	if (ret == QIPROG_SUCCESS)
+		qi_shadow_chip_id(dev, &ids[0]);
+	return ret;
+}
+
+/**
+ * @brief Remember a bulk operation, so that it can be resumed if it fails
+ */
+static void checkpoint_start(struct qiprog_device *dev, uint32_t where,
+			     void *buf, uint32_t n, int write)
+{
+	struct qiprog_checkpoint *cp = &dev->checkpoint;
+
+	cp->buf = buf;
+	cp->where = where;
+	cp->len = n;
+	cp->write = write;
+	cp->base = cp->done = 0;
+}
+
+/**
+ * @brief Go on with the last bulk operation, from where it got to
+ */
+static qiprog_err checkpoint_continue(struct qiprog_device *dev)
+{
+	uint32_t left;
+	struct qiprog_checkpoint *cp = &dev->checkpoint;
+
+	cp->base += MIN(cp->done, cp->len - cp->base);
+	cp->done = 0;
+	if ((left = cp->len - cp->base) == 0)
+		return QIPROG_SUCCESS;
+
+	dev->stats.bulk_retries++;
+	if (cp->write)
+		return dev->drv->write(dev, cp->where + cp->base,
+				       cp->buf + cp->base, left);
+	return dev->drv->read(dev, cp->where + cp->base, cp->buf + cp->base,
+			      left);
+}
+
+/**
+ * @brief Try again, a few times, when the transfers of a bulk operation fail
+ *
+ * Each try starts where the one before it got to. Tries which get further do
+ * not count against the limit, so a long operation on a marginal link keeps
+ * going, but one which cannot make progress gives up. Errors which do not come
+ * from the transfers, like bad arguments, are not retried.
+ *
+ * Only the host waits between tries. Firmware builds have no way to sleep, and
+ * try again right away.
+ */
+static qiprog_err checkpoint_retry(struct qiprog_device *dev, qiprog_err ret)
+{
+	uint8_t tries = 0;
+	uint32_t reached;
+	uint64_t delay_ms = dev->retry_delay_ms;
+	struct qiprog_checkpoint *cp = &dev->checkpoint;
+
+	while (((ret == QIPROG_ERR) || (ret == QIPROG_ERR_TIMEOUT)) &&
+	       (tries < dev->bulk_retries)) {
+		reached = cp->base + MIN(cp->done, cp->len - cp->base);
+		qi_pwarn("Bulk %s failed at 0x%.8x, trying again in %u ms",
+			 cp->write ? "write" : "read", cp->where + reached,
+			 (unsigned int)delay_ms);
+#if CONFIG_DRIVER_USB_MASTER || CONFIG_DRIVER_SIM
+		qi_sleep_us(delay_ms * 1000);
+#endif
+
+		ret = checkpoint_continue(dev);
+		if (cp->base + cp->done > reached) {
+			tries = 0;
+			delay_ms = dev->retry_delay_ms;
+		} else {
+			tries++;
+			delay_ms *= 2;
+		}
+	}
+
+	return ret;
 }
 
+/**
+ * @brief Read from the flash chip
+ *
+ * If a shadow copy is kept with @ref qiprog_shadow_enable(), and it holds the
+ * whole range, the data comes from the copy.
+ *
+ * If the transfers fail, the read goes on from where they stopped, as set with
+ * @ref qiprog_set_retries().
+ *
+ * @param[in] dev Device to operate on
+ * @param[in] where Address in the flash chip from where to start reading
+ * @param[out] dest Location where to store the data
+ * @param[in] n Number of bytes to read
+ *
+ * @return QIPROG_SUCCESS on success, or a QIPROG_ERR code otherwise.
+ */
 qiprog_err qiprog_read(struct qiprog_device *dev, uint32_t where, void *dest,
 		       uint32_t n)
 {
+	qiprog_err ret;
+
 	QIPROG_RETURN_ON_BAD_DEV(dev);
-	return dev->drv->read(dev, where, dest, n);
+	checkpoint_start(dev, where, dest, n, 0);
+	if (qi_shadow_read(dev, where, dest, n) == QIPROG_SUCCESS) {
+		dev->checkpoint.done = n;
+		return QIPROG_SUCCESS;
+	}
+
+	ret = dev->drv->read(dev, where, dest, n);
+	if (ret != QIPROG_SUCCESS)
+		ret = checkpoint_retry(dev, ret);
+	if (ret == QIPROG_SUCCESS)
+		qi_shadow_update(dev, where, dest, n, 0);
+	return ret;
 }
 
+/**
+ * @brief Write to the flash chip
+ *
+ * If the transfers fail, the write goes on from where they stopped, as set with
+ * @ref qiprog_set_retries().
+ *
+ * @param[in] dev Device to operate on
+ * @param[in] where Address in the flash chip where to start writing
+ * @param[in] src Data to write
+ * @param[in] n Number of bytes to write
+ *
+ * @return QIPROG_SUCCESS on success, or a QIPROG_ERR code otherwise.
+ */
 qiprog_err qiprog_write(struct qiprog_device *dev, uint32_t where, void *src,
 			uint32_t n)
 {
+	qiprog_err ret;
+
 	QIPROG_RETURN_ON_BAD_DEV(dev);
-	return dev->drv->write(dev, where, src, n);
+	checkpoint_start(dev, where, src, n, 1);
+	ret = dev->drv->write(dev, where, src, n);
+	if (ret != QIPROG_SUCCESS)
+		ret = checkpoint_retry(dev, ret);
+	if (ret == QIPROG_SUCCESS)
+		qi_shadow_update(dev, where, src, n, 1);
+	else
+		qiprog_shadow_invalidate(dev, where, n);
+	return ret;
+}
+
+/**
+ * @brief Start reading from the flash chip without waiting for the data
+ *
+ * Returns as soon as the read is started. The operation then progresses while
+ * the application calls @ref qiprog_handle_events_timeout(), or in the event
+ * thread started with @ref qiprog_start_event_thread(). 'cb' is called
+ * with QIPROG_TRANSFER_PROGRESS as data arrives, and exactly once with
+ * QIPROG_TRANSFER_COMPLETE when the read ends, successfully or not. 'dest' must
+ * remain valid until then.
+ *
+ * Only one bulk operation may be in progress on a device at a time. Other
+ * devices may run their own operations at the same time.
+ *
+ * If the driver cannot do this asynchronously, or if no USB traffic is needed,
+ * 'cb' may be called before this function returns. This is the case when the
+ * data comes from the shadow copy, see @ref qiprog_read().
+ *
+ * @param[in] dev Device to operate on
+ * @param[in] where Address in the flash chip from where to start reading
+ * @param[out] dest Location where to store the data
+ * @param[in] n Number of bytes to read
+ * @param[in] cb Function to call on progress and completion
+ * @param[in] user_data Pointer passed to 'cb'
+ *
+ * @return QIPROG_SUCCESS if the operation was started, or a QIPROG_ERR code
+ *	   otherwise. 'cb' is not called when the operation could not start.
+ */
+qiprog_err qiprog_read_async(struct qiprog_device *dev, uint32_t where,
+			     void *dest, uint32_t n, qiprog_transfer_cb cb,
+			     void *user_data)
+{
+	qiprog_err ret;
+
+	QIPROG_RETURN_ON_BAD_DEV(dev);
+	if (!cb)
+		return QIPROG_ERR_ARG;
+	if (qi_shadow_read(dev, where, dest, n) == QIPROG_SUCCESS) {
+		checkpoint_start(dev, where, dest, n, 0);
+		dev->checkpoint.done = n;
+		cb(dev, QIPROG_TRANSFER_COMPLETE, QIPROG_SUCCESS, n, n,
+		   user_data);
+		return QIPROG_SUCCESS;
+	}
+	if (dev->drv->read_async) {
+		checkpoint_start(dev, where, dest, n, 0);
+		qi_shadow_track(dev, where, dest, n, 0, &cb, &user_data);
+		ret = dev->drv->read_async(dev, where, dest, n, cb, user_data);
+		if (ret != QIPROG_SUCCESS)
+			qi_shadow_untrack(dev);
+		return ret;
+	}
+
+	/* Driver can only do blocking reads */
+	ret = qiprog_read(dev, where, dest, n);
+	cb(dev, QIPROG_TRANSFER_COMPLETE, ret, (ret == QIPROG_SUCCESS) ? n : 0,
+	   n, user_data);
+	return QIPROG_SUCCESS;
+}
+
+/**
+ * @brief Start writing to the flash chip without waiting for completion
+ *
+ * This is the asynchronous version of @ref qiprog_write(). Completion is
+ * reported the same way as for @ref qiprog_read_async(). 'src' must remain
+ * valid until 'cb' is called with QIPROG_TRANSFER_COMPLETE.
+ *
+ * @param[in] dev Device to operate on
+ * @param[in] where Address in the flash chip where to start writing
+ * @param[in] src Data to write
+ * @param[in] n Number of bytes to write
+ * @param[in] cb Function to call on progress and completion
+ * @param[in] user_data Pointer passed to 'cb'
+ *
+ * @return QIPROG_SUCCESS if the operation was started, or a QIPROG_ERR code
+ *	   otherwise. 'cb' is not called when the operation could not start.
+ */
+qiprog_err qiprog_write_async(struct qiprog_device *dev, uint32_t where,
+			      void *src, uint32_t n, qiprog_transfer_cb cb,
+			      void *user_data)
+{
+	qiprog_err ret;
+
+	QIPROG_RETURN_ON_BAD_DEV(dev);
+	if (!cb)
+		return QIPROG_ERR_ARG;
+	if (dev->drv->write_async) {
+		checkpoint_start(dev, where, src, n, 1);
+		qi_shadow_track(dev, where, src, n, 1, &cb, &user_data);
+		ret = dev->drv->write_async(dev, where, src, n, cb, user_data);
+		if (ret != QIPROG_SUCCESS)
+			qi_shadow_untrack(dev);
+		return ret;
+	}
+
+	/* Driver can only do blocking writes */
+	ret = qiprog_write(dev, where, src, n);
+	cb(dev, QIPROG_TRANSFER_COMPLETE, ret, (ret == QIPROG_SUCCESS) ? n : 0,
+	   n, user_data);
+	return QIPROG_SUCCESS;
+}
+
+/**
+ * @brief Finish the last bulk read or write, after it failed
+ *
+ * Drivers keep track of how much of a bulk operation is known to have made it,
+ * and only the rest is transferred again. Blocking operations already do this
+ * on their own, see @ref qiprog_set_retries(). This is for asynchronous ones,
+ * which report their failure to their callback, and for blocking ones which ran
+ * out of retries.
+ *
+ * The buffer given to the operation must still be valid. This blocks until the
+ * operation is done, or has failed again as many times as allowed. Progress of
+ * what is left goes to the callback set with @ref qiprog_set_progress_cb().
+ *
+ * @param[in] dev Device to operate on
+ *
+ * @return QIPROG_SUCCESS once the whole operation is done, or a QIPROG_ERR code
+ * otherwise. The operation may be resumed again after a failure.
+ */
+qiprog_err qiprog_resume(struct qiprog_device *dev)
+{
+	qiprog_err ret;
+	struct qiprog_checkpoint *cp;
+
+	QIPROG_RETURN_ON_BAD_DEV(dev);
+	cp = &dev->checkpoint;
+
+	ret = checkpoint_continue(dev);
+	if (ret != QIPROG_SUCCESS)
+		ret = checkpoint_retry(dev, ret);
+	if (ret == QIPROG_SUCCESS)
+		qi_shadow_update(dev, cp->where, cp->buf, cp->len, cp->write);
+	return ret;
+}
+
+/**
+ * @brief Set how failed bulk operations are retried
+ *
+ * A blocking bulk operation whose transfers fail goes on from where it got to,
+ * after waiting 'delay_ms'. Each retry which does not get any further waits
+ * twice as long as the one before it. The operation fails once 'retries' of
+ * those have gone by. The defaults are 3 retries, starting at 10 ms.
+ *
+ * @param[in] dev Device to operate on
+ * @param[in] retries Number of retries without progress, or 0 to fail right
+ *		      away
+ * @param[in] delay_ms Time to wait before the first retry
+ *
+ * @return QIPROG_SUCCESS on success, or a QIPROG_ERR code otherwise.
+ */
+qiprog_err qiprog_set_retries(struct qiprog_device *dev, uint8_t retries,
+			      uint32_t delay_ms)
+{
+	QIPROG_RETURN_ON_BAD_DEV(dev);
+	dev->bulk_retries = retries;
+	dev->retry_delay_ms = delay_ms;
+	return QIPROG_SUCCESS;
 }
 
 /**
@@ -340,6 +693,8 @@ qiprog_err qiprog_set_custom_erase_command(struct qiprog_device *dev,
 					   size_t num_bytes)
 {
 	QIPROG_RETURN_ON_BAD_DEV(dev);
+	/* We can not tell what the sequence does to the chip */
+	qi_shadow_drop(dev);
 	return dev->drv->set_custom_erase_command(dev, chip_idx, addr, data,
 						  num_bytes);
 }
@@ -380,10 +735,39 @@ qiprog_err qiprog_set_custom_write_command(struct qiprog_device *dev,
 					   size_t num_bytes)
 {
 	QIPROG_RETURN_ON_BAD_DEV(dev);
+	/* We can not tell what the sequence does to the chip */
+	qi_shadow_drop(dev);
 	return dev->drv->set_custom_write_command(dev, chip_idx, addr, data,
 						  num_bytes);
 }
 
+/**
+ * @brief Pick the command the programmer reads an SPI chip with
+ *
+ * Bulk reads use the normal read command unless told otherwise. The faster
+ * commands need both the chip and the programmer to support them, see
+ * @ref qiprog_capabilities.read_cmds. The fast commands usually allow a higher
+ * clock, which should be set afterwards with @ref qiprog_set_clock().
+ *
+ * @param[in] dev Device to operate on
+ * @param[in] chip_idx Index of chip in array returned by @ref read_chip_id
+ * @param[in] cmd Read command to use
+ *
+ * @return QIPROG_SUCCESS on success, or a QIPROG_ERR code otherwise.
+ */
+qiprog_err qiprog_set_read_command(struct qiprog_device *dev, uint8_t chip_idx,
+				   enum qiprog_read_cmd cmd)
+{
+	QIPROG_RETURN_ON_BAD_DEV(dev);
+	if (cmd > QIPROG_READ_CMD_QUAD_IO)
+		return QIPROG_ERR_ARG;
+	/* Drivers which do not know about read commands use the normal one */
+	if (!dev->drv->set_read_command)
+		return (cmd == QIPROG_READ_CMD_NORMAL) ? QIPROG_SUCCESS
+						       : QIPROG_ERR;
+	return dev->drv->set_read_command(dev, chip_idx, cmd);
+}
+
 /**
  * @brief Inform the programmer of the size of connected chips
  *
@@ -399,6 +783,139 @@ qiprog_err qiprog_set_chip_size(struct qiprog_device *dev, uint8_t chip_idx,
 	QIPROG_RETURN_ON_BAD_DEV(dev);
 	return dev->drv->set_chip_size(dev, chip_idx, size);
 }
+
+/**
+ * @brief Erase a range of the flash chip
+ *
+ * Erases every erase block which overlaps the range [where, where + n). The
+ * erase geometry is the one given with @ref qiprog_set_erase_size(), and the
+ * sequence is the one given with @ref qiprog_set_erase_command().
+ *
+ * This allows erasing only some parts of the chip. When doing so, the erase
+ * command should be set up without @ref QIPROG_ERASE_BEFORE_WRITE, otherwise
+ * the programmer will erase the blocks a second time when they are written.
+ *
+ * @param[in] dev Device to operate on
+ * @param[in] chip_idx Index of chip in array returned by @ref read_chip_id
+ * @param[in] where Address of the first byte to erase
+ * @param[in] n Number of bytes to erase
+ *
+ * @return QIPROG_SUCCESS on success, or a QIPROG_ERR code otherwise.
+ */
+qiprog_err qiprog_erase(struct qiprog_device *dev, uint8_t chip_idx,
+			uint32_t where, uint32_t n)
+{
+	QIPROG_RETURN_ON_BAD_DEV(dev);
+	/* Not all drivers can erase on request */
+	if (!dev->drv->erase)
+		return QIPROG_ERR;
+	/* The shadow copy is that of the chip bulk operations go to */
+	if (chip_idx == dev->chip_idx)
+		qiprog_shadow_invalidate(dev, where, n);
+	return dev->drv->erase(dev, chip_idx, where, n);
+}
+
+/**
+ * @brief Pick the chip bulk operations and digests go to
+ *
+ * A programmer may have several chips connected, as returned by
+ * @ref qiprog_read_chip_id. Reads, writes and checksums work on one chip at a
+ * time, the first one unless told otherwise. Byte accesses always go to the
+ * first chip.
+ *
+ * A shadow copy, if enabled, only holds the contents of one chip. It starts
+ * over when another chip is picked.
+ *
+ * This may not be called while an asynchronous bulk operation is in progress.
+ *
+ * @param[in] dev Device to operate on
+ * @param[in] chip_idx Index of chip in array returned by @ref read_chip_id
+ *
+ * @return QIPROG_SUCCESS on success, or a QIPROG_ERR code otherwise.
+ */
+qiprog_err qiprog_select_chip(struct qiprog_device *dev, uint8_t chip_idx)
+{
+	QIPROG_RETURN_ON_BAD_DEV(dev);
+	if (chip_idx >= 9)
+		return QIPROG_ERR_ARG;
+	if (chip_idx == dev->chip_idx)
+		return QIPROG_SUCCESS;
+
+	dev->chip_idx = chip_idx;
+	/* The address range of the device is that of the other chip */
+	dev->addr.end = 0;
+	qi_shadow_drop(dev);
+	return QIPROG_SUCCESS;
+}
+
+/**
+ * @brief Erase and write the same data to several chips on one programmer
+ *
+ * Instead of programming one chip after the other, the data goes out one chunk
+ * at a time, to each chip in turn. Right after a chip gets its chunk, the next
+ * chunk of that chip is erased. Programmers which return from an erase while
+ * the chip is still busy, as multi-chip programmers do, keep erasing a chip
+ * while the other chips are written. With enough chips, the erase time is
+ * hidden behind the transfers.
+ *
+ * The chips are erased explicitly, so the erase command should be set up
+ * without @ref QIPROG_ERASE_BEFORE_WRITE. 'where' and 'chunk' should be
+ * multiples of the erase size, since each erase covers every erase block a
+ * chunk touches.
+ *
+ * When it returns, the chip picked with @ref qiprog_select_chip is the same as
+ * before the call.
+ *
+ * @param[in] dev Device to operate on
+ * @param[in] chips Indexes of the chips to write, as returned by
+ *		    @ref read_chip_id
+ * @param[in] num_chips Number of entries in 'chips'
+ * @param[in] where Address in the flash chips where to start writing
+ * @param[in] src Data to write
+ * @param[in] n Number of bytes to write to each chip
+ * @param[in] chunk Number of bytes to write to one chip before the next one
+ *
+ * @return QIPROG_SUCCESS on success, or the QIPROG_ERR code of the first
+ * operation which failed.
+ */
+qiprog_err qiprog_write_chips(struct qiprog_device *dev, const uint8_t *chips,
+			      size_t num_chips, uint32_t where, void *src,
+			      uint32_t n, uint32_t chunk)
+{
+	size_t i;
+	uint8_t old_chip;
+	uint32_t done, len, next;
+	qiprog_err ret = QIPROG_SUCCESS;
+
+	QIPROG_RETURN_ON_BAD_DEV(dev);
+	if (!chips || !num_chips || !src || !chunk)
+		return QIPROG_ERR_ARG;
+
+	old_chip = dev->chip_idx;
+	for (i = 0; (i < num_chips) && (ret == QIPROG_SUCCESS); i++)
+		ret = qiprog_erase(dev, chips[i], where, MIN(n, chunk));
+
+	for (done = 0; (done < n) && (ret == QIPROG_SUCCESS); done += len) {
+		len = MIN(n - done, chunk);
+		next = done + len;
+		for (i = 0; i < num_chips; i++) {
+			if ((ret = qiprog_select_chip(dev, chips[i])) ||
+			    (ret = qiprog_write(dev, where + done,
+						(uint8_t *)src + done, len)))
+				break;
+			if (next == n)
+				continue;
+			ret = qiprog_erase(dev, chips[i], where + next,
+					   MIN(n - next, chunk));
+			if (ret != QIPROG_SUCCESS)
+				break;
+		}
+	}
+
+	qiprog_select_chip(dev, old_chip);
+	return ret;
+}
+
 /**
  * @brief Read a byte from the flash chip
  *
@@ -467,6 +984,8 @@ qiprog_err qiprog_read32(struct qiprog_device *dev, uint32_t addr,
 qiprog_err qiprog_write8(struct qiprog_device *dev, uint32_t addr, uint8_t data)
 {
 	QIPROG_RETURN_ON_BAD_DEV(dev);
+	/* Usually part of a command sequence, which may change the chip */
+	qi_shadow_drop(dev);
 	return dev->drv->write8(dev, addr, data);
 }
 
@@ -490,6 +1009,8 @@ qiprog_err qiprog_write16(struct qiprog_device *dev, uint32_t addr,
 			  uint16_t data)
 {
 	QIPROG_RETURN_ON_BAD_DEV(dev);
+	/* Usually part of a command sequence, which may change the chip */
+	qi_shadow_drop(dev);
 	return dev->drv->write16(dev, addr, data);
 }
 
@@ -509,7 +1030,214 @@ qiprog_err qiprog_write32(struct qiprog_device *dev, uint32_t addr,
 			  uint32_t data)
 {
 	QIPROG_RETURN_ON_BAD_DEV(dev);
+	/* Usually part of a command sequence, which may change the chip */
+	qi_shadow_drop(dev);
 	return dev->drv->write32(dev, addr, data);
 }
 
+/**
+ * @brief Execute a sequence of reads, writes and delays
+ *
+ * The operations are done in order, as if each was done with the matching
+ * fine-grained call. Drivers which can do so send the whole sequence to the
+ * programmer at once, instead of paying for a round trip per operation. The
+ * value of each read is stored in the 'data' member of its operation.
+ *
+ * @param[in] dev Device to operate on
+ * @param[in,out] ops Operations to execute, see @ref qiprog_op
+ * @param[in] num_ops Number of operations in 'ops'
+ *
+ * @return QIPROG_SUCCESS on success, or a QIPROG_ERR code otherwise. When an
+ * operation fails, the ones after it are not executed.
+ */
+qiprog_err qiprog_exec_batch(struct qiprog_device *dev, struct qiprog_op *ops,
+			     size_t num_ops)
+{
+	size_t i;
+	uint8_t reg8;
+	uint16_t reg16;
+	qiprog_err ret;
+	struct qiprog_op *op;
+
+	QIPROG_RETURN_ON_BAD_DEV(dev);
+	/* Batches are command sequences too */
+	qi_shadow_drop(dev);
+
+	if (dev->drv->exec_batch)
+		return dev->drv->exec_batch(dev, ops, num_ops);
+
+	/* The driver can not do better, so do one operation at a time */
+	for (i = 0; i < num_ops; i++) {
+		op = &ops[i];
+		switch (op->type) {
+		case QIPROG_OP_READ8:
+			ret = dev->drv->read8(dev, op->addr, &reg8);
+			op->data = reg8;
+			break;
+		case QIPROG_OP_READ16:
+			ret = dev->drv->read16(dev, op->addr, &reg16);
+			op->data = reg16;
+			break;
+		case QIPROG_OP_READ32:
+			ret = dev->drv->read32(dev, op->addr, &op->data);
+			break;
+		case QIPROG_OP_WRITE8:
+			ret = dev->drv->write8(dev, op->addr, op->data);
+			break;
+		case QIPROG_OP_WRITE16:
+			ret = dev->drv->write16(dev, op->addr, op->data);
+			break;
+		case QIPROG_OP_WRITE32:
+			ret = dev->drv->write32(dev, op->addr, op->data);
+			break;
+		case QIPROG_OP_DELAY_US:
+			/* Only the driver knows how to wait */
+			if (!dev->drv->delay_us)
+				return QIPROG_ERR_ARG;
+			ret = dev->drv->delay_us(dev, op->addr);
+			break;
+		default:
+			return QIPROG_ERR_ARG;
+		}
+		if (ret != QIPROG_SUCCESS)
+			return ret;
+	}
+
+	return QIPROG_SUCCESS;
+}
+
+/**
+ * @brief Run a program on the programmer
+ *
+ * Runs a program of the @ref QIPROG_LANG_BUS instruction set. Programmers
+ * which advertise this instruction set in their capabilities run the program
+ * themselves, without a round trip to the host for every bus cycle. For other
+ * programmers, the program is run by the host, one bus cycle at a time. The
+ * result is the same either way.
+ *
+ * @param[in] dev Device to operate on
+ * @param[in] prog The program, see @ref qiprog_isa_op
+ * @param[in] len Size of the program in bytes
+ * @param[out] out Where to store the output of the program
+ * @param[in] max_out Size of the 'out' buffer
+ * @param[out] out_len Number of bytes of output
+ *
+ * @return QIPROG_SUCCESS if the program completed, QIPROG_ERR if it failed
+ * with QIPROG_ISA_FAIL, or another QIPROG_ERR code otherwise.
+ */
+qiprog_err qiprog_run_program(struct qiprog_device *dev, void *prog,
+			      uint16_t len, void *out, uint16_t max_out,
+			      uint16_t *out_len)
+{
+	QIPROG_RETURN_ON_BAD_DEV(dev);
+	if (!prog || !out_len || (max_out && !out))
+		return QIPROG_ERR_ARG;
+	/* Programs can do anything to the chip */
+	qi_shadow_drop(dev);
+
+	if (dev->drv->run_program)
+		return dev->drv->run_program(dev, prog, len, out, max_out,
+					     out_len);
+
+	return qiprog_isa_exec(dev, prog, len, out, max_out, out_len);
+}
+
+/** @} */
+
+/**
+ * @defgroup stats QiProg performance counters
+ *
+ * @ingroup qiprog_public
+ *
+ * @brief <b>Find out how fast, and how well, a device moves data</b>
+ *
+ * Drivers count the bytes and transfers they move, the control requests they
+ * send and how long those take. Slow programmers, bad cables and flaky hubs all
+ * show up in these numbers. Drivers which do not keep counters report zeros.
+ */
+/** @{ */
+
+/**
+ * @brief Get the performance counters of a device
+ *
+ * @param[in] dev Device to operate on
+ * @param[out] stats Where to store the counters
+ *
+ * @return QIPROG_SUCCESS on success, or a QIPROG_ERR code otherwise.
+ */
+qiprog_err qiprog_get_stats(struct qiprog_device *dev,
+			    struct qiprog_stats *stats)
+{
+	QIPROG_RETURN_ON_BAD_DEV(dev);
+	if (!stats)
+		return QIPROG_ERR_ARG;
+
+	*stats = dev->stats;
+	stats->event_time_us = dev->ctx ? dev->ctx->event_time_us : 0;
+	return QIPROG_SUCCESS;
+}
+
+/**
+ * @brief Start counting again from zero
+ *
+ * The time spent handling events is shared by all devices of the context, and
+ * is not reset.
+ *
+ * @param[in] dev Device to operate on
+ *
+ * @return QIPROG_SUCCESS on success, or a QIPROG_ERR code otherwise.
+ */
+qiprog_err qiprog_reset_stats(struct qiprog_device *dev)
+{
+	QIPROG_RETURN_ON_BAD_DEV(dev);
+	memset(&dev->stats, 0, sizeof(dev->stats));
+	return QIPROG_SUCCESS;
+}
+
+/**
+ * @brief Get the counters the device keeps about itself
+ *
+ * Where @ref qiprog_get_stats() tells how the host sees the device, these tell
+ * where the time goes inside it: reading or writing the chip, or waiting for
+ * the host to take packets. Devices without a clock only count events.
+ *
+ * @param[in] dev Device to operate on
+ * @param[out] stats Where to store the counters
+ *
+ * @return QIPROG_SUCCESS on success, or a QIPROG_ERR code otherwise.
+ */
+qiprog_err qiprog_get_device_stats(struct qiprog_device *dev,
+				   struct qiprog_device_stats *stats)
+{
+	QIPROG_RETURN_ON_BAD_DEV(dev);
+	if (!stats)
+		return QIPROG_ERR_ARG;
+	if (!dev->drv->get_device_stats)
+		return QIPROG_ERR;
+
+	return dev->drv->get_device_stats(dev, stats);
+}
+
+/**
+ * @brief Get told about the progress of blocking bulk operations
+ *
+ * @ref qiprog_read() and @ref qiprog_write() only return once they are done.
+ * When set, 'cb' is called as they progress, with the same events asynchronous
+ * operations report. Asynchronous operations keep using their own callback.
+ *
+ * @param[in] dev Device to operate on
+ * @param[in] cb Function to call, or NULL to stop reporting progress
+ * @param[in] user_data Pointer passed to 'cb'
+ *
+ * @return QIPROG_SUCCESS on success, or a QIPROG_ERR code otherwise.
+ */
+qiprog_err qiprog_set_progress_cb(struct qiprog_device *dev,
+				  qiprog_transfer_cb cb, void *user_data)
+{
+	QIPROG_RETURN_ON_BAD_DEV(dev);
+	dev->progress_cb = cb;
+	dev->progress_data = user_data;
+	return QIPROG_SUCCESS;
+}
+
 /** @} */
@@ -0,0 +1,388 @@
+/*
+ * qiprog - Reference implementation of the QiProg protocol
+ *
+ * Copyright (C) 2013 Alexandru Gagniuc <mr.nuke.me@gmail.com>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+#include "qiprog_internal.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+/**
+ * @defgroup erase_plan QiProg erase planning
+ *
+ * @ingroup chip_io
+ *
+ * @brief Pick the erase operations which rewrite changed parts fastest
+ *
+ * Chips can usually erase a sector, a block, or the whole chip. A big erase
+ * takes about as long as a small one, but erases data which did not change,
+ * and which then has to be programmed again. The planner weighs both costs,
+ * and finds the cheapest set of erases which covers every dirty range.
+ *
+ * The erase blocks of all operations must nest: two blocks either do not
+ * overlap, or one is inside the other. That holds for uniform sectors and
+ * blocks, and for boot block layouts, where the blocks at one end of the chip
+ * are smaller. Each block is then either erased as a whole, or left to the
+ * blocks inside it, whichever costs less.
+ */
+/** @{ */
+
+/* Every unit beyond this many is most likely a broken geometry */
+#define PLAN_MAX_UNITS		(1 << 24)
+
+enum unit_choice {
+	UNIT_CLEAN = 0,		/**< Nothing to erase in the unit */
+	UNIT_WHOLE,		/**< Erase the unit itself */
+	UNIT_SPLIT,		/**< Leave it to the units inside it */
+};
+
+/*
+ * One block which one of the operations can erase
+ */
+struct plan_unit {
+	uint32_t start;
+	uint32_t size;
+	uint32_t time_us;
+	size_t op;
+	/* First unit after the ones inside this one */
+	size_t next;
+	/* Cheapest way to erase the dirty parts, in nanoseconds */
+	uint64_t cost;
+	enum unit_choice choice;
+};
+
+struct planner {
+	struct plan_unit *units;
+	size_t num_units;
+	/* Sorted, with no two ranges touching */
+	struct qiprog_range *dirty;
+	size_t num_dirty;
+	uint32_t program_ns;
+	qiprog_err err;
+};
+
+static int cmp_units(const void *a, const void *b)
+{
+	const struct plan_unit *ua = a, *ub = b;
+
+	/* Units inside others come after them, so the order is a tree walk */
+	if (ua->start != ub->start)
+		return (ua->start < ub->start) ? -1 : 1;
+	if (ua->size != ub->size)
+		return (ua->size > ub->size) ? -1 : 1;
+	if (ua->time_us != ub->time_us)
+		return (ua->time_us < ub->time_us) ? -1 : 1;
+	return 0;
+}
+
+static int cmp_ranges(const void *a, const void *b)
+{
+	const struct qiprog_range *ra = a, *rb = b;
+
+	if (ra->start != rb->start)
+		return (ra->start < rb->start) ? -1 : 1;
+	return 0;
+}
+
+/*
+ * Sort the dirty ranges, and merge the ones which overlap or touch
+ */
+static qiprog_err copy_dirty(struct planner *p,
+			     const struct qiprog_range *dirty, size_t num_dirty)
+{
+	size_t i, n = 0;
+	uint64_t end;
+	struct qiprog_range *r;
+
+	if (num_dirty && !(p->dirty = malloc(num_dirty * sizeof(*p->dirty))))
+		return QIPROG_ERR_MALLOC;
+
+	for (i = 0; i < num_dirty; i++)
+		if (dirty[i].len)
+			p->dirty[n++] = dirty[i];
+	if (n)
+		qsort(p->dirty, n, sizeof(*p->dirty), cmp_ranges);
+
+	for (i = 0, r = NULL; i < n; i++) {
+		end = (uint64_t)p->dirty[i].start + p->dirty[i].len;
+		if (r && (p->dirty[i].start <= (uint64_t)r->start + r->len)) {
+			if (end > (uint64_t)r->start + r->len)
+				r->len = end - r->start;
+			continue;
+		}
+		r = &p->dirty[p->num_dirty++];
+		*r = p->dirty[i];
+	}
+
+	return QIPROG_SUCCESS;
+}
+
+/*
+ * Check if anything in [start, end) is dirty
+ */
+static int is_dirty(const struct planner *p, uint64_t start, uint64_t end)
+{
+	size_t lo = 0, hi = p->num_dirty, mid;
+	const struct qiprog_range *r;
+
+	if (start >= end)
+		return 0;
+
+	/* Find the first range which ends after 'start' */
+	while (lo < hi) {
+		mid = lo + (hi - lo) / 2;
+		r = &p->dirty[mid];
+		if ((uint64_t)r->start + r->len <= start)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+
+	return (lo < p->num_dirty) && (p->dirty[lo].start < end);
+}
+
+static qiprog_err make_units(struct planner *p,
+			     const struct qiprog_erase_op *ops, size_t num_ops)
+{
+	size_t i, j;
+	uint32_t k;
+	uint64_t total = 0, start;
+	const struct qiprog_erase_run *run;
+	struct plan_unit *u;
+
+	for (i = 0; i < num_ops; i++) {
+		for (j = 0; j < ops[i].num_runs; j++) {
+			run = &ops[i].runs[j];
+			if ((run->size == 0) || ((uint64_t)run->start +
+				(uint64_t)run->size * run->count > 1ull << 32))
+				return QIPROG_ERR_ARG;
+			total += run->count;
+		}
+	}
+	if (total > PLAN_MAX_UNITS)
+		return QIPROG_ERR_LARGE_ARG;
+
+	if (total && !(p->units = calloc(total, sizeof(*p->units))))
+		return QIPROG_ERR_MALLOC;
+
+	for (i = 0, u = p->units; i < num_ops; i++) {
+		for (j = 0; j < ops[i].num_runs; j++) {
+			run = &ops[i].runs[j];
+			start = run->start;
+			for (k = 0; k < run->count; k++, u++) {
+				u->start = start;
+				u->size = run->size;
+				u->time_us = ops[i].time_us;
+				u->op = i;
+				start += run->size;
+			}
+		}
+	}
+	p->num_units = total;
+	if (total)
+		qsort(p->units, p->num_units, sizeof(*p->units), cmp_units);
+
+	return QIPROG_SUCCESS;
+}
+
+/*
+ * Find the cheapest way to erase the dirty parts of a unit, and of the units
+ * inside it
+ *
+ * Returns the index of the first unit which is not inside this one.
+ */
+static size_t solve_unit(struct planner *p, size_t i)
+{
+	size_t j;
+	uint64_t end, pos, split = 0, whole;
+	int can_split = 1;
+	struct plan_unit *u = &p->units[i], *child;
+
+	end = (uint64_t)u->start + u->size;
+	pos = u->start;
+	for (j = i + 1; (j < p->num_units) && (p->units[j].start < end); ) {
+		child = &p->units[j];
+		if ((uint64_t)child->start + child->size > end) {
+			qi_perr("Erase blocks at 0x%.8x and 0x%.8x overlap",
+				u->start, child->start);
+			p->err = QIPROG_ERR_ARG;
+			return p->num_units;
+		}
+		/* Dirty bytes between the units inside can only go whole */
+		if (is_dirty(p, pos, child->start))
+			can_split = 0;
+		j = solve_unit(p, j);
+		split += child->cost;
+		pos = (uint64_t)child->start + child->size;
+	}
+	if (is_dirty(p, pos, end))
+		can_split = 0;
+	u->next = j;
+
+	if (!is_dirty(p, u->start, end)) {
+		u->choice = UNIT_CLEAN;
+		u->cost = 0;
+		return j;
+	}
+
+	/* What is erased must be programmed again */
+	whole = (uint64_t)u->time_us * 1000 + (uint64_t)u->size * p->program_ns;
+	if (can_split && (split < whole)) {
+		u->choice = UNIT_SPLIT;
+		u->cost = split;
+	} else {
+		u->choice = UNIT_WHOLE;
+		u->cost = whole;
+	}
+
+	return j;
+}
+
+/*
+ * Add the erases a unit was planned to need, merging consecutive blocks of
+ * the same operation into one step
+ */
+static void emit_unit(const struct planner *p, size_t i,
+		      const struct qiprog_erase_op *ops,
+		      struct qiprog_erase_plan *plan)
+{
+	size_t j;
+	struct qiprog_erase_step *last;
+	const struct plan_unit *u = &p->units[i];
+
+	if (u->choice == UNIT_SPLIT) {
+		for (j = i + 1; j < u->next; j = p->units[j].next)
+			emit_unit(p, j, ops, plan);
+		return;
+	}
+	if (u->choice != UNIT_WHOLE)
+		return;
+
+	plan->erased += u->size;
+	last = plan->num_steps ? &plan->steps[plan->num_steps - 1] : NULL;
+	if (last && (last->op == u->op) && (last->block_size == u->size) &&
+	    ((uint64_t)last->start + last->len == u->start)) {
+		last->len += u->size;
+		return;
+	}
+
+	last = &plan->steps[plan->num_steps++];
+	last->op = u->op;
+	last->type = ops[u->op].type;
+	last->block_size = u->size;
+	last->start = u->start;
+	last->len = u->size;
+}
+
+/**
+ * @brief Plan the cheapest erases which cover a set of dirty ranges
+ *
+ * Each operation is one way the chip can erase, like a certain erase type and
+ * size, and lists the blocks it erases. A whole chip erase is one block the
+ * size of the chip. The cost of a plan is the time the erases take, plus the
+ * time to program every byte they erase.
+ *
+ * The steps of the plan come in address order, and do not overlap. Each one is
+ * a run of consecutive blocks of the same operation.
+ *
+ * @param[in] ops Ways the chip can erase
+ * @param[in] num_ops Number of entries in 'ops'
+ * @param[in] dirty Ranges which must be erased, in any order
+ * @param[in] num_dirty Number of entries in 'dirty'
+ * @param[in] program_ns Time to program one byte, in nanoseconds
+ * @param[out] plan The plan, to free with @ref qiprog_free_erase_plan
+ *
+ * @return QIPROG_SUCCESS on success, QIPROG_ERR_ARG if the blocks of the
+ * operations do not nest, or if no operation erases part of a dirty range, or
+ * another QIPROG_ERR code otherwise.
+ */
+qiprog_err qiprog_plan_erase(const struct qiprog_erase_op *ops, size_t num_ops,
+			     const struct qiprog_range *dirty, size_t num_dirty,
+			     uint32_t program_ns, struct qiprog_erase_plan *plan)
+{
+	size_t i;
+	uint64_t pos = 0, cost = 0;
+	struct planner p = {0};
+	qiprog_err ret;
+
+	if (!plan || (num_ops && !ops) || (num_dirty && !dirty))
+		return QIPROG_ERR_ARG;
+	memset(plan, 0, sizeof(*plan));
+	p.program_ns = program_ns;
+
+	if (((ret = make_units(&p, ops, num_ops)) != QIPROG_SUCCESS) ||
+	    ((ret = copy_dirty(&p, dirty, num_dirty)) != QIPROG_SUCCESS))
+		goto cleanup;
+
+	/* The chip itself can only be split into the units */
+	for (i = 0; i < p.num_units; i = p.units[i].next) {
+		if (is_dirty(&p, pos, p.units[i].start))
+			break;
+		solve_unit(&p, i);
+		if (p.err != QIPROG_SUCCESS)
+			break;
+		cost += p.units[i].cost;
+		pos = (uint64_t)p.units[i].start + p.units[i].size;
+	}
+	if ((ret = p.err) != QIPROG_SUCCESS)
+		goto cleanup;
+	if ((i < p.num_units) || is_dirty(&p, pos, 1ull << 32)) {
+		qi_perr("Part of a dirty range cannot be erased");
+		ret = QIPROG_ERR_ARG;
+		goto cleanup;
+	}
+
+	if (p.num_units &&
+	    !(plan->steps = malloc(p.num_units * sizeof(*plan->steps)))) {
+		ret = QIPROG_ERR_MALLOC;
+		goto cleanup;
+	}
+	for (i = 0; i < p.num_units; i = p.units[i].next)
+		emit_unit(&p, i, ops, plan);
+	plan->time_us = cost / 1000;
+
+	qi_pspew("Planned %zu erase steps, %llu bytes, %llu us",
+		 plan->num_steps, (unsigned long long)plan->erased,
+		 (unsigned long long)plan->time_us);
+
+ cleanup:
+	free(p.units);
+	free(p.dirty);
+	return ret;
+}
+
+/**
+ * @brief Free the steps of a plan from @ref qiprog_plan_erase
+ *
+ * @param[in] plan The plan
+ */
+void qiprog_free_erase_plan(struct qiprog_erase_plan *plan)
+{
+	if (!plan)
+		return;
+	free(plan->steps);
+	plan->steps = NULL;
+	plan->num_steps = 0;
+}
+
+/** @} */
@@ -0,0 +1,277 @@
+/*
+ * qiprog - Reference implementation of the QiProg protocol
+ *
+ * Copyright (C) 2013 Alexandru Gagniuc <mr.nuke.me@gmail.com>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+#include "qiprog_internal.h"
+
+/**
+ * @defgroup isa QiProg instruction set interpreter
+ *
+ * @ingroup qiprog_private
+ *
+ * @brief Run @ref QIPROG_LANG_BUS programs
+ *
+ * The interpreter only talks to the chip through the fine-grained IO calls of
+ * the device it is given. Firmware uses it to run programs it receives on the
+ * instruction set endpoint, right next to the chip. The host library uses it
+ * as a fallback when the programmer cannot run programs itself; the result is
+ * the same, only slower.
+ */
+/** @{ */
+
+#define ISA_NUM_REGS	16
+
+/*
+ * Upper bound on the number of instructions in one run. A program stuck in a
+ * loop gives up, instead of hanging the programmer for good. The firmware
+ * serves nothing else while a program runs, so its bound is much lower.
+ * Override when building.
+ */
+#ifndef QIPROG_ISA_MAX_STEPS
+#if CONFIG_DRIVER_USB_MASTER || CONFIG_DRIVER_SIM
+#define QIPROG_ISA_MAX_STEPS	(1UL << 24)
+#else
+#define QIPROG_ISA_MAX_STEPS	(1UL << 16)
+#endif
+#endif
+
+/*
+ * Size of an instruction, including its opcode, or 0 if the opcode is invalid
+ */
+static uint8_t isa_op_len(uint8_t op)
+{
+	switch (op) {
+	case QIPROG_ISA_END:
+	case QIPROG_ISA_FAIL:
+		return 1;
+	case QIPROG_ISA_MOV:
+	case QIPROG_ISA_ADD:
+	case QIPROG_ISA_SUB:
+	case QIPROG_ISA_AND:
+	case QIPROG_ISA_OR:
+	case QIPROG_ISA_XOR:
+	case QIPROG_ISA_LDB:
+	case QIPROG_ISA_RD8:
+	case QIPROG_ISA_RD16:
+	case QIPROG_ISA_RD32:
+	case QIPROG_ISA_WR8:
+	case QIPROG_ISA_WR16:
+	case QIPROG_ISA_WR32:
+	case QIPROG_ISA_OUT8:
+	case QIPROG_ISA_OUT16:
+	case QIPROG_ISA_OUT32:
+		return 2;
+	case QIPROG_ISA_SHL:
+	case QIPROG_ISA_SHR:
+	case QIPROG_ISA_JMP:
+		return 3;
+	case QIPROG_ISA_BEQ:
+	case QIPROG_ISA_BNE:
+	case QIPROG_ISA_DJNZ:
+		return 4;
+	case QIPROG_ISA_DELAY:
+		return 5;
+	case QIPROG_ISA_SET:
+		return 6;
+	default:
+		return 0;
+	}
+}
+
+static qiprog_err isa_read(struct qiprog_device *dev, uint8_t op,
+			   uint32_t addr, uint32_t *val)
+{
+	qiprog_err ret;
+	uint8_t reg8;
+	uint16_t reg16;
+
+	switch (op) {
+	case QIPROG_ISA_RD8:
+		ret = qiprog_read8(dev, addr, &reg8);
+		*val = reg8;
+		return ret;
+	case QIPROG_ISA_RD16:
+		ret = qiprog_read16(dev, addr, &reg16);
+		*val = reg16;
+		return ret;
+	default:
+		return qiprog_read32(dev, addr, val);
+	}
+}
+
+static qiprog_err isa_write(struct qiprog_device *dev, uint8_t op,
+			    uint32_t addr, uint32_t val)
+{
+	switch (op) {
+	case QIPROG_ISA_WR8:
+		return qiprog_write8(dev, addr, val);
+	case QIPROG_ISA_WR16:
+		return qiprog_write16(dev, addr, val);
+	default:
+		return qiprog_write32(dev, addr, val);
+	}
+}
+
+static qiprog_err isa_out(uint8_t op, uint32_t val, uint8_t *out,
+			  uint16_t max_out, uint16_t *out_len)
+{
+	uint8_t width;
+
+	width = (op == QIPROG_ISA_OUT8) ? 1 : (op == QIPROG_ISA_OUT16) ? 2 : 4;
+	if (*out_len + width > max_out)
+		return QIPROG_ERR_LARGE_ARG;
+
+	if (width == 1)
+		out[*out_len] = val;
+	else if (width == 2)
+		h_to_le16(val, out + *out_len);
+	else
+		h_to_le32(val, out + *out_len);
+	*out_len += width;
+
+	return QIPROG_SUCCESS;
+}
+
+/**
+ * @brief Run a program of the QIPROG_LANG_BUS instruction set
+ *
+ * @param[in] dev Device whose chip the program operates on
+ * @param[in] prog The program
+ * @param[in] len Size of the program in bytes
+ * @param[out] out Where to store the output of the program
+ * @param[in] max_out Size of the 'out' buffer
+ * @param[out] out_len Number of bytes the program stored in 'out'
+ *
+ * @return QIPROG_SUCCESS if the program reached QIPROG_ISA_END,
+ * QIPROG_ERR if it reached QIPROG_ISA_FAIL, QIPROG_ERR_ARG if it is malformed,
+ * QIPROG_ERR_LARGE_ARG if its output does not fit, QIPROG_ERR_TIMEOUT if it
+ * ran for too long, or the error of a failed bus access. The output produced
+ * up to that point is kept in all cases.
+ */
+qiprog_err qiprog_isa_exec(struct qiprog_device *dev, uint8_t *prog,
+			   uint16_t len, uint8_t *out, uint16_t max_out,
+			   uint16_t *out_len)
+{
+	qiprog_err ret;
+	uint8_t op, d, s, *arg;
+	uint16_t pc, target;
+	uint32_t steps, regs[ISA_NUM_REGS] = {0};
+
+	*out_len = 0;
+
+	for (pc = 0, steps = 0; steps < QIPROG_ISA_MAX_STEPS; steps++) {
+		if (pc >= len)
+			return QIPROG_ERR_ARG;
+		op = prog[pc];
+		if (!isa_op_len(op) || (isa_op_len(op) > len - pc))
+			return QIPROG_ERR_ARG;
+
+		/* Only look at the operands the instruction has */
+		arg = prog + pc + 1;
+		d = (isa_op_len(op) > 1) ? arg[0] >> 4 : 0;
+		s = (isa_op_len(op) > 1) ? arg[0] & 0xf : 0;
+		pc += isa_op_len(op);
+		ret = QIPROG_SUCCESS;
+
+		switch (op) {
+		case QIPROG_ISA_END:
+			return QIPROG_SUCCESS;
+		case QIPROG_ISA_FAIL:
+			return QIPROG_ERR;
+		case QIPROG_ISA_SET:
+			regs[d] = le32_to_h(arg + 1);
+			break;
+		case QIPROG_ISA_MOV:
+			regs[d] = regs[s];
+			break;
+		case QIPROG_ISA_ADD:
+			regs[d] += regs[s];
+			break;
+		case QIPROG_ISA_SUB:
+			regs[d] -= regs[s];
+			break;
+		case QIPROG_ISA_AND:
+			regs[d] &= regs[s];
+			break;
+		case QIPROG_ISA_OR:
+			regs[d] |= regs[s];
+			break;
+		case QIPROG_ISA_XOR:
+			regs[d] ^= regs[s];
+			break;
+		case QIPROG_ISA_SHL:
+			regs[d] = (arg[1] < 32) ? regs[d] << arg[1] : 0;
+			break;
+		case QIPROG_ISA_SHR:
+			regs[d] = (arg[1] < 32) ? regs[d] >> arg[1] : 0;
+			break;
+		case QIPROG_ISA_LDB:
+			if (regs[s] >= len)
+				return QIPROG_ERR_ARG;
+			regs[d] = prog[regs[s]];
+			break;
+		case QIPROG_ISA_RD8:
+		case QIPROG_ISA_RD16:
+		case QIPROG_ISA_RD32:
+			ret = isa_read(dev, op, regs[s], &regs[d]);
+			break;
+		case QIPROG_ISA_WR8:
+		case QIPROG_ISA_WR16:
+		case QIPROG_ISA_WR32:
+			ret = isa_write(dev, op, regs[d], regs[s]);
+			break;
+		case QIPROG_ISA_JMP:
+			pc = le16_to_h(arg);
+			break;
+		case QIPROG_ISA_BEQ:
+		case QIPROG_ISA_BNE:
+			target = le16_to_h(arg + 1);
+			if ((regs[d] == regs[s]) == (op == QIPROG_ISA_BEQ))
+				pc = target;
+			break;
+		case QIPROG_ISA_DJNZ:
+			target = le16_to_h(arg + 1);
+			if (--regs[d])
+				pc = target;
+			break;
+		case QIPROG_ISA_DELAY:
+			/* Only the driver knows how to wait */
+			if (!dev->drv->delay_us)
+				return QIPROG_ERR_ARG;
+			ret = dev->drv->delay_us(dev, le32_to_h(arg));
+			break;
+		case QIPROG_ISA_OUT8:
+		case QIPROG_ISA_OUT16:
+		case QIPROG_ISA_OUT32:
+			ret = isa_out(op, regs[d], out, max_out, out_len);
+			break;
+		}
+
+		if (ret != QIPROG_SUCCESS)
+			return ret;
+	}
+
+	return QIPROG_ERR_TIMEOUT;
+}
+
+/** @} */
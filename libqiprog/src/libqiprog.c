@@ -28,6 +28,7 @@
 #include <stddef.h>
 #include <stdlib.h>
 #include <string.h>
+#include <time.h>
 
 /**
  * @mainpage QiProg API
@@ -65,18 +66,56 @@
 /* FIXME: Kill this idiotic include */
 #include <stdio.h>
 
+/* How often the event thread looks whether it should stop, in milliseconds */
+#define EVENT_THREAD_POLL_MS		100
+
 #if CONFIG_DRIVER_USB_MASTER
 extern struct qiprog_driver qiprog_usb_master_drv;
 #endif
+#if CONFIG_DRIVER_SIM
+extern struct qiprog_driver qiprog_sim_drv;
+#endif
 
 /* NULL-terminated list of drivers compiled in */
 static const struct qiprog_driver *driver_list[] = {
 #if CONFIG_DRIVER_USB_MASTER
 	&qiprog_usb_master_drv,
+#endif
+#if CONFIG_DRIVER_SIM
+	&qiprog_sim_drv,
 #endif
 	NULL,
 };
 
+/*
+ * Time, for the host side only. The firmware may not have a POSIX clock, so
+ * this does not live in util.c. It brings its own clock instead, see
+ * qiprog_usb_dev_set_clock().
+ */
+/**
+ * @brief Read a monotonic clock, in microseconds
+ */
+uint64_t qi_time_us(void)
+{
+	struct timespec now;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return (uint64_t)now.tv_sec * 1000000 + now.tv_nsec / 1000;
+}
+
+/**
+ * @brief Wait for at least 'us' microseconds
+ */
+void qi_sleep_us(uint64_t us)
+{
+	struct timespec ts;
+
+	ts.tv_sec = us / 1000000;
+	ts.tv_nsec = (us % 1000000) * 1000;
+	while (nanosleep(&ts, &ts) < 0)
+		;
+}
+
 /**
  * @defgroup initialization QiProg initialization/deinitialization
  *
@@ -100,6 +139,8 @@ static const struct qiprog_driver *driver_list[] = {
  */
 qiprog_err qiprog_init(struct qiprog_context **ctx)
 {
+	size_t i;
+	const struct qiprog_driver *drv;
 	struct qiprog_context *context;
 	*ctx = 0;
 
@@ -107,13 +148,29 @@ qiprog_err qiprog_init(struct qiprog_context **ctx)
 		/* FIXME: Add some sort console and print a message */
 		return QIPROG_ERR_MALLOC;
 	}
+	memset(context, 0, sizeof(*context));
+	if (dev_list_init(&context->devices) != QIPROG_SUCCESS) {
+		free(context);
+		return QIPROG_ERR_MALLOC;
+	}
 #if CONFIG_DRIVER_USB_MASTER
 	if (libusb_init(&(context->libusb_host_ctx)) != LIBUSB_SUCCESS) {
 		/* FIXME: Printable error message */
+		dev_list_free(&context->devices);
+		free(context);
 		return QIPROG_ERR_MALLOC;
 	}
+	pthread_mutex_init(&context->lock, NULL);
 #endif
 
+	/* Drivers which can watch for devices save us from rescanning */
+	for (i = 0; (drv = driver_list[i]) != NULL; i++) {
+		if (!drv->hotplug)
+			continue;
+		if (drv->hotplug(context, &context->devices) == QIPROG_SUCCESS)
+			context->hotplug_drivers |= (1 << i);
+	}
+
 	*ctx = context;
 	return QIPROG_SUCCESS;
 }
@@ -122,7 +179,8 @@ qiprog_err qiprog_init(struct qiprog_context **ctx)
  * @brief Free a QiProg context
  *
  * Release all resources used by the given context. Sould be called after
- * closing all open devices and before the application terminates.
+ * closing all open devices and before the application terminates. Every device
+ * of the context is freed, so none of them may be used afterwards.
  *
  * @param[in] ctx the context to free. Cannot be NULL.
  *
@@ -130,10 +188,20 @@ qiprog_err qiprog_init(struct qiprog_context **ctx)
  */
 qiprog_err qiprog_exit(struct qiprog_context *ctx)
 {
+	size_t i;
+
 	if (ctx == NULL)
 		return QIPROG_ERR_ARG;
+
+	/* Nothing may touch the devices while we free them */
+	qiprog_stop_event_thread(ctx);
+
+	for (i = 0; i < ctx->devices.len; i++)
+		qiprog_free_device(ctx->devices.devs[i]);
+	dev_list_free(&ctx->devices);
 #if CONFIG_DRIVER_USB_MASTER
 	libusb_exit(ctx->libusb_host_ctx);
+	pthread_mutex_destroy(&ctx->lock);
 #endif
 	free(ctx);
 
@@ -142,6 +210,302 @@ qiprog_err qiprog_exit(struct qiprog_context *ctx)
 
 /** @} */
 
+/**
+ * @brief Tell the application about devices which came or went
+ */
+static void report_hotplug(struct qiprog_context *ctx)
+{
+	size_t i;
+	int pending;
+	void *data;
+	qiprog_hotplug_cb cb;
+	struct qiprog_device *dev;
+
+	/*
+	 * The callback may add devices, so do not cache the length. It is
+	 * called without the lock held, so it may use the context.
+	 */
+	for (i = 0; ; i++) {
+		qi_ctx_lock(ctx);
+		if (i >= ctx->devices.len) {
+			qi_ctx_unlock(ctx);
+			break;
+		}
+		dev = ctx->devices.devs[i];
+		pending = dev->pending;
+		dev->pending = 0;
+		cb = ctx->hotplug_cb;
+		data = ctx->hotplug_data;
+		qi_ctx_unlock(ctx);
+
+		if (!pending || !cb)
+			continue;
+		if (pending & QIPROG_DEVICE_ARRIVED)
+			cb(ctx, dev, QIPROG_DEVICE_ARRIVED, data);
+		if (pending & QIPROG_DEVICE_LEFT)
+			cb(ctx, dev, QIPROG_DEVICE_LEFT, data);
+	}
+}
+
+/**
+ * @defgroup events QiProg event handling
+ *
+ * @ingroup qiprog_public
+ *
+ * @brief <b>Driving asynchronous operations from an event loop</b>
+ *
+ * Asynchronous operations, such as @ref qiprog_read_async(), only make
+ * progress while @ref qiprog_handle_events_timeout() is called. Applications
+ * with their own event loop can get the file descriptors to watch with
+ * @ref qiprog_get_pollfds(), and call qiprog_handle_events_timeout() with a
+ * timeout of 0 whenever one of them is ready.
+ *
+ * For example:
+ * @code{.c}
+ *	struct qiprog_pollfd fds[16];
+ *	size_t i, nfds;
+ *
+ *	nfds = qiprog_get_pollfds(ctx, fds, 16);
+ *	for (i = 0; i < nfds; i++)
+ *		add_to_my_epoll_set(fds[i].fd, fds[i].events);
+ *	...
+ *	// When epoll says one of them is ready
+ *	qiprog_handle_events_timeout(ctx, 0);
+ * @endcode
+ *
+ * The set of file descriptors may change when devices are opened or closed, so
+ * query it again after doing either.
+ *
+ * Applications with several threads can instead have the context handle events
+ * in a thread of its own, with @ref qiprog_start_event_thread(). Blocking calls
+ * then only wait for their operation to complete, so each thread can drive its
+ * own device through the same context. The callbacks of asynchronous
+ * operations, and of @ref qiprog_set_hotplug_cb(), are called from the event
+ * thread.
+ *
+ * For example:
+ * @code{.c}
+ *	qiprog_init(&ctx);
+ *	qiprog_start_event_thread(ctx);
+ *	...
+ *	// In each worker thread, with its own device
+ *	qiprog_open_device(dev);
+ *	qiprog_read(dev, 0, buf, size);
+ * @endcode
+ *
+ * A device should still be used by one thread at a time.
+ */
+/** @{ */
+
+#if CONFIG_DRIVER_USB_MASTER
+/**
+ * @brief Tell whether the event thread of a context is running
+ *
+ * Drivers use this to choose between waiting for the event thread, and
+ * handling events themselves.
+ */
+bool qi_event_thread_running(struct qiprog_context *ctx)
+{
+	bool running;
+
+	qi_ctx_lock(ctx);
+	running = ctx->event_thread_running;
+	qi_ctx_unlock(ctx);
+
+	return running;
+}
+
+/**
+ * @brief Handle events until qiprog_stop_event_thread() is called
+ */
+static void *event_thread(void *arg)
+{
+	int ret;
+	struct timeval tv;
+	struct qiprog_context *ctx = arg;
+
+	while (qi_event_thread_running(ctx)) {
+		tv.tv_sec = 0;
+		tv.tv_usec = EVENT_THREAD_POLL_MS * 1000;
+		ret = libusb_handle_events_timeout_completed(
+			ctx->libusb_host_ctx, &tv, NULL);
+		if (ret != LIBUSB_SUCCESS && ret != LIBUSB_ERROR_INTERRUPTED)
+			qi_pwarn("Could not handle events: %s",
+				 libusb_error_name(ret));
+		report_hotplug(ctx);
+	}
+
+	return NULL;
+}
+#endif
+
+/**
+ * @brief Handle events in a thread owned by the context
+ *
+ * From now on, asynchronous operations make progress without calling
+ * @ref qiprog_handle_events_timeout(), and blocking operations wait for the
+ * event thread to complete them. This makes it safe to use different devices
+ * of the context from different threads at the same time. The thread stops in
+ * @ref qiprog_stop_event_thread(), or in @ref qiprog_exit().
+ *
+ * Only the USB host driver has events to handle. Without it, this does nothing.
+ *
+ * @param[in] ctx the context to operate on.
+ *
+ * @return QIPROG_SUCCESS on success, or a QIPROG_ERR code otherwise.
+ */
+qiprog_err qiprog_start_event_thread(struct qiprog_context *ctx)
+{
+#if CONFIG_DRIVER_USB_MASTER
+	int ret;
+#endif
+
+	if (!ctx)
+		return QIPROG_ERR_ARG;
+
+#if CONFIG_DRIVER_USB_MASTER
+	qi_ctx_lock(ctx);
+	if (ctx->event_thread_running) {
+		qi_ctx_unlock(ctx);
+		return QIPROG_SUCCESS;
+	}
+
+	ctx->event_thread_running = true;
+	ret = pthread_create(&ctx->event_thread, NULL, event_thread, ctx);
+	if (ret != 0)
+		ctx->event_thread_running = false;
+	qi_ctx_unlock(ctx);
+
+	if (ret != 0) {
+		qi_perr("Could not start the event thread");
+		return QIPROG_ERR;
+	}
+#endif
+
+	return QIPROG_SUCCESS;
+}
+
+/**
+ * @brief Stop the thread started with @ref qiprog_start_event_thread()
+ *
+ * Returns once the thread has exited. Callbacks are then again called from
+ * @ref qiprog_handle_events_timeout(). Blocking operations which are waiting
+ * go back to handling events themselves. This may not be called from a
+ * callback, since those run in the event thread.
+ *
+ * @param[in] ctx the context to operate on.
+ *
+ * @return QIPROG_SUCCESS on success, or a QIPROG_ERR code otherwise.
+ */
+qiprog_err qiprog_stop_event_thread(struct qiprog_context *ctx)
+{
+#if CONFIG_DRIVER_USB_MASTER
+	bool running;
+#endif
+
+	if (!ctx)
+		return QIPROG_ERR_ARG;
+
+#if CONFIG_DRIVER_USB_MASTER
+	qi_ctx_lock(ctx);
+	running = ctx->event_thread_running;
+	ctx->event_thread_running = false;
+	qi_ctx_unlock(ctx);
+
+	/* It notices within EVENT_THREAD_POLL_MS */
+	if (running)
+		pthread_join(ctx->event_thread, NULL);
+#endif
+
+	return QIPROG_SUCCESS;
+}
+
+/**
+ * @brief Get the file descriptors on which QiProg events arrive
+ *
+ * @param[in] ctx the context to operate on.
+ * @param[out] fds array where to store the file descriptors
+ * @param[in] max_fds number of elements in 'fds'
+ *
+ * @return The number of file descriptors stored in 'fds'.
+ */
+size_t qiprog_get_pollfds(struct qiprog_context *ctx,
+			  struct qiprog_pollfd *fds, size_t max_fds)
+{
+	size_t nfds = 0;
+#if CONFIG_DRIVER_USB_MASTER
+	size_t i;
+	const struct libusb_pollfd **usb_fds;
+#endif
+
+	if (!ctx || !fds)
+		return 0;
+
+#if CONFIG_DRIVER_USB_MASTER
+	if ((usb_fds = libusb_get_pollfds(ctx->libusb_host_ctx)) == NULL)
+		return 0;
+
+	for (i = 0; usb_fds[i] != NULL && nfds < max_fds; i++) {
+		fds[nfds].fd = usb_fds[i]->fd;
+		fds[nfds].events = usb_fds[i]->events;
+		nfds++;
+	}
+	libusb_free_pollfds(usb_fds);
+#else
+	(void)max_fds;
+#endif
+
+	return nfds;
+}
+
+/**
+ * @brief Process pending events, and complete asynchronous operations
+ *
+ * Callbacks of asynchronous operations are called from within this function, and
+ * so is the callback set with @ref qiprog_set_hotplug_cb().
+ *
+ * There is no need to call this while the event thread runs, see
+ * @ref qiprog_start_event_thread().
+ *
+ * @param[in] ctx the context to operate on.
+ * @param[in] timeout_ms maximum time to wait for an event, in milliseconds. Use
+ *			 0 to only handle events which are already pending.
+ *
+ * @return QIPROG_SUCCESS on success, or a QIPROG_ERR code otherwise.
+ */
+qiprog_err qiprog_handle_events_timeout(struct qiprog_context *ctx,
+					uint32_t timeout_ms)
+{
+#if CONFIG_DRIVER_USB_MASTER
+	int ret;
+	uint64_t start;
+	struct timeval tv;
+#endif
+
+	if (!ctx)
+		return QIPROG_ERR_ARG;
+
+#if CONFIG_DRIVER_USB_MASTER
+	tv.tv_sec = timeout_ms / 1000;
+	tv.tv_usec = (timeout_ms % 1000) * 1000;
+	start = qi_time_us();
+	ret = libusb_handle_events_timeout_completed(ctx->libusb_host_ctx, &tv,
+						     NULL);
+	qi_ctx_lock(ctx);
+	ctx->event_time_us += qi_time_us() - start;
+	qi_ctx_unlock(ctx);
+	if (ret != LIBUSB_SUCCESS)
+		return QIPROG_ERR;
+#else
+	(void)timeout_ms;
+#endif
+
+	report_hotplug(ctx);
+	return QIPROG_SUCCESS;
+}
+
+/** @} */
+
 /**
  * @defgroup discovery QiProg device discovery and handling
  *
@@ -151,50 +515,170 @@ qiprog_err qiprog_exit(struct qiprog_context *ctx)
  *
  * @brief <b>QiProg device discovery and handling</b>
  *
+ * The context keeps track of the devices it has found. A device keeps the same
+ * handle for as long as it stays connected, so handles from different calls to
+ * @ref qiprog_get_device_list() can be compared. When a device goes away, its
+ * handle stays valid until @ref qiprog_exit(), but operations on it fail.
+ *
+ * Where the system can tell us about devices as they come and go, such as
+ * with libusb hotplug support, getting the device list does not scan the buses
+ * again. Applications which want to know right away can set a callback with
+ * @ref qiprog_set_hotplug_cb(), and call @ref qiprog_handle_events_timeout().
  */
 /** @{ */
 
+/**
+ * @brief Scan for devices with the drivers which can not watch for them
+ */
+static void rescan(struct qiprog_context *ctx)
+{
+	size_t i, j;
+	const struct qiprog_driver *drv;
+	struct qiprog_device *dev;
+
+	for (i = 0; (drv = driver_list[i]) != NULL; i++) {
+		if (ctx->hotplug_drivers & (1 << i))
+			continue;
+		if (!drv->scan) {
+			/* FIXME: This would be bad. Print something */
+			continue;
+		}
+
+		qi_ctx_lock(ctx);
+		for (j = 0; j < ctx->devices.len; j++) {
+			if (ctx->devices.devs[j]->drv == drv)
+				ctx->devices.devs[j]->seen = 0;
+		}
+
+		if (drv->scan(ctx, &ctx->devices) != QIPROG_SUCCESS) {
+			qi_ctx_unlock(ctx);
+			continue;
+		}
+
+		/* Whatever the driver did not find again is gone */
+		for (j = 0; j < ctx->devices.len; j++) {
+			dev = ctx->devices.devs[j];
+			if ((dev->drv == drv) && !dev->seen)
+				qi_device_left(dev);
+		}
+		qi_ctx_unlock(ctx);
+	}
+}
+
 /**
  * @brief Get a list of all available QiProg devices.
  *
- * Scans the system for available QiProg devices, and returns a flat list with
- * such devices.
+ * Returns a snapshot of the QiProg devices currently connected. Drivers which
+ * can not watch for devices scan the system again; the others only handle
+ * pending events, as in @ref qiprog_handle_events_timeout().
  *
  * @param[in] ctx the context to operate on.
- * @param[out] list output location for a list of QiProg devices. TODO: how to
- * 		    free safely?
+ * @param[out] list output location for a NULL-terminated list of QiProg
+ *		    devices. Free it with @ref qiprog_free_device_list(). The
+ *		    devices themselves belong to the context.
  *
  * @return The number of QiProg devices in the list.
  */
 size_t qiprog_get_device_list(struct qiprog_context *ctx,
 			      struct qiprog_device ***list)
 {
-	size_t i;
-	const struct qiprog_driver *drv;
-	struct dev_list qi_list;
+	size_t i, n;
+	struct qiprog_device **devs;
 
-	if (!ctx)
+	if (!ctx || !list)
 		return 0;
+	*list = NULL;
+
+	/* The event thread, if running, keeps the list up to date for us */
+	if (ctx->hotplug_drivers && !qi_event_thread_running(ctx))
+		qiprog_handle_events_timeout(ctx, 0);
+	rescan(ctx);
+	report_hotplug(ctx);
 
-	if (dev_list_init(&qi_list) != QIPROG_SUCCESS) {
-		/* FIXME: message here */
+	qi_ctx_lock(ctx);
+	for (i = 0, n = 0; i < ctx->devices.len; i++)
+		n += ctx->devices.devs[i]->present ? 1 : 0;
+
+	if ((devs = malloc((n + 1) * sizeof(*devs))) == NULL) {
+		qi_ctx_unlock(ctx);
 		return 0;
 	}
 
-	for (i = 0;; i++) {
-		drv = driver_list[i];
-		if (drv == NULL)
-			break;
-		if (!drv->scan) {
-			/* FIXME: This would be bad. Print something */
-			continue;
-		}
-		drv->scan(ctx, &qi_list);
+	for (i = 0, n = 0; i < ctx->devices.len; i++) {
+		if (ctx->devices.devs[i]->present)
+			devs[n++] = ctx->devices.devs[i];
+	}
+	devs[n] = NULL;
+	qi_ctx_unlock(ctx);
+
+	*list = devs;
+	return n;
+}
+
+/**
+ * @brief Free a list from @ref qiprog_get_device_list()
+ *
+ * Only the list is freed. The devices in it remain valid.
+ *
+ * @param[in] list the list to free. May be NULL.
+ */
+void qiprog_free_device_list(struct qiprog_device **list)
+{
+	free(list);
+}
+
+/**
+ * @brief Be told when devices come and go
+ *
+ * 'cb' is called with QIPROG_DEVICE_ARRIVED for every device already present,
+ * before this function returns. Later changes are reported from
+ * @ref qiprog_get_device_list() and @ref qiprog_handle_events_timeout().
+ *
+ * @param[in] ctx the context to operate on.
+ * @param[in] cb function to call, or NULL to stop calling it
+ * @param[in] user_data pointer passed to 'cb'
+ *
+ * @return QIPROG_SUCCESS on success, or a QIPROG_ERR code otherwise.
+ */
+qiprog_err qiprog_set_hotplug_cb(struct qiprog_context *ctx,
+				 qiprog_hotplug_cb cb, void *user_data)
+{
+	size_t i;
 
+	if (!ctx)
+		return QIPROG_ERR_ARG;
+
+	qi_ctx_lock(ctx);
+	ctx->hotplug_cb = cb;
+	ctx->hotplug_data = user_data;
+
+	/* Devices we already know about can be reported right away */
+	for (i = 0; i < ctx->devices.len; i++) {
+		if (ctx->devices.devs[i]->present)
+			ctx->devices.devs[i]->pending |= QIPROG_DEVICE_ARRIVED;
 	}
+	qi_ctx_unlock(ctx);
+	report_hotplug(ctx);
+
+	return QIPROG_SUCCESS;
+}
+
+/**
+ * @brief Get the serial number of a QiProg device
+ *
+ * The serial number is only known after the device has been opened with
+ * @ref qiprog_open_device().
+ *
+ * @param[in] dev the device to query
+ *
+ * @return The serial number, or NULL if it is not known.
+ */
+const char *qiprog_get_serial(struct qiprog_device *dev)
+{
+	if (!dev)
+		return NULL;
 
-	*list = qi_list.devs;
-	return qi_list.len;
+	return dev->serial;
 }
 
 /** @} */
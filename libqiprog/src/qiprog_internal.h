@@ -27,6 +27,8 @@
 
 #include <qiprog.h>
 
+#include <stdbool.h>
+
 #define MAX(a,b) \
 	({ \
 		__typeof__ (a) _a = (a);	\
@@ -50,14 +52,9 @@
 
 #if defined(CONFIG_DRIVER_USB_MASTER) && (CONFIG_DRIVER_USB_MASTER)
 #include <qiprog_usb_host.h>
+#include <pthread.h>
 #endif
 
-struct qiprog_context {
-#if defined(CONFIG_DRIVER_USB_MASTER) && (CONFIG_DRIVER_USB_MASTER)
-	struct libusb_context *libusb_host_ctx;
-#endif
-};
-
 #define LIST_STEP 128
 struct dev_list {
 	size_t len;
@@ -65,6 +62,28 @@ struct dev_list {
 	struct qiprog_device **devs;
 };
 
+struct qiprog_context {
+#if defined(CONFIG_DRIVER_USB_MASTER) && (CONFIG_DRIVER_USB_MASTER)
+	struct libusb_context *libusb_host_ctx;
+	/*
+	 * Guards the device list and the event thread state. Drivers which
+	 * touch the list from their event callbacks take it too.
+	 */
+	pthread_mutex_t lock;
+	/* Handles events in the background, see qiprog_start_event_thread() */
+	pthread_t event_thread;
+	bool event_thread_running;
+#endif
+	/* Time spent handling events, for qiprog_stats.event_time_us */
+	uint64_t event_time_us;
+	/* Every device ever found, including the ones which went away */
+	struct dev_list devices;
+	/* Bit i is set when driver_list[i] reports devices as they come and go */
+	uint32_t hotplug_drivers;
+	qiprog_hotplug_cb hotplug_cb;
+	void *hotplug_data;
+};
+
 struct qiprog_address {
 	/* Start of address range */
 	uint32_t start;
@@ -76,23 +95,122 @@ struct qiprog_address {
 	uint32_t pwrite;
 };
 
+/*
+ * The last bulk read or write of a device, so that it can be resumed
+ */
+struct qiprog_checkpoint {
+	/* The user's request */
+	uint8_t *buf;
+	uint32_t where;
+	uint32_t len;
+	int write;
+	/* Part of the request done before the driver call now in progress */
+	uint32_t base;
+	/*
+	 * Bytes of the driver call, from its start, which are known to have
+	 * made it. Kept by the driver, as the call progresses.
+	 */
+	uint32_t done;
+};
+
+/* Retry a failed bulk operation this many times, by default */
+#define QI_BULK_RETRIES		3
+/* Wait this long before the first retry. Each retry waits twice as long. */
+#define QI_BULK_RETRY_DELAY_MS	10
+
+/*
+ * Instruction set interpreter, for devices and drivers without their own
+ */
+qiprog_err qiprog_isa_exec(struct qiprog_device *dev, uint8_t *prog,
+			   uint16_t len, uint8_t *out, uint16_t max_out,
+			   uint16_t *out_len);
+
+/*
+ * Shadow copy of the chip, see shadow.c
+ */
+qiprog_err qi_shadow_read(struct qiprog_device *dev, uint32_t where,
+			  void *dest, uint32_t n);
+void qi_shadow_update(struct qiprog_device *dev, uint32_t where,
+		      const void *src, uint32_t n, int write);
+void qi_shadow_drop(struct qiprog_device *dev);
+void qi_shadow_chip_id(struct qiprog_device *dev,
+		       const struct qiprog_chip_id *id);
+void qi_shadow_track(struct qiprog_device *dev, uint32_t where, void *buf,
+		     uint32_t n, int write, qiprog_transfer_cb *cb,
+		     void **user_data);
+void qi_shadow_untrack(struct qiprog_device *dev);
+
+/*
+ * Run-length coding of bulk OUT data, see rle.c
+ */
+struct qi_rle_decoder {
+	uint8_t state;
+	uint8_t value;
+	/* Bytes left in the literal or run being expanded */
+	uint16_t count;
+};
+
+uint32_t qi_rle_bound(uint32_t n, uint32_t block);
+uint32_t qi_rle_encode(const uint8_t *src, uint32_t n, uint8_t *dst,
+		       uint32_t dst_len, uint32_t block, uint32_t *block_ends);
+void qi_rle_reset(struct qi_rle_decoder *dec);
+uint16_t qi_rle_decode(struct qi_rle_decoder *dec, const uint8_t **in,
+		       uint16_t *in_len, uint16_t max, const uint8_t **literal);
+
+/*
+ * Monotonic time, in microseconds. Host side only, see libqiprog.c
+ */
+uint64_t qi_time_us(void);
+void qi_sleep_us(uint64_t us);
+
 /*
  * Logging helpers:
  */
-void qi_log(enum qiprog_log_level level, const char *fmt, ...);
+/*
+ * Most verbose messages compiled in. More verbose ones compile to nothing, and
+ * their arguments are not evaluated.
+ */
+#ifndef CONFIG_LOG_MAX_LEVEL
+#define CONFIG_LOG_MAX_LEVEL	QIPROG_LOG_SPEW
+#endif
+
+/* Longer messages are truncated */
+#define QI_LOG_MSG_MAX		256
+
+extern enum qiprog_log_level qi_loglevel;
+void qi_log(enum qiprog_log_level level, const char *fmt, ...)
+	__attribute__ ((format (printf, 2, 3)));
+
+#define qi_log_at(level, str, ...) do {					\
+	if (((level) <= CONFIG_LOG_MAX_LEVEL) && ((level) <= qi_loglevel))	\
+		qi_log(level, str, ##__VA_ARGS__);			\
+	} while (0)
 
-#define qi_perr(str, ...)	qi_log(QIPROG_LOG_ERR, str,  ##__VA_ARGS__)
-#define qi_pwarn(str, ...)	qi_log(QIPROG_LOG_WARN, str, ##__VA_ARGS__)
-#define qi_pinfo(str, ...)	qi_log(QIPROG_LOG_INFO, str, ##__VA_ARGS__)
-#define qi_pdbg(str, ...)	qi_log(QIPROG_LOG_DBG, str,  ##__VA_ARGS__)
-#define qi_pspew(str, ...)	qi_log(QIPROG_LOG_SPEW, str, ##__VA_ARGS__)
+#define qi_perr(str, ...)	qi_log_at(QIPROG_LOG_ERR, str,  ##__VA_ARGS__)
+#define qi_pwarn(str, ...)	qi_log_at(QIPROG_LOG_WARN, str, ##__VA_ARGS__)
+#define qi_pinfo(str, ...)	qi_log_at(QIPROG_LOG_INFO, str, ##__VA_ARGS__)
+#define qi_pdbg(str, ...)	qi_log_at(QIPROG_LOG_DBG, str,  ##__VA_ARGS__)
+#define qi_pspew(str, ...)	qi_log_at(QIPROG_LOG_SPEW, str, ##__VA_ARGS__)
 
 /*
  * TODO: Functions which take varargs are NOT IMPLEMENTED yet.
  */
 struct qiprog_driver {
+	/*
+	 * Append new devices to the list. Devices already in the list must not
+	 * be added again; set their 'seen' flag instead.
+	 */
 	qiprog_err(*scan) (struct qiprog_context *ctx, struct dev_list *list);
+	/*
+	 * hotplug is optional. It starts adding devices to the list as they
+	 * arrive, and clearing 'present' as they leave. If it succeeds, scan is
+	 * no longer needed.
+	 */
+	qiprog_err(*hotplug) (struct qiprog_context *ctx, struct dev_list *list);
 	qiprog_err(*dev_open) (struct qiprog_device *dev);
+	qiprog_err(*dev_close) (struct qiprog_device *dev);
+	/* dev_free is optional. It releases what scan allocated. */
+	void (*dev_free) (struct qiprog_device *dev);
 	qiprog_err(*get_capabilities) (struct qiprog_device *dev,
 				       struct qiprog_capabilities *caps);
 	qiprog_err(*set_bus) (struct qiprog_device *dev, enum qiprog_bus bus);
@@ -125,14 +243,33 @@ struct qiprog_driver {
 					       uint8_t chip_idx,
 					       uint32_t *addr, uint8_t *data,
 					       size_t num_bytes);
+	/* set_read_command is optional */
+	qiprog_err(*set_read_command) (struct qiprog_device *dev,
+				       uint8_t chip_idx,
+				       enum qiprog_read_cmd cmd);
 	qiprog_err (*set_chip_size) (struct qiprog_device *dev,
 				     uint8_t chip_idx, uint32_t size);
+	/* erase is optional */
+	qiprog_err(*erase) (struct qiprog_device *dev, uint8_t chip_idx,
+			    uint32_t where, uint32_t n);
+	/* checksum is optional */
+	qiprog_err(*checksum) (struct qiprog_device *dev, uint32_t where,
+			       uint32_t n, uint32_t block_size,
+			       enum qiprog_checksum_algo algo,
+			       uint32_t *digests);
 	qiprog_err(*set_spi_timing) (struct qiprog_device *dev,
 				     uint16_t tpu_read_us, uint32_t tces_ns);
 	qiprog_err(*read) (struct qiprog_device *dev, uint32_t where,
 			   void *dest, uint32_t n);
 	qiprog_err(*write) (struct qiprog_device *dev, uint32_t where,
 			    void *src, uint32_t n);
+	/* read_async and write_async are optional */
+	qiprog_err(*read_async) (struct qiprog_device *dev, uint32_t where,
+				 void *dest, uint32_t n,
+				 qiprog_transfer_cb cb, void *user_data);
+	qiprog_err(*write_async) (struct qiprog_device *dev, uint32_t where,
+				  void *src, uint32_t n,
+				  qiprog_transfer_cb cb, void *user_data);
 	qiprog_err(*read8) (struct qiprog_device *dev, uint32_t addr,
 			    uint8_t *data);
 	qiprog_err(*read16) (struct qiprog_device *dev, uint32_t addr,
@@ -146,6 +283,17 @@ struct qiprog_driver {
 	qiprog_err(*write32) (struct qiprog_device *dev, uint32_t addr,
 			      uint32_t data);
 	qiprog_err(*set_vdd) (struct qiprog_device *dev, uint16_t vdd_mv);
+	/* exec_batch and delay_us are optional */
+	qiprog_err(*exec_batch) (struct qiprog_device *dev,
+				 struct qiprog_op *ops, size_t num_ops);
+	qiprog_err(*delay_us) (struct qiprog_device *dev, uint32_t us);
+	/* run_program is optional */
+	qiprog_err(*run_program) (struct qiprog_device *dev, void *prog,
+				  uint16_t len, void *out, uint16_t max_out,
+				  uint16_t *out_len);
+	/* get_device_stats is optional */
+	qiprog_err(*get_device_stats) (struct qiprog_device *dev,
+				       struct qiprog_device_stats *stats);
 };
 
 struct qiprog_device {
@@ -158,12 +306,33 @@ struct qiprog_device {
 
 	/* Internal address range - Used with set_address() and readn() */
 	struct qiprog_address addr;
+	/* Where the last bulk operation got to, see qiprog_resume() */
+	struct qiprog_checkpoint checkpoint;
+	/* How hard to try again when a bulk operation fails */
+	uint8_t bulk_retries;
+	uint32_t retry_delay_ms;
+	/* Chip bulk operations and checksums go to, see qiprog_select_chip() */
+	uint8_t chip_idx;
 	/* Underlying driver */
 	struct qiprog_driver *drv;
 	/* Underlying context */
 	struct qiprog_context *ctx;
 	/* Per-device, specific context */
 	void *priv;
+	/* Copy of the contents of the chip, if enabled */
+	struct qiprog_shadow *shadow;
+	/* Performance counters, kept by the driver */
+	struct qiprog_stats stats;
+	/* Told about the progress of blocking bulk operations, if set */
+	qiprog_transfer_cb progress_cb;
+	void *progress_data;
+
+	/* Still connected, as far as the driver knows */
+	int present;
+	/* Found again by the last scan */
+	int seen;
+	/* QIPROG_DEVICE_ events not yet reported to the hotplug callback */
+	int pending;
 };
 
 /**
@@ -250,5 +419,38 @@ qiprog_err dev_list_free(struct dev_list *list);
 void dev_list_append(struct dev_list *list, struct qiprog_device *dev);
 struct qiprog_device *qiprog_new_device(struct qiprog_context *ctx);
 qiprog_err qiprog_free_device(struct qiprog_device *dev);
+void qi_device_left(struct qiprog_device *dev);
+
+/* libqiprog.c */
+#if defined(CONFIG_DRIVER_USB_MASTER) && (CONFIG_DRIVER_USB_MASTER)
+bool qi_event_thread_running(struct qiprog_context *ctx);
+
+inline static void qi_ctx_lock(struct qiprog_context *ctx)
+{
+	pthread_mutex_lock(&ctx->lock);
+}
+
+inline static void qi_ctx_unlock(struct qiprog_context *ctx)
+{
+	pthread_mutex_unlock(&ctx->lock);
+}
+#else
+/* Without USB, nothing runs in the background */
+inline static bool qi_event_thread_running(struct qiprog_context *ctx)
+{
+	(void)ctx;
+	return false;
+}
+
+inline static void qi_ctx_lock(struct qiprog_context *ctx)
+{
+	(void)ctx;
+}
+
+inline static void qi_ctx_unlock(struct qiprog_context *ctx)
+{
+	(void)ctx;
+}
+#endif
 
 #endif				/* QIPROG_INTERNAL_H */
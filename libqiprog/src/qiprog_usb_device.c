@@ -210,8 +210,23 @@
  * sizes when moving packets.
  *
  * Finally, bulk_buf, must be a memory region capable of holding at least four
- * IN or four OUT packets, whichever is greater. This buffer must be available
- * to QiProg indefinitely, and must be left untouched by the firmware.
+ * IN or four OUT packets, whichever is greater. One of those packets receives
+ * data from the host, and the others are read ahead from the chip. Firmware
+ * with more memory to spare can read further ahead by passing a larger buffer,
+ * and its size, to @ref qiprog_usb_dev_init_buf(). This buffer must be
+ * available to QiProg indefinitely, and must be left untouched by the firmware.
+ *
+ * <h3> Running programs on the instruction set endpoint </h3>
+ *
+ * Firmware which wants to run @ref QIPROG_LANG_BUS programs sent by the host
+ * also calls @ref qiprog_usb_dev_init_isa(). Its send_packet and recv_packet
+ * follow the same rules as above, but operate on the instruction set endpoint,
+ * the second one in the USB descriptors. The program and output buffers bound
+ * the size of programs and of their output, which is advertised to the host in
+ * capabilities.max_direct_data. Programs run from @ref qiprog_handle_events(),
+ * and the DELAY instruction needs the device driver to implement .delay_us().
+ * Nothing else is served while a program runs, so programs are stopped after
+ * QIPROG_ISA_MAX_STEPS instructions, 65536 unless defined when building.
  *
  * <h3> Handling QiProg events </h3>
  *
@@ -219,6 +234,14 @@
  * should be called continuously from the main firmware loop. This handler is
  * safe to call at any time, even before a call to @ref qiprog_usb_dev_init().
  *
+ * <h3> Measuring where the time goes </h3>
+ *
+ * QiProg counts the packets it moves, and the control requests it handles. The
+ * host reads these counters with QIPROG_GET_STATS. Firmware with a free-running
+ * microsecond timer should also pass it to @ref qiprog_usb_dev_set_clock(), so
+ * that QiProg can tell how long the chip was busy, and how long the host kept
+ * the read-ahead ring full.
+ *
  * @todo
  * The event handler is not safely re-entrant if interrupted by a control
  * request. Fix this.
@@ -227,6 +250,9 @@
 
 #include <qiprog_usb_dev.h>
 
+#include <stdbool.h>
+#include <string.h>
+
 /*
  * We need a qiprog_device to run the QiProg API.
  * The bad news is we don't know what device to run until we are being told to
@@ -241,6 +267,301 @@
 /** @private */
 static struct qiprog_device *qi_dev = NULL;
 
+/** @cond private */
+/* How to move packets around */
+static qiprog_packet_io_cb qi_read_packet = NULL;
+static qiprog_packet_io_cb qi_write_packet = NULL;
+static uint16_t qi_max_rx_packet = 0;
+static uint16_t qi_max_tx_packet = 0;
+static uint8_t *qi_bulk_buf = NULL;
+/* Packets received from the host go here */
+static uint8_t *qi_rx_buf = NULL;
+/** @endcond */
+
+/*==============================================================================
+ *= Performance counters
+ *----------------------------------------------------------------------------*/
+/** @cond private */
+/* Where time comes from, if the firmware has a clock */
+static qiprog_clock_cb qi_clock = NULL;
+
+/* Counters sent to the host with QIPROG_GET_STATS */
+static struct {
+	uint32_t packets_rx;
+	uint32_t packets_tx;
+	uint32_t tx_retries;
+	uint32_t starved;
+	uint32_t starved_us;
+	uint32_t read_us;
+	uint32_t write_us;
+	uint32_t erase_us;
+	uint16_t reqs[QIPROG_STATS_NUM_REQS];
+	uint32_t other_reqs;
+	/* The read-ahead ring has been full since 'starved_since' */
+	bool starving;
+	uint32_t starved_since;
+} stats = {
+	.starving = false,
+};
+
+/* Without a clock, time stands still, and all times are 0 */
+static uint32_t stats_now(void)
+{
+	return qi_clock ? qi_clock() : 0;
+}
+
+static uint32_t starved_us(void)
+{
+	if (!stats.starving)
+		return stats.starved_us;
+	return stats.starved_us + (stats_now() - stats.starved_since);
+}
+
+/* We cannot read ahead until the host takes what we already read */
+static void stats_starve(void)
+{
+	if (stats.starving)
+		return;
+	stats.starving = true;
+	stats.starved++;
+	stats.starved_since = stats_now();
+}
+
+static void stats_unstarve(void)
+{
+	if (!stats.starving)
+		return;
+	stats.starved_us = starved_us();
+	stats.starving = false;
+}
+
+static void stats_count_request(uint8_t bRequest)
+{
+	if (bRequest < QIPROG_STATS_NUM_REQS)
+		stats.reqs[bRequest]++;
+	else
+		stats.other_reqs++;
+}
+
+/*
+ * Fill in the reply to QIPROG_GET_STATS
+ */
+static qiprog_err get_stats(uint16_t page, uint16_t first, uint16_t wLength,
+			    uint8_t *buf, uint16_t buf_len, uint16_t *len)
+{
+	uint16_t i, count;
+
+	switch (page) {
+	case QIPROG_STATS_COUNTERS:
+		h_to_le32(qi_clock ? QIPROG_STATS_TIMED : 0, buf + 0x00);
+		h_to_le32(stats.packets_rx, buf + 0x04);
+		h_to_le32(stats.packets_tx, buf + 0x08);
+		h_to_le32(stats.tx_retries, buf + 0x0c);
+		h_to_le32(stats.starved, buf + 0x10);
+		h_to_le32(starved_us(), buf + 0x14);
+		h_to_le32(stats.read_us, buf + 0x18);
+		h_to_le32(stats.write_us, buf + 0x1c);
+		h_to_le32(stats.erase_us, buf + 0x20);
+		h_to_le32(stats.other_reqs, buf + 0x24);
+		*len = MIN(wLength, (uint16_t)QIPROG_STATS_LEN);
+		return QIPROG_SUCCESS;
+	case QIPROG_STATS_REQUESTS:
+		count = wLength / sizeof(uint16_t);
+		if ((count * sizeof(uint16_t) > buf_len) ||
+		    (first + count > QIPROG_STATS_NUM_REQS))
+			return QIPROG_ERR_ARG;
+		for (i = 0; i < count; i++)
+			h_to_le16(stats.reqs[first + i],
+				  buf + i * sizeof(uint16_t));
+		*len = count * sizeof(uint16_t);
+		return QIPROG_SUCCESS;
+	default:
+		return QIPROG_ERR_ARG;
+	}
+}
+/** @endcond */
+
+/**
+ * @brief Tell QiProg how to measure time
+ *
+ * Without a clock, QiProg only counts events. With one, it also measures how
+ * long the chip takes to read, write and erase, and how long the read-ahead
+ * ring stays full because the host does not take packets fast enough.
+ *
+ * @param[in] now_us Returns the time in microseconds. It may wrap around, but
+ *		     must count all 32 bits. NULL to stop measuring time.
+ */
+void qiprog_usb_dev_set_clock(qiprog_clock_cb now_us)
+{
+	stats_unstarve();
+	qi_clock = now_us;
+	/* Don't measure an interval with two different clocks */
+	stats.starved_since = stats_now();
+}
+
+/** @private */
+static void flush_tasks(void);
+/** @private */
+static void flush_writes(void);
+/** @private */
+static qiprog_err set_bulk_encoding(uint16_t encoding);
+/** @private */
+static void reset_bulk_encoding(void);
+/** @private */
+static uint16_t bulk_encodings(void);
+
+/*==============================================================================
+ *= Instruction set endpoint
+ *----------------------------------------------------------------------------*/
+/** @cond private */
+enum {
+	ISA_RECV,
+	ISA_SEND,
+};
+
+/* Programs come in prefixed by their length */
+#define ISA_PROG_HEADER_LEN	2
+
+static struct {
+	qiprog_packet_io_cb read_packet;
+	qiprog_packet_io_cb write_packet;
+	uint16_t max_packet;
+	/* Program being received, with its length header */
+	uint8_t *prog;
+	uint16_t prog_size;
+	/* Status header and output of the last program */
+	uint8_t *out;
+	uint16_t out_size;
+	uint8_t state;
+	/* Bytes of the program received so far, and bytes expected */
+	uint32_t rx_len;
+	uint32_t rx_total;
+	/* Bytes of the answer sent so far, and bytes to send */
+	uint16_t tx_len;
+	uint16_t tx_total;
+} isa = {
+	.out = NULL,
+};
+
+static uint16_t isa_max_direct_data(void)
+{
+	return MIN(isa.prog_size - ISA_PROG_HEADER_LEN,
+		   isa.out_size - QIPROG_ISA_HEADER_LEN);
+}
+/** @endcond */
+
+/**
+ * @brief Enable the instruction set endpoint
+ *
+ * @param[in] send_packet Send one packet on EP 2 IN
+ * @param[in] recv_packet Receive one packet from EP 2 OUT
+ * @param[in] max_packet Maximum packet size of the endpoint
+ * @param[in] prog_buf Where to store received programs
+ * @param[in] prog_buf_len Size of prog_buf; at least two packets
+ * @param[in] out_buf Where to store the output of programs
+ * @param[in] out_buf_len Size of out_buf; at least one packet
+ *
+ * @return QIPROG_SUCCESS on success, or QIPROG_ERR_ARG if the buffers are too
+ * small.
+ */
+qiprog_err qiprog_usb_dev_init_isa(qiprog_packet_io_cb send_packet,
+				   qiprog_packet_io_cb recv_packet,
+				   uint16_t max_packet,
+				   uint8_t *prog_buf, uint16_t prog_buf_len,
+				   uint8_t *out_buf, uint16_t out_buf_len)
+{
+	if ((send_packet == NULL) ||
+	    (recv_packet == NULL) ||
+	    (max_packet == 0) ||
+	    (prog_buf == NULL) || (prog_buf_len < 2 * max_packet) ||
+	    (out_buf == NULL) || (out_buf_len < max_packet) ||
+	    (out_buf_len <= QIPROG_ISA_HEADER_LEN))
+		return QIPROG_ERR_ARG;
+
+	isa.write_packet = send_packet;
+	isa.read_packet = recv_packet;
+	isa.max_packet = max_packet;
+	isa.prog = prog_buf;
+	/* Whole packets only, so a packet never runs past the end */
+	isa.prog_size = prog_buf_len - (prog_buf_len % max_packet);
+	isa.out = out_buf;
+	isa.out_size = out_buf_len;
+	isa.state = ISA_RECV;
+	isa.rx_len = isa.rx_total = 0;
+
+	return QIPROG_SUCCESS;
+}
+
+/** @private */
+static void isa_run(void)
+{
+	qiprog_err ret;
+	uint16_t out_len = 0;
+	uint32_t len = isa.rx_total - ISA_PROG_HEADER_LEN;
+
+	if (len > isa_max_direct_data())
+		ret = QIPROG_ERR_LARGE_ARG;
+	else
+		ret = qiprog_isa_exec(qi_dev, isa.prog + ISA_PROG_HEADER_LEN,
+				      len, isa.out + QIPROG_ISA_HEADER_LEN,
+				      isa_max_direct_data(), &out_len);
+
+	isa.out[0] = (uint8_t)(int8_t)ret;
+	isa.out[1] = 0;
+	h_to_le16(out_len, isa.out + 2);
+
+	/*
+	 * The host reads until it gets a short packet. Rather than deal with
+	 * zero-length packets, send one byte of padding, which the host ignores
+	 * since it knows the real length from the header.
+	 */
+	isa.tx_total = QIPROG_ISA_HEADER_LEN + out_len;
+	if (!(isa.tx_total % isa.max_packet))
+		isa.tx_total++;
+	isa.tx_len = 0;
+	isa.state = ISA_SEND;
+}
+
+/** @private */
+static void handle_isa(void)
+{
+	uint16_t rxd, txd, len;
+	uint32_t pos;
+
+	if (isa.out == NULL)
+		return;
+
+	if (isa.state == ISA_SEND) {
+		len = MIN(isa.max_packet, isa.tx_total - isa.tx_len);
+		txd = isa.write_packet(isa.out + isa.tx_len, len);
+		if (txd != len)
+			return;
+		isa.tx_len += len;
+		if (isa.tx_len == isa.tx_total) {
+			isa.state = ISA_RECV;
+			isa.rx_len = isa.rx_total = 0;
+		}
+		return;
+	}
+
+	/*
+	 * Programs which do not fit are still received in full, so we stay in
+	 * step with the host, but they overwrite the end of the buffer.
+	 */
+	pos = MIN(isa.rx_len, (uint32_t)(isa.prog_size - isa.max_packet));
+	rxd = isa.read_packet(isa.prog + pos, isa.max_packet);
+	if (!rxd)
+		return;
+
+	if ((isa.rx_len < ISA_PROG_HEADER_LEN) &&
+	    (isa.rx_len + rxd >= ISA_PROG_HEADER_LEN))
+		isa.rx_total = le16_to_h(isa.prog) + ISA_PROG_HEADER_LEN;
+	isa.rx_len += rxd;
+
+	if (isa.rx_total && (isa.rx_len >= isa.rx_total))
+		isa_run();
+}
+
 /**
  * @brief Change the QiProg device to operate on
  *
@@ -257,7 +578,8 @@ static struct qiprog_device *qi_dev = NULL;
  */
 void qiprog_change_device(struct qiprog_device *new_dev)
 {
-	/* FIXME: close old driver */
+	if (qi_dev && qi_dev->drv->dev_close)
+		qi_dev->drv->dev_close(qi_dev);
 
 	qi_dev = new_dev;
 
@@ -265,6 +587,129 @@ void qiprog_change_device(struct qiprog_device *new_dev)
 	qi_dev->drv->dev_open(qi_dev);
 }
 
+/** @cond private */
+#define BATCH_MAX_OPS	(QIPROG_BATCH_MAX_LEN / QIPROG_BATCH_OP_LEN)
+
+/* Results of the last batch, collected with QIPROG_GET_BATCH_RESULT */
+static uint8_t batch_result[QIPROG_BATCH_MAX_LEN];
+static uint16_t batch_result_len = 0;
+
+/*
+ * Decode and execute a batch sent with QIPROG_EXEC_BATCH
+ */
+static qiprog_err exec_batch(uint8_t *cmd, uint16_t len)
+{
+	qiprog_err ret;
+	uint16_t pos, res_len;
+	uint8_t i, width, num_ops;
+	struct qiprog_op ops[BATCH_MAX_OPS];
+
+	batch_result_len = 0;
+
+	for (pos = 0, num_ops = 0; pos < len; num_ops++) {
+		if ((len - pos < QIPROG_BATCH_OP_LEN) ||
+		    (num_ops >= BATCH_MAX_OPS))
+			return QIPROG_ERR_ARG;
+
+		ops[num_ops].type = cmd[pos];
+		ops[num_ops].addr = le32_to_h(cmd + pos + 1);
+		pos += QIPROG_BATCH_OP_LEN;
+
+		if (!qiprog_op_is_write(ops[num_ops].type))
+			continue;
+
+		width = qiprog_op_width(ops[num_ops].type);
+		if (len - pos < width)
+			return QIPROG_ERR_ARG;
+		if (width == sizeof(uint8_t))
+			ops[num_ops].data = cmd[pos];
+		else if (width == sizeof(uint16_t))
+			ops[num_ops].data = le16_to_h(cmd + pos);
+		else
+			ops[num_ops].data = le32_to_h(cmd + pos);
+		pos += width;
+	}
+
+	ret = qiprog_exec_batch(qi_dev, ops, num_ops);
+	if (ret != QIPROG_SUCCESS)
+		return ret;
+
+	/* Pack the values read, in order */
+	for (i = 0, res_len = 0; i < num_ops; i++) {
+		if (!qiprog_op_is_read(ops[i].type))
+			continue;
+		width = qiprog_op_width(ops[i].type);
+		if (res_len + width > sizeof(batch_result))
+			return QIPROG_ERR_ARG;
+		if (width == sizeof(uint8_t))
+			batch_result[res_len] = ops[i].data;
+		else if (width == sizeof(uint16_t))
+			h_to_le16(ops[i].data, batch_result + res_len);
+		else
+			h_to_le32(ops[i].data, batch_result + res_len);
+		res_len += width;
+	}
+	batch_result_len = res_len;
+
+	return QIPROG_SUCCESS;
+}
+
+/* Range set with QIPROG_SET_CHECKSUM */
+static struct {
+	uint32_t where;
+	uint32_t n;
+	uint32_t block_size;
+	uint8_t algo;
+} csum = {
+	.n = 0,
+};
+static uint8_t csum_result[QIPROG_CHECKSUM_MAX_LEN];
+
+/*
+ * Compute the digests QIPROG_GET_CHECKSUM asks for, starting with block 'first'
+ */
+static qiprog_err get_checksum(uint16_t first, uint16_t len)
+{
+	qiprog_err ret;
+	uint16_t i;
+	uint32_t start, end, pos, n, crc, nblocks, block_size, t0;
+	struct qiprog_address addr;
+
+	if ((csum.n == 0) || (csum.algo != QIPROG_CHECKSUM_CRC32))
+		return QIPROG_ERR_ARG;
+
+	block_size = csum.block_size ? csum.block_size : csum.n;
+	nblocks = (csum.n + block_size - 1) / block_size;
+	if ((len > sizeof(csum_result)) || (len % sizeof(uint32_t)) ||
+	    (first + len / sizeof(uint32_t) > nblocks))
+		return QIPROG_ERR_ARG;
+
+	/* Reading moves the bulk pointers, which the host still relies on */
+	addr = qi_dev->addr;
+
+	t0 = stats_now();
+	for (i = 0, ret = QIPROG_SUCCESS; i < len / sizeof(uint32_t); i++) {
+		start = csum.where + (first + i) * block_size;
+		end = MIN(start + block_size, csum.where + csum.n);
+		for (pos = start, crc = 0; pos < end; pos += n) {
+			/* The receive buffer is free between packets */
+			n = MIN(end - pos, (uint32_t)qi_max_rx_packet);
+			ret = qiprog_read(qi_dev, pos, qi_rx_buf, n);
+			if (ret != QIPROG_SUCCESS)
+				break;
+			crc = qiprog_crc32(crc, qi_rx_buf, n);
+		}
+		if (ret != QIPROG_SUCCESS)
+			break;
+		h_to_le32(crc, csum_result + i * sizeof(uint32_t));
+	}
+	stats.read_us += stats_now() - t0;
+
+	qi_dev->addr = addr;
+	return ret;
+}
+/** @endcond */
+
 /**
  * @brief Handle USB control requests
  *
@@ -297,19 +742,34 @@ qiprog_err qiprog_handle_control_request(uint8_t bRequest, uint16_t wValue,
 	/* The handler should decide if any data is to be returned */
 	*len = 0;
 
+	stats_count_request(bRequest);
+
+	/* Requests must not overtake data the host sent before them */
+	flush_writes();
+
 	switch (bRequest) {
 	case QIPROG_GET_CAPABILITIES: {
 		int i;
 		struct qiprog_capabilities caps;
 
 		ret = qiprog_get_capabilities(qi_dev, &caps);
+		/* We, not the device driver, run programs */
+		if (isa.out) {
+			caps.instruction_set |= QIPROG_LANG_BUS;
+			caps.max_direct_data = isa_max_direct_data();
+		}
 		h_to_le16(caps.instruction_set, ctrl_buf + 0);
 		h_to_le32(caps.bus_master, ctrl_buf + 2);
-		h_to_le32(caps.max_direct_data, ctrl_buf + 4);
+		h_to_le32(caps.max_direct_data, ctrl_buf + 6);
 		for (i = 0; i < 10; i++)
 			h_to_le16(caps.voltages[i], (ctrl_buf + 10) + (2 * i));
+		h_to_le16(caps.read_cmds, ctrl_buf + 30);
+		/* Encoded data is expanded here, not by the device driver */
+		h_to_le16(caps.bulk_encodings | bulk_encodings(),
+			  ctrl_buf + 32);
 		*data = ctrl_buf;
-		*len = 0x20;
+		/* Hosts which predate the last fields ask for less */
+		*len = MIN(wLength, (uint16_t)0x22);
 		break;
 	}
 	case QIPROG_SET_BUS: {
@@ -318,9 +778,16 @@ qiprog_err qiprog_handle_control_request(uint8_t bRequest, uint16_t wValue,
 		ret = qiprog_set_bus(qi_dev, bus);
 		break;
 	}
-	case QIPROG_SET_CLOCK:
-		/* Not Handled */
+	case QIPROG_SET_CLOCK: {
+		uint32_t clock_khz = (wValue << 16) | wIndex;
+
+		ret = qiprog_set_clock(qi_dev, &clock_khz);
+		/* Tell the host which clock we ended up with */
+		h_to_le32(clock_khz, ctrl_buf);
+		*data = ctrl_buf;
+		*len = (ret == QIPROG_SUCCESS) ? sizeof(uint32_t) : 0;
 		break;
+	}
 	case QIPROG_READ_DEVICE_ID: {
 		int i;
 		uint8_t *base;
@@ -341,10 +808,22 @@ qiprog_err qiprog_handle_control_request(uint8_t bRequest, uint16_t wValue,
 		uint32_t start = le32_to_h(*data + 0);
 		uint32_t end = le32_to_h(*data + 4);
 
+		/* Whatever we read ahead is not what the host wants now */
+		flush_tasks();
+		/* And the bulk data which follows starts with a new token */
+		reset_bulk_encoding();
+
+		/* wIndex is the chip the following bulk transfers go to */
+		ret = qiprog_select_chip(qi_dev, wIndex);
+		if (ret != QIPROG_SUCCESS)
+			break;
 		/* set_address() is not in the core, just the driver */
 		ret = qi_dev->drv->set_address(qi_dev, start, end);
 		break;
 	}
+	case QIPROG_SET_BULK_ENCODING:
+		ret = wIndex ? QIPROG_ERR_ARG : set_bulk_encoding(wValue);
+		break;
 	case QIPROG_SET_ERASE_SIZE: {
 		int i, num_sizes;
 		enum qiprog_erase_type types[12];
@@ -434,8 +913,42 @@ qiprog_err qiprog_handle_control_request(uint8_t bRequest, uint16_t wValue,
 		ret = qiprog_set_chip_size(qi_dev, wIndex, size);
 		break;
 	}
+	case QIPROG_ERASE: {
+		uint32_t where = le32_to_h(*data + 0);
+		uint32_t n = le32_to_h(*data + 4);
+		uint32_t t0;
+		/* What we read ahead is about to be erased */
+		flush_tasks();
+		t0 = stats_now();
+		ret = qiprog_erase(qi_dev, wIndex, where, n);
+		stats.erase_us += stats_now() - t0;
+		break;
+	}
+	case QIPROG_SET_CHECKSUM:
+		csum.where = le32_to_h(*data + 0);
+		csum.n = le32_to_h(*data + 4);
+		csum.block_size = le32_to_h(*data + 8);
+		csum.algo = wValue;
+		/* wIndex is the chip to read, like for QIPROG_SET_ADDRESS */
+		if (wIndex != qi_dev->chip_idx)
+			flush_tasks();
+		ret = qiprog_select_chip(qi_dev, wIndex);
+		break;
+	case QIPROG_GET_CHECKSUM:
+		ret = get_checksum(wValue, wLength);
+		*data = csum_result;
+		*len = (ret == QIPROG_SUCCESS) ? wLength : 0;
+		break;
+	case QIPROG_GET_STATS:
+		ret = get_stats(wValue, wIndex, wLength, ctrl_buf,
+				sizeof(ctrl_buf), len);
+		*data = ctrl_buf;
+		break;
 	case QIPROG_SET_SPI_TIMING:
-		/* Not Handled */
+		ret = qiprog_set_spi_timing(qi_dev, wValue, wIndex);
+		break;
+	case QIPROG_SET_READ_COMMAND:
+		ret = qiprog_set_read_command(qi_dev, wIndex, wValue);
 		break;
 	case QIPROG_READ8: {
 		uint32_t addr = (wValue << 16) | wIndex;
@@ -476,8 +989,17 @@ qiprog_err qiprog_handle_control_request(uint8_t bRequest, uint16_t wValue,
 		ret = qiprog_write32(qi_dev, addr, reg32);
 		break;
 	}
+	case QIPROG_EXEC_BATCH:
+		ret = exec_batch(*data, wLength);
+		break;
+	case QIPROG_GET_BATCH_RESULT:
+		*data = batch_result;
+		*len = batch_result_len;
+		ret = QIPROG_SUCCESS;
+		break;
 	case QIPROG_SET_VDD:
-		/* Not Handled */
+		/* wIndex turns the supply on or off */
+		ret = qiprog_set_vdd(qi_dev, wIndex ? wValue : 0);
 		break;
 	default:
 		/* Nothing to handle */
@@ -491,36 +1013,32 @@ qiprog_err qiprog_handle_control_request(uint8_t bRequest, uint16_t wValue,
  *= Asynchronous task manager
  *----------------------------------------------------------------------------*/
 /** @cond private */
+#ifndef QIPROG_MAX_TX_TASKS
+/* Upper bound on the depth of the read-ahead ring; override when building */
+#define QIPROG_MAX_TX_TASKS	16
+#endif
+
 struct qiprog_task {
 	uint8_t status;
 	uint8_t *buf;
 	uint16_t len;
 };
 
+/*
+ * Ring of packets read from the chip, waiting to be sent to the host. Packets
+ * are sent from 'head', in the order they were read.
+ */
 struct qiprog_task_list {
-	struct qiprog_task tasks[4];
-	uint8_t task_start;
+	struct qiprog_task tasks[QIPROG_MAX_TX_TASKS];
+	uint8_t depth;
+	uint8_t head;
+	uint8_t count;
 };
 
 static struct qiprog_task_list task_list = {
-	.tasks = {{
-		.status = 0,
-		.buf = NULL,
-		.len = 0,
-	}, {
-		.status = 0,
-		.buf = NULL,
-		.len = 0,
-	}, {
-		.status = 0,
-		.buf = NULL,
-		.len = 0,
-	}, {
-		.status = 0,
-		.buf = NULL,
-		.len = 0,
-	}},
-	.task_start = 0,
+	.depth = 0,
+	.head = 0,
+	.count = 0,
 };
 
 enum {
@@ -532,53 +1050,83 @@ enum {
 /** @private */
 static struct qiprog_task *get_free_task(void)
 {
-	int i, dx;
 	struct qiprog_task *task;
 
-	for (i = 0; i < 2; i++) {
-		dx = (i + task_list.task_start) & 1;
-		task = &(task_list.tasks[dx]);
-		if (task->status == IDLE)
-			return task;
-	}
-	return NULL;
+	if (task_list.count == task_list.depth)
+		return NULL;
+
+	task = &(task_list.tasks[(task_list.head + task_list.count)
+				 % task_list.depth]);
+	task_list.count++;
+	return task;
 }
 
 /** @private */
 static struct qiprog_task *get_first_task(void)
 {
-	return &(task_list.tasks[task_list.task_start]);
+	if (task_list.count == 0)
+		return NULL;
+	return &(task_list.tasks[task_list.head]);
 }
 
 /** @private */
 static void idle_task(struct qiprog_task *task)
 {
-	task_list.task_start = (task_list.task_start + 1) & 1;
+	task_list.head = (task_list.head + 1) % task_list.depth;
+	task_list.count--;
 	task->status = IDLE;
 	task->len = 0;
 }
 
+/** @private */
+static void flush_tasks(void)
+{
+	struct qiprog_task *task;
+
+	while ((task = get_first_task()) != NULL)
+		idle_task(task);
+	/* There is room to read ahead again */
+	stats_unstarve();
+}
+
 /*==============================================================================
  *= How to move packets around
  *----------------------------------------------------------------------------*/
-/** @cond private */
-static qiprog_packet_io_cb qi_read_packet = NULL;
-static qiprog_packet_io_cb qi_write_packet = NULL;
-static uint16_t qi_max_rx_packet = 0;
-static uint16_t qi_max_tx_packet = 0;
-static uint8_t *qi_bulk_buf = NULL;
-/** @endcond */
-
 /**
  * @brief handle stuff
+ *
+ * Same as @ref qiprog_usb_dev_init_buf(), with a bulk_buf of four packets.
  */
 qiprog_err qiprog_usb_dev_init(qiprog_packet_io_cb send_packet,
 			       qiprog_packet_io_cb recv_packet,
 			       uint16_t max_rx_packet, uint16_t max_tx_packet,
 			       uint8_t *bulk_buf)
+{
+	uint16_t max_packet = MAX(max_rx_packet, max_tx_packet);
+
+	return qiprog_usb_dev_init_buf(send_packet, recv_packet, max_rx_packet,
+				       max_tx_packet, bulk_buf,
+				       (uint32_t)max_packet * 4);
+}
+
+/**
+ * @brief Initialize the bulk endpoint, with a read-ahead ring of any depth
+ *
+ * One packet of bulk_buf receives data from the host. The rest is split into
+ * packets read ahead from the chip, up to QIPROG_MAX_TX_TASKS of them. A
+ * deeper ring keeps the IN endpoint busy while the chip is being read.
+ *
+ * @param[in] bulk_buf_len Size of bulk_buf, at least two packets
+ */
+qiprog_err qiprog_usb_dev_init_buf(qiprog_packet_io_cb send_packet,
+				   qiprog_packet_io_cb recv_packet,
+				   uint16_t max_rx_packet,
+				   uint16_t max_tx_packet,
+				   uint8_t *bulk_buf, uint32_t bulk_buf_len)
 {
 	int i;
 	uint16_t max_packet;
+	uint32_t depth;
 
 	if ((send_packet == NULL) ||
 	    (recv_packet == NULL) ||
@@ -587,62 +1135,430 @@ qiprog_err qiprog_usb_dev_init(qiprog_packet_io_cb send_packet,
 	    (bulk_buf == NULL))
 		return QIPROG_ERR_ARG;
 
+	/* One packet to receive, and at least one to read ahead */
+	max_packet = MAX(max_rx_packet, max_tx_packet);
+	if (bulk_buf_len < 2 * (uint32_t)max_packet)
+		return QIPROG_ERR_ARG;
+	depth = MIN(bulk_buf_len / max_packet - 1,
+		    (uint32_t)QIPROG_MAX_TX_TASKS);
+
 	qi_read_packet = recv_packet;
 	qi_write_packet = send_packet;
 	qi_max_rx_packet = max_rx_packet;
 	qi_max_tx_packet = max_tx_packet;
 	qi_bulk_buf = bulk_buf;
 
-	max_packet = MAX(max_rx_packet, max_tx_packet);
-	for (i = 0; i < 4; i++)
-		task_list.tasks[i].buf = bulk_buf + max_packet * i;
+	qi_rx_buf = bulk_buf;
+	task_list.depth = depth;
+	task_list.head = task_list.count = 0;
+	for (i = 0; i < task_list.depth; i++) {
+		task_list.tasks[i].buf = bulk_buf + max_packet * (i + 1);
+		task_list.tasks[i].status = IDLE;
+		task_list.tasks[i].len = 0;
+	}
 
 	return QIPROG_SUCCESS;
 }
 
+/*
+ * Send as many packets as the USB stack takes. Returns true if the ring has
+ * room for more packets.
+ */
 /** @private */
-static void handle_send(void)
+static bool handle_send(void)
 {
 	uint16_t txd;
 	struct qiprog_task *task;
 
-	/*
-	 * See if any packet needs sending
-	 */
-	task = get_first_task();
-	/* Try to send if it wasn't sent last time */
-	if (task->status == READY_SEND) {
+	while ((task = get_first_task()) != NULL) {
+		if (task->status != READY_SEND)
+			break;
 		txd = qi_write_packet(task->buf, task->len);
-		/* Clear task from queue if successfully transmitted */
-		if (txd == task->len)
-			idle_task(task);
+		/* Try again next time if it could not be sent */
+		if (txd != task->len) {
+			stats.tx_retries++;
+			break;
+		}
+		stats.packets_tx++;
+		idle_task(task);
 	}
+
+	return task_list.count < task_list.depth;
+}
+
+/*==============================================================================
+ *= Write coalescing
+ *----------------------------------------------------------------------------*/
+/** @cond private */
+#ifndef QIPROG_MAX_WRITE_BUFS
+/* Upper bound on the number of write buffers; override when building */
+#define QIPROG_MAX_WRITE_BUFS	8
+#endif
+
+struct qiprog_wbuf {
+	uint8_t *buf;
+	/* Where in the chip the data goes */
+	uint32_t addr;
+	/* Bytes received so far, and bytes needed to fill the buffer */
+	uint16_t len;
+	uint16_t size;
+	uint8_t status;
+};
+
+/*
+ * Ring of write buffers. The buffer at 'head' is the oldest, and the last one
+ * in the ring is the one being filled, unless it is READY_WRITE.
+ */
+static struct {
+	struct qiprog_wbuf bufs[QIPROG_MAX_WRITE_BUFS];
+	uint8_t num;
+	uint8_t head;
+	uint8_t count;
+	uint16_t unit;
+	/* Where the next byte received goes */
+	uint32_t next_addr;
+} wq = {
+	.num = 0,
+};
+
+enum {
+	FILLING = 1,
+	READY_WRITE,
+};
+/** @endcond */
+
+/**
+ * @brief Gather received data into buffers of program granularity
+ *
+ * By default, every packet received from the host is written to the chip as
+ * soon as it arrives. With write buffers, the data is gathered instead into
+ * chunks of 'unit' bytes, aligned to 'unit' in the chip's address space, and
+ * each chunk is written at once. 'unit' should be the page size of the chip,
+ * or its erase block size.
+ *
+ * While a buffer is written, the others keep receiving data. The host is only
+ * NAK'ed when all buffers are full. Device drivers which wait for the chip to
+ * be ready before starting a write, rather than after, let the chip program
+ * one buffer while the next one fills up.
+ *
+ * Write buffers are also where run-length encoded data from the host is
+ * expanded to, so only with them does the device offer QIPROG_BULK_RLE.
+ *
+ * @param[in] buf Memory for the buffers. It must be available to QiProg
+ *		  indefinitely, and left untouched by the firmware.
+ * @param[in] buf_len Size of buf; up to QIPROG_MAX_WRITE_BUFS buffers are used
+ * @param[in] unit Size of each buffer
+ *
+ * @return QIPROG_SUCCESS on success, or QIPROG_ERR_ARG if there is not room for
+ * at least one received packet.
+ */
+qiprog_err qiprog_usb_dev_set_write_bufs(uint8_t *buf, uint32_t buf_len,
+					 uint16_t unit)
+{
+	uint8_t i;
+
+	if ((buf == NULL) || (unit == 0) || (qi_bulk_buf == NULL))
+		return QIPROG_ERR_ARG;
+
+	wq.num = MIN(buf_len / unit, (uint32_t)QIPROG_MAX_WRITE_BUFS);
+	if ((uint32_t)wq.num * unit < qi_max_rx_packet) {
+		wq.num = 0;
+		return QIPROG_ERR_ARG;
+	}
+
+	wq.unit = unit;
+	wq.head = wq.count = 0;
+	for (i = 0; i < wq.num; i++) {
+		wq.bufs[i].buf = buf + (uint32_t)unit * i;
+		wq.bufs[i].status = IDLE;
+	}
+
+	return QIPROG_SUCCESS;
+}
+
+/** @private */
+static struct qiprog_wbuf *last_wbuf(void)
+{
+	if (wq.count == 0)
+		return NULL;
+	return &wq.bufs[(wq.head + wq.count - 1) % wq.num];
+}
+
+/** @private */
+static struct qiprog_wbuf *new_wbuf(void)
+{
+	struct qiprog_wbuf *wbuf;
+
+	if (wq.count == wq.num)
+		return NULL;
+
+	/* Start where the host is writing, if nothing is pending */
+	if (wq.count == 0)
+		wq.next_addr = qi_dev->addr.pwrite;
+
+	wbuf = &wq.bufs[(wq.head + wq.count) % wq.num];
+	wq.count++;
+	wbuf->addr = wq.next_addr;
+	wbuf->len = 0;
+	/* Stop at the next unit boundary, even if we start in the middle */
+	wbuf->size = wq.unit - (wbuf->addr % wq.unit);
+	wbuf->status = FILLING;
+	return wbuf;
+}
+
+/*
+ * Number of bytes we can take without overwriting anything
+ */
+/** @private */
+static uint32_t wbuf_room(void)
+{
+	uint32_t room, next;
+	struct qiprog_wbuf *wbuf = last_wbuf();
+
+	next = (wq.count == 0) ? qi_dev->addr.pwrite : wq.next_addr;
+	room = (uint32_t)(wq.num - wq.count) * wq.unit;
+	if (wbuf && (wbuf->status == FILLING))
+		room += wbuf->size - wbuf->len;
+	/* The first new buffer may be short, if it starts unaligned */
+	else if (wq.count < wq.num)
+		room -= next % wq.unit;
+	return room;
+}
+
+/*
+ * Copy received data into the write buffers, or fill them with 'fill' if data
+ * is NULL
+ */
+/** @private */
+static void wbuf_store(const uint8_t *data, uint8_t fill, uint16_t len)
+{
+	uint16_t n;
+	struct qiprog_wbuf *wbuf;
+
+	while (len) {
+		wbuf = last_wbuf();
+		if (!wbuf || (wbuf->status != FILLING))
+			wbuf = new_wbuf();
+
+		n = MIN(len, wbuf->size - wbuf->len);
+		if (data) {
+			memcpy(wbuf->buf + wbuf->len, data, n);
+			data += n;
+		} else {
+			memset(wbuf->buf + wbuf->len, fill, n);
+		}
+		wbuf->len += n;
+		wq.next_addr += n;
+		len -= n;
+
+		if (wbuf->len == wbuf->size)
+			wbuf->status = READY_WRITE;
+	}
+}
+
+/*
+ * Write the oldest buffer to the chip, if it is ready
+ */
+/** @private */
+static void wbuf_write_one(void)
+{
+	uint32_t t0;
+	struct qiprog_wbuf *wbuf;
+
+	if (wq.count == 0)
+		return;
+	wbuf = &wq.bufs[wq.head];
+	if (wbuf->status != READY_WRITE)
+		return;
+
+	t0 = stats_now();
+	qiprog_write(qi_dev, wbuf->addr, wbuf->buf, wbuf->len);
+	stats.write_us += stats_now() - t0;
+	wbuf->status = IDLE;
+	wq.head = (wq.head + 1) % wq.num;
+	wq.count--;
+}
+
+/** @private */
+static void wbuf_close(void)
+{
+	struct qiprog_wbuf *wbuf = last_wbuf();
+
+	if (wbuf && (wbuf->status == FILLING))
+		wbuf->status = READY_WRITE;
+}
+
+/*==============================================================================
+ *= Encoded bulk data
+ *----------------------------------------------------------------------------*/
+/** @cond private */
+static struct {
+	uint8_t encoding;
+	struct qi_rle_decoder dec;
+	/* What is left to expand of the last packet received */
+	const uint8_t *in;
+	uint16_t in_len;
+	/* The last packet was short, which ends the transfer */
+	bool last;
+} rx = {
+	.encoding = QIPROG_BULK_RAW,
+};
+/** @endcond */
+
+/*
+ * Encodings we can expand. Expanded data needs somewhere to go, so only with
+ * write buffers.
+ */
+/** @private */
+static uint16_t bulk_encodings(void)
+{
+	return wq.num ? QIPROG_BULK_ENCODING_BIT(QIPROG_BULK_RLE) : 0;
+}
+
+/** @private */
+static void reset_bulk_encoding(void)
+{
+	qi_rle_reset(&rx.dec);
+	rx.in_len = 0;
+	rx.last = false;
+}
+
+/** @private */
+static qiprog_err set_bulk_encoding(uint16_t encoding)
+{
+	if ((encoding != QIPROG_BULK_RAW) &&
+	    !(bulk_encodings() & QIPROG_BULK_ENCODING_BIT(encoding)))
+		return QIPROG_ERR_ARG;
+
+	rx.encoding = encoding;
+	reset_bulk_encoding();
+	return QIPROG_SUCCESS;
+}
+
+/*
+ * Expand as much of the packet received as the write buffers have room for.
+ * Returns true once all of it is expanded.
+ */
+/** @private */
+static bool rle_expand(void)
+{
+	uint16_t n;
+	uint32_t room;
+	const uint8_t *literal;
+
+	while ((room = wbuf_room()) != 0) {
+		n = qi_rle_decode(&rx.dec, &rx.in, &rx.in_len,
+				  MIN(room, (uint32_t)UINT16_MAX), &literal);
+		if (n == 0)
+			return true;
+		wbuf_store(literal, rx.dec.value, n);
+	}
+
+	return false;
+}
+
+/*
+ * Receive run-length encoded data. A packet is only taken in once the one
+ * before it is expanded, so the host is NAK'ed while the buffers are full.
+ */
+/** @private */
+static void rle_recv(void)
+{
+	uint16_t rxd;
+
+	while (rle_expand()) {
+		/* A short packet ends the transfer. Don't wait for more. */
+		if (rx.last) {
+			rx.last = false;
+			wbuf_close();
+			break;
+		}
+
+		rxd = qi_read_packet(qi_rx_buf, qi_max_rx_packet);
+		if (!rxd)
+			break;
+		stats.packets_rx++;
+		rx.in = qi_rx_buf;
+		rx.in_len = rxd;
+		rx.last = (rxd < qi_max_rx_packet);
+	}
+}
+
+/*
+ * Write everything the host sent so far, including partial buffers
+ */
+/** @private */
+static void flush_writes(void)
+{
+	do {
+		wbuf_close();
+		while (wq.count)
+			wbuf_write_one();
+		/* Encoded data may not all have fit in the buffers */
+	} while ((rx.encoding != QIPROG_BULK_RAW) && wq.num && !rle_expand());
 }
 
 /** @private */
 static void handle_recv(void)
 {
 	uint16_t rxd;
-	struct qiprog_task *task;
+	uint32_t t0;
+
+	if (wq.num == 0) {
+		/* Check for incoming data */
+		rxd = qi_read_packet(qi_rx_buf, qi_max_rx_packet);
 
-	/* We use the third task in the list for receiving and writing data */
-	task = &(task_list.tasks[2]);
+		/* If we got some data, immediately write it */
+		if (rxd) {
+			stats.packets_rx++;
+			t0 = stats_now();
+			qiprog_write(qi_dev, qi_dev->addr.pwrite, qi_rx_buf,
+				     rxd);
+			stats.write_us += stats_now() - t0;
+		}
+		return;
+	}
+
+	if (rx.encoding == QIPROG_BULK_RLE) {
+		rle_recv();
+		wbuf_write_one();
+		return;
+	}
 
-	/* Check for incoming data */
-	rxd = qi_read_packet(task->buf, qi_max_rx_packet);
+	/* Take in everything we have room for; the host is NAK'ed otherwise */
+	while (wbuf_room() >= qi_max_rx_packet) {
+		rxd = qi_read_packet(qi_rx_buf, qi_max_rx_packet);
+		if (!rxd)
+			break;
+		stats.packets_rx++;
+		wbuf_store(qi_rx_buf, 0, rxd);
 
-	/* If we got some data, immediately write it */
-	if (rxd) {
-		qiprog_write(qi_dev, qi_dev->addr.pwrite, task->buf, rxd);
+		/*
+		 * A short packet ends the transfer, and the end of the range
+		 * ends the data. Don't wait for more to fill the buffer.
+		 */
+		if ((rxd < qi_max_rx_packet) ||
+		    (wq.next_addr > qi_dev->addr.end)) {
+			wbuf_close();
+			break;
+		}
 	}
+
+	/* One buffer per pass, so reads and sends get a turn */
+	wbuf_write_one();
 }
 
 /**
- * @brief QiProg event handler
+ * @brief Handle QiProg events
+ *
+ * Reads ahead of the host, until the read-ahead ring is full, or the end of
+ * the range given with set_address is reached. Every packet is offered to the
+ * USB stack as soon as it is read, so reading the chip and sending to the host
+ * overlap.
  */
 void qiprog_handle_events(void)
 {
-	uint32_t len, start, end;
+	uint32_t len, start, end, t0;
 	struct qiprog_task *task;
 
 	/* Have we been initialized properly? */
@@ -651,26 +1567,36 @@ void qiprog_handle_events(void)
 
 	handle_send();
 	handle_recv();
+	handle_isa();
 
 	/*
 	 * Now see if there is anything we can read
 	 */
-	start = qi_dev->addr.pread;
-	end = qi_dev->addr.end;
-	if (start == end)
-		return;
-	len = end - start + 1;
+	while (handle_send()) {
+		start = qi_dev->addr.pread;
+		end = qi_dev->addr.end;
+		if (start == end)
+			return;
+		len = end - start + 1;
 
-	if (len == 0)
-		return;
+		if (len == 0)
+			return;
 
-	/* Get a free task */
-	if ((task = get_free_task()) == NULL)
-		return;
+		/* Get a free task */
+		if ((task = get_free_task()) == NULL)
+			return;
+		stats_unstarve();
+
+		task->len = MIN(len, qi_max_tx_packet);
+		t0 = stats_now();
+		qiprog_read(qi_dev, start, task->buf, task->len);
+		stats.read_us += stats_now() - t0;
+		task->status = READY_SEND;
+	}
 
-	task->len = MIN(len, qi_max_tx_packet);
-	qiprog_read(qi_dev, start, task->buf, task->len);
-	task->status = READY_SEND;
+	/* The ring is full, and the host has yet to take what is in it */
+	if (qi_dev->addr.pread != qi_dev->addr.end)
+		stats_starve();
 }
 
 /** @} */
@@ -0,0 +1,237 @@
+/*
+ * qiprog - Reference implementation of the QiProg protocol
+ *
+ * Copyright (C) 2013 Alexandru Gagniuc <mr.nuke.me@gmail.com>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+#include "qiprog_internal.h"
+
+#include <string.h>
+
+/**
+ * @defgroup rle QiProg run-length coding
+ *
+ * @ingroup chip_io
+ *
+ * @brief Fewer bytes on the bus for images with long runs
+ *
+ * Firmware images are mostly padding of 0xff or 0x00. Sent run-length encoded,
+ * a run of up to 32 KiB takes three bytes on the bus. The coding is simple
+ * enough to expand on a programmer, one packet at a time. The stream is made of
+ * tokens:
+ *
+ *	0x00		padding, expands to nothing
+ *	0x01 - 0x7f	that many literal bytes follow
+ *	0x80 - 0xff	a run. With the next byte, the low 15 bits give its
+ *			length, and the byte after that is repeated.
+ *
+ * The encoder never lets a token cross a block boundary of the stream, so that
+ * every block expands to a known part of the data, on its own.
+ */
+/** @{ */
+
+#define RLE_MAX_LITERAL		((uint32_t)0x7f)
+#define RLE_MAX_RUN		((uint32_t)0x7fff)
+/* A run token takes three bytes, so shorter runs are no gain */
+#define RLE_MIN_RUN		4
+#define RLE_RUN_LEN		((uint32_t)3)
+
+/** @cond private */
+enum {
+	RLE_TOKEN,
+	RLE_RUN_HIGH,
+	RLE_RUN_VALUE,
+	RLE_LITERAL,
+	RLE_RUN,
+};
+/** @endcond */
+
+/*
+ * Number of times the first byte repeats, up to max
+ */
+static uint32_t run_len(const uint8_t *data, uint32_t n, uint32_t max)
+{
+	uint32_t i;
+
+	n = MIN(n, max);
+	for (i = 1; (i < n) && (data[i] == data[0]); i++)
+		;
+
+	return i;
+}
+
+/*
+ * Number of bytes before the next run worth a token, up to max
+ */
+static uint32_t literal_len(const uint8_t *data, uint32_t n, uint32_t max)
+{
+	uint32_t i;
+
+	n = MIN(n, max);
+	for (i = 1; i < n; i++)
+		if (run_len(data + i, n - i, RLE_MIN_RUN) == RLE_MIN_RUN)
+			break;
+
+	return i;
+}
+
+/**
+ * @brief Most bytes qi_rle_encode() can make out of n bytes
+ *
+ * @param[in] n Number of bytes to encode
+ * @param[in] block Block size given to qi_rle_encode(), at least 64 bytes
+ */
+uint32_t qi_rle_bound(uint32_t n, uint32_t block)
+{
+	/* One header per literal, and up to two bytes of padding per block */
+	return n + n / 8 + 2 * block + 16;
+}
+
+/**
+ * @brief Run-length encode data in blocks
+ *
+ * @param[in] src Data to encode
+ * @param[in] n Number of bytes in src
+ * @param[out] dst Where to place the encoded data
+ * @param[in] dst_len Size of dst, see qi_rle_bound()
+ * @param[in] block No token crosses a multiple of this many bytes in dst
+ * @param[out] block_ends For each block of dst, how many bytes of src are
+ *			  encoded up to its end. The last block may be partial.
+ *			  May be NULL.
+ *
+ * @return Number of bytes in dst, or 0 if it does not have room for them
+ */
+uint32_t qi_rle_encode(const uint8_t *src, uint32_t n, uint8_t *dst,
+		       uint32_t dst_len, uint32_t block, uint32_t *block_ends)
+{
+	uint32_t in = 0, out = 0, room, len;
+
+	while (in < n) {
+		room = block - (out % block);
+		len = run_len(src + in, n - in, RLE_MAX_RUN);
+		if (out + MIN(room, RLE_RUN_LEN) > dst_len)
+			return 0;
+
+		if ((len >= RLE_MIN_RUN) && (room >= RLE_RUN_LEN)) {
+			dst[out++] = 0x80 | (len >> 8);
+			dst[out++] = len & 0xff;
+			dst[out++] = src[in];
+			in += len;
+		} else if ((len < RLE_MIN_RUN) && (room >= 2)) {
+			len = literal_len(src + in, n - in,
+					  MIN(room - 1, RLE_MAX_LITERAL));
+			if (out + 1 + len > dst_len)
+				return 0;
+			dst[out++] = len;
+			memcpy(dst + out, src + in, len);
+			out += len;
+			in += len;
+		} else {
+			/* The token does not fit. Pad to the next block. */
+			while (out % block)
+				dst[out++] = 0;
+		}
+
+		if (block_ends && !(out % block))
+			block_ends[out / block - 1] = in;
+	}
+
+	if (block_ends && (out % block))
+		block_ends[out / block] = in;
+
+	return out;
+}
+
+/**
+ * @brief Get ready for a new stream
+ */
+void qi_rle_reset(struct qi_rle_decoder *dec)
+{
+	dec->state = RLE_TOKEN;
+	dec->count = 0;
+}
+
+/**
+ * @brief Expand the next piece of a run-length encoded stream
+ *
+ * Pieces are either literal bytes, which stay where they are in the input, or
+ * part of a run of dec->value. The stream may be fed in any number of pieces;
+ * the decoder keeps track of tokens which span them.
+ *
+ * @param[in] dec Decoder state
+ * @param[in,out] in Input, moved past what was used
+ * @param[in,out] in_len Bytes left in the input
+ * @param[in] max Most bytes to expand
+ * @param[out] literal Literal bytes, or NULL for a run of dec->value
+ *
+ * @return Number of bytes expanded, or 0 once more input is needed
+ */
+uint16_t qi_rle_decode(struct qi_rle_decoder *dec, const uint8_t **in,
+		       uint16_t *in_len, uint16_t max, const uint8_t **literal)
+{
+	uint8_t c;
+	uint16_t n;
+
+	while ((dec->state < RLE_LITERAL) && *in_len) {
+		c = *(*in)++;
+		(*in_len)--;
+
+		switch (dec->state) {
+		case RLE_TOKEN:
+			if (c & 0x80) {
+				dec->count = (c & 0x7f) << 8;
+				dec->state = RLE_RUN_HIGH;
+			} else if (c) {
+				dec->count = c;
+				dec->state = RLE_LITERAL;
+			}
+			break;
+		case RLE_RUN_HIGH:
+			dec->count |= c;
+			dec->state = RLE_RUN_VALUE;
+			break;
+		case RLE_RUN_VALUE:
+			dec->value = c;
+			dec->state = dec->count ? RLE_RUN : RLE_TOKEN;
+			break;
+		}
+	}
+
+	if (dec->state == RLE_LITERAL) {
+		n = MIN(MIN(dec->count, *in_len), max);
+		*literal = *in;
+		*in += n;
+		*in_len -= n;
+	} else if (dec->state == RLE_RUN) {
+		n = MIN(dec->count, max);
+		*literal = NULL;
+	} else {
+		return 0;
+	}
+
+	dec->count -= n;
+	if (dec->count == 0)
+		dec->state = RLE_TOKEN;
+
+	return n;
+}
+
+/** @} */
@@ -0,0 +1,312 @@
+/*
+ * qiprog - Reference implementation of the QiProg protocol
+ *
+ * Copyright (C) 2013 Alexandru Gagniuc <mr.nuke.me@gmail.com>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+#include "qiprog_internal.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+/**
+ * @defgroup segments QiProg scatter-gather IO
+ *
+ * @ingroup chip_io
+ *
+ * @brief Read or write many ranges of the chip in one call
+ *
+ * Sparse images, such as configuration blocks, NVRAM or microcode slots, are
+ * made of many small ranges. Handled one at a time, every range costs a round
+ * trip to set the address, and the transfers stop between ranges.
+ *
+ * @ref qiprog_readv() and @ref qiprog_writev() sort the ranges, and merge the
+ * ones which follow each other on the chip into runs. The address is set once
+ * for each run, which is then streamed in large chunks, no matter which of the
+ * caller's ranges the data belongs to. Reads also bridge small gaps between
+ * ranges, since reading a few bytes we do not need takes less time than setting
+ * a new address.
+ */
+/** @{ */
+
+/* Most bytes in one bulk operation. Longer runs are split in chunks */
+#define SEG_CHUNK_SIZE		((uint32_t)1 << 20)
+/* Gaps between reads up to this size are read too, and thrown away */
+#define SEG_MAX_READ_GAP	((uint32_t)4 << 10)
+
+static uint64_t seg_end(const struct qiprog_segment *seg)
+{
+	return (uint64_t)seg->addr + seg->len;
+}
+
+static int seg_cmp(const void *a, const void *b)
+{
+	const struct qiprog_segment *sa = *(const struct qiprog_segment **)a;
+	const struct qiprog_segment *sb = *(const struct qiprog_segment **)b;
+
+	if (sa->addr == sb->addr)
+		return 0;
+	return (sa->addr < sb->addr) ? -1 : 1;
+}
+
+/**
+ * @brief Sort the segments which are not empty by address
+ *
+ * Overlapping segments are refused. For writes, it would not be clear which
+ * data ends up on the chip.
+ */
+static qiprog_err sort_segments(const struct qiprog_segment *segs,
+				size_t num_segs,
+				const struct qiprog_segment ***sorted,
+				size_t *num_sorted)
+{
+	size_t i, n;
+	const struct qiprog_segment **list;
+
+	if ((list = malloc((num_segs + 1) * sizeof(*list))) == NULL)
+		return QIPROG_ERR_MALLOC;
+
+	for (i = 0, n = 0; i < num_segs; i++) {
+		if (segs[i].len == 0)
+			continue;
+		/* The range can end at the very top of the address space */
+		if (!segs[i].data ||
+		    (seg_end(&segs[i]) > ((uint64_t)UINT32_MAX + 1))) {
+			free(list);
+			return QIPROG_ERR_ARG;
+		}
+		list[n++] = &segs[i];
+	}
+
+	qsort(list, n, sizeof(*list), seg_cmp);
+
+	for (i = 1; i < n; i++) {
+		if (list[i]->addr < seg_end(list[i - 1])) {
+			free(list);
+			return QIPROG_ERR_ARG;
+		}
+	}
+
+	*sorted = list;
+	*num_sorted = n;
+	return QIPROG_SUCCESS;
+}
+
+/**
+ * @brief Copy between a chunk of a run, and the segments it covers
+ */
+static void copy_chunk(const struct qiprog_segment **segs, size_t num_segs,
+		       uint32_t where, uint32_t n, uint8_t *chunk,
+		       bool to_chunk)
+{
+	size_t i;
+	uint64_t start, end;
+	uint8_t *data;
+
+	for (i = 0; (i < num_segs) && (segs[i]->addr < (uint64_t)where + n);
+	     i++) {
+		start = MAX((uint64_t)segs[i]->addr, (uint64_t)where);
+		end = MIN(seg_end(segs[i]), (uint64_t)where + n);
+		if (start >= end)
+			continue;
+
+		data = (uint8_t *)segs[i]->data + (start - segs[i]->addr);
+		if (to_chunk)
+			memcpy(chunk + (start - where), data, end - start);
+		else
+			memcpy(data, chunk + (start - where), end - start);
+	}
+}
+
+/**
+ * @brief Set the address for a whole run, so its chunks need not do it again
+ *
+ * The driver sets the address itself when a chunk does not start where its
+ * pointer is, so a failure here only costs the round trips we wanted to save.
+ */
+static void set_run_address(struct qiprog_device *dev, uint32_t start,
+			    uint64_t len, bool writing)
+{
+	uint32_t ptr;
+	const uint32_t end = MIN((uint64_t)start + len, (uint64_t)UINT32_MAX);
+
+	if (!dev->drv->set_address)
+		return;
+
+	/* Maybe the device is already there */
+	ptr = writing ? dev->addr.pwrite : dev->addr.pread;
+	if ((ptr == start) && (dev->addr.end >= end))
+		return;
+
+	dev->drv->set_address(dev, start, end);
+}
+
+/**
+ * @brief Read or write one run of segments, which follow each other
+ *
+ * Chunks which lie within one segment use its memory directly. The others go
+ * through 'bounce', which is allocated the first time it is needed.
+ */
+static qiprog_err do_run(struct qiprog_device *dev,
+			 const struct qiprog_segment **segs, size_t num_segs,
+			 uint32_t start, uint64_t len, bool writing,
+			 uint8_t **bounce)
+{
+	size_t k = 0;
+	uint64_t off;
+	uint32_t where, n;
+	uint8_t *buf;
+	bool direct;
+	qiprog_err ret;
+
+	if (len > SEG_CHUNK_SIZE)
+		set_run_address(dev, start, len, writing);
+
+	for (off = 0; off < len; off += n) {
+		where = start + off;
+		n = MIN(len - off, (uint64_t)SEG_CHUNK_SIZE);
+
+		/* Segments are sorted, so earlier chunks are done with these */
+		while (seg_end(segs[k]) <= where)
+			k++;
+
+		direct = (segs[k]->addr <= where) &&
+			 (seg_end(segs[k]) >= (uint64_t)where + n);
+		if (direct) {
+			buf = (uint8_t *)segs[k]->data +
+			      (where - segs[k]->addr);
+		} else {
+			if (!*bounce && !(*bounce = malloc(SEG_CHUNK_SIZE)))
+				return QIPROG_ERR_MALLOC;
+			buf = *bounce;
+		}
+
+		if (writing) {
+			if (!direct)
+				copy_chunk(segs + k, num_segs - k, where, n,
+					   buf, true);
+			ret = qiprog_write(dev, where, buf, n);
+		} else {
+			ret = qiprog_read(dev, where, buf, n);
+			if ((ret == QIPROG_SUCCESS) && !direct)
+				copy_chunk(segs + k, num_segs - k, where, n,
+					   buf, false);
+		}
+
+		if (ret != QIPROG_SUCCESS)
+			return ret;
+	}
+
+	return QIPROG_SUCCESS;
+}
+
+/**
+ * @brief Common part of qiprog_readv() and qiprog_writev()
+ */
+static qiprog_err do_segments(struct qiprog_device *dev,
+			      const struct qiprog_segment *segs,
+			      size_t num_segs, bool writing)
+{
+	size_t i, j, num;
+	uint64_t end;
+	uint8_t *bounce = NULL;
+	qiprog_err ret;
+	const struct qiprog_segment **sorted;
+	const uint32_t gap = writing ? 0 : SEG_MAX_READ_GAP;
+
+	QIPROG_RETURN_ON_BAD_DEV(dev);
+	if (!segs && num_segs)
+		return QIPROG_ERR_ARG;
+
+	ret = sort_segments(segs, num_segs, &sorted, &num);
+	if (ret != QIPROG_SUCCESS)
+		return ret;
+
+	for (i = 0; (i < num) && (ret == QIPROG_SUCCESS); i = j) {
+		/* Take in the segments which follow, closely enough */
+		end = seg_end(sorted[i]);
+		for (j = i + 1; j < num; j++) {
+			if (sorted[j]->addr > end + gap)
+				break;
+			end = seg_end(sorted[j]);
+		}
+
+		ret = do_run(dev, sorted + i, j - i, sorted[i]->addr,
+			     end - sorted[i]->addr, writing, &bounce);
+	}
+
+	free(bounce);
+	free(sorted);
+	return ret;
+}
+
+/**
+ * @brief Read many ranges of the flash chip
+ *
+ * The ranges may come in any order, but may not overlap. Empty ones are
+ * ignored. Every chunk is read with @ref qiprog_read(), so the shadow copy and
+ * retries work the same way.
+ *
+ * For example, to read two configuration blocks and a microcode slot:
+ * @code{.c}
+ *	struct qiprog_segment segs[] = {
+ *		{.addr = 0x001000, .data = cfg0, .len = sizeof(cfg0)},
+ *		{.addr = 0x002000, .data = cfg1, .len = sizeof(cfg1)},
+ *		{.addr = 0x100000, .data = ucode, .len = sizeof(ucode)},
+ *	};
+ *	qiprog_readv(dev, segs, 3);
+ * @endcode
+ *
+ * @param[in] dev Device to operate on
+ * @param[in] segs Ranges to read, and where to store their data
+ * @param[in] num_segs Number of elements in 'segs'
+ *
+ * @return QIPROG_SUCCESS on success, or a QIPROG_ERR code otherwise. On
+ *	   failure, some of the ranges may have been read already.
+ */
+qiprog_err qiprog_readv(struct qiprog_device *dev,
+			const struct qiprog_segment *segs, size_t num_segs)
+{
+	return do_segments(dev, segs, num_segs, false);
+}
+
+/**
+ * @brief Write many ranges of the flash chip
+ *
+ * The ranges may come in any order, but may not overlap. Empty ones are
+ * ignored. As with @ref qiprog_write(), the ranges must have been erased. Every
+ * chunk is written with qiprog_write(), so the shadow copy and retries work
+ * the same way.
+ *
+ * @param[in] dev Device to operate on
+ * @param[in] segs Ranges to write, and the data to write to them
+ * @param[in] num_segs Number of elements in 'segs'
+ *
+ * @return QIPROG_SUCCESS on success, or a QIPROG_ERR code otherwise. On
+ *	   failure, some of the ranges may have been written already.
+ */
+qiprog_err qiprog_writev(struct qiprog_device *dev,
+			 const struct qiprog_segment *segs, size_t num_segs)
+{
+	return do_segments(dev, segs, num_segs, true);
+}
+
+/** @} */
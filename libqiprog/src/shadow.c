@@ -0,0 +1,340 @@
+/*
+ * qiprog - Reference implementation of the QiProg protocol
+ *
+ * Copyright (C) 2013 Alexandru Gagniuc <mr.nuke.me@gmail.com>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+#include "qiprog_internal.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+/**
+ * @defgroup shadow QiProg shadow cache
+ *
+ * @ingroup chip_io
+ *
+ * @brief Remember what is on the chip, so it does not need to be read again
+ *
+ * A device may keep a copy of the contents of its chip, one block at a time.
+ * A block is filled when it is read or written in full, and bulk reads which
+ * only cover valid blocks are served from memory, without any bus traffic.
+ *
+ * The copy is dropped when the chip may have changed behind our back: when it
+ * is erased, when a different chip is identified, when the bus changes, or when
+ * the chip is accessed outside of bulk reads and writes. Anything else which
+ * changes the chip, like a different host, or the chip failing to program,
+ * goes unnoticed. When the contents must come from the chip itself, for
+ * example to verify a write, invalidate the copy first.
+ */
+/** @{ */
+
+struct qiprog_shadow {
+	uint8_t *data;
+	uint32_t size;
+	uint32_t block_size;
+	/* One entry per block, non-zero if data holds what is on the chip */
+	uint8_t *valid;
+	/* Chip the contents belong to, set by qi_shadow_chip_id() */
+	struct qiprog_chip_id id;
+	/* The bulk operation in progress, see qi_shadow_track() */
+	struct {
+		qiprog_transfer_cb cb;
+		void *user_data;
+		uint32_t where;
+		void *buf;
+		uint32_t n;
+		uint8_t write;
+	} op;
+};
+
+/*
+ * Clip [where, where + n) to the chip, and find the blocks it fully covers, and
+ * the blocks it touches. Returns 0 if the range is outside of the chip.
+ */
+static int block_range(const struct qiprog_shadow *shadow, uint32_t where,
+		       uint32_t n, uint32_t *full_first, uint32_t *full_last,
+		       uint32_t *first, uint32_t *last)
+{
+	uint32_t end;
+
+	if (where >= shadow->size)
+		return 0;
+	end = where + MIN(n, shadow->size - where);
+
+	*first = where / shadow->block_size;
+	*last = (end + shadow->block_size - 1) / shadow->block_size;
+	*full_first = (where + shadow->block_size - 1) / shadow->block_size;
+	/* The end of the chip completes the last block */
+	*full_last = (end == shadow->size) ? *last : end / shadow->block_size;
+
+	return 1;
+}
+
+/**
+ * @brief Keep a copy of the contents of the chip
+ *
+ * Any copy kept before is dropped. The copy starts empty, and fills up as the
+ * chip is read and written.
+ *
+ * @param[in] dev Device to operate on
+ * @param[in] size Size of the chip
+ * @param[in] block_size Size of the blocks the copy is kept by. It should be
+ *			 the erase block size, or a multiple of it, so erases
+ *			 drop exactly what they touch.
+ *
+ * @return QIPROG_SUCCESS on success, or a QIPROG_ERR code otherwise.
+ */
+qiprog_err qiprog_shadow_enable(struct qiprog_device *dev, uint32_t size,
+				uint32_t block_size)
+{
+	struct qiprog_shadow *shadow;
+
+	QIPROG_RETURN_ON_BAD_DEV(dev);
+	if ((size == 0) || (block_size == 0))
+		return QIPROG_ERR_ARG;
+	/* The copy must not change under a bulk operation */
+	if (dev->shadow && dev->shadow->op.cb)
+		return QIPROG_ERR_BUSY;
+
+	qiprog_shadow_disable(dev);
+
+	if ((shadow = calloc(1, sizeof(*shadow))) == NULL)
+		return QIPROG_ERR_MALLOC;
+	shadow->size = size;
+	shadow->block_size = block_size;
+	shadow->data = malloc(size);
+	shadow->valid = calloc((size + block_size - 1) / block_size, 1);
+	if (!shadow->data || !shadow->valid) {
+		free(shadow->data);
+		free(shadow->valid);
+		free(shadow);
+		return QIPROG_ERR_MALLOC;
+	}
+
+	dev->shadow = shadow;
+	return QIPROG_SUCCESS;
+}
+
+/**
+ * @brief Stop keeping a copy of the contents of the chip
+ *
+ * @param[in] dev Device to operate on
+ *
+ * @return QIPROG_SUCCESS on success, or a QIPROG_ERR code otherwise.
+ */
+qiprog_err qiprog_shadow_disable(struct qiprog_device *dev)
+{
+	QIPROG_RETURN_ON_BAD_DEV(dev);
+	if (!dev->shadow)
+		return QIPROG_SUCCESS;
+	if (dev->shadow->op.cb)
+		return QIPROG_ERR_BUSY;
+
+	free(dev->shadow->data);
+	free(dev->shadow->valid);
+	free(dev->shadow);
+	dev->shadow = NULL;
+	return QIPROG_SUCCESS;
+}
+
+/**
+ * @brief Forget what the copy holds for a range of the chip
+ *
+ * Every block touched by [where, where + n) is read from the chip again the
+ * next time it is needed. To forget everything, use a range covering the whole
+ * chip. This does nothing if no copy is kept.
+ *
+ * @param[in] dev Device to operate on
+ * @param[in] where Address of the first byte
+ * @param[in] n Number of bytes
+ *
+ * @return QIPROG_SUCCESS on success, or a QIPROG_ERR code otherwise.
+ */
+qiprog_err qiprog_shadow_invalidate(struct qiprog_device *dev, uint32_t where,
+				    uint32_t n)
+{
+	uint32_t full_first, full_last, first, last;
+	struct qiprog_shadow *shadow;
+
+	QIPROG_RETURN_ON_BAD_DEV(dev);
+	if (!(shadow = dev->shadow) || (n == 0))
+		return QIPROG_SUCCESS;
+
+	if (block_range(shadow, where, n, &full_first, &full_last, &first,
+			&last))
+		memset(shadow->valid + first, 0, last - first);
+	return QIPROG_SUCCESS;
+}
+
+/** @} */
+
+/*
+ * Serve a read from the copy. Fails unless every block of the range is valid.
+ */
+qiprog_err qi_shadow_read(struct qiprog_device *dev, uint32_t where,
+			  void *dest, uint32_t n)
+{
+	uint32_t i, full_first, full_last, first, last;
+	struct qiprog_shadow *shadow = dev->shadow;
+
+	if (!shadow || (n == 0) || (n > shadow->size - MIN(where, shadow->size)))
+		return QIPROG_ERR;
+	if (!block_range(shadow, where, n, &full_first, &full_last, &first,
+			 &last))
+		return QIPROG_ERR;
+
+	for (i = first; i < last; i++) {
+		if (!shadow->valid[i])
+			return QIPROG_ERR;
+	}
+
+	qi_pspew("Reading 0x%.8x -> 0x%.8x from shadow copy", where,
+		where + n - 1);
+	memcpy(dest, shadow->data + where, n);
+	return QIPROG_SUCCESS;
+}
+
+/*
+ * Record data which was read from, or written to the chip
+ *
+ * Blocks covered in full become valid. A write which only covers part of a
+ * block may have erased the rest of it, so that block is dropped.
+ */
+void qi_shadow_update(struct qiprog_device *dev, uint32_t where,
+		      const void *src, uint32_t n, int write)
+{
+	uint32_t i, off, len, full_first, full_last, first, last;
+	const uint8_t *data = src;
+	struct qiprog_shadow *shadow = dev->shadow;
+
+	if (!shadow || (n == 0))
+		return;
+	if (!block_range(shadow, where, n, &full_first, &full_last, &first,
+			 &last))
+		return;
+
+	for (i = full_first; i < full_last; i++) {
+		off = i * shadow->block_size;
+		len = MIN(shadow->block_size, shadow->size - off);
+		memcpy(shadow->data + off, data + (off - where), len);
+		shadow->valid[i] = 1;
+	}
+
+	if (!write)
+		return;
+	if ((first < full_first) || (full_first > full_last))
+		shadow->valid[first] = 0;
+	if ((last > full_last) && (last > first))
+		shadow->valid[last - 1] = 0;
+}
+
+/*
+ * Forget everything, but keep the copy enabled
+ */
+void qi_shadow_drop(struct qiprog_device *dev)
+{
+	struct qiprog_shadow *shadow = dev->shadow;
+
+	if (!shadow)
+		return;
+	memset(shadow->valid, 0,
+	       (shadow->size + shadow->block_size - 1) / shadow->block_size);
+}
+
+/*
+ * The copy belongs to one chip. Drop it if we find a different one.
+ */
+void qi_shadow_chip_id(struct qiprog_device *dev,
+		       const struct qiprog_chip_id *id)
+{
+	struct qiprog_shadow *shadow = dev->shadow;
+
+	if (!shadow)
+		return;
+	if ((shadow->id.id_method == id->id_method) &&
+	    (shadow->id.vendor_id == id->vendor_id) &&
+	    (shadow->id.device_id == id->device_id))
+		return;
+
+	qi_shadow_drop(dev);
+	shadow->id = *id;
+}
+
+static void shadow_cb(struct qiprog_device *dev,
+		      enum qiprog_transfer_event event, qiprog_err status,
+		      uint32_t done, uint32_t total, void *user_data)
+{
+	struct qiprog_shadow *shadow = dev->shadow;
+	qiprog_transfer_cb cb = shadow->op.cb;
+	void *cb_data = shadow->op.user_data;
+
+	(void)user_data;
+
+	if (event == QIPROG_TRANSFER_COMPLETE) {
+		if (status == QIPROG_SUCCESS)
+			qi_shadow_update(dev, shadow->op.where, shadow->op.buf,
+					 shadow->op.n, shadow->op.write);
+		else if (shadow->op.write)
+			qiprog_shadow_invalidate(dev, shadow->op.where,
+						 shadow->op.n);
+		/* The callback may start the next operation */
+		shadow->op.cb = NULL;
+	}
+
+	cb(dev, event, status, done, total, cb_data);
+}
+
+/*
+ * Watch a bulk operation, so its data ends up in the copy
+ *
+ * Replaces the callback of the operation with one which updates the copy, then
+ * calls the original one. Only one bulk operation may be in progress on a
+ * device, so one slot is enough.
+ */
+void qi_shadow_track(struct qiprog_device *dev, uint32_t where, void *buf,
+		     uint32_t n, int write, qiprog_transfer_cb *cb,
+		     void **user_data)
+{
+	struct qiprog_shadow *shadow = dev->shadow;
+
+	if (!shadow || shadow->op.cb)
+		return;
+
+	shadow->op.cb = *cb;
+	shadow->op.user_data = *user_data;
+	shadow->op.where = where;
+	shadow->op.buf = buf;
+	shadow->op.n = n;
+	shadow->op.write = write;
+
+	*cb = shadow_cb;
+	*user_data = NULL;
+}
+
+/*
+ * The operation passed to qi_shadow_track() did not start after all
+ */
+void qi_shadow_untrack(struct qiprog_device *dev)
+{
+	if (dev->shadow)
+		dev->shadow->op.cb = NULL;
+}
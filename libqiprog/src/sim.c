@@ -0,0 +1,1465 @@
+/*
+ * qiprog - Reference implementation of the QiProg protocol
+ *
+ * Copyright (C) 2013 Alexandru Gagniuc <mr.nuke.me@gmail.com>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+/**
+ * @defgroup sim_file QiProg simulated programmer
+ *
+ * @ingroup qiprog_drivers
+ *
+ * @brief <b>QiProg simulated programmer</b>
+ *
+ * This driver pretends to be a programmer with a JEDEC flash chip connected to
+ * it. The chip lives in memory, or in a file, so that applications and
+ * libqiprog itself can be tested and profiled without any hardware.
+ *
+ * The simulator follows the rules of a real programmer: bulk operations begin
+ * with a QIPROG_SET_ADDRESS unless the pointers are already in place, programs
+ * can only clear bits, and erases work on whole erase blocks. Byte accesses go
+ * through a model of the JEDEC command sequences, so chip IDs can be read, and
+ * bytes programmed and sectors erased, the way an application would do it on
+ * real hardware.
+ *
+ * On SPI, reads take as long as the clock and the read command make them, so
+ * the faster read commands can be compared. Other buses run at 33 MHz.
+ *
+ * A programmer may have several chips, like a fixture with several sockets.
+ * Erasing one of them only holds back later operations on the same chip, so the
+ * others can be written in the meantime.
+ *
+ * What the simulator does is controlled by the environment at scan time:
+ * - QIPROG_SIM_DEVICES: number of programmers to simulate, default 1
+ * - QIPROG_SIM_CHIPS: number of chips on each programmer, default 1, up to 9
+ * - QIPROG_SIM_SIZE: size of the chips in bytes, default 1 MiB. 512 KiB,
+ *   1 MiB and 2 MiB chips report the IDs of SST49LF parts of that size.
+ * - QIPROG_SIM_FILE: keep the contents of the first programmer in this file,
+ *   and of programmer n in file.n. The other chips of a programmer go in the
+ *   same file name, followed by .chip1, .chip2 and so on. Otherwise the
+ *   contents only last until the device is closed.
+ * - QIPROG_SIM_SCALE: percentage of the modelled time to really wait, default
+ *   0. See @ref qiprog_sim_timing.
+ * - QIPROG_SIM_FAIL_EVERY: make one in this many 64 KiB steps of bulk
+ *   operations fail half way, like a bad cable would. Default 0, for never.
+ */
+
+/** @{ */
+
+#include <qiprog_sim.h>
+#include "qiprog_internal.h"
+
+#include <fcntl.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#define LOG_DOMAIN "sim: "
+#define qi_err(str, ...)	qi_perr(LOG_DOMAIN str,  ##__VA_ARGS__)
+#define qi_warn(str, ...)	qi_pwarn(LOG_DOMAIN str, ##__VA_ARGS__)
+#define qi_info(str, ...)	qi_pinfo(LOG_DOMAIN str, ##__VA_ARGS__)
+#define qi_dbg(str, ...)	qi_pdbg(LOG_DOMAIN str,  ##__VA_ARGS__)
+#define qi_spew(str, ...)	qi_pspew(LOG_DOMAIN str, ##__VA_ARGS__)
+
+#define SIM_DEFAULT_SIZE	((uint32_t)1 << 20)
+/* As many chips as QIPROG_READ_CHIP_ID can report */
+#define SIM_MAX_CHIPS		9
+/* JEDEC sector and block erase commands work on these sizes */
+#define SIM_SECTOR_SIZE		((uint32_t)4 << 10)
+#define SIM_BLOCK_SIZE		((uint32_t)64 << 10)
+/* Blocking bulk operations report progress this often */
+#define SIM_PROGRESS_STEP	((uint32_t)64 << 10)
+/* Waiting for less than this is not worth a system call */
+#define SIM_MIN_SLEEP_NS	((int64_t)100000)
+/* LPC and FWH only run at 33 MHz. SPI starts at 20 MHz, and goes up to this */
+#define SIM_LPC_CLOCK_KHZ	((uint32_t)33000)
+#define SIM_SPI_CLOCK_KHZ	((uint32_t)20000)
+#define SIM_SPI_MAX_CLOCK_KHZ	((uint32_t)104000)
+#define SIM_BUSES		(QIPROG_BUS_ISA | QIPROG_BUS_LPC | \
+				 QIPROG_BUS_FWH | QIPROG_BUS_SPI)
+
+/* Roughly an SST49LF080A on LPC, behind a full-speed USB programmer */
+static const struct qiprog_sim_timing default_timing = {
+	.request_us = 250,
+	.read_ns = 1000,
+	.program_ns = 20000,
+	.erase_us = 25000,
+	.scale = 0,
+};
+
+/* Data lines used by each read command */
+static const uint8_t read_lines[] = {
+	[QIPROG_READ_CMD_NORMAL] = 1,
+	[QIPROG_READ_CMD_FAST] = 1,
+	[QIPROG_READ_CMD_DUAL_OUTPUT] = 2,
+	[QIPROG_READ_CMD_QUAD_IO] = 4,
+};
+
+/* Chips we know the IDs of */
+static const struct {
+	uint32_t size;
+	uint16_t vendor_id;
+	uint32_t device_id;
+} sim_chips[] = {
+	{512 << 10, 0xbf, 0x50},	/* SST49LF040B */
+	{1 << 20, 0xbf, 0x5b},		/* SST49LF080A */
+	{2 << 20, 0xbf, 0x4c},		/* SST49LF160C */
+};
+
+struct qiprog_driver qiprog_sim_drv;
+
+/** Where the chip is in a JEDEC command sequence */
+enum jedec_state {
+	JEDEC_READ = 0,		/**< Reads return the array */
+	JEDEC_UNLOCK1,		/**< Got 0xaa at 0x5555 */
+	JEDEC_UNLOCK2,		/**< Got 0x55 at 0x2aaa */
+	JEDEC_PROGRAM,		/**< The next write programs a byte */
+	JEDEC_ERASE,		/**< Got the erase setup command */
+	JEDEC_ERASE_UNLOCK1,	/**< Got 0xaa at 0x5555 again */
+	JEDEC_ERASE_UNLOCK2,	/**< Got 0x55 at 0x2aaa again */
+	JEDEC_ID,		/**< Reads return the chip IDs */
+};
+
+/**
+ * @brief One chip of the simulated programmer
+ */
+struct sim_chip {
+	/* Contents of the chip, NULL until the device is opened */
+	uint8_t *flash;
+	/* File holding the contents, or NULL */
+	char *file;
+	int fd;
+	/* Size of the chip, as told by the host */
+	uint32_t chip_size;
+	uint32_t erase_size;
+	uint16_t erase_flags;
+	enum qiprog_read_cmd read_cmd;
+	enum jedec_state state;
+	/* Modelled time at which the chip is done with its last erase */
+	uint64_t ready_ns;
+};
+
+/**
+ * @brief Private data of the simulated programmer
+ */
+struct sim_priv {
+	/* Number of the programmer, for its serial number and file name */
+	uint32_t index;
+	/* Size of every chip */
+	uint32_t size;
+	struct qiprog_chip_id id;
+	enum qiprog_bus bus;
+	uint32_t clock_khz;
+	size_t num_chips;
+	struct sim_chip chips[SIM_MAX_CHIPS];
+	struct qiprog_sim_timing timing;
+	/* Time the operations would have taken on real hardware */
+	uint64_t chip_time_ns;
+	/* Part of that time we still have to wait, negative if we overslept */
+	int64_t owed_ns;
+	/* Fail one in this many steps of bulk operations, if not 0 */
+	uint32_t fail_every;
+	uint32_t steps;
+};
+
+/**
+ * @brief Get a number from the environment
+ */
+static uint32_t env_u32(const char *name, uint32_t default_val)
+{
+	char *end;
+	const char *str;
+	unsigned long val;
+
+	if ((str = getenv(name)) == NULL)
+		return default_val;
+
+	val = strtoul(str, &end, 0);
+	if ((end == str) || (*end != '\0')) {
+		qi_warn("Ignoring %s=%s, which is not a number", name, str);
+		return default_val;
+	}
+
+	return val;
+}
+
+/**
+ * @brief Account for the time an operation would take
+ *
+ * Only timing.scale percent of the time is really waited for. Short waits are
+ * saved up, and done together.
+ */
+static void sim_charge(struct sim_priv *priv, uint64_t ns)
+{
+	uint64_t start;
+	struct timespec ts;
+
+	priv->chip_time_ns += ns;
+	if (priv->timing.scale == 0)
+		return;
+
+	priv->owed_ns += ns * priv->timing.scale / 100;
+	if (priv->owed_ns < SIM_MIN_SLEEP_NS)
+		return;
+
+	ts.tv_sec = priv->owed_ns / 1000000000;
+	ts.tv_nsec = priv->owed_ns % 1000000000;
+	start = qi_time_us();
+	nanosleep(&ts, NULL);
+	priv->owed_ns -= (int64_t)(qi_time_us() - start) * 1000;
+}
+
+/**
+ * @brief Account for a request, which is a round trip on real hardware
+ */
+static void sim_request(struct qiprog_device *dev)
+{
+	struct sim_priv *priv = dev->priv;
+
+	dev->stats.ctrl_requests++;
+	sim_charge(priv, (uint64_t)priv->timing.request_us * 1000);
+}
+
+/**
+ * @brief Wait for the chip to finish erasing, if it is still at it
+ */
+static void sim_wait(struct sim_priv *priv, struct sim_chip *chip)
+{
+	if (chip->ready_ns > priv->chip_time_ns)
+		sim_charge(priv, chip->ready_ns - priv->chip_time_ns);
+}
+
+/**
+ * @brief Time to read one byte from a chip, in nanoseconds
+ */
+static uint64_t sim_read_ns(struct sim_priv *priv, struct sim_chip *chip)
+{
+	if (priv->bus != QIPROG_BUS_SPI)
+		return priv->timing.read_ns;
+
+	/* Eight bits, over as many lines as the read command uses */
+	return 8000000 / ((uint64_t)priv->clock_khz *
+			  read_lines[chip->read_cmd]);
+}
+
+/**
+ * @brief Read from the array, wrapping around at the end of the chip
+ *
+ * Like a chip on a memory bus, the upper address lines are not decoded.
+ */
+static void sim_read(struct sim_priv *priv, struct sim_chip *chip,
+		     uint32_t addr, uint8_t *dest, uint32_t n)
+{
+	uint32_t len;
+
+	sim_wait(priv, chip);
+	sim_charge(priv, n * sim_read_ns(priv, chip));
+	for (addr %= priv->size; n; n -= len, addr = 0) {
+		len = MIN(n, priv->size - addr);
+		memcpy(dest, chip->flash + addr, len);
+		dest += len;
+	}
+}
+
+/**
+ * @brief Program bytes of the array, which can only clear bits
+ */
+static void sim_program(struct sim_priv *priv, struct sim_chip *chip,
+			uint32_t addr, const uint8_t *src, uint32_t n)
+{
+	sim_wait(priv, chip);
+	sim_charge(priv, (uint64_t)n * priv->timing.program_ns);
+	while (n--) {
+		chip->flash[addr % priv->size] &= *src++;
+		addr++;
+	}
+}
+
+/**
+ * @brief Erase every block of 'unit' bytes which [where, where + n) touches
+ *
+ * The chip is busy until the erase is done, but the programmer is free to do
+ * other things. @ref sim_wait() waits for it.
+ */
+static void sim_erase(struct sim_priv *priv, struct sim_chip *chip,
+		      uint32_t where, uint32_t n, uint32_t unit)
+{
+	uint32_t start, end;
+
+	start = ((where % priv->size) / unit) * unit;
+	end = MIN((uint64_t)(where % priv->size) + n, (uint64_t)priv->size);
+	end = MIN(((uint64_t)end + unit - 1) / unit * unit,
+		  (uint64_t)priv->size);
+
+	sim_wait(priv, chip);
+	qi_spew("Erasing 0x%.8x -> 0x%.8x", start, end - 1);
+	memset(chip->flash + start, 0xff, end - start);
+	chip->ready_ns = priv->chip_time_ns + (uint64_t)((end - start) / unit) *
+			 priv->timing.erase_us * 1000;
+}
+
+/**
+ * @brief Byte read, as seen through the JEDEC command state machine
+ */
+static uint8_t jedec_read(struct sim_priv *priv, struct sim_chip *chip,
+			  uint32_t addr)
+{
+	uint8_t val;
+
+	if (chip->state == JEDEC_ID)
+		return (addr & 1) ? priv->id.device_id : priv->id.vendor_id;
+
+	sim_read(priv, chip, addr, &val, 1);
+	return val;
+}
+
+/**
+ * @brief Byte write, as seen through the JEDEC command state machine
+ *
+ * Only A0 to A14 are decoded for the unlock addresses, as on most parallel and
+ * LPC chips.
+ */
+static void jedec_write(struct sim_priv *priv, struct sim_chip *chip,
+			uint32_t addr, uint8_t data)
+{
+	const uint16_t cmd_addr = addr & 0x7fff;
+	const bool unlock1 = (cmd_addr == 0x5555) && (data == 0xaa);
+	const bool unlock2 = (cmd_addr == 0x2aaa) && (data == 0x55);
+
+	/* Reset, unless it is the byte being programmed */
+	if ((data == 0xf0) && (chip->state != JEDEC_PROGRAM)) {
+		chip->state = JEDEC_READ;
+		return;
+	}
+
+	switch (chip->state) {
+	case JEDEC_UNLOCK1:
+		chip->state = unlock2 ? JEDEC_UNLOCK2 : JEDEC_READ;
+		break;
+	case JEDEC_UNLOCK2:
+		chip->state = JEDEC_READ;
+		if (cmd_addr != 0x5555)
+			break;
+		if (data == 0xa0)
+			chip->state = JEDEC_PROGRAM;
+		else if (data == 0x80)
+			chip->state = JEDEC_ERASE;
+		else if (data == 0x90)
+			chip->state = JEDEC_ID;
+		break;
+	case JEDEC_PROGRAM:
+		sim_program(priv, chip, addr, &data, 1);
+		chip->state = JEDEC_READ;
+		break;
+	case JEDEC_ERASE:
+		chip->state = unlock1 ? JEDEC_ERASE_UNLOCK1 : JEDEC_READ;
+		break;
+	case JEDEC_ERASE_UNLOCK1:
+		chip->state = unlock2 ? JEDEC_ERASE_UNLOCK2 : JEDEC_READ;
+		break;
+	case JEDEC_ERASE_UNLOCK2:
+		if ((cmd_addr == 0x5555) && (data == 0x10))
+			sim_erase(priv, chip, 0, priv->size, priv->size);
+		else if (data == 0x30)
+			sim_erase(priv, chip, addr, 1, SIM_SECTOR_SIZE);
+		else if (data == 0x50)
+			sim_erase(priv, chip, addr, 1, SIM_BLOCK_SIZE);
+		/* Polling for the end of the erase is not modelled */
+		sim_wait(priv, chip);
+		chip->state = JEDEC_READ;
+		break;
+	case JEDEC_READ:
+	case JEDEC_ID:
+	default:
+		/* A new command may start in ID mode, as on SST parts */
+		if (unlock1)
+			chip->state = JEDEC_UNLOCK1;
+		break;
+	}
+}
+
+/**
+ * @brief Helper to create a new simulated programmer
+ */
+static struct qiprog_device *new_sim_prog(struct qiprog_context *ctx,
+					  uint32_t index)
+{
+	size_t i, len;
+	const char *file;
+	struct qiprog_device *dev;
+	struct sim_priv *priv;
+	struct sim_chip *chip;
+
+	if ((dev = qiprog_new_device(ctx)) == NULL)
+		return NULL;
+
+	if ((priv = calloc(1, sizeof(*priv))) == NULL) {
+		qiprog_free_device(dev);
+		return NULL;
+	}
+
+	priv->index = index;
+	priv->size = env_u32("QIPROG_SIM_SIZE", SIM_DEFAULT_SIZE);
+	if (priv->size == 0) {
+		qi_warn("Chips can not be empty, using %u bytes",
+			SIM_DEFAULT_SIZE);
+		priv->size = SIM_DEFAULT_SIZE;
+	}
+	priv->num_chips = env_u32("QIPROG_SIM_CHIPS", 1);
+	if ((priv->num_chips == 0) || (priv->num_chips > SIM_MAX_CHIPS)) {
+		qi_warn("Programmers have 1 to %u chips, using 1",
+			SIM_MAX_CHIPS);
+		priv->num_chips = 1;
+	}
+	for (i = 0; i < priv->num_chips; i++) {
+		chip = &priv->chips[i];
+		chip->fd = -1;
+		chip->chip_size = priv->size;
+		chip->erase_size = SIM_SECTOR_SIZE;
+	}
+	priv->clock_khz = SIM_LPC_CLOCK_KHZ;
+	priv->timing = default_timing;
+	priv->timing.scale = env_u32("QIPROG_SIM_SCALE", default_timing.scale);
+	priv->fail_every = env_u32("QIPROG_SIM_FAIL_EVERY", 0);
+
+	/* Unknown sizes still identify, just not as anything we know */
+	priv->id.id_method = QIPROG_ID_METH_JEDEC;
+	priv->id.vendor_id = 0xbf;
+	for (i = 0; i < sizeof(sim_chips) / sizeof(sim_chips[0]); i++) {
+		if (sim_chips[i].size != priv->size)
+			continue;
+		priv->id.vendor_id = sim_chips[i].vendor_id;
+		priv->id.device_id = sim_chips[i].device_id;
+	}
+
+	dev->drv = &qiprog_sim_drv;
+	dev->priv = priv;
+	if ((file = getenv("QIPROG_SIM_FILE")) == NULL)
+		goto done;
+
+	len = strlen(file) + 24;
+	for (i = 0; i < priv->num_chips; i++) {
+		chip = &priv->chips[i];
+		/* dev_free() cleans up whatever we got */
+		if ((chip->file = malloc(len)) == NULL) {
+			qiprog_free_device(dev);
+			return NULL;
+		}
+		if (index == 0)
+			snprintf(chip->file, len, "%s", file);
+		else
+			snprintf(chip->file, len, "%s.%u", file, index);
+		if (i != 0)
+			snprintf(chip->file + strlen(chip->file),
+				 len - strlen(chip->file), ".chip%zu", i);
+	}
+
+ done:
+	dev->manufacturer = "QiProg";
+	dev->product = "Simulated programmer";
+
+	return dev;
+}
+
+/**
+ * @brief QiProg driver 'scan' member
+ */
+static qiprog_err scan(struct qiprog_context *ctx, struct dev_list *qi_list)
+{
+	size_t i, ndevs;
+	int known = 0;
+	struct qiprog_device *dev;
+
+	/* Simulated programmers never go away */
+	for (i = 0; i < qi_list->len; i++) {
+		if (qi_list->devs[i]->drv == &qiprog_sim_drv) {
+			qi_list->devs[i]->seen = 1;
+			known = 1;
+		}
+	}
+	if (known)
+		return QIPROG_SUCCESS;
+
+	ndevs = env_u32("QIPROG_SIM_DEVICES", 1);
+	for (i = 0; i < ndevs; i++) {
+		if ((dev = new_sim_prog(ctx, i)) == NULL) {
+			qi_err("Malloc failure");
+			return QIPROG_ERR_MALLOC;
+		}
+		dev_list_append(qi_list, dev);
+	}
+
+	return QIPROG_SUCCESS;
+}
+
+/**
+ * @brief Map the file holding the chip, erased where it was too short
+ */
+static qiprog_err map_file(struct sim_priv *priv, struct sim_chip *chip)
+{
+	void *map;
+	struct stat st;
+
+	if ((chip->fd = open(chip->file, O_RDWR | O_CREAT, 0644)) < 0) {
+		qi_err("Could not open %s", chip->file);
+		return QIPROG_ERR;
+	}
+	if (fstat(chip->fd, &st) < 0)
+		goto fail;
+	if ((st.st_size < priv->size) && (ftruncate(chip->fd, priv->size) < 0))
+		goto fail;
+
+	map = mmap(NULL, priv->size, PROT_READ | PROT_WRITE, MAP_SHARED,
+		   chip->fd, 0);
+	if (map == MAP_FAILED)
+		goto fail;
+
+	chip->flash = map;
+	if (st.st_size < priv->size)
+		memset(chip->flash + st.st_size, 0xff,
+		       priv->size - st.st_size);
+
+	return QIPROG_SUCCESS;
+
+ fail:
+	qi_err("Could not map %u bytes of %s", priv->size, chip->file);
+	close(chip->fd);
+	chip->fd = -1;
+	return QIPROG_ERR;
+}
+
+/**
+ * @brief Let go of the contents of the chips
+ */
+static void unmap_chips(struct sim_priv *priv)
+{
+	size_t i;
+	struct sim_chip *chip;
+
+	for (i = 0; i < priv->num_chips; i++) {
+		chip = &priv->chips[i];
+		if (chip->fd >= 0) {
+			munmap(chip->flash, priv->size);
+			close(chip->fd);
+			chip->fd = -1;
+		} else {
+			free(chip->flash);
+		}
+		chip->flash = NULL;
+	}
+}
+
+/**
+ * @brief QiProg driver 'dev_open' member
+ */
+static qiprog_err dev_open(struct qiprog_device *dev)
+{
+	size_t i;
+	char serial[16];
+	struct sim_priv *priv;
+	struct sim_chip *chip;
+
+	if (!dev)
+		return QIPROG_ERR_ARG;
+	if (!(priv = dev->priv))
+		return QIPROG_ERR_ARG;
+	if (priv->chips[0].flash)
+		return QIPROG_ERR_BUSY;
+
+	for (i = 0; i < priv->num_chips; i++) {
+		chip = &priv->chips[i];
+		chip->state = JEDEC_READ;
+		if (chip->file) {
+			if (map_file(priv, chip) == QIPROG_SUCCESS)
+				continue;
+			unmap_chips(priv);
+			return QIPROG_ERR;
+		}
+		if ((chip->flash = malloc(priv->size)) == NULL) {
+			unmap_chips(priv);
+			return QIPROG_ERR_MALLOC;
+		}
+		/* Fresh chips come erased */
+		memset(chip->flash, 0xff, priv->size);
+	}
+
+	snprintf(serial, sizeof(serial), "sim%u", priv->index);
+	dev->serial = strdup(serial);
+	/* Make sure the first bulk operation sets the address */
+	dev->addr.end = 0;
+
+	return QIPROG_SUCCESS;
+}
+
+/**
+ * @brief QiProg driver 'dev_close' member
+ */
+static qiprog_err dev_close(struct qiprog_device *dev)
+{
+	struct sim_priv *priv;
+
+	if (!dev)
+		return QIPROG_ERR_ARG;
+	if (!(priv = dev->priv))
+		return QIPROG_ERR_ARG;
+
+	unmap_chips(priv);
+
+	free((void *)dev->serial);
+	dev->serial = NULL;
+
+	return QIPROG_SUCCESS;
+}
+
+/**
+ * @brief QiProg driver 'dev_free' member
+ */
+static void dev_free(struct qiprog_device *dev)
+{
+	size_t i;
+	struct sim_priv *priv = dev->priv;
+
+	if (!priv)
+		return;
+
+	/* The application may not have closed it */
+	if (priv->chips[0].flash)
+		dev_close(dev);
+
+	for (i = 0; i < priv->num_chips; i++)
+		free(priv->chips[i].file);
+	free(priv);
+	dev->priv = NULL;
+}
+
+/**
+ * @brief Get the private data of an open simulated programmer
+ */
+static struct sim_priv *get_priv(struct qiprog_device *dev)
+{
+	struct sim_priv *priv;
+
+	if (!dev || !(priv = dev->priv))
+		return NULL;
+	if (priv->chips[0].flash == NULL) {
+		qi_err("Device was not opened");
+		return NULL;
+	}
+
+	return priv;
+}
+
+/**
+ * @brief Get a chip of an open simulated programmer
+ */
+static struct sim_chip *get_chip(struct qiprog_device *dev, uint8_t chip_idx)
+{
+	struct sim_priv *priv;
+
+	if (!(priv = get_priv(dev)))
+		return NULL;
+	if (chip_idx >= priv->num_chips) {
+		qi_err("There is no chip %u", chip_idx);
+		return NULL;
+	}
+
+	return &priv->chips[chip_idx];
+}
+
+/**
+ * @brief Change the timing of a simulated programmer
+ *
+ * @param[in] dev Device to operate on. It must be a simulated programmer.
+ * @param[in] timing The new timing
+ *
+ * @return QIPROG_SUCCESS on success, or a QIPROG_ERR code otherwise.
+ */
+qiprog_err qiprog_sim_set_timing(struct qiprog_device *dev,
+				 const struct qiprog_sim_timing *timing)
+{
+	struct sim_priv *priv;
+
+	if (!dev || (dev->drv != &qiprog_sim_drv) || !timing)
+		return QIPROG_ERR_ARG;
+	if (!(priv = dev->priv))
+		return QIPROG_ERR_ARG;
+
+	priv->timing = *timing;
+	priv->owed_ns = 0;
+	return QIPROG_SUCCESS;
+}
+
+/**
+ * @brief Get the timing of a simulated programmer
+ *
+ * @param[in] dev Device to operate on. It must be a simulated programmer.
+ * @param[out] timing Where to store the timing
+ *
+ * @return QIPROG_SUCCESS on success, or a QIPROG_ERR code otherwise.
+ */
+qiprog_err qiprog_sim_get_timing(struct qiprog_device *dev,
+				 struct qiprog_sim_timing *timing)
+{
+	struct sim_priv *priv;
+
+	if (!dev || (dev->drv != &qiprog_sim_drv) || !timing)
+		return QIPROG_ERR_ARG;
+	if (!(priv = dev->priv))
+		return QIPROG_ERR_ARG;
+
+	*timing = priv->timing;
+	return QIPROG_SUCCESS;
+}
+
+/**
+ * @brief Get the time real hardware would have spent so far
+ *
+ * This is the sum of the modelled time of every operation since the device was
+ * found, however much of it was really waited for.
+ *
+ * @param[in] dev Device to operate on. It must be a simulated programmer.
+ * @param[out] time_us Where to store the time, in microseconds
+ *
+ * @return QIPROG_SUCCESS on success, or a QIPROG_ERR code otherwise.
+ */
+qiprog_err qiprog_sim_get_chip_time(struct qiprog_device *dev,
+				    uint64_t *time_us)
+{
+	struct sim_priv *priv;
+
+	if (!dev || (dev->drv != &qiprog_sim_drv) || !time_us)
+		return QIPROG_ERR_ARG;
+	if (!(priv = dev->priv))
+		return QIPROG_ERR_ARG;
+
+	*time_us = priv->chip_time_ns / 1000;
+	return QIPROG_SUCCESS;
+}
+
+/**
+ * @brief QiProg driver 'get_capabilities' member
+ */
+static qiprog_err get_capabilities(struct qiprog_device *dev,
+				   struct qiprog_capabilities *caps)
+{
+	if (!get_priv(dev) || !caps)
+		return QIPROG_ERR_ARG;
+
+	sim_request(dev);
+	memset(caps, 0, sizeof(*caps));
+	/* Programs are run by the host, through read8() and write8() */
+	caps->instruction_set = 0;
+	caps->bus_master = SIM_BUSES;
+	caps->max_direct_data = 0;
+	caps->voltages[0] = 3300;
+	caps->read_cmds = QIPROG_READ_CMD_BIT(QIPROG_READ_CMD_FAST) |
+			  QIPROG_READ_CMD_BIT(QIPROG_READ_CMD_DUAL_OUTPUT) |
+			  QIPROG_READ_CMD_BIT(QIPROG_READ_CMD_QUAD_IO);
+
+	return QIPROG_SUCCESS;
+}
+
+/**
+ * @brief QiProg driver 'set_bus' member
+ */
+static qiprog_err set_bus(struct qiprog_device *dev, enum qiprog_bus bus)
+{
+	size_t i;
+	struct sim_priv *priv;
+
+	if (!(priv = get_priv(dev)))
+		return QIPROG_ERR_ARG;
+	if (!bus || (bus & ~SIM_BUSES))
+		return QIPROG_ERR_ARG;
+
+	sim_request(dev);
+	priv->bus = bus;
+	priv->clock_khz = (bus == QIPROG_BUS_SPI) ? SIM_SPI_CLOCK_KHZ
+						  : SIM_LPC_CLOCK_KHZ;
+	for (i = 0; i < priv->num_chips; i++)
+		priv->chips[i].state = JEDEC_READ;
+
+	return QIPROG_SUCCESS;
+}
+
+/**
+ * @brief QiProg driver 'set_clock' member
+ */
+static qiprog_err set_clock(struct qiprog_device *dev, uint32_t *clock_khz)
+{
+	struct sim_priv *priv;
+
+	if (!(priv = get_priv(dev)) || !clock_khz || !*clock_khz)
+		return QIPROG_ERR_ARG;
+
+	sim_request(dev);
+	if (priv->bus != QIPROG_BUS_SPI) {
+		/* There is only the one clock, and we can not go below it */
+		if (*clock_khz < SIM_LPC_CLOCK_KHZ)
+			return QIPROG_ERR;
+		*clock_khz = SIM_LPC_CLOCK_KHZ;
+		return QIPROG_SUCCESS;
+	}
+
+	priv->clock_khz = MIN(*clock_khz, SIM_SPI_MAX_CLOCK_KHZ);
+	*clock_khz = priv->clock_khz;
+
+	return QIPROG_SUCCESS;
+}
+
+/**
+ * @brief QiProg driver 'set_spi_timing' member
+ *
+ * Setup times are much shorter than a request, and are not modelled.
+ */
+static qiprog_err set_spi_timing(struct qiprog_device *dev,
+				 uint16_t tpu_read_us, uint32_t tces_ns)
+{
+	struct sim_priv *priv;
+
+	(void)tpu_read_us;
+
+	if (!(priv = get_priv(dev)))
+		return QIPROG_ERR_ARG;
+	if (tces_ns > 0xffff)
+		return QIPROG_ERR_LARGE_ARG;
+	if (priv->bus != QIPROG_BUS_SPI)
+		return QIPROG_ERR;
+
+	sim_request(dev);
+
+	return QIPROG_SUCCESS;
+}
+
+/**
+ * @brief QiProg driver 'set_vdd' member
+ */
+static qiprog_err set_vdd(struct qiprog_device *dev, uint16_t vdd_mv)
+{
+	if (!get_priv(dev))
+		return QIPROG_ERR_ARG;
+	/* The one voltage we report, or off */
+	if ((vdd_mv != 0) && (vdd_mv != 3300))
+		return QIPROG_ERR_ARG;
+
+	sim_request(dev);
+
+	return QIPROG_SUCCESS;
+}
+
+/**
+ * @brief QiProg driver 'read_chip_id' member
+ */
+static qiprog_err read_chip_id(struct qiprog_device *dev,
+			       struct qiprog_chip_id ids[9])
+{
+	size_t i;
+	struct sim_priv *priv;
+
+	if (!(priv = get_priv(dev)))
+		return QIPROG_ERR_ARG;
+
+	sim_request(dev);
+	memset(ids, 0, 9 * sizeof(*ids));
+	for (i = 0; i < priv->num_chips; i++) {
+		ids[i] = priv->id;
+		/* The programmer leaves ID mode when it is done */
+		priv->chips[i].state = JEDEC_READ;
+	}
+
+	return QIPROG_SUCCESS;
+}
+
+/**
+ * @brief Tell the programmer what address range we want to operate on
+ */
+static qiprog_err set_address(struct qiprog_device *dev, uint32_t start,
+			      uint32_t end)
+{
+	qi_spew("Setting address range 0x%.8x -> 0x%.8x", start, end);
+
+	sim_request(dev);
+	dev->addr.end = end;
+	/* Read and write pointers are reset when setting a new range */
+	dev->addr.pread = dev->addr.pwrite = dev->addr.start = start;
+
+	return QIPROG_SUCCESS;
+}
+
+/**
+ * @brief QiProg driver 'set_erase_size' member
+ *
+ * Only the first size is used, for erases and erase-before-write.
+ */
+static qiprog_err set_erase_size(struct qiprog_device *dev, uint8_t chip_idx,
+				 enum qiprog_erase_type *types, uint32_t *sizes,
+				 size_t num_sizes)
+{
+	struct sim_priv *priv;
+	struct sim_chip *chip;
+
+	if (!(priv = get_priv(dev)) || !(chip = get_chip(dev, chip_idx)))
+		return QIPROG_ERR_ARG;
+	if (num_sizes == 0)
+		return QIPROG_ERR_ARG;
+	/* Same limit as a control packet */
+	if (num_sizes > 12)
+		return QIPROG_ERR_LARGE_ARG;
+
+	sim_request(dev);
+	if (types[0] == QIPROG_ERASE_TYPE_CHIP)
+		chip->erase_size = priv->size;
+	else if (sizes[0] != 0)
+		chip->erase_size = MIN(sizes[0], priv->size);
+	else
+		return QIPROG_ERR_ARG;
+
+	return QIPROG_SUCCESS;
+}
+
+/**
+ * @brief QiProg driver 'set_erase_command' member
+ */
+static qiprog_err set_erase_command(struct qiprog_device *dev, uint8_t chip_idx,
+				    enum qiprog_erase_cmd cmd,
+				    enum qiprog_erase_subcmd subcmd,
+				    uint16_t flags)
+{
+	struct sim_chip *chip;
+
+	(void)subcmd;
+
+	if (!(chip = get_chip(dev, chip_idx)))
+		return QIPROG_ERR_ARG;
+	if (cmd == QIPROG_ERASE_CMD_INVALID)
+		return QIPROG_ERR_ARG;
+
+	sim_request(dev);
+	chip->erase_flags = flags;
+
+	return QIPROG_SUCCESS;
+}
+
+/**
+ * @brief QiProg driver 'set_custom_erase_command' member
+ *
+ * Custom sequences are accepted, but erases always work like JEDEC ones.
+ */
+static qiprog_err set_custom_erase_command(struct qiprog_device *dev,
+					   uint8_t chip_idx,
+					   uint32_t *addr, uint8_t *data,
+					   size_t num_bytes)
+{
+	if (!get_chip(dev, chip_idx) || !addr || !data)
+		return QIPROG_ERR_ARG;
+	/* Same limit as a control packet */
+	if (num_bytes > 10)
+		return QIPROG_ERR_LARGE_ARG;
+
+	sim_request(dev);
+	qi_dbg("Custom erase sequences are simulated as JEDEC ones");
+
+	return QIPROG_SUCCESS;
+}
+
+/**
+ * @brief QiProg driver 'set_write_command' member
+ */
+static qiprog_err set_write_command(struct qiprog_device *dev, uint8_t chip_idx,
+				    enum qiprog_write_cmd cmd,
+				    enum qiprog_write_subcmd subcmd)
+{
+	(void)subcmd;
+
+	if (!get_chip(dev, chip_idx))
+		return QIPROG_ERR_ARG;
+	if (cmd == QIPROG_WRITE_CMD_INVALID)
+		return QIPROG_ERR_ARG;
+
+	sim_request(dev);
+
+	return QIPROG_SUCCESS;
+}
+
+/**
+ * @brief QiProg driver 'set_custom_write_command' member
+ *
+ * Custom sequences are accepted, but bytes are always programmed like JEDEC
+ * ones.
+ */
+static qiprog_err set_custom_write_command(struct qiprog_device *dev,
+					   uint8_t chip_idx,
+					   uint32_t *addr, uint8_t *data,
+					   size_t num_bytes)
+{
+	if (!get_chip(dev, chip_idx) || !addr || !data)
+		return QIPROG_ERR_ARG;
+	/* Same limit as a control packet */
+	if (num_bytes > 10)
+		return QIPROG_ERR_LARGE_ARG;
+
+	sim_request(dev);
+	qi_dbg("Custom write sequences are simulated as JEDEC ones");
+
+	return QIPROG_SUCCESS;
+}
+
+/**
+ * @brief QiProg driver 'set_read_command' member
+ */
+static qiprog_err set_read_command(struct qiprog_device *dev, uint8_t chip_idx,
+				   enum qiprog_read_cmd cmd)
+{
+	struct sim_priv *priv;
+	struct sim_chip *chip;
+
+	if (!(priv = get_priv(dev)) || !(chip = get_chip(dev, chip_idx)))
+		return QIPROG_ERR_ARG;
+	if (cmd > QIPROG_READ_CMD_QUAD_IO)
+		return QIPROG_ERR_ARG;
+	/* Parallel and LPC chips only have the one way of reading */
+	if ((cmd != QIPROG_READ_CMD_NORMAL) && (priv->bus != QIPROG_BUS_SPI))
+		return QIPROG_ERR;
+
+	sim_request(dev);
+	chip->read_cmd = cmd;
+
+	return QIPROG_SUCCESS;
+}
+
+/**
+ * @brief QiProg driver 'set_chip_size' member
+ */
+static qiprog_err set_chip_size(struct qiprog_device *dev, uint8_t chip_idx,
+				uint32_t size)
+{
+	struct sim_priv *priv;
+	struct sim_chip *chip;
+
+	if (!(priv = get_priv(dev)) || !(chip = get_chip(dev, chip_idx)))
+		return QIPROG_ERR_ARG;
+	if (size == 0)
+		return QIPROG_ERR_ARG;
+	if (size > priv->size) {
+		qi_err("Chip size %u is larger than the %u byte chip we have",
+		       size, priv->size);
+		return QIPROG_ERR_LARGE_ARG;
+	}
+
+	sim_request(dev);
+	chip->chip_size = size;
+
+	return QIPROG_SUCCESS;
+}
+
+/**
+ * @brief QiProg driver 'erase' member
+ *
+ * Like the programmer, we erase every erase block the range touches. With
+ * more than one chip, we return as soon as the erase has started, and only
+ * later requests to the same chip wait for it to finish.
+ */
+static qiprog_err erase(struct qiprog_device *dev, uint8_t chip_idx,
+			uint32_t where, uint32_t n)
+{
+	struct sim_priv *priv;
+	struct sim_chip *chip;
+
+	if (!(priv = get_priv(dev)) || !(chip = get_chip(dev, chip_idx)))
+		return QIPROG_ERR_ARG;
+	if ((uint64_t)where + n > chip->chip_size)
+		return QIPROG_ERR_LARGE_ARG;
+
+	sim_request(dev);
+	if (n)
+		sim_erase(priv, chip, where, n, chip->erase_size);
+	if (priv->num_chips == 1)
+		sim_wait(priv, chip);
+	chip->state = JEDEC_READ;
+
+	return QIPROG_SUCCESS;
+}
+
+/**
+ * @brief QiProg driver 'checksum' member
+ */
+static qiprog_err checksum(struct qiprog_device *dev, uint32_t where,
+			   uint32_t n, uint32_t block_size,
+			   enum qiprog_checksum_algo algo, uint32_t *digests)
+{
+	uint32_t len;
+	struct sim_priv *priv;
+	struct sim_chip *chip;
+
+	if (!(priv = get_priv(dev)) || !(chip = get_chip(dev, dev->chip_idx)))
+		return QIPROG_ERR_ARG;
+	if (algo != QIPROG_CHECKSUM_CRC32)
+		return QIPROG_ERR_ARG;
+	if ((uint64_t)where + n > priv->size)
+		return QIPROG_ERR_LARGE_ARG;
+
+	sim_request(dev);
+	if (block_size == 0)
+		block_size = n;
+
+	/* The programmer reads the chip, but nothing goes over the bus */
+	sim_wait(priv, chip);
+	sim_charge(priv, n * sim_read_ns(priv, chip));
+	for (; n; n -= len, where += len) {
+		len = MIN(n, block_size);
+		*digests++ = qiprog_crc32(0, chip->flash + where, len);
+	}
+
+	return QIPROG_SUCCESS;
+}
+
+/**
+ * @brief QiProg driver 'read8' member
+ *
+ * Byte accesses always go to the first chip, like the memory-mapped window of
+ * a real programmer.
+ */
+static qiprog_err read8(struct qiprog_device *dev, uint32_t addr,
+			uint8_t *data)
+{
+	struct sim_priv *priv;
+
+	if (!(priv = get_priv(dev)))
+		return QIPROG_ERR_ARG;
+
+	sim_request(dev);
+	*data = jedec_read(priv, &priv->chips[0], addr);
+
+	return QIPROG_SUCCESS;
+}
+
+/**
+ * @brief QiProg driver 'read16' member
+ */
+static qiprog_err read16(struct qiprog_device *dev, uint32_t addr,
+			 uint16_t *data)
+{
+	struct sim_priv *priv;
+
+	if (!(priv = get_priv(dev)))
+		return QIPROG_ERR_ARG;
+
+	sim_request(dev);
+	*data = jedec_read(priv, &priv->chips[0], addr);
+	*data |= jedec_read(priv, &priv->chips[0], addr + 1) << 8;
+
+	return QIPROG_SUCCESS;
+}
+
+/**
+ * @brief QiProg driver 'read32' member
+ */
+static qiprog_err read32(struct qiprog_device *dev, uint32_t addr,
+			 uint32_t *data)
+{
+	int i;
+	struct sim_priv *priv;
+
+	if (!(priv = get_priv(dev)))
+		return QIPROG_ERR_ARG;
+
+	sim_request(dev);
+	for (i = 3, *data = 0; i >= 0; i--)
+		*data = (*data << 8) |
+			jedec_read(priv, &priv->chips[0], addr + i);
+
+	return QIPROG_SUCCESS;
+}
+
+/**
+ * @brief QiProg driver 'write8' member
+ */
+static qiprog_err write8(struct qiprog_device *dev, uint32_t addr,
+			 uint8_t data)
+{
+	struct sim_priv *priv;
+
+	if (!(priv = get_priv(dev)))
+		return QIPROG_ERR_ARG;
+
+	sim_request(dev);
+	jedec_write(priv, &priv->chips[0], addr, data);
+
+	return QIPROG_SUCCESS;
+}
+
+/**
+ * @brief QiProg driver 'write16' member
+ *
+ * Wide writes are seen by the chip as one byte cycle after the other, LSB
+ * first.
+ */
+static qiprog_err write16(struct qiprog_device *dev, uint32_t addr,
+			  uint16_t data)
+{
+	struct sim_priv *priv;
+
+	if (!(priv = get_priv(dev)))
+		return QIPROG_ERR_ARG;
+
+	sim_request(dev);
+	jedec_write(priv, &priv->chips[0], addr, data & 0xff);
+	jedec_write(priv, &priv->chips[0], addr + 1, data >> 8);
+
+	return QIPROG_SUCCESS;
+}
+
+/**
+ * @brief QiProg driver 'write32' member
+ */
+static qiprog_err write32(struct qiprog_device *dev, uint32_t addr,
+			  uint32_t data)
+{
+	int i;
+	struct sim_priv *priv;
+
+	if (!(priv = get_priv(dev)))
+		return QIPROG_ERR_ARG;
+
+	sim_request(dev);
+	for (i = 0; i < 4; i++, data >>= 8)
+		jedec_write(priv, &priv->chips[0], addr + i, data & 0xff);
+
+	return QIPROG_SUCCESS;
+}
+
+/**
+ * @brief QiProg driver 'delay_us' member
+ */
+static qiprog_err delay_us(struct qiprog_device *dev, uint32_t us)
+{
+	struct sim_priv *priv;
+
+	if (!(priv = get_priv(dev)))
+		return QIPROG_ERR_ARG;
+
+	sim_request(dev);
+	sim_charge(priv, (uint64_t)us * 1000);
+
+	return QIPROG_SUCCESS;
+}
+
+/**
+ * @brief Move the device pointer to 'where', the way the USB host driver does
+ *
+ * @param[in] ptr The read or write pointer of the device
+ */
+static qiprog_err seek(struct qiprog_device *dev, uint32_t ptr, uint32_t where,
+		       uint32_t n)
+{
+	if ((ptr != where) || (dev->addr.end < (where + n)))
+		return set_address(dev, where, where + n);
+
+	dev->stats.set_address_saved++;
+	return QIPROG_SUCCESS;
+}
+
+/**
+ * @brief See if this step of a bulk operation is one which fails
+ *
+ * A failed step only gets half of its bytes across. Like on the USB driver, the
+ * pointers of the device are then unknown, and the next operation sets them.
+ */
+static bool sim_fault(struct qiprog_device *dev, struct sim_priv *priv,
+		      uint32_t addr)
+{
+	if (!priv->fail_every || (++priv->steps % priv->fail_every))
+		return false;
+
+	qi_err("Simulating a failed transfer at 0x%.8x", addr);
+	dev->stats.short_transfers++;
+	dev->addr.end = 0;
+	return true;
+}
+
+/**
+ * @brief Tell the callback about a failed bulk operation
+ */
+static qiprog_err sim_bulk_failed(struct qiprog_device *dev, uint32_t done,
+				  uint32_t n)
+{
+	if (dev->progress_cb)
+		dev->progress_cb(dev, QIPROG_TRANSFER_COMPLETE, QIPROG_ERR,
+				 done, n, dev->progress_data);
+	return QIPROG_ERR;
+}
+
+/**
+ * @brief QiProg driver 'read' member
+ *
+ * Named so as not to clash with read(2), which we need for the file.
+ */
+static qiprog_err bulk_read(struct qiprog_device *dev, uint32_t where,
+			    void *dest, uint32_t n)
+{
+	uint32_t done, len;
+	uint64_t start;
+	struct sim_priv *priv;
+	struct sim_chip *chip;
+
+	if (!(priv = get_priv(dev)) || !(chip = get_chip(dev, dev->chip_idx)))
+		return QIPROG_ERR_ARG;
+
+	seek(dev, dev->addr.pread, where, n);
+	if (n > dev->addr.end + 1 - dev->addr.pread) {
+		qi_err("I can give you %u bytes, but you asked me to read %u",
+		       dev->addr.end + 1 - dev->addr.pread, n);
+		return QIPROG_ERR_ARG;
+	}
+
+	start = qi_time_us();
+	for (done = 0; done < n; done += len) {
+		len = MIN(n - done, SIM_PROGRESS_STEP);
+		if (sim_fault(dev, priv, dev->addr.pread)) {
+			sim_read(priv, chip, dev->addr.pread,
+				 (uint8_t *)dest + done, len / 2);
+			return sim_bulk_failed(dev, done, n);
+		}
+		sim_read(priv, chip, dev->addr.pread, (uint8_t *)dest + done,
+			 len);
+		dev->addr.pread += len;
+		dev->checkpoint.done = done + len;
+		if (dev->progress_cb && (done + len < n))
+			dev->progress_cb(dev, QIPROG_TRANSFER_PROGRESS,
+					 QIPROG_SUCCESS, done + len, n,
+					 dev->progress_data);
+	}
+
+	dev->stats.bytes_in += n;
+	dev->stats.transfers_in++;
+	dev->stats.bulk_time_us += qi_time_us() - start;
+	if (dev->progress_cb)
+		dev->progress_cb(dev, QIPROG_TRANSFER_COMPLETE, QIPROG_SUCCESS,
+				 n, n, dev->progress_data);
+
+	return QIPROG_SUCCESS;
+}
+
+/**
+ * @brief QiProg driver 'write' member
+ *
+ * With QIPROG_ERASE_BEFORE_WRITE, each erase block is erased when the write
+ * pointer reaches its start.
+ */
+static qiprog_err bulk_write(struct qiprog_device *dev, uint32_t where,
+			     void *src, uint32_t n)
+{
+	uint32_t done, len, next_block;
+	uint64_t start;
+	struct sim_priv *priv;
+	struct sim_chip *chip;
+
+	if (!(priv = get_priv(dev)) || !(chip = get_chip(dev, dev->chip_idx)))
+		return QIPROG_ERR_ARG;
+
+	seek(dev, dev->addr.pwrite, where, n);
+	if (n > dev->addr.end + 1 - dev->addr.pwrite) {
+		qi_err("I can write %u bytes, but you asked me to write %u",
+		       dev->addr.end + 1 - dev->addr.pwrite, n);
+		return QIPROG_ERR_ARG;
+	}
+
+	start = qi_time_us();
+	for (done = 0; done < n; done += len) {
+		len = MIN(n - done, SIM_PROGRESS_STEP);
+		/* Never go past the start of the next erase block */
+		next_block = chip->erase_size -
+			     (dev->addr.pwrite % chip->erase_size);
+		len = MIN(len, next_block);
+		if ((chip->erase_flags & QIPROG_ERASE_BEFORE_WRITE) &&
+		    (dev->addr.pwrite % chip->erase_size == 0))
+			sim_erase(priv, chip, dev->addr.pwrite, 1,
+				  chip->erase_size);
+
+		if (sim_fault(dev, priv, dev->addr.pwrite)) {
+			sim_program(priv, chip, dev->addr.pwrite,
+				    (uint8_t *)src + done, len / 2);
+			return sim_bulk_failed(dev, done, n);
+		}
+		sim_program(priv, chip, dev->addr.pwrite,
+			    (uint8_t *)src + done, len);
+		dev->addr.pwrite += len;
+		dev->checkpoint.done = done + len;
+		if (dev->progress_cb && (done + len < n))
+			dev->progress_cb(dev, QIPROG_TRANSFER_PROGRESS,
+					 QIPROG_SUCCESS, done + len, n,
+					 dev->progress_data);
+	}
+
+	dev->stats.bytes_out += n;
+	dev->stats.transfers_out++;
+	dev->stats.bulk_time_us += qi_time_us() - start;
+	if (dev->progress_cb)
+		dev->progress_cb(dev, QIPROG_TRANSFER_COMPLETE, QIPROG_SUCCESS,
+				 n, n, dev->progress_data);
+
+	return QIPROG_SUCCESS;
+}
+
+/**
+ * @brief The simulated programmer driver structure
+ *
+ * Asynchronous bulk operations and batches are left to the fallbacks in core.c.
+ * They complete immediately anyway.
+ */
+struct qiprog_driver qiprog_sim_drv = {
+	.scan = scan,
+	.dev_open = dev_open,
+	.dev_close = dev_close,
+	.dev_free = dev_free,
+	.set_bus = set_bus,
+	.set_clock = set_clock,
+	.get_capabilities = get_capabilities,
+	.read_chip_id = read_chip_id,
+	.set_address = set_address,
+	.set_chip_size = set_chip_size,
+	.set_read_command = set_read_command,
+	.set_spi_timing = set_spi_timing,
+	.set_vdd = set_vdd,
+	.erase = erase,
+	.checksum = checksum,
+	.set_erase_size = set_erase_size,
+	.set_erase_command = set_erase_command,
+	.set_custom_erase_command = set_custom_erase_command,
+	.set_write_command = set_write_command,
+	.set_custom_write_command = set_custom_write_command,
+	.read8 = read8,
+	.read16 = read16,
+	.read32 = read32,
+	.write8 = write8,
+	.write16 = write16,
+	.write32 = write32,
+	.delay_us = delay_us,
+	.read = bulk_read,
+	.write = bulk_write,
+};
+
+/** @} */
@@ -43,6 +43,7 @@
 #include <stdlib.h>
 #include <stdbool.h>
 #include <string.h>
+#include <time.h>
 
 ////#include <stdio.h>
 ////#include <sys/time.h>
@@ -55,13 +56,91 @@
 #define qi_spew(str, ...)	qi_pspew(LOG_DOMAIN str, ##__VA_ARGS__)
 
 /*
- * The maximum number of USB transfers that may be active at any given time
- * Each device may have at most MAX_CONCURRENT_TRANSFERS during bulk operations.
+ * The number of USB transfers that may be active at any given time during bulk
+ * operations. Each device gets DEFAULT_QUEUE_DEPTH transfers unless told
+ * otherwise with qiprog_usb_set_queue_depth().
  */
-#define MAX_CONCURRENT_TRANSFERS	((unsigned int)32)
+#define DEFAULT_QUEUE_DEPTH		((uint32_t)32)
+#define MAX_QUEUE_DEPTH			((uint32_t)1024)
+
+/*
+ * Each bulk transfer packs many packets. Fewer, larger transfers mean fewer
+ * submissions and callbacks for the same amount of data. Unless told otherwise
+ * with qiprog_usb_set_transfer_size(), the size is chosen based on the speed
+ * of the link.
+ */
+#define TRANSFER_SIZE_FULL_SPEED	((uint32_t)4 << 10)
+#define TRANSFER_SIZE_HIGH_SPEED	((uint32_t)32 << 10)
+#define TRANSFER_SIZE_SUPER_SPEED	((uint32_t)64 << 10)
+#define MAX_TRANSFER_SIZE		((uint32_t)1 << 20)
+
+/* Times to handle events again when it fails, to get our transfers back */
+#define EVENT_RETRIES			3
+
+/* How often a blocking call looks whether the event thread still runs, in ms */
+#define EVENT_THREAD_WAIT_MS		100
+
+/* We do not know how the device expands bulk writes, until we tell it */
+#define ENCODING_UNKNOWN		0xff
 
 struct qiprog_driver qiprog_usb_master_drv;
 
+struct usb_bulk_op;
+
+/** Callback data passed to asynchronous USB transfers */
+struct usb_host_cb_data {
+	/** The bulk operation this transfer is part of */
+	struct usb_bulk_op *op;
+	/** The sequential number assigned to this transfer */
+	uint32_t transfer_number;
+	/** We gave up on the transfer, see abandon_bulk_op() */
+	bool lost;
+};
+
+/** State of the bulk operation in progress on a device */
+struct usb_bulk_op {
+	/** Device the operation runs on */
+	struct qiprog_device *dev;
+	/** Endpoint used for the operation, which also gives the direction */
+	unsigned char ep;
+	/** When the transfers were started, in microseconds */
+	uint64_t starttime;
+	/** The total number of bytes transferred up until now */
+	volatile uint32_t transferred_bytes;
+	/** The number of transfers which are still active */
+	volatile uint32_t active_transfers;
+	/** The total number of transfers needed to complete the transaction */
+	uint32_t total_transfers;
+	/** Queue depth, or maximum number of concurrent transfers */
+	uint32_t queue_depth;
+	/** Size of every transfer, except possibly the last one */
+	uint32_t transfer_size;
+	/** Start of the data for the whole transaction */
+	uint8_t *data;
+	/** Number of bytes which fill whole packets */
+	uint32_t len;
+	/** Number of bytes after 'len' which do not fill a whole packet */
+	uint32_t tail_len;
+	/**
+	 * For encoded data, how many bytes of the user's data each transfer
+	 * completes, counted from the start of the operation. NULL otherwise.
+	 */
+	const uint32_t *src_ends;
+	/** Bytes of the user's request handled before any transfer */
+	uint32_t done_before;
+	/** Total number of bytes in the user's request */
+	uint32_t total;
+	/** Result of the operation */
+	qiprog_err status;
+	/** An operation was started and has not finished yet */
+	bool busy;
+	/** Set when the operation finishes. Used with libusb_handle_events */
+	int completed;
+	/** Who to tell about progress and completion, if anyone */
+	qiprog_transfer_cb cb;
+	void *user_data;
+};
+
 /**
  * @brief Private per-device context for USB devices
  */
@@ -73,8 +152,89 @@ struct usb_master_priv {
 	/* Buffer used to store 'leftover' bulk data */
 	uint8_t * buf;
 	size_t buflen;
+	/* Transfers reused by every bulk operation, allocated on dev_open */
+	struct libusb_transfer **transfers;
+	struct usb_host_cb_data *cb_data;
+	/* Number of transfers in the pool */
+	uint32_t pool_size;
+	/* Number of transfers we want in the pool */
+	uint32_t queue_depth;
+	/* Maximum number of bytes in one bulk transfer */
+	uint32_t transfer_size;
+	/* The bulk operation in progress, if any */
+	struct usb_bulk_op op;
+	/* Bit (ep >> 7) is set when that endpoint stalled, and is halted */
+	uint8_t stalled;
+	/* What the device told us about its instruction set support */
+	bool caps_valid;
+	uint16_t instruction_set;
+	uint32_t max_direct_data;
+	uint16_t read_cmds;
+	uint16_t bulk_encodings;
+	/* Encode bulk writes when the device can expand them */
+	bool compress;
+	/* How the device expands bulk writes, or ENCODING_UNKNOWN */
+	uint8_t out_encoding;
+	/* Encoded data of the last write, and where its transfers end */
+	uint8_t *enc_buf;
+	uint32_t enc_size;
+	uint32_t *enc_ends;
+	uint32_t enc_ends_size;
+	/*
+	 * Held while the bulk operation is started or completed, since the
+	 * event thread may complete it. It is recursive, because completion
+	 * callbacks may start the next operation.
+	 */
+	pthread_mutex_t lock;
+	/* Signalled when the bulk operation completes */
+	pthread_cond_t done;
 };
 
+/**
+ * @brief Pick a bulk transfer size suited to the speed of the link
+ */
+static uint32_t default_transfer_size(libusb_device *libusb_dev)
+{
+	const int speed = libusb_get_device_speed(libusb_dev);
+
+	if (speed >= LIBUSB_SPEED_SUPER)
+		return TRANSFER_SIZE_SUPER_SPEED;
+	if (speed == LIBUSB_SPEED_HIGH)
+		return TRANSFER_SIZE_HIGH_SPEED;
+	/* Low, full, or unknown speed */
+	return TRANSFER_SIZE_FULL_SPEED;
+}
+
+/**
+ * @brief Send a control request, and account for it in the device's stats
+ */
+static int control_transfer(struct qiprog_device *dev, uint8_t request_type,
+			    uint8_t request, uint16_t wValue, uint16_t wIndex,
+			    void *data, uint16_t wLength, unsigned int timeout)
+{
+	int ret;
+	uint64_t start, elapsed;
+	unsigned int bucket;
+	struct usb_master_priv *priv = dev->priv;
+
+	start = qi_time_us();
+	ret = libusb_control_transfer(priv->handle, request_type, request,
+				      wValue, wIndex, data, wLength, timeout);
+	elapsed = qi_time_us() - start;
+
+	dev->stats.ctrl_requests++;
+	if (ret < LIBUSB_SUCCESS)
+		dev->stats.ctrl_errors++;
+	dev->stats.ctrl_time_us += elapsed;
+	for (bucket = 0; bucket < QIPROG_LATENCY_BUCKETS - 1; bucket++) {
+		if (elapsed < (128u << bucket))
+			break;
+	}
+	dev->stats.ctrl_latency[bucket]++;
+
+	return ret;
+}
+
 /**
  * @brief Helper to create a new USB QiProg device
  */
@@ -88,6 +248,7 @@ static struct qiprog_device *new_usb_prog(libusb_device *libusb_dev,
 	 * him.
 	 */
 	int ep_in, ep_out;
+	pthread_mutexattr_t attr;
 	struct qiprog_device *peter_stuge;
 	struct usb_master_priv *priv = NULL;
 
@@ -118,24 +279,60 @@ static struct qiprog_device *new_usb_prog(libusb_device *libusb_dev,
 
 	priv->ep_size_in = ep_in;
 	priv->ep_size_out = ep_out;
+	priv->queue_depth = DEFAULT_QUEUE_DEPTH;
+	priv->transfer_size = default_transfer_size(libusb_dev);
+	priv->compress = true;
 
 	qi_spew("Max packet size: %i IN, %i OUT", ep_in, ep_out);
+	qi_spew("Bulk transfer size: %u", priv->transfer_size);
 
 	if ((priv->buf = malloc(MAX(ep_in, ep_out))) == NULL) {
 		qi_warn("Could not allocate memory.");
 		goto cleanup;
 	}
 
+	pthread_mutexattr_init(&attr);
+	pthread_mutexattr_settype(&attr, PTHREAD_MUTEX_RECURSIVE);
+	pthread_mutex_init(&priv->lock, &attr);
+	pthread_mutexattr_destroy(&attr);
+	pthread_cond_init(&priv->done, NULL);
+
+	/* Keep libusb from freeing the device while we know about it */
+	libusb_ref_device(libusb_dev);
 	return peter_stuge;
 
  cleanup:
 	if (priv && priv->buf)
 		free(priv->buf);
 	free(priv);
+	/* Do not let dev_free have a go at what we just freed */
+	peter_stuge->priv = NULL;
 	qiprog_free_device(peter_stuge);
 	return NULL;
 }
 
+/**
+ * @brief Find the QiProg device of a USB device we already know about
+ */
+static struct qiprog_device *find_usb_prog(struct dev_list *qi_list,
+					   libusb_device *libusb_dev)
+{
+	size_t i;
+	struct qiprog_device *dev;
+	struct usb_master_priv *priv;
+
+	for (i = 0; i < qi_list->len; i++) {
+		dev = qi_list->devs[i];
+		if ((dev->drv != &qiprog_usb_master_drv) || !dev->present)
+			continue;
+		priv = dev->priv;
+		if (priv->usb_dev == libusb_dev)
+			return dev;
+	}
+
+	return NULL;
+}
+
 /**
  * @brief Decide if given USB device is a QiProg device
  */
@@ -178,6 +375,11 @@ static qiprog_err scan(struct qiprog_context *ctx, struct dev_list *qi_list)
 
 	for (i = 0; i < cnt; i++) {
 		device = list[i];
+		/* Known devices need not have their descriptors read again */
+		if ((qi_dev = find_usb_prog(qi_list, device)) != NULL) {
+			qi_dev->seen = 1;
+			continue;
+		}
 		if (is_interesting(device)) {
 			qi_dev = new_usb_prog(device, ctx);
 			if (qi_dev == NULL) {
@@ -189,8 +391,124 @@ static qiprog_err scan(struct qiprog_context *ctx, struct dev_list *qi_list)
 		}
 	}
 
-	libusb_free_device_list(list, 0);
+	/* The devices we keep have their own reference */
+	libusb_free_device_list(list, 1);
+	return QIPROG_SUCCESS;
+}
+
+/**
+ * @brief Called by libusb when a QiProg device is plugged in or removed
+ */
+static int LIBUSB_CALL hotplug_cb(libusb_context *usb_ctx,
+				  libusb_device *device,
+				  libusb_hotplug_event event, void *user_data)
+{
+	struct qiprog_context *ctx = user_data;
+	struct qiprog_device *qi_dev;
+
+	(void)usb_ctx;
+
+	/* This may run in the event thread, while others look at the list */
+	qi_ctx_lock(ctx);
+	qi_dev = find_usb_prog(&ctx->devices, device);
+	if (event == LIBUSB_HOTPLUG_EVENT_DEVICE_ARRIVED) {
+		/* We may have found it with a scan already */
+		if (qi_dev == NULL) {
+			if ((qi_dev = new_usb_prog(device, ctx)) != NULL)
+				dev_list_append(&ctx->devices, qi_dev);
+			else
+				qi_err("Malloc failure");
+		}
+	} else if (qi_dev != NULL) {
+		qi_device_left(qi_dev);
+	}
+	qi_ctx_unlock(ctx);
+
+	/* Keep the callback registered */
+	return 0;
+}
+
+/**
+ * @brief QiProg driver 'hotplug' member
+ *
+ * Devices already connected are reported right away. The callback stays
+ * registered until libusb_exit().
+ */
+static qiprog_err hotplug(struct qiprog_context *ctx, struct dev_list *qi_list)
+{
+	int ret;
+	libusb_hotplug_callback_handle handle;
+
+	(void)qi_list;
+
+	if (!libusb_has_capability(LIBUSB_CAP_HAS_HOTPLUG))
+		return QIPROG_ERR;
+
+	ret = libusb_hotplug_register_callback(ctx->libusb_host_ctx,
+					       LIBUSB_HOTPLUG_EVENT_DEVICE_ARRIVED |
+					       LIBUSB_HOTPLUG_EVENT_DEVICE_LEFT,
+					       LIBUSB_HOTPLUG_ENUMERATE,
+					       USB_VID_OPENMOKO,
+					       USB_PID_OPENMOKO_VULTUREPROG,
+					       LIBUSB_HOTPLUG_MATCH_ANY,
+					       hotplug_cb, ctx, &handle);
+	if (ret != LIBUSB_SUCCESS) {
+		qi_warn("Could not watch for devices: %s",
+			libusb_error_name(ret));
+		return QIPROG_ERR;
+	}
+
+	return QIPROG_SUCCESS;
+}
+
+/**
+ * @brief Release the pool of bulk transfers of a device
+ */
+static void free_transfer_pool(struct usb_master_priv *priv)
+{
+	uint32_t i;
+
+	if (priv->transfers) {
+		for (i = 0; i < priv->pool_size; i++)
+			libusb_free_transfer(priv->transfers[i]);
+	}
+	free(priv->transfers);
+	free(priv->cb_data);
+	priv->transfers = NULL;
+	priv->cb_data = NULL;
+	priv->pool_size = 0;
+}
+
+/**
+ * @brief Allocate a pool of priv->queue_depth bulk transfers
+ *
+ * The transfers are reused for every bulk operation on the device, so that we
+ * do not pay the cost of allocating them on every read or write.
+ */
+static qiprog_err alloc_transfer_pool(struct usb_master_priv *priv)
+{
+	uint32_t i;
+	const uint32_t depth = priv->queue_depth;
+
+	free_transfer_pool(priv);
+
+	priv->transfers = calloc(depth, sizeof(*priv->transfers));
+	priv->cb_data = calloc(depth, sizeof(*priv->cb_data));
+	if (!priv->transfers || !priv->cb_data)
+		goto fail;
+
+	for (i = 0; i < depth; i++) {
+		if ((priv->transfers[i] = libusb_alloc_transfer(0)) == NULL)
+			goto fail;
+		priv->pool_size++;
+	}
+
 	return QIPROG_SUCCESS;
+
+ fail:
+	qi_err("Could not allocate %u transfers", depth);
+	free_transfer_pool(priv);
+	return QIPROG_ERR_MALLOC;
 }
 
 /**
@@ -199,6 +517,8 @@ static qiprog_err scan(struct qiprog_context *ctx, struct dev_list *qi_list)
 static qiprog_err dev_open(struct qiprog_device *dev)
 {
 	int ret;
+	unsigned char serial[128];
+	struct libusb_device_descriptor descr;
 	struct usb_master_priv *priv;
 
 	if (!dev)
@@ -219,6 +539,168 @@ static qiprog_err dev_open(struct qiprog_device *dev)
 		return QIPROG_ERR;
 	}
 
+	/* Not having a serial number is not an error */
+	ret = libusb_get_device_descriptor(priv->usb_dev, &descr);
+	if ((ret == LIBUSB_SUCCESS) && descr.iSerialNumber && !dev->serial) {
+		ret = libusb_get_string_descriptor_ascii(priv->handle,
+							 descr.iSerialNumber,
+							 serial,
+							 sizeof(serial));
+		if (ret > 0)
+			dev->serial = strndup((char *)serial, ret);
+	}
+
+	/* Someone else may have left the device expecting encoded data */
+	priv->out_encoding = ENCODING_UNKNOWN;
+
+	return alloc_transfer_pool(priv);
+}
+
+/**
+ * @brief QiProg driver 'dev_close' member
+ */
+static qiprog_err dev_close(struct qiprog_device *dev)
+{
+	struct usb_master_priv *priv;
+
+	if (!dev)
+		return QIPROG_ERR_ARG;
+	if (!(priv = dev->priv))
+		return QIPROG_ERR_ARG;
+
+	free_transfer_pool(priv);
+
+	free((void *)dev->serial);
+	dev->serial = NULL;
+
+	if (priv->handle) {
+		libusb_release_interface(priv->handle, 0);
+		libusb_close(priv->handle);
+		priv->handle = NULL;
+	}
+
+	return QIPROG_SUCCESS;
+}
+
+/**
+ * @brief QiProg driver 'dev_free' member
+ */
+static void dev_free(struct qiprog_device *dev)
+{
+	struct usb_master_priv *priv = dev->priv;
+
+	if (!priv)
+		return;
+
+	/* The application may not have closed it */
+	if (priv->handle)
+		dev_close(dev);
+
+	libusb_unref_device(priv->usb_dev);
+	pthread_cond_destroy(&priv->done);
+	pthread_mutex_destroy(&priv->lock);
+	free(priv->buf);
+	free(priv->enc_buf);
+	free(priv->enc_ends);
+	free(priv);
+	dev->priv = NULL;
+}
+
+/**
+ * @brief Set the number of bulk transfers kept in flight for a USB device
+ *
+ * A deeper queue keeps the bus busy while completed transfers are processed,
+ * at the cost of more memory pinned by the USB stack. The default is
+ * DEFAULT_QUEUE_DEPTH. If the device is already open, its transfer pool is
+ * reallocated with the new depth.
+ *
+ * @param[in] dev USB device to operate on
+ * @param[in] depth maximum number of concurrent bulk transfers
+ *
+ * @return QIPROG_SUCCESS on success, or a QIPROG_ERR code otherwise.
+ */
+qiprog_err qiprog_usb_set_queue_depth(struct qiprog_device *dev,
+				      uint32_t depth)
+{
+	struct usb_master_priv *priv;
+
+	if (!dev || (dev->drv != &qiprog_usb_master_drv))
+		return QIPROG_ERR_ARG;
+	if (!(priv = dev->priv))
+		return QIPROG_ERR_ARG;
+	if (depth == 0)
+		return QIPROG_ERR_ARG;
+	if (depth > MAX_QUEUE_DEPTH)
+		return QIPROG_ERR_LARGE_ARG;
+	/* Transfers in the pool may still be in flight */
+	if (priv->op.busy)
+		return QIPROG_ERR_BUSY;
+
+	priv->queue_depth = depth;
+
+	/* Device not yet open. The pool will be allocated by dev_open */
+	if (priv->handle == NULL)
+		return QIPROG_SUCCESS;
+
+	return alloc_transfer_pool(priv);
+}
+
+/**
+ * @brief Set the maximum size of one bulk transfer for a USB device
+ *
+ * Bulk operations are split into transfers of this size. Each transfer is
+ * made of whole packets, so the size is rounded down to a multiple of the
+ * endpoint size. The last transfer of an operation may be shorter.
+ *
+ * @param[in] dev USB device to operate on
+ * @param[in] size maximum bytes per transfer, or 0 to choose a size based on
+ *		   the speed of the USB link.
+ *
+ * @return QIPROG_SUCCESS on success, or a QIPROG_ERR code otherwise.
+ */
+qiprog_err qiprog_usb_set_transfer_size(struct qiprog_device *dev,
+					uint32_t size)
+{
+	struct usb_master_priv *priv;
+
+	if (!dev || (dev->drv != &qiprog_usb_master_drv))
+		return QIPROG_ERR_ARG;
+	if (!(priv = dev->priv))
+		return QIPROG_ERR_ARG;
+	if (size > MAX_TRANSFER_SIZE)
+		return QIPROG_ERR_LARGE_ARG;
+
+	if (size == 0)
+		size = default_transfer_size(priv->usb_dev);
+
+	priv->transfer_size = size;
+	return QIPROG_SUCCESS;
+}
+
+/**
+ * @brief Compress bulk writes to a USB device, if it can expand them
+ *
+ * Writes are run-length encoded when the device lists QIPROG_BULK_RLE in its
+ * capabilities, which is the default. Images which are mostly padding then go
+ * over the bus several times faster. Data which does not compress grows by
+ * less than one percent.
+ *
+ * @param[in] dev USB device to operate on
+ * @param[in] enable Encode writes if the device can expand them, or send them
+ *		     raw
+ *
+ * @return QIPROG_SUCCESS on success, or a QIPROG_ERR code otherwise.
+ */
+qiprog_err qiprog_usb_set_compression(struct qiprog_device *dev, bool enable)
+{
+	struct usb_master_priv *priv;
+
+	if (!dev || (dev->drv != &qiprog_usb_master_drv))
+		return QIPROG_ERR_ARG;
+	if (!(priv = dev->priv))
+		return QIPROG_ERR_ARG;
+
+	priv->compress = enable;
 	return QIPROG_SUCCESS;
 }
 
@@ -237,9 +719,11 @@ static qiprog_err get_capabilities(struct qiprog_device *dev,
 	if (!(priv = dev->priv))
 		return QIPROG_ERR_ARG;
 
-	ret = libusb_control_transfer(priv->handle, 0xc0,
-				      QIPROG_GET_CAPABILITIES, 0, 0,
-				      (void *)buf, 0x20, 3000);
+	/* Older devices send fewer fields. Those they leave out are 0. */
+	memset(buf, 0, sizeof(buf));
+	ret = control_transfer(dev, 0xc0,
+			       QIPROG_GET_CAPABILITIES, 0, 0,
+			       (void *)buf, 0x22, 3000);
 	if (ret < LIBUSB_SUCCESS) {
 		qi_err("Control transfer failed: %s", libusb_error_name(ret));
 		return QIPROG_ERR;
@@ -251,6 +735,15 @@ static qiprog_err get_capabilities(struct qiprog_device *dev,
 	caps->max_direct_data = le32_to_h(buf + 6);
 	for (i = 0; i < 10; i++)
 		caps->voltages[i] = le16_to_h((buf + 10) + (2 * i));
+	caps->read_cmds = le16_to_h(buf + 30);
+	caps->bulk_encodings = le16_to_h(buf + 32);
+
+	/* Remember if we can hand programs over to the device */
+	priv->instruction_set = caps->instruction_set;
+	priv->max_direct_data = caps->max_direct_data;
+	priv->read_cmds = caps->read_cmds;
+	priv->bulk_encodings = caps->bulk_encodings;
+	priv->caps_valid = true;
 
 	return QIPROG_SUCCESS;
 }
@@ -277,9 +770,9 @@ static qiprog_err set_bus(struct qiprog_device *dev, enum qiprog_bus bus)
 	 * FIXME: This doesn't seem to return an error when the device NAKs the
 	 * request.
 	 */
-	ret = libusb_control_transfer(priv->handle, 0x40,
-				      QIPROG_SET_BUS, wValue, wIndex,
-				      NULL, 0, 3000);
+	ret = control_transfer(dev, 0x40,
+			       QIPROG_SET_BUS, wValue, wIndex,
+			       NULL, 0, 3000);
 	if (ret < LIBUSB_SUCCESS) {
 		qi_err("Control transfer failed: %s", libusb_error_name(ret));
 		return QIPROG_ERR;
@@ -289,65 +782,58 @@ static qiprog_err set_bus(struct qiprog_device *dev, enum qiprog_bus bus)
 }
 
 /**
- * @brief QiProg driver 'read_chip_id' member
+ * @brief QiProg driver 'set_clock' member
+ *
+ * The device picks the closest clock it can do, without going over, and tells
+ * us which one it picked.
  */
-static qiprog_err read_chip_id(struct qiprog_device *dev,
-			       struct qiprog_chip_id ids[9])
+static qiprog_err set_clock(struct qiprog_device *dev, uint32_t *clock_khz)
 {
-	int ret, i;
-	uint8_t buf[64];
-	uint8_t * base;
+	int ret;
+	uint8_t buf[4];
 	struct usb_master_priv *priv;
 
-	if (!dev)
+	if (!dev || !clock_khz)
 		return QIPROG_ERR_ARG;
 	if (!(priv = dev->priv))
 		return QIPROG_ERR_ARG;
 
-	ret = libusb_control_transfer(priv->handle, 0xc0,
-				      QIPROG_READ_DEVICE_ID, 0, 0,
-				      (void *)buf, 0x3f * 9, 3000);
+	ret = control_transfer(dev, 0xc0, QIPROG_SET_CLOCK, *clock_khz >> 16,
+			       *clock_khz & 0xffff, buf, sizeof(buf), 3000);
 	if (ret < LIBUSB_SUCCESS) {
 		qi_err("Control transfer failed: %s", libusb_error_name(ret));
 		return QIPROG_ERR;
 	}
+	if (ret != sizeof(buf)) {
+		qi_err("Device did not tell us the clock it uses");
+		return QIPROG_ERR;
+	}
 
 	/* USB is LE, we are host-endian */
-	for (i = 0; i < 9; i++) {
-		base = buf + (i * 7);
-		ids[i].id_method = *(base + 0);
-		ids[i].vendor_id = le16_to_h(base + 1);
-		ids[i].device_id = le32_to_h(base + 3);
-	}
+	*clock_khz = le32_to_h(buf);
 
 	return QIPROG_SUCCESS;
 }
 
 /**
- * @brief QiProg driver 'set_chip_size' member
+ * @brief QiProg driver 'set_spi_timing' member
  */
-static qiprog_err set_chip_size(struct qiprog_device *dev, uint8_t chip_idx,
-				uint32_t size)
+static qiprog_err set_spi_timing(struct qiprog_device *dev,
+				 uint16_t tpu_read_us, uint32_t tces_ns)
 {
 	int ret;
-	uint16_t wIndex;
-	uint8_t buf[64];
 	struct usb_master_priv *priv;
 
 	if (!dev)
 		return QIPROG_ERR_ARG;
 	if (!(priv = dev->priv))
 		return QIPROG_ERR_ARG;
+	/* TCES goes in wIndex */
+	if (tces_ns > 0xffff)
+		return QIPROG_ERR_LARGE_ARG;
 
-	/* Least significant 16 bits of the QIPROG_BUS_ constant */
-	wIndex = chip_idx;
-
-	/* USB is LE, we are host-endian */
-	h_to_le32(size, buf);
-
-	ret = libusb_control_transfer(priv->handle, 0x40,
-				      QIPROG_SET_CHIP_SIZE, 0, wIndex,
-				      buf, 0x04, 3000);
+	ret = control_transfer(dev, 0x40, QIPROG_SET_SPI_TIMING, tpu_read_us,
+			       tces_ns, NULL, 0, 3000);
 	if (ret < LIBUSB_SUCCESS) {
 		qi_err("Control transfer failed: %s", libusb_error_name(ret));
 		return QIPROG_ERR;
@@ -357,15 +843,14 @@ static qiprog_err set_chip_size(struct qiprog_device *dev, uint8_t chip_idx,
 }
 
 /**
- * @brief QiProg driver 'read8' member
- *
- * TODO: Try to unify read 8/16/32 into one common function
+ * @brief QiProg driver 'get_device_stats' member
  */
-static qiprog_err read8(struct qiprog_device *dev, uint32_t addr,
-			uint8_t *data)
+static qiprog_err get_device_stats(struct qiprog_device *dev,
+				   struct qiprog_device_stats *stats)
 {
-	int ret;
-	uint16_t wValue, wIndex;
+	int ret, i;
+	uint8_t buf[64];
+	uint16_t first, count;
 	struct usb_master_priv *priv;
 
 	if (!dev)
@@ -373,31 +858,54 @@ static qiprog_err read8(struct qiprog_device *dev, uint32_t addr,
 	if (!(priv = dev->priv))
 		return QIPROG_ERR_ARG;
 
-	/* Most significant 16 bits of the memory address to read from */
-	wValue = addr >> 16;
-	/* Least significant 16 bits of the memory address to read from */
-	wIndex = addr & 0xffff;
+	/* These requests are counted too, in reqs[QIPROG_GET_STATS] */
+	for (first = 0; first < QIPROG_STATS_NUM_REQS; first += count) {
+		count = MIN(QIPROG_STATS_NUM_REQS - first,
+			    (int)(sizeof(buf) / sizeof(uint16_t)));
+		ret = control_transfer(dev, 0xc0, QIPROG_GET_STATS,
+				       QIPROG_STATS_REQUESTS, first,
+				       (void *)buf, count * sizeof(uint16_t),
+				       3000);
+		if (ret < LIBUSB_SUCCESS) {
+			qi_err("Control transfer failed: %s",
+			       libusb_error_name(ret));
+			return QIPROG_ERR;
+		}
+		for (i = 0; i < count; i++)
+			stats->reqs[first + i] = le16_to_h(buf + 2 * i);
+	}
 
-	ret = libusb_control_transfer(priv->handle, 0xc0,
-				      QIPROG_READ8, wValue, wIndex,
-				      (void *)data, sizeof(*data), 3000);
+	/* Newer devices may send more counters, older ones fewer */
+	memset(buf, 0, sizeof(buf));
+	ret = control_transfer(dev, 0xc0, QIPROG_GET_STATS,
+			       QIPROG_STATS_COUNTERS, 0,
+			       (void *)buf, QIPROG_STATS_LEN, 3000);
 	if (ret < LIBUSB_SUCCESS) {
 		qi_err("Control transfer failed: %s", libusb_error_name(ret));
 		return QIPROG_ERR;
 	}
 
+	/* USB is LE, we are host-endian */
+	stats->timed = !!(le32_to_h(buf + 0x00) & QIPROG_STATS_TIMED);
+	stats->packets_rx = le32_to_h(buf + 0x04);
+	stats->packets_tx = le32_to_h(buf + 0x08);
+	stats->tx_retries = le32_to_h(buf + 0x0c);
+	stats->starved = le32_to_h(buf + 0x10);
+	stats->starved_us = le32_to_h(buf + 0x14);
+	stats->read_us = le32_to_h(buf + 0x18);
+	stats->write_us = le32_to_h(buf + 0x1c);
+	stats->erase_us = le32_to_h(buf + 0x20);
+	stats->other_reqs = le32_to_h(buf + 0x24);
+
 	return QIPROG_SUCCESS;
 }
 
 /**
- * @brief QiProg driver 'read16' member
+ * @brief QiProg driver 'set_vdd' member
  */
-static qiprog_err read16(struct qiprog_device *dev, uint32_t addr,
-			 uint16_t *data)
+static qiprog_err set_vdd(struct qiprog_device *dev, uint16_t vdd_mv)
 {
 	int ret;
-	uint8_t buf[64];
-	uint16_t wValue, wIndex;
 	struct usb_master_priv *priv;
 
 	if (!dev)
@@ -405,34 +913,26 @@ static qiprog_err read16(struct qiprog_device *dev, uint32_t addr,
 	if (!(priv = dev->priv))
 		return QIPROG_ERR_ARG;
 
-	/* Most significant 16 bits of the memory address to read from */
-	wValue = addr >> 16;
-	/* Least significant 16 bits of the memory address to read from */
-	wIndex = addr & 0xffff;
-
-	ret = libusb_control_transfer(priv->handle, 0xc0,
-				      QIPROG_READ16, wValue, wIndex,
-				      (void *)buf, sizeof(*data), 3000);
+	/* wIndex turns the supply on or off */
+	ret = control_transfer(dev, 0x40, QIPROG_SET_VDD, vdd_mv,
+			       vdd_mv ? 1 : 0, NULL, 0, 3000);
 	if (ret < LIBUSB_SUCCESS) {
 		qi_err("Control transfer failed: %s", libusb_error_name(ret));
 		return QIPROG_ERR;
 	}
 
-	/* USB is LE, we are host-endian */
-	*data = le16_to_h(buf);
-
 	return QIPROG_SUCCESS;
 }
 
 /**
- * @brief QiProg driver 'read32' member
+ * @brief QiProg driver 'read_chip_id' member
  */
-static qiprog_err read32(struct qiprog_device *dev, uint32_t addr,
-			 uint32_t *data)
+static qiprog_err read_chip_id(struct qiprog_device *dev,
+			       struct qiprog_chip_id ids[9])
 {
-	int ret;
+	int ret, i;
 	uint8_t buf[64];
-	uint16_t wValue, wIndex;
+	uint8_t * base;
 	struct usb_master_priv *priv;
 
 	if (!dev)
@@ -440,34 +940,34 @@ static qiprog_err read32(struct qiprog_device *dev, uint32_t addr,
 	if (!(priv = dev->priv))
 		return QIPROG_ERR_ARG;
 
-	/* Most significant 16 bits of the memory address to read from */
-	wValue = addr >> 16;
-	/* Least significant 16 bits of the memory address to read from */
-	wIndex = addr & 0xffff;
-
-	ret = libusb_control_transfer(priv->handle, 0xc0,
-				      QIPROG_READ32, wValue, wIndex,
-				      (void *)buf, sizeof(*data), 3000);
+	ret = control_transfer(dev, 0xc0,
+			       QIPROG_READ_DEVICE_ID, 0, 0,
+			       (void *)buf, 0x3f * 9, 3000);
 	if (ret < LIBUSB_SUCCESS) {
 		qi_err("Control transfer failed: %s", libusb_error_name(ret));
 		return QIPROG_ERR;
 	}
 
 	/* USB is LE, we are host-endian */
-	*data = le32_to_h(buf);
+	for (i = 0; i < 9; i++) {
+		base = buf + (i * 7);
+		ids[i].id_method = *(base + 0);
+		ids[i].vendor_id = le16_to_h(base + 1);
+		ids[i].device_id = le32_to_h(base + 3);
+	}
 
 	return QIPROG_SUCCESS;
 }
 
 /**
- * @brief QiProg driver 'write8' member
- *
- * TODO: Try to unify write 8/16/32 into one common function
+ * @brief QiProg driver 'set_chip_size' member
  */
-static qiprog_err write8(struct qiprog_device *dev, uint32_t addr, uint8_t data)
+static qiprog_err set_chip_size(struct qiprog_device *dev, uint8_t chip_idx,
+				uint32_t size)
 {
 	int ret;
-	uint16_t wValue, wIndex;
+	uint16_t wIndex;
+	uint8_t buf[64];
 	struct usb_master_priv *priv;
 
 	if (!dev)
@@ -475,14 +975,15 @@ static qiprog_err write8(struct qiprog_device *dev, uint32_t addr, uint8_t data)
 	if (!(priv = dev->priv))
 		return QIPROG_ERR_ARG;
 
-	/* Most significant 16 bits of the memory address to read from */
-	wValue = addr >> 16;
-	/* Least significant 16 bits of the memory address to read from */
-	wIndex = addr & 0xffff;
+	/* Least significant 16 bits of the QIPROG_BUS_ constant */
+	wIndex = chip_idx;
+
+	/* USB is LE, we are host-endian */
+	h_to_le32(size, buf);
 
-	ret = libusb_control_transfer(priv->handle, 0x40,
-				      QIPROG_WRITE8, wValue, wIndex,
-				      (void *)&data, sizeof(data), 3000);
+	ret = control_transfer(dev, 0x40,
+			       QIPROG_SET_CHIP_SIZE, 0, wIndex,
+			       buf, 0x04, 3000);
 	if (ret < LIBUSB_SUCCESS) {
 		qi_err("Control transfer failed: %s", libusb_error_name(ret));
 		return QIPROG_ERR;
@@ -492,14 +993,13 @@ static qiprog_err write8(struct qiprog_device *dev, uint32_t addr, uint8_t data)
 }
 
 /**
- * @brief QiProg driver 'write16' member
+ * @brief QiProg driver 'erase' member
  */
-static qiprog_err write16(struct qiprog_device *dev, uint32_t addr,
-			  uint16_t data)
+static qiprog_err erase(struct qiprog_device *dev, uint8_t chip_idx,
+			uint32_t where, uint32_t n)
 {
 	int ret;
 	uint8_t buf[64];
-	uint16_t wValue, wIndex;
 	struct usb_master_priv *priv;
 
 	if (!dev)
@@ -507,17 +1007,19 @@ static qiprog_err write16(struct qiprog_device *dev, uint32_t addr,
 	if (!(priv = dev->priv))
 		return QIPROG_ERR_ARG;
 
-	/* Most significant 16 bits of the memory address to read from */
-	wValue = addr >> 16;
-	/* Least significant 16 bits of the memory address to read from */
-	wIndex = addr & 0xffff;
+	qi_spew("Erasing 0x%.8x -> 0x%.8x", where, where + n);
+
+	/* Anything we read ahead of time from this range is now stale */
+	priv->buflen = 0;
+	dev->addr.end = 0;
 
 	/* USB is LE, we are host-endian */
-	h_to_le16(data, buf);
+	h_to_le32(where, buf + 0);
+	h_to_le32(n, buf + 4);
 
-	ret = libusb_control_transfer(priv->handle, 0x40,
-				      QIPROG_WRITE16, wValue, wIndex,
-				      (void *)buf, sizeof(data), 3000);
+	/* Erasing takes a long time, and the device only answers when done */
+	ret = control_transfer(dev, 0x40, QIPROG_ERASE, 0,
+			       chip_idx, buf, 0x08, 60000);
 	if (ret < LIBUSB_SUCCESS) {
 		qi_err("Control transfer failed: %s", libusb_error_name(ret));
 		return QIPROG_ERR;
@@ -527,14 +1029,16 @@ static qiprog_err write16(struct qiprog_device *dev, uint32_t addr,
 }
 
 /**
- * @brief QiProg driver 'write32' member
+ * @brief QiProg driver 'checksum' member
  */
-static qiprog_err write32(struct qiprog_device *dev, uint32_t addr,
-			  uint32_t data)
+static qiprog_err checksum(struct qiprog_device *dev, uint32_t where,
+			   uint32_t n, uint32_t block_size,
+			   enum qiprog_checksum_algo algo, uint32_t *digests)
 {
 	int ret;
-	uint8_t buf[64];
-	uint16_t wValue, wIndex;
+	uint8_t buf[QIPROG_CHECKSUM_MAX_LEN];
+	uint16_t len;
+	uint32_t nblocks, first, count, i;
 	struct usb_master_priv *priv;
 
 	if (!dev)
@@ -542,33 +1046,61 @@ static qiprog_err write32(struct qiprog_device *dev, uint32_t addr,
 	if (!(priv = dev->priv))
 		return QIPROG_ERR_ARG;
 
-	/* Most significant 16 bits of the memory address to read from */
-	wValue = addr >> 16;
-	/* Least significant 16 bits of the memory address to read from */
-	wIndex = addr & 0xffff;
+	nblocks = block_size ? (n + block_size - 1) / block_size : 1;
+	/* The first block of each request goes in wValue */
+	if (nblocks > 0x10000)
+		return QIPROG_ERR_LARGE_ARG;
+
+	qi_spew("Checksumming 0x%.8x -> 0x%.8x", where, where + n - 1);
 
 	/* USB is LE, we are host-endian */
-	h_to_le32(data, buf);
+	h_to_le32(where, buf + 0);
+	h_to_le32(n, buf + 4);
+	h_to_le32(block_size, buf + 8);
 
-	ret = libusb_control_transfer(priv->handle, 0x40,
-				      QIPROG_WRITE32, wValue, wIndex,
-				      (void *)buf, sizeof(data), 3000);
+	ret = control_transfer(dev, 0x40, QIPROG_SET_CHECKSUM,
+			       algo, dev->chip_idx, buf, 12, 3000);
 	if (ret < LIBUSB_SUCCESS) {
 		qi_err("Control transfer failed: %s", libusb_error_name(ret));
 		return QIPROG_ERR;
 	}
 
+	for (first = 0; first < nblocks; first += count) {
+		count = MIN(nblocks - first, sizeof(buf) / sizeof(uint32_t));
+		len = count * sizeof(uint32_t);
+
+		/* The device reads the blocks before it answers */
+		ret = control_transfer(dev, 0xc0,
+				       QIPROG_GET_CHECKSUM, first, 0,
+				       buf, len, 30000);
+		if (ret < LIBUSB_SUCCESS) {
+			qi_err("Control transfer failed: %s",
+			       libusb_error_name(ret));
+			return QIPROG_ERR;
+		}
+		if (ret != len) {
+			qi_err("Device returned %i bytes of digests, "
+			       "expected %u", ret, len);
+			return QIPROG_ERR;
+		}
+
+		for (i = 0; i < count; i++)
+			digests[first + i] = le32_to_h(buf + i * 4);
+	}
+
 	return QIPROG_SUCCESS;
 }
 
 /**
- * @brief Tell the programmer what address range we want to operate on
+ * @brief QiProg driver 'read8' member
+ *
+ * TODO: Try to unify read 8/16/32 into one common function
  */
-static qiprog_err set_address(struct qiprog_device *dev, uint32_t start,
-			      uint32_t end)
+static qiprog_err read8(struct qiprog_device *dev, uint32_t addr,
+			uint8_t *data)
 {
 	int ret;
-	uint8_t buf[64];
+	uint16_t wValue, wIndex;
 	struct usb_master_priv *priv;
 
 	if (!dev)
@@ -576,88 +1108,66 @@ static qiprog_err set_address(struct qiprog_device *dev, uint32_t start,
 	if (!(priv = dev->priv))
 		return QIPROG_ERR_ARG;
 
-	qi_spew("Setting address range 0x%.8lx -> 0x%.8lx\n", start, end);
-
-	/*
-	 * Contents of the buffer are no longer valid. Device will start to
-	 * read at the new address. We get those contents with the next readn()
-	 * call.
-	 */
-	priv->buflen = 0;
-
-	/* USB is LE, we are host-endian */
-	h_to_le32(start, buf + 0);
-	h_to_le32(end, buf + 4);
+	/* Most significant 16 bits of the memory address to read from */
+	wValue = addr >> 16;
+	/* Least significant 16 bits of the memory address to read from */
+	wIndex = addr & 0xffff;
 
-	ret = libusb_control_transfer(priv->handle, 0x40,
-				      QIPROG_SET_ADDRESS, 0, 0,
-			              (void *)buf, 0x08, 3000);
+	ret = control_transfer(dev, 0xc0,
+			       QIPROG_READ8, wValue, wIndex,
+			       (void *)data, sizeof(*data), 3000);
 	if (ret < LIBUSB_SUCCESS) {
 		qi_err("Control transfer failed: %s", libusb_error_name(ret));
 		return QIPROG_ERR;
 	}
 
-	/* We have successfully set the address, now keep track of it */
-	dev->addr.end = end;
-	/* Read and write pointers are reset when setting a new range */
-	dev->addr.pread = dev->addr.pwrite = dev->addr.start = start;
-
 	return QIPROG_SUCCESS;
 }
 
 /**
- * @brief QiProg driver 'set_erase_size' member
+ * @brief QiProg driver 'read16' member
  */
-static qiprog_err set_erase_size(struct qiprog_device *dev, uint8_t chip_idx,
-				 enum qiprog_erase_type *types, uint32_t *sizes,
-				 size_t num_sizes)
+static qiprog_err read16(struct qiprog_device *dev, uint32_t addr,
+			 uint16_t *data)
 {
 	int ret;
-	uint16_t wIndex;
 	uint8_t buf[64];
-	size_t i;
+	uint16_t wValue, wIndex;
 	struct usb_master_priv *priv;
 
 	if (!dev)
 		return QIPROG_ERR_ARG;
 	if (!(priv = dev->priv))
 		return QIPROG_ERR_ARG;
-	if (num_sizes == 0)
-		return QIPROG_ERR_ARG;
-	/* We can only fit 12 erase sizes in a control packet */
-	if (num_sizes > 12)
-		return QIPROG_ERR_LARGE_ARG;
-
-	/* Least significant 16 bits of the QIPROG_BUS_ constant */
-	wIndex = chip_idx;
 
-	/* USB is LE, we are host-endian */
-	for (i = 0; i < num_sizes; i++) {
-		buf[i*5] = (uint8_t)types[i];
-		h_to_le32(sizes[i], buf + i*5 + 1);
-	}
+	/* Most significant 16 bits of the memory address to read from */
+	wValue = addr >> 16;
+	/* Least significant 16 bits of the memory address to read from */
+	wIndex = addr & 0xffff;
 
-	ret = libusb_control_transfer(priv->handle, 0x40, QIPROG_SET_ERASE_SIZE,
-				      0, wIndex, buf, num_sizes * 5, 3000);
+	ret = control_transfer(dev, 0xc0,
+			       QIPROG_READ16, wValue, wIndex,
+			       (void *)buf, sizeof(*data), 3000);
 	if (ret < LIBUSB_SUCCESS) {
 		qi_err("Control transfer failed: %s", libusb_error_name(ret));
 		return QIPROG_ERR;
 	}
 
+	/* USB is LE, we are host-endian */
+	*data = le16_to_h(buf);
+
 	return QIPROG_SUCCESS;
 }
 
 /**
- * @brief QiProg driver 'set_erase_command' member
+ * @brief QiProg driver 'read32' member
  */
-static qiprog_err set_erase_command(struct qiprog_device *dev, uint8_t chip_idx,
-				    enum qiprog_erase_cmd cmd,
-				    enum qiprog_erase_subcmd subcmd,
-				    uint16_t flags)
+static qiprog_err read32(struct qiprog_device *dev, uint32_t addr,
+			 uint32_t *data)
 {
 	int ret;
-	uint16_t wIndex;
 	uint8_t buf[64];
+	uint16_t wValue, wIndex;
 	struct usb_master_priv *priv;
 
 	if (!dev)
@@ -665,63 +1175,49 @@ static qiprog_err set_erase_command(struct qiprog_device *dev, uint8_t chip_idx,
 	if (!(priv = dev->priv))
 		return QIPROG_ERR_ARG;
 
-	/* Least significant 16 bits of the QIPROG_BUS_ constant */
-	wIndex = chip_idx;
-
-	/* USB is LE, we are host-endian */
-	buf[0] = (uint8_t)cmd;
-	buf[1] = (uint8_t)subcmd;
-	h_to_le16(flags, buf + 2);
+	/* Most significant 16 bits of the memory address to read from */
+	wValue = addr >> 16;
+	/* Least significant 16 bits of the memory address to read from */
+	wIndex = addr & 0xffff;
 
-	ret = libusb_control_transfer(priv->handle, 0x40,
-				      QIPROG_SET_ERASE_COMMAND, 0, wIndex, buf,
-				      0x04, 3000);
+	ret = control_transfer(dev, 0xc0,
+			       QIPROG_READ32, wValue, wIndex,
+			       (void *)buf, sizeof(*data), 3000);
 	if (ret < LIBUSB_SUCCESS) {
 		qi_err("Control transfer failed: %s", libusb_error_name(ret));
 		return QIPROG_ERR;
 	}
 
+	/* USB is LE, we are host-endian */
+	*data = le32_to_h(buf);
+
 	return QIPROG_SUCCESS;
 }
 
 /**
- * @brief QiProg driver 'set_custom_erase_command' member
+ * @brief QiProg driver 'write8' member
+ *
+ * TODO: Try to unify write 8/16/32 into one common function
  */
-static qiprog_err set_custom_erase_command(struct qiprog_device *dev,
-					   uint8_t chip_idx, uint32_t *addr,
-					   uint8_t *data, size_t num_bytes)
+static qiprog_err write8(struct qiprog_device *dev, uint32_t addr, uint8_t data)
 {
 	int ret;
-	uint16_t wIndex;
-	uint8_t buf[64];
-	size_t i;
+	uint16_t wValue, wIndex;
 	struct usb_master_priv *priv;
 
 	if (!dev)
 		return QIPROG_ERR_ARG;
 	if (!(priv = dev->priv))
 		return QIPROG_ERR_ARG;
-	if (num_bytes == 0)
-		return QIPROG_ERR_ARG;
-	/* We can only fit 12 erase steps in a control packet */
-	if (num_bytes > 12)
-		return QIPROG_ERR_LARGE_ARG;
-
-	/* Least significant 16 bits of the QIPROG_BUS_ constant */
-	wIndex = chip_idx;
 
-	/* USB is LE, we are host-endian */
-	buf[0] = (uint8_t)QIPROG_ERASE_CMD_CUSTOM;
-	buf[1] = (uint8_t)QIPROG_ERASE_SUBCMD_CUSTOM;
-	h_to_le16(0, buf + 2);
-	for (i = 0; i < num_bytes; i++) {
-		buf[4 + i*5] = data[i];
-		h_to_le32(addr[i], buf + 4 + i*5);
-	}
+	/* Most significant 16 bits of the memory address to read from */
+	wValue = addr >> 16;
+	/* Least significant 16 bits of the memory address to read from */
+	wIndex = addr & 0xffff;
 
-	ret = libusb_control_transfer(priv->handle, 0x40,
-				      QIPROG_SET_ERASE_COMMAND, 0, wIndex, buf,
-				      4 + num_bytes * 5, 3000);
+	ret = control_transfer(dev, 0x40,
+			       QIPROG_WRITE8, wValue, wIndex,
+			       (void *)&data, sizeof(data), 3000);
 	if (ret < LIBUSB_SUCCESS) {
 		qi_err("Control transfer failed: %s", libusb_error_name(ret));
 		return QIPROG_ERR;
@@ -731,15 +1227,14 @@ static qiprog_err set_custom_erase_command(struct qiprog_device *dev,
 }
 
 /**
- * @brief QiProg driver 'set_write_command' member
+ * @brief QiProg driver 'write16' member
  */
-static qiprog_err set_write_command(struct qiprog_device *dev, uint8_t chip_idx,
-				    enum qiprog_write_cmd cmd,
-				    enum qiprog_write_subcmd subcmd)
+static qiprog_err write16(struct qiprog_device *dev, uint32_t addr,
+			  uint16_t data)
 {
 	int ret;
-	uint16_t wIndex;
 	uint8_t buf[64];
+	uint16_t wValue, wIndex;
 	struct usb_master_priv *priv;
 
 	if (!dev)
@@ -747,17 +1242,17 @@ static qiprog_err set_write_command(struct qiprog_device *dev, uint8_t chip_idx,
 	if (!(priv = dev->priv))
 		return QIPROG_ERR_ARG;
 
-	/* Least significant 16 bits of the QIPROG_BUS_ constant */
-	wIndex = chip_idx;
+	/* Most significant 16 bits of the memory address to read from */
+	wValue = addr >> 16;
+	/* Least significant 16 bits of the memory address to read from */
+	wIndex = addr & 0xffff;
 
 	/* USB is LE, we are host-endian */
-	buf[0] = (uint8_t)cmd;
-	buf[1] = (uint8_t)subcmd;
-	/* bytes 2,3 ignored (?) TODO! */
+	h_to_le16(data, buf);
 
-	ret = libusb_control_transfer(priv->handle, 0x40,
-				      QIPROG_SET_WRITE_COMMAND, 0, wIndex, buf,
-				      0x04, 3000);
+	ret = control_transfer(dev, 0x40,
+			       QIPROG_WRITE16, wValue, wIndex,
+			       (void *)buf, sizeof(data), 3000);
 	if (ret < LIBUSB_SUCCESS) {
 		qi_err("Control transfer failed: %s", libusb_error_name(ret));
 		return QIPROG_ERR;
@@ -767,43 +1262,32 @@ static qiprog_err set_write_command(struct qiprog_device *dev, uint8_t chip_idx,
 }
 
 /**
- * @brief QiProg driver 'set_custom_write_command' member
+ * @brief QiProg driver 'write32' member
  */
-static qiprog_err set_custom_write_command(struct qiprog_device *dev,
-					   uint8_t chip_idx, uint32_t *addr,
-					   uint8_t *data, size_t num_bytes)
+static qiprog_err write32(struct qiprog_device *dev, uint32_t addr,
+			  uint32_t data)
 {
 	int ret;
-	uint16_t wIndex;
 	uint8_t buf[64];
-	size_t i;
+	uint16_t wValue, wIndex;
 	struct usb_master_priv *priv;
 
 	if (!dev)
 		return QIPROG_ERR_ARG;
 	if (!(priv = dev->priv))
 		return QIPROG_ERR_ARG;
-	if (num_bytes == 0)
-		return QIPROG_ERR_ARG;
-	/* We can only fit 12 erase steps in a control packet */
-	if (num_bytes > 12)
-		return QIPROG_ERR_LARGE_ARG;
 
-	/* Least significant 16 bits of the QIPROG_BUS_ constant */
-	wIndex = chip_idx;
+	/* Most significant 16 bits of the memory address to read from */
+	wValue = addr >> 16;
+	/* Least significant 16 bits of the memory address to read from */
+	wIndex = addr & 0xffff;
 
 	/* USB is LE, we are host-endian */
-	buf[0] = (uint8_t)QIPROG_WRITE_CMD_CUSTOM;
-	buf[1] = (uint8_t)QIPROG_WRITE_SUBCMD_CUSTOM;
-	h_to_le16(0, buf + 2);
-	for (i = 0; i < num_bytes; i++) {
-		buf[4 + i*5] = data[i];
-		h_to_le32(addr[i], buf + 4 + i*5);
-	}
+	h_to_le32(data, buf);
 
-	ret = libusb_control_transfer(priv->handle, 0x40,
-				      QIPROG_SET_WRITE_COMMAND, 0, wIndex, buf,
-				      4 + num_bytes * 5, 3000);
+	ret = control_transfer(dev, 0x40,
+			       QIPROG_WRITE32, wValue, wIndex,
+			       (void *)buf, sizeof(data), 3000);
 	if (ret < LIBUSB_SUCCESS) {
 		qi_err("Control transfer failed: %s", libusb_error_name(ret));
 		return QIPROG_ERR;
@@ -812,86 +1296,773 @@ static qiprog_err set_custom_write_command(struct qiprog_device *dev,
 	return QIPROG_SUCCESS;
 }
 
-/*==============================================================================
- *= Bulk transaction handlers
- *----------------------------------------------------------------------------*/
-/** Callback data passed to asynchronous USB transfers */
-struct usb_host_cb_data {
-	/** When the transfers were started */
-	double starttime;
-	/** The total number of bytes transferred up until now */
-	volatile uint32_t *transferred_bytes;
-	/** The number of transfers which are still active */
-	volatile uint32_t *active_transfers;
-	/** The total number of transfers needed to complete the transaction */
-	uint32_t total_transfers;
-	/** Queue depth, or maximum number of concurrent transfers */
-	uint32_t queue_depth;
-	/** The sequential number assigned to this transfer */
-	uint32_t transfer_number;
-};
+/*
+ * Write a value of 'width' bytes to a LE stream
+ */
+static void put_le(uint32_t val, uint8_t width, uint8_t *buf)
+{
+	if (width == sizeof(uint8_t))
+		*buf = val;
+	else if (width == sizeof(uint16_t))
+		h_to_le16(val, buf);
+	else
+		h_to_le32(val, buf);
+}
 
-static inline double get_time()
+/*
+ * Read a value of 'width' bytes from a LE stream
+ */
+static uint32_t get_le(uint8_t width, uint8_t *buf)
 {
-	////struct timespec timer;
-	////clock_gettime(CLOCK_MONOTONIC, &timer);
-	////return (double)timer.tv_sec + (double)(timer.tv_nsec)/1E9;
-	return 0.0;
+	if (width == sizeof(uint8_t))
+		return *buf;
+	else if (width == sizeof(uint16_t))
+		return le16_to_h(buf);
+	return le32_to_h(buf);
 }
 
-static void async_cb(struct libusb_transfer *transfer)
+/**
+ * @brief QiProg driver 'exec_batch' member
+ *
+ * As many operations as fit in a control packet are sent with one request. If
+ * any of them are reads, the results come back with a second request. Longer
+ * batches are split in as many such pairs as needed.
+ */
+static qiprog_err exec_batch(struct qiprog_device *dev, struct qiprog_op *ops,
+			     size_t num_ops)
 {
 	int ret;
-	double endtime, time, avg_speed;
-	struct usb_host_cb_data *cb_data = transfer->user_data;
-	const uint32_t next = cb_data->transfer_number + cb_data->queue_depth;
+	size_t first, last, i;
+	uint8_t width, op_len, res_width;
+	uint16_t cmd_len, res_len;
+	uint32_t delay_us;
+	uint8_t cmd[QIPROG_BATCH_MAX_LEN], res[QIPROG_BATCH_MAX_LEN];
+	struct usb_master_priv *priv;
 
-	/*
-	 * Error handling
-	 */
-	ret = QIPROG_SUCCESS;
-	/* A failed transfer can mess up the data, so halt if we meet one */
-	if (transfer->status != LIBUSB_TRANSFER_COMPLETED) {
-		qi_err("Transfer failed: %s",
-		       libusb_error_name(transfer->status));
-		/* FIXME: How to exit elegantly? */
-		ret = QIPROG_ERR;
+	if (!dev)
+		return QIPROG_ERR_ARG;
+	if (!(priv = dev->priv))
+		return QIPROG_ERR_ARG;
+
+	for (first = 0; first < num_ops; first = last) {
+		cmd_len = res_len = 0;
+		delay_us = 0;
+
+		/* Pack as many operations as fit in one request */
+		for (last = first; last < num_ops; last++) {
+			struct qiprog_op *op = &ops[last];
+
+			width = qiprog_op_width(op->type);
+			if (!width && (op->type != QIPROG_OP_DELAY_US))
+				return QIPROG_ERR_ARG;
+
+			op_len = QIPROG_BATCH_OP_LEN;
+			op_len += qiprog_op_is_write(op->type) ? width : 0;
+			res_width = qiprog_op_is_read(op->type) ? width : 0;
+			if ((cmd_len + op_len > sizeof(cmd)) ||
+			    (res_len + res_width > sizeof(res)))
+				break;
+
+			/* USB is LE, we are host-endian */
+			cmd[cmd_len] = op->type;
+			h_to_le32(op->addr, cmd + cmd_len + 1);
+			if (qiprog_op_is_write(op->type))
+				put_le(op->data, width,
+				       cmd + cmd_len + QIPROG_BATCH_OP_LEN);
+			if (op->type == QIPROG_OP_DELAY_US)
+				delay_us += op->addr;
+
+			cmd_len += op_len;
+			res_len += res_width;
+		}
+
+		qi_spew("Sending batch of %zu operations", last - first);
+
+		/* The device only answers once it has waited for the delays */
+		ret = control_transfer(dev, 0x40,
+				       QIPROG_EXEC_BATCH, 0, 0, cmd,
+				       cmd_len, 3000 + delay_us / 1000);
+		if (ret < LIBUSB_SUCCESS) {
+			qi_err("Control transfer failed: %s",
+			       libusb_error_name(ret));
+			return QIPROG_ERR;
+		}
+
+		if (!res_len)
+			continue;
+
+		ret = control_transfer(dev, 0xc0,
+				       QIPROG_GET_BATCH_RESULT, 0, 0,
+				       res, res_len, 3000);
+		if (ret < LIBUSB_SUCCESS) {
+			qi_err("Control transfer failed: %s",
+			       libusb_error_name(ret));
+			return QIPROG_ERR;
+		}
+		if (ret != res_len) {
+			qi_err("Device returned %i bytes of results, "
+			       "expected %u", ret, res_len);
+			return QIPROG_ERR;
+		}
+
+		/* Results come in the order of the reads */
+		for (i = first, res_len = 0; i < last; i++) {
+			if (!qiprog_op_is_read(ops[i].type))
+				continue;
+			width = qiprog_op_width(ops[i].type);
+			ops[i].data = get_le(width, res + res_len);
+			res_len += width;
+		}
+	}
+
+	return QIPROG_SUCCESS;
+}
+
+/**
+ * @brief QiProg driver 'delay_us' member
+ *
+ * Every bus cycle is its own round trip, so waiting on the host side is just
+ * as good.
+ */
+static qiprog_err delay_us(struct qiprog_device *dev, uint32_t us)
+{
+	struct timespec ts;
+
+	(void)dev;
+
+	ts.tv_sec = us / 1000000;
+	ts.tv_nsec = (us % 1000000) * 1000;
+	while (nanosleep(&ts, &ts) != 0)
+		;
+
+	return QIPROG_SUCCESS;
+}
+
+/**
+ * @brief QiProg driver 'run_program' member
+ *
+ * The program goes out on EP 2 OUT, prefixed by its length. The device answers
+ * on EP 2 IN with a status header followed by the output of the program. If
+ * the device does not understand the instruction set, the program is run here,
+ * one bus cycle at a time.
+ */
+static qiprog_err run_program(struct qiprog_device *dev, void *prog,
+			      uint16_t len, void *out, uint16_t max_out,
+			      uint16_t *out_len)
+{
+	int ret, xfered, ep_size;
+	size_t res_size;
+	uint16_t res_len;
+	uint8_t *buf;
+	qiprog_err status;
+	struct qiprog_capabilities caps;
+	struct usb_master_priv *priv;
+
+	if (!dev)
+		return QIPROG_ERR_ARG;
+	if (!(priv = dev->priv))
+		return QIPROG_ERR_ARG;
+
+	if (!priv->caps_valid && (get_capabilities(dev, &caps)
+				  != QIPROG_SUCCESS))
+		return QIPROG_ERR;
+
+	if (!(priv->instruction_set & QIPROG_LANG_BUS))
+		return qiprog_isa_exec(dev, prog, len, out, max_out, out_len);
+
+	if (len > priv->max_direct_data)
+		return QIPROG_ERR_LARGE_ARG;
+
+	if ((ep_size = libusb_get_max_packet_size(priv->usb_dev, 0x82)) <= 0) {
+		qi_err("Could not get endpoint size");
+		return QIPROG_ERR;
+	}
+
+	/*
+	 * Same buffer for the program going out, and the answer coming in. The
+	 * device pads answers of whole packets with one byte. Leave room for a
+	 * packet more than the largest answer, so the padding is never left
+	 * behind for the next program to read.
+	 */
+	res_size = QIPROG_ISA_HEADER_LEN + priv->max_direct_data;
+	res_size = ((res_size + ep_size - 1) / ep_size + 1) * ep_size;
+	if (!(buf = malloc(MAX(res_size, (size_t)len + 2))))
+		return QIPROG_ERR_MALLOC;
+
+	/* USB is LE, we are host-endian */
+	h_to_le16(len, buf);
+	memcpy(buf + 2, prog, len);
+
+	status = QIPROG_ERR;
+	ret = libusb_bulk_transfer(priv->handle, 0x02, buf, len + 2,
+				   &xfered, 3000);
+	if ((ret != LIBUSB_SUCCESS) || (xfered != len + 2)) {
+		qi_err("Could not send program: %s", libusb_error_name(ret));
+		goto cleanup;
+	}
+
+	/* The device only answers once the program is done */
+	ret = libusb_bulk_transfer(priv->handle, 0x82, buf, res_size,
+				   &xfered, 60000);
+	if ((ret != LIBUSB_SUCCESS) || (xfered < QIPROG_ISA_HEADER_LEN)) {
+		qi_err("No answer to program: %s", libusb_error_name(ret));
+		goto cleanup;
+	}
+
+	status = (int8_t)buf[0];
+	res_len = le16_to_h(buf + 2);
+	if (res_len > xfered - QIPROG_ISA_HEADER_LEN) {
+		qi_err("Device sent %i bytes of output, but claims %u",
+		       xfered - QIPROG_ISA_HEADER_LEN, res_len);
+		status = QIPROG_ERR;
+		goto cleanup;
+	}
+
+	/* Keep what fits, but let the caller know there was more */
+	*out_len = MIN(res_len, max_out);
+	memcpy(out, buf + QIPROG_ISA_HEADER_LEN, *out_len);
+	if ((status == QIPROG_SUCCESS) && (res_len > max_out))
+		status = QIPROG_ERR_LARGE_ARG;
+
+ cleanup:
+	free(buf);
+	return status;
+}
+
+/**
+ * @brief Tell the programmer what address range we want to operate on
+ *
+ * Bulk operations call this with priv->lock held. The lock is recursive, so
+ * taking it again here is fine.
+ */
+static qiprog_err set_address(struct qiprog_device *dev, uint32_t start,
+			      uint32_t end)
+{
+	int ret;
+	uint8_t buf[64];
+	struct usb_master_priv *priv;
+
+	if (!dev)
+		return QIPROG_ERR_ARG;
+	if (!(priv = dev->priv))
+		return QIPROG_ERR_ARG;
+
+	pthread_mutex_lock(&priv->lock);
+	/* The device pointers are in flux until the current operation ends */
+	if (priv->op.busy) {
+		pthread_mutex_unlock(&priv->lock);
+		return QIPROG_ERR_BUSY;
+	}
+
+	qi_spew("Setting address range 0x%.8x -> 0x%.8x\n", start, end);
+
+	/*
+	 * Contents of the buffer are no longer valid. Device will start to
+	 * read at the new address. We get those contents with the next readn()
+	 * call.
+	 */
+	priv->buflen = 0;
+
+	/* USB is LE, we are host-endian */
+	h_to_le32(start, buf + 0);
+	h_to_le32(end, buf + 4);
+
+	/* wIndex picks the chip, for programmers with more than one */
+	ret = control_transfer(dev, 0x40,
+			       QIPROG_SET_ADDRESS, 0, dev->chip_idx,
+			       (void *)buf, 0x08, 3000);
+	if (ret < LIBUSB_SUCCESS) {
+		qi_err("Control transfer failed: %s", libusb_error_name(ret));
+		pthread_mutex_unlock(&priv->lock);
+		return QIPROG_ERR;
+	}
+
+	/* We have successfully set the address, now keep track of it */
+	dev->addr.end = end;
+	/* Read and write pointers are reset when setting a new range */
+	dev->addr.pread = dev->addr.pwrite = dev->addr.start = start;
+	pthread_mutex_unlock(&priv->lock);
+
+	return QIPROG_SUCCESS;
+}
+
+/**
+ * @brief QiProg driver 'set_erase_size' member
+ */
+static qiprog_err set_erase_size(struct qiprog_device *dev, uint8_t chip_idx,
+				 enum qiprog_erase_type *types, uint32_t *sizes,
+				 size_t num_sizes)
+{
+	int ret;
+	uint16_t wIndex;
+	uint8_t buf[64];
+	size_t i;
+	struct usb_master_priv *priv;
+
+	if (!dev)
+		return QIPROG_ERR_ARG;
+	if (!(priv = dev->priv))
+		return QIPROG_ERR_ARG;
+	if (num_sizes == 0)
+		return QIPROG_ERR_ARG;
+	/* We can only fit 12 erase sizes in a control packet */
+	if (num_sizes > 12)
+		return QIPROG_ERR_LARGE_ARG;
+
+	/* Least significant 16 bits of the QIPROG_BUS_ constant */
+	wIndex = chip_idx;
+
+	/* USB is LE, we are host-endian */
+	for (i = 0; i < num_sizes; i++) {
+		buf[i*5] = (uint8_t)types[i];
+		h_to_le32(sizes[i], buf + i*5 + 1);
+	}
+
+	ret = control_transfer(dev, 0x40, QIPROG_SET_ERASE_SIZE,
+			       0, wIndex, buf, num_sizes * 5, 3000);
+	if (ret < LIBUSB_SUCCESS) {
+		qi_err("Control transfer failed: %s", libusb_error_name(ret));
+		return QIPROG_ERR;
+	}
+
+	return QIPROG_SUCCESS;
+}
+
+/**
+ * @brief QiProg driver 'set_erase_command' member
+ */
+static qiprog_err set_erase_command(struct qiprog_device *dev, uint8_t chip_idx,
+				    enum qiprog_erase_cmd cmd,
+				    enum qiprog_erase_subcmd subcmd,
+				    uint16_t flags)
+{
+	int ret;
+	uint16_t wIndex;
+	uint8_t buf[64];
+	struct usb_master_priv *priv;
+
+	if (!dev)
+		return QIPROG_ERR_ARG;
+	if (!(priv = dev->priv))
+		return QIPROG_ERR_ARG;
+
+	/* Least significant 16 bits of the QIPROG_BUS_ constant */
+	wIndex = chip_idx;
+
+	/* USB is LE, we are host-endian */
+	buf[0] = (uint8_t)cmd;
+	buf[1] = (uint8_t)subcmd;
+	h_to_le16(flags, buf + 2);
+
+	ret = control_transfer(dev, 0x40,
+			       QIPROG_SET_ERASE_COMMAND, 0, wIndex, buf,
+			       0x04, 3000);
+	if (ret < LIBUSB_SUCCESS) {
+		qi_err("Control transfer failed: %s", libusb_error_name(ret));
+		return QIPROG_ERR;
+	}
+
+	return QIPROG_SUCCESS;
+}
+
+/**
+ * @brief QiProg driver 'set_custom_erase_command' member
+ */
+static qiprog_err set_custom_erase_command(struct qiprog_device *dev,
+					   uint8_t chip_idx, uint32_t *addr,
+					   uint8_t *data, size_t num_bytes)
+{
+	int ret;
+	uint16_t wIndex;
+	uint8_t buf[64];
+	size_t i;
+	struct usb_master_priv *priv;
+
+	if (!dev)
+		return QIPROG_ERR_ARG;
+	if (!(priv = dev->priv))
+		return QIPROG_ERR_ARG;
+	if (num_bytes == 0)
+		return QIPROG_ERR_ARG;
+	/* We can only fit 12 erase steps in a control packet */
+	if (num_bytes > 12)
+		return QIPROG_ERR_LARGE_ARG;
+
+	/* Least significant 16 bits of the QIPROG_BUS_ constant */
+	wIndex = chip_idx;
+
+	/* USB is LE, we are host-endian */
+	buf[0] = (uint8_t)QIPROG_ERASE_CMD_CUSTOM;
+	buf[1] = (uint8_t)QIPROG_ERASE_SUBCMD_CUSTOM;
+	h_to_le16(0, buf + 2);
+	for (i = 0; i < num_bytes; i++) {
+		buf[4 + i*5] = data[i];
+		h_to_le32(addr[i], buf + 4 + i*5);
+	}
+
+	ret = control_transfer(dev, 0x40,
+			       QIPROG_SET_ERASE_COMMAND, 0, wIndex, buf,
+			       4 + num_bytes * 5, 3000);
+	if (ret < LIBUSB_SUCCESS) {
+		qi_err("Control transfer failed: %s", libusb_error_name(ret));
+		return QIPROG_ERR;
+	}
+
+	return QIPROG_SUCCESS;
+}
+
+/**
+ * @brief QiProg driver 'set_write_command' member
+ */
+static qiprog_err set_write_command(struct qiprog_device *dev, uint8_t chip_idx,
+				    enum qiprog_write_cmd cmd,
+				    enum qiprog_write_subcmd subcmd)
+{
+	int ret;
+	uint16_t wIndex;
+	uint8_t buf[64];
+	struct usb_master_priv *priv;
+
+	if (!dev)
+		return QIPROG_ERR_ARG;
+	if (!(priv = dev->priv))
+		return QIPROG_ERR_ARG;
+
+	/* Least significant 16 bits of the QIPROG_BUS_ constant */
+	wIndex = chip_idx;
+
+	/* USB is LE, we are host-endian */
+	buf[0] = (uint8_t)cmd;
+	buf[1] = (uint8_t)subcmd;
+	/* bytes 2,3 ignored (?) TODO! */
+
+	ret = control_transfer(dev, 0x40,
+			       QIPROG_SET_WRITE_COMMAND, 0, wIndex, buf,
+			       0x04, 3000);
+	if (ret < LIBUSB_SUCCESS) {
+		qi_err("Control transfer failed: %s", libusb_error_name(ret));
+		return QIPROG_ERR;
+	}
+
+	return QIPROG_SUCCESS;
+}
+
+/**
+ * @brief QiProg driver 'set_custom_write_command' member
+ */
+static qiprog_err set_custom_write_command(struct qiprog_device *dev,
+					   uint8_t chip_idx, uint32_t *addr,
+					   uint8_t *data, size_t num_bytes)
+{
+	int ret;
+	uint16_t wIndex;
+	uint8_t buf[64];
+	size_t i;
+	struct usb_master_priv *priv;
+
+	if (!dev)
+		return QIPROG_ERR_ARG;
+	if (!(priv = dev->priv))
+		return QIPROG_ERR_ARG;
+	if (num_bytes == 0)
+		return QIPROG_ERR_ARG;
+	/* We can only fit 12 erase steps in a control packet */
+	if (num_bytes > 12)
+		return QIPROG_ERR_LARGE_ARG;
+
+	/* Least significant 16 bits of the QIPROG_BUS_ constant */
+	wIndex = chip_idx;
+
+	/* USB is LE, we are host-endian */
+	buf[0] = (uint8_t)QIPROG_WRITE_CMD_CUSTOM;
+	buf[1] = (uint8_t)QIPROG_WRITE_SUBCMD_CUSTOM;
+	h_to_le16(0, buf + 2);
+	for (i = 0; i < num_bytes; i++) {
+		buf[4 + i*5] = data[i];
+		h_to_le32(addr[i], buf + 4 + i*5);
+	}
+
+	ret = control_transfer(dev, 0x40,
+			       QIPROG_SET_WRITE_COMMAND, 0, wIndex, buf,
+			       4 + num_bytes * 5, 3000);
+	if (ret < LIBUSB_SUCCESS) {
+		qi_err("Control transfer failed: %s", libusb_error_name(ret));
+		return QIPROG_ERR;
+	}
+
+	return QIPROG_SUCCESS;
+}
+
+/**
+ * @brief QiProg driver 'set_read_command' member
+ */
+static qiprog_err set_read_command(struct qiprog_device *dev, uint8_t chip_idx,
+				   enum qiprog_read_cmd cmd)
+{
+	int ret;
+	struct usb_master_priv *priv;
+	struct qiprog_capabilities caps;
+
+	if (!dev)
+		return QIPROG_ERR_ARG;
+	if (!(priv = dev->priv))
+		return QIPROG_ERR_ARG;
+
+	/* Devices which predate read commands would not know this request */
+	if (!priv->caps_valid && (get_capabilities(dev, &caps)
+				  != QIPROG_SUCCESS))
+		return QIPROG_ERR;
+	if ((cmd != QIPROG_READ_CMD_NORMAL) &&
+	    !(priv->read_cmds & QIPROG_READ_CMD_BIT(cmd)))
+		return QIPROG_ERR;
+	if (!priv->read_cmds)
+		return QIPROG_SUCCESS;
+
+	ret = control_transfer(dev, 0x40, QIPROG_SET_READ_COMMAND, cmd,
+			       chip_idx, NULL, 0, 3000);
+	if (ret < LIBUSB_SUCCESS) {
+		qi_err("Control transfer failed: %s", libusb_error_name(ret));
+		return QIPROG_ERR;
+	}
+
+	return QIPROG_SUCCESS;
+}
+
+/*==============================================================================
+ *= Bulk transaction handlers
+ *----------------------------------------------------------------------------*/
+/**
+ * @brief Point a transfer at the data for its place in the operation
+ *
+ * Transfers are numbered sequentially. All but the last carry whole packets.
+ * If the operation does not end on a packet boundary, one more transfer moves
+ * the leftover bytes. For reads, the leftover transfer asks for a whole packet
+ * into priv->buf, since the device may have more data to give us.
+ */
+static void setup_transfer(struct usb_bulk_op *op,
+			   struct libusb_transfer *transfer, uint32_t number)
+{
+	const uint32_t offset = number * op->transfer_size;
+	struct usb_master_priv *priv = op->dev->priv;
+
+	if (offset < op->len) {
+		transfer->buffer = op->data + offset;
+		/* The last transfer only carries what is left */
+		transfer->length = MIN(op->transfer_size, op->len - offset);
+	} else if (op->ep & 0x80) {
+		transfer->buffer = priv->buf;
+		transfer->length = priv->ep_size_in;
+	} else {
+		transfer->buffer = op->data + op->len;
+		transfer->length = op->tail_len;
+	}
+}
+
+/**
+ * @brief Number of bytes of the user's request which have made it so far
+ */
+static uint32_t bulk_op_done(struct usb_bulk_op *op)
+{
+	uint32_t whole;
+	const uint32_t len = op->len + op->tail_len;
+
+	if (!op->src_ends)
+		return op->done_before + MIN(op->transferred_bytes, len);
+	if (op->transferred_bytes >= len)
+		return op->total;
+
+	/* Transfers come back in order, and only whole ones count */
+	whole = op->transferred_bytes / op->transfer_size;
+	return op->done_before + (whole ? op->src_ends[whole - 1] : 0);
+}
+
+/**
+ * @brief Get back the transfers of a bulk operation which are still out
+ *
+ * They come back to async_cb() as cancelled, and the operation finishes once
+ * the last one is in. Transfers which are not out are left alone by libusb.
+ */
+static void cancel_bulk_op(struct usb_bulk_op *op)
+{
+	uint32_t i;
+	struct usb_master_priv *priv = op->dev->priv;
+
+	for (i = 0; i < op->queue_depth; i++)
+		libusb_cancel_transfer(priv->transfers[i]);
+}
+
+/**
+ * @brief Stop a bulk operation at its first failure
+ *
+ * Once one transfer failed, the ones after it are of no use, and more data
+ * should not pile up on top. Whatever came in before the failure is kept in
+ * the checkpoint, so the operation can be resumed from there.
+ */
+static void fail_bulk_op(struct usb_bulk_op *op)
+{
+	if (op->status != QIPROG_SUCCESS)
+		return;
+
+	op->status = QIPROG_ERR;
+	cancel_bulk_op(op);
+}
+
+/**
+ * @brief Wrap up a bulk operation once every transfer has come back
+ */
+static void finish_bulk_op(struct usb_bulk_op *op)
+{
+	uint32_t extra;
+	struct qiprog_device *dev = op->dev;
+	struct usb_master_priv *priv = dev->priv;
+
+	if ((op->status == QIPROG_SUCCESS) &&
+	    (op->transferred_bytes < op->len + op->tail_len)) {
+		qi_warn("Only transferred %i bytes of %i bytes",
+			op->transferred_bytes, op->len + op->tail_len);
+		op->status = QIPROG_ERR;
+	}
+
+	if (op->status != QIPROG_SUCCESS) {
+		/*
+		 * We no longer know where the device's pointers are. Make sure
+		 * the next operation starts with a set_address.
+		 */
+		priv->buflen = 0;
+		dev->addr.end = 0;
+	} else if (op->ep & 0x80) {
+		/* Update address range to reflect the read bytes */
+		dev->addr.pread += op->transferred_bytes;
+		if (op->tail_len) {
+			/* Move the leftover data to the user's memory region */
+			extra = op->transferred_bytes - op->len;
+			memcpy(op->data + op->len, priv->buf, op->tail_len);
+			/* And keep the rest at the start of our buffer */
+			priv->buflen = extra - op->tail_len;
+			memmove(priv->buf, priv->buf + op->tail_len,
+				priv->buflen);
+		}
+	} else {
+		/* Update address range to reflect the programmed bytes */
+		dev->addr.pwrite += bulk_op_done(op) - op->done_before;
+	}
+
+	if (op->status == QIPROG_SUCCESS)
+		dev->checkpoint.done = bulk_op_done(op);
+	dev->stats.bulk_time_us += qi_time_us() - op->starttime;
+
+	/* Clear busy first, so the callback can start another operation */
+	op->busy = false;
+	op->completed = 1;
+	pthread_cond_broadcast(&priv->done);
+	if (op->cb)
+		op->cb(dev, QIPROG_TRANSFER_COMPLETE, op->status,
+		       bulk_op_done(op), op->total, op->user_data);
+}
+
+static void async_cb(struct libusb_transfer *transfer)
+{
+	struct usb_host_cb_data *cb_data = transfer->user_data;
+	struct usb_bulk_op *op = cb_data->op;
+	const uint32_t next = cb_data->transfer_number + op->queue_depth;
+	const uint32_t offset = cb_data->transfer_number * op->transfer_size;
+	struct usb_master_priv *priv = op->dev->priv;
+	struct qiprog_stats *stats = &op->dev->stats;
+
+	/* The user's thread may still be submitting the first transfers */
+	pthread_mutex_lock(&priv->lock);
+
+	/* The operation was over long ago, and a new one may be running */
+	if (cb_data->lost) {
+		pthread_mutex_unlock(&priv->lock);
+		return;
 	}
 
-	if (transfer->actual_length != transfer->length) {
-		/* FIXME: This can be serious. figure out how to handle */
+	/*
+	 * Error handling
+	 */
+	/* A failed transfer can mess up the data, so halt if we meet one */
+	if (transfer->status == LIBUSB_TRANSFER_CANCELLED) {
+		/* We did that, because another transfer failed */
+		qi_spew("Transfer %u cancelled", cb_data->transfer_number);
+	} else if (transfer->status != LIBUSB_TRANSFER_COMPLETED) {
+		qi_err("Transfer failed: %s",
+		       libusb_error_name(transfer->status));
+		if (transfer->status == LIBUSB_TRANSFER_STALL)
+			priv->stalled |= 1 << (op->ep >> 7);
+		fail_bulk_op(op);
+	} else if (offset >= op->len) {
+		/* We should get at least the leftover bytes */
+		if (transfer->actual_length < (int)op->tail_len) {
+			qi_err("Received less data than expected.");
+			stats->short_transfers++;
+			fail_bulk_op(op);
+		}
+	} else if (transfer->actual_length != transfer->length) {
+		/* The operation is resumed from the start of this transfer */
 		qi_warn("Transfer of %u bytes only brought %u bytes",
 			transfer->length, transfer->actual_length);
-		ret = QIPROG_ERR;
+		stats->short_transfers++;
+		fail_bulk_op(op);
 	}
 
 	/*
-	 * Print timing information
+	 * Transfers on the endpoint come back in order. If none failed so far,
+	 * everything up to the end of this one made it.
 	 */
-	endtime = get_time();
-	time = endtime - cb_data->starttime;
-	*(cb_data->transferred_bytes) += transfer->actual_length;
+	if ((op->status == QIPROG_SUCCESS) && (offset < op->len))
+		op->dev->checkpoint.done = op->done_before + (op->src_ends ?
+			op->src_ends[cb_data->transfer_number] :
+			offset + transfer->actual_length);
 
-	avg_speed = *(cb_data->transferred_bytes) / time;
-	(void)avg_speed;
+	/*
+	 * Account for the data. Throughput is up to the callback and the
+	 * stats, see qiprog_get_stats().
+	 */
+	op->transferred_bytes += transfer->actual_length;
+	if (op->ep & 0x80) {
+		stats->transfers_in++;
+		stats->bytes_in += transfer->actual_length;
+	} else {
+		stats->transfers_out++;
+		stats->bytes_out += transfer->actual_length;
+	}
 
-	////printf("\rSpeed %.1f KiB/s", avg_speed/1024);
-	////fflush(stdout);
+	if (op->cb && (op->status == QIPROG_SUCCESS))
+		op->cb(op->dev, QIPROG_TRANSFER_PROGRESS, QIPROG_SUCCESS,
+		       bulk_op_done(op), op->total, op->user_data);
 
 	/*
-	 * Resubmit another transfer if needed
+	 * Resubmit another transfer if needed. Once one transfer failed, let
+	 * the others drain instead of piling more data on top.
 	 */
-	if ((next < cb_data->total_transfers) && (ret == QIPROG_SUCCESS)) {
+	if ((next < op->total_transfers) && (op->status == QIPROG_SUCCESS)) {
 		cb_data->transfer_number = next;
-		transfer->buffer += transfer->length * cb_data->queue_depth;
+		setup_transfer(op, transfer, next);
 		if (libusb_submit_transfer(transfer) != LIBUSB_SUCCESS) {
 			qi_err("Failed to resubmit transfer");
-			(*(cb_data->active_transfers))--;
+			stats->resubmit_failures++;
+			fail_bulk_op(op);
+			op->active_transfers--;
 		}
 	} else {
-		/* Careful how we dereference this one !!! */
-		(*(cb_data->active_transfers))--;
+		op->active_transfers--;
 	}
+
+	if (op->active_transfers == 0)
+		finish_bulk_op(op);
+
+	pthread_mutex_unlock(&priv->lock);
+}
+
+/**
+ * @brief Size of the transfers of a bulk operation, in whole packets
+ */
+static uint32_t bulk_transfer_size(struct usb_master_priv *priv,
+				   uint16_t ep_size)
+{
+	return MAX((priv->transfer_size / ep_size) * ep_size,
+		   (uint32_t)ep_size);
 }
 
 /*
@@ -899,110 +2070,230 @@ static void async_cb(struct libusb_transfer *transfer)
  * direction is given by the ep parameter. We do not do anything to distinguish
  * between IN and OUT transactions, hence why we can use this function for
  * either case.
+ *
+ * The transfers are taken from the pool allocated when the device was opened.
+ * Each transfer packs as many whole packets as fit in priv->transfer_size.
+ *
+ * The operation runs in the background. When it finishes, 'cb' is called with
+ * QIPROG_TRANSFER_COMPLETE. If there is nothing to transfer, that happens
+ * before this function returns. 'done_before' and 'total' are only used to
+ * report progress for the whole of the user's request.
+ *
+ * Encoded data comes with 'src_ends', which tells how much of the user's data
+ * each transfer carries, see bulk_transfer_size().
  */
-static int do_async_bulk_transfers(libusb_context *usb_ctx,
-				   libusb_device_handle *handle,
-				   unsigned char ep, uint16_t ep_size,
-				   void *data, uint32_t n)
+static qiprog_err start_bulk_op(struct qiprog_device *dev, unsigned char ep,
+				uint16_t ep_size, void *data, uint32_t n,
+				uint32_t done_before, uint32_t total,
+				const uint32_t *src_ends,
+				qiprog_transfer_cb cb, void *user_data)
 {
 	int ret;
-	size_t i;
-	uint8_t *curr_buf;
-	volatile double starttime;
-	volatile uint32_t transferred_bytes;
-	volatile uint32_t active_transfers;
-	struct libusb_transfer *transfers[MAX_CONCURRENT_TRANSFERS];
-	struct usb_host_cb_data cbds[MAX_CONCURRENT_TRANSFERS];
+	uint32_t i, depth, whole_transfers;
+	struct usb_master_priv *priv = dev->priv;
+	struct usb_bulk_op *op = &priv->op;
+	struct libusb_transfer **transfers = priv->transfers;
+	struct usb_host_cb_data *cbds = priv->cb_data;
 
-	const uint32_t transz = ep_size;
-	/* Intentionally round down. Leftover packets are not handled here */
-	const uint32_t total = n / transz;
-	const uint32_t depth = MIN(total , MAX_CONCURRENT_TRANSFERS);
+	if (op->busy)
+		return QIPROG_ERR_BUSY;
 
-	/*
-	 * We transfer in multiples of ep_size. When there is a leftover packet,
-	 * we don't transfer it here, so we may end up with zero transfers for
-	 * small enough transfers.
-	 */
-	if (total == 0)
+	if (priv->pool_size == 0) {
+		qi_err("No transfers available. Was the device opened?");
+		return QIPROG_ERR;
+	}
+
+	op->dev = dev;
+	op->ep = ep;
+	op->data = data;
+	/* Whole packets go in big transfers, leftover bytes in a last one */
+	op->len = (n / ep_size) * ep_size;
+	op->tail_len = n - op->len;
+	op->transfer_size = bulk_transfer_size(priv, ep_size);
+	op->src_ends = src_ends;
+	whole_transfers = (op->len + op->transfer_size - 1) / op->transfer_size;
+	op->total_transfers = whole_transfers + (op->tail_len ? 1 : 0);
+	op->done_before = done_before;
+	op->total = total;
+	op->cb = cb;
+	op->user_data = user_data;
+	op->status = QIPROG_SUCCESS;
+	op->transferred_bytes = 0;
+	op->completed = 0;
+	op->busy = true;
+	dev->checkpoint.done = done_before;
+
+	/* A stalled endpoint stays halted until it is told otherwise */
+	if (priv->stalled & (1 << (ep >> 7))) {
+		qi_info("Clearing halt on endpoint 0x%.2x", ep);
+		libusb_clear_halt(priv->handle, ep);
+		priv->stalled &= ~(1 << (ep >> 7));
+	}
+
+	depth = MIN(op->total_transfers, priv->pool_size);
+	op->queue_depth = depth;
+	op->active_transfers = depth;
+
+	if (depth == 0) {
+		finish_bulk_op(op);
 		return QIPROG_SUCCESS;
+	}
 
 	/*
 	 * Submit initial transfers
 	 * The transfers will re-submit themselves when completed
 	 */
-	qi_info("Starting %i transfers of %i bytes each", total, transz);
+	qi_info("Starting %i transfers of up to %i bytes each",
+		op->total_transfers, op->transfer_size);
 
-	active_transfers = depth;
-	transferred_bytes = 0;
-	starttime = get_time();
+	op->starttime = qi_time_us();
 
 	for (i = 0; i < depth; i++) {
-		/* FIXME: Handle alloc failures, don't just crash */
-		transfers[i] = libusb_alloc_transfer(0);
-		curr_buf = data + transz * i;
-		cbds[i].starttime = starttime;
-		cbds[i].active_transfers = &active_transfers;
-		cbds[i].transferred_bytes = &transferred_bytes;
-		cbds[i].total_transfers = total;
-		cbds[i].queue_depth = depth;
+		cbds[i].op = op;
 		cbds[i].transfer_number = i;
 
-		libusb_fill_bulk_transfer(transfers[i], handle, ep, curr_buf,
-					  transz, async_cb, (void*)&cbds[i],
+		libusb_fill_bulk_transfer(transfers[i], priv->handle, ep,
+					  NULL, 0, async_cb, (void*)&cbds[i],
 					  3000);
+		setup_transfer(op, transfers[i], i);
 		ret = libusb_submit_transfer(transfers[i]);
 		if (ret != LIBUSB_SUCCESS) {
 			qi_err("Error submitting transfer: %s",
 			       libusb_error_name(ret));
-			/* FIXME: cleanup, don't just exit */
-			return QIPROG_ERR;
+			op->status = QIPROG_ERR;
+			/* The ones we did not submit will never come back */
+			op->active_transfers -= depth - i;
+			break;
 		}
 	}
 
-	/*
-	 * Block until all transfers come back
-	 */
-	while (active_transfers) {
-		ret =  libusb_handle_events(usb_ctx);
-		if (ret != LIBUSB_SUCCESS) {
-			qi_err("Error: %s\n", libusb_error_name(ret));
-			/* FIXME: cleanup, don't just exit */
-			return QIPROG_ERR;
-		}
+	/* Nothing went out, so nothing will come back to report the error */
+	if (i == 0) {
+		op->busy = false;
+		op->completed = 1;
+		return QIPROG_ERR;
 	}
 
-	if (transferred_bytes != n) {
-		qi_warn("Only transferred %i bytes of %i bytes",
-			transferred_bytes, n);
-		/* FIXME: cleanup, don't just exit */
-		return QIPROG_ERR;
+	return QIPROG_SUCCESS;
+}
+
+/**
+ * @brief Wait for the event thread to complete the bulk operation, for a while
+ *
+ * Must be called with priv->lock held. Returns after EVENT_THREAD_WAIT_MS at
+ * the latest, in case the thread was stopped in the meantime.
+ */
+static void wait_event_thread(struct usb_master_priv *priv)
+{
+	struct timespec deadline;
+
+	clock_gettime(CLOCK_REALTIME, &deadline);
+	deadline.tv_nsec += EVENT_THREAD_WAIT_MS * 1000000L;
+	if (deadline.tv_nsec >= 1000000000L) {
+		deadline.tv_sec++;
+		deadline.tv_nsec -= 1000000000L;
 	}
 
-	/* FIXME: cleanup, cleanup, cleanup */
+	pthread_cond_timedwait(&priv->done, &priv->lock, &deadline);
+}
 
-	return QIPROG_SUCCESS;
+/**
+ * @brief Give up on the transfers of a bulk operation which did not come back
+ *
+ * Must be called with priv->lock held. libusb still owns the transfers, so
+ * they can neither be freed nor used again. They are left to libusb, and a new
+ * pool takes their place. If they ever come back, async_cb() ignores them.
+ *
+ * The operation then ends as failed, with its checkpoint as it was, so that it
+ * can be resumed.
+ */
+static void abandon_bulk_op(struct usb_bulk_op *op)
+{
+	uint32_t i;
+	struct usb_master_priv *priv = op->dev->priv;
+
+	qi_err("Giving up on %u transfers", op->active_transfers);
+
+	for (i = 0; i < priv->pool_size; i++)
+		priv->cb_data[i].lost = true;
+	/* Not freed, since libusb may still write to them */
+	priv->transfers = NULL;
+	priv->cb_data = NULL;
+	priv->pool_size = 0;
+	alloc_transfer_pool(priv);
+
+	op->status = QIPROG_ERR;
+	op->active_transfers = 0;
+	finish_bulk_op(op);
 }
 
 /**
- * @brief QiProg driver 'read' member
+ * @brief Block until the bulk operation in progress on a device finishes
+ *
+ * If the context runs an event thread, we only wait for it to complete the
+ * operation. Otherwise we handle events ourselves.
+ *
+ * If events cannot be handled, the operation is cancelled, and we keep trying
+ * until its transfers are back. After EVENT_RETRIES failures, the transfers
+ * are abandoned, and the operation fails.
  */
-static qiprog_err read(struct qiprog_device *dev, uint32_t where, void *dest,
-		       uint32_t n)
+static qiprog_err wait_bulk_op(struct qiprog_device *dev)
 {
-	int ret, left, len;
-	size_t copysz, range;
-	struct usb_master_priv *priv;
+	int ret, failures = 0;
+	uint64_t start;
+	qiprog_err status;
+	struct qiprog_context *ctx = dev->ctx;
+	struct usb_master_priv *priv = dev->priv;
+	struct usb_bulk_op *op = &priv->op;
+
+	start = qi_time_us();
+	pthread_mutex_lock(&priv->lock);
+	while (!op->completed) {
+		if (qi_event_thread_running(ctx)) {
+			wait_event_thread(priv);
+			continue;
+		}
 
+		/* Our callbacks take the lock, whichever thread runs them */
+		pthread_mutex_unlock(&priv->lock);
+		ret = libusb_handle_events_completed(ctx->libusb_host_ctx,
+						     &op->completed);
+		pthread_mutex_lock(&priv->lock);
+		if (ret == LIBUSB_SUCCESS)
+			continue;
+
+		qi_err("Error: %s", libusb_error_name(ret));
+		fail_bulk_op(op);
+		if (++failures > EVENT_RETRIES) {
+			abandon_bulk_op(op);
+			break;
+		}
+	}
+	status = op->status;
+	pthread_mutex_unlock(&priv->lock);
 
-	if (!dev)
-		return QIPROG_ERR_ARG;
-	if (!dev->ctx)
-		return QIPROG_ERR_ARG;
-	if (!dev->ctx->libusb_host_ctx)
-		return QIPROG_ERR_ARG;
-	if (!(priv = dev->priv))
-		return QIPROG_ERR_ARG;
+	qi_ctx_lock(ctx);
+	ctx->event_time_us += qi_time_us() - start;
+	qi_ctx_unlock(ctx);
+
+	return status;
+}
+
+/**
+ * @brief Start a bulk read, with priv->lock held
+ */
+static qiprog_err start_read_locked(struct qiprog_device *dev, uint32_t where,
+				    void *dest, uint32_t n,
+				    qiprog_transfer_cb cb, void *user_data)
+{
+	int ret;
+	size_t copysz, range;
+	const uint32_t total = n;
+	struct usb_master_priv *priv = dev->priv;
+
+	/* The device pointers are in flux until the current operation ends */
+	if (priv->op.busy)
+		return QIPROG_ERR_BUSY;
 
 	/*
 	 * Avoid a set_address round-trip if our read pointer is where we want
@@ -1017,6 +2308,8 @@ static qiprog_err read(struct qiprog_device *dev, uint32_t where, void *dest,
 			qi_err("Could not set address range %i", ret);
 			return ret;
 		}
+	} else {
+		dev->stats.set_address_saved++;
 	}
 
 	/* See how much the device has left to read */
@@ -1036,84 +2329,187 @@ static qiprog_err read(struct qiprog_device *dev, uint32_t where, void *dest,
 		priv->buflen -= copysz;
 
 		/* Keep any remaining data at the top of the buffer */
-		if (priv->buflen) {
+		if (priv->buflen)
 			memmove(priv->buf, priv->buf + copysz, priv->buflen);
-			/* If there's still data in the buffer, we're done */
-			return QIPROG_SUCCESS;
-		}
 	}
 
-	/* Only read in multiples of the endpoint size */
-	range = (n / priv->ep_size_in) * priv->ep_size_in;
-	qi_spew("Reading 0x%.8lx -> 0x%.8lx", dev->addr.pread,
-		dev->addr.pread + range - 1);
+	qi_spew("Reading 0x%.8x -> 0x%.8x", dev->addr.pread,
+		dev->addr.pread + n - 1);
+
+	/* If there's still data in the buffer, n is 0, and we're done */
+	return start_bulk_op(dev, 0x81, priv->ep_size_in, dest, n, copysz,
+			     total, NULL, cb, user_data);
+}
+
+/**
+ * @brief Start a bulk read, common to 'read' and 'read_async'
+ */
+static qiprog_err start_read(struct qiprog_device *dev, uint32_t where,
+			     void *dest, uint32_t n, qiprog_transfer_cb cb,
+			     void *user_data)
+{
+	qiprog_err ret;
+	struct usb_master_priv *priv;
+
+	if (!dev)
+		return QIPROG_ERR_ARG;
+	if (!dev->ctx)
+		return QIPROG_ERR_ARG;
+	if (!dev->ctx->libusb_host_ctx)
+		return QIPROG_ERR_ARG;
+	if (!(priv = dev->priv))
+		return QIPROG_ERR_ARG;
+
+	pthread_mutex_lock(&priv->lock);
+	ret = start_read_locked(dev, where, dest, n, cb, user_data);
+	pthread_mutex_unlock(&priv->lock);
+
+	return ret;
+}
+
+/**
+ * @brief QiProg driver 'read' member
+ */
+static qiprog_err read(struct qiprog_device *dev, uint32_t where, void *dest,
+		       uint32_t n)
+{
+	qiprog_err ret;
 
-	ret = do_async_bulk_transfers(dev->ctx->libusb_host_ctx, priv->handle,
-				      0x81, priv->ep_size_in, dest, range);
+	ret = start_read(dev, where, dest, n, dev->progress_cb,
+			 dev->progress_data);
 	/* Stop here on any error. async handler will print an error message. */
 	if (ret != QIPROG_SUCCESS)
 		return ret;
 
-	/* Update address range to reflect the previously read bytes */
-	dev->addr.pread += range;
+	return wait_bulk_op(dev);
+}
 
-	/*
-	 * Handle leftover transfers
-	 */
-	left = n % priv->ep_size_in;
-	if (left) {
-		qi_spew("Reading leftover packet from 0x%.8lx",
-			dev->addr.pread);
-		/*
-		 * Try to read a whole packet. If the device sends less data
-		 * (last packet), we will see that
-		 */
-		ret = libusb_bulk_transfer(priv->handle, 0x81, priv->buf,
-					   priv->ep_size_in, &len, 3000);
-		if (ret != LIBUSB_SUCCESS) {
-			qi_err("Could not complete transfer: %s",
-			       libusb_error_name(ret));
-			return QIPROG_ERR;
-		}
+/**
+ * @brief QiProg driver 'read_async' member
+ */
+static qiprog_err read_async(struct qiprog_device *dev, uint32_t where,
+			     void *dest, uint32_t n, qiprog_transfer_cb cb,
+			     void *user_data)
+{
+	if (!cb)
+		return QIPROG_ERR_ARG;
 
-		/* We should get at least 'left' bytes of data */
-		if (len < left) {
-			qi_err("Received less data than expected.");
-			return QIPROG_ERR;
-		}
+	return start_read(dev, where, dest, n, cb, user_data);
+}
+
+/**
+ * @brief Tell the device how the bulk writes which follow are encoded
+ *
+ * Writes are encoded if we want them to be, and the device can expand them.
+ * The request is only sent when that changes.
+ */
+static qiprog_err set_out_encoding(struct qiprog_device *dev)
+{
+	int ret;
+	uint8_t encoding = QIPROG_BULK_RAW;
+	struct usb_master_priv *priv = dev->priv;
+	struct qiprog_capabilities caps;
 
-		/* Update address range to reflect the previously read bytes */
-		dev->addr.pread += len;
+	if (!priv->caps_valid && (get_capabilities(dev, &caps)
+				  != QIPROG_SUCCESS))
+		return QIPROG_ERR;
+	/* Devices which predate encodings would not know the request */
+	if (!priv->bulk_encodings)
+		priv->out_encoding = QIPROG_BULK_RAW;
+
+	if (priv->compress && (priv->bulk_encodings &
+			       QIPROG_BULK_ENCODING_BIT(QIPROG_BULK_RLE)))
+		encoding = QIPROG_BULK_RLE;
+	if (encoding == priv->out_encoding)
+		return QIPROG_SUCCESS;
 
-		/* Move the data to the user-specified memory region */
-		memcpy(dest + n - left, priv->buf, left);
-		priv->buflen = len - left;
-		/* And copy the rest to the start of our internal buffer */
-		memmove(priv->buf, priv->buf + left, priv->buflen);
+	ret = control_transfer(dev, 0x40, QIPROG_SET_BULK_ENCODING, encoding,
+			       0, NULL, 0, 3000);
+	if (ret < LIBUSB_SUCCESS) {
+		qi_err("Control transfer failed: %s", libusb_error_name(ret));
+		return QIPROG_ERR;
 	}
 
+	priv->out_encoding = encoding;
 	return QIPROG_SUCCESS;
 }
 
 /**
- * @brief QiProg driver 'write' member
+ * @brief Run-length encode the data of a bulk write into priv->enc_buf
+ *
+ * Tokens do not cross transfers, so each transfer which makes it to the device
+ * is expanded in full. priv->enc_ends then tells how much of the write is done.
+ * The last transfer is always short, which tells the device the write is over,
+ * and that it should not wait for more data to fill its buffers.
  */
-static qiprog_err write(struct qiprog_device *dev, uint32_t where, void *src,
-			uint32_t n)
+static qiprog_err encode_write(struct usb_master_priv *priv, const void *src,
+			       uint32_t n, uint32_t *enc_len)
+{
+	void *ptr;
+	uint32_t len, size, last;
+	const uint16_t ep_size = priv->ep_size_out;
+	const uint32_t block = bulk_transfer_size(priv, ep_size);
+
+	size = qi_rle_bound(n, block) + 1;
+	if (size > priv->enc_size) {
+		if ((ptr = realloc(priv->enc_buf, size)) == NULL)
+			return QIPROG_ERR_MALLOC;
+		priv->enc_buf = ptr;
+		priv->enc_size = size;
+	}
+	if (size / block + 1 > priv->enc_ends_size) {
+		ptr = realloc(priv->enc_ends,
+			      (size / block + 1) * sizeof(*priv->enc_ends));
+		if (ptr == NULL)
+			return QIPROG_ERR_MALLOC;
+		priv->enc_ends = ptr;
+		priv->enc_ends_size = size / block + 1;
+	}
+
+	len = qi_rle_encode(src, n, priv->enc_buf, size - 1, block,
+			    priv->enc_ends);
+	if (len == 0) {
+		qi_err("No room to encode %u bytes", n);
+		return QIPROG_ERR;
+	}
+	/* Padding is a token of its own, and expands to nothing */
+	if (!(len % ep_size))
+		priv->enc_buf[len++] = 0;
+
+	/*
+	 * The last block is then split in whole packets, and the short packet
+	 * after them. The first of the two may end in the middle of a token, so
+	 * it does not count until the other one is in too.
+	 */
+	last = len / block;
+	priv->enc_ends[last] = last ? priv->enc_ends[last - 1] : 0;
+
+	*enc_len = len;
+	return QIPROG_SUCCESS;
+}
+
+/**
+ * @brief Start a bulk write, with priv->lock held
+ *
+ * Unlike bulk reads, we do not need to send endpoint-sized packets, and thus
+ * the last packet may be smaller than the endpoint size.
+ */
+static qiprog_err start_write_locked(struct qiprog_device *dev,
+				     uint32_t where, void *src, uint32_t n,
+				     qiprog_transfer_cb cb, void *user_data)
 {
-	int ret, left, len;
+	int ret;
 	size_t range;
-	struct usb_master_priv *priv;
+	uint32_t enc_len;
+	struct usb_master_priv *priv = dev->priv;
 
+	/* The device pointers are in flux until the current operation ends */
+	if (priv->op.busy)
+		return QIPROG_ERR_BUSY;
 
-	if (!dev)
-		return QIPROG_ERR_ARG;
-	if (!dev->ctx)
-		return QIPROG_ERR_ARG;
-	if (!dev->ctx->libusb_host_ctx)
-		return QIPROG_ERR_ARG;
-	if (!(priv = dev->priv))
-		return QIPROG_ERR_ARG;
+	ret = set_out_encoding(dev);
+	if (ret != QIPROG_SUCCESS)
+		return ret;
 
 	/*
 	 * Avoid a set_address round-trip if our write pointer is where we want
@@ -1128,63 +2524,89 @@ static qiprog_err write(struct qiprog_device *dev, uint32_t where, void *src,
 			qi_err("Could not set address range %i", ret);
 			return ret;
 		}
+	} else {
+		dev->stats.set_address_saved++;
 	}
 
-	/* See how much the device has left to read */
+	/* See how much of the range is left to write */
 	range = dev->addr.end + 1 - dev->addr.pwrite;
 	/* Stop if we have been requested to write too much */
 	if (n > range) {
 		qi_err("I can write %i bytes, but you asked me to write %i",
-		       (int)(range + priv->buflen), (int) n);
+		       (int)range, (int) n);
 		return QIPROG_ERR_ARG;
 	}
 
-	/* Only program in multiples of the endpoint size */
-	range = (n / priv->ep_size_in) * priv->ep_size_in;
-	qi_spew("Programming 0x%.8lx -> 0x%.8lx", dev->addr.pwrite,
-		dev->addr.pwrite - 1 + range);
+	qi_spew("Programming 0x%.8x -> 0x%.8x", dev->addr.pwrite,
+		dev->addr.pwrite - 1 + n);
+
+	if (priv->out_encoding == QIPROG_BULK_RLE) {
+		ret = encode_write(priv, src, n, &enc_len);
+		if (ret != QIPROG_SUCCESS)
+			return ret;
+		return start_bulk_op(dev, 0x01, priv->ep_size_out,
+				     priv->enc_buf, enc_len, 0, n,
+				     priv->enc_ends, cb, user_data);
+	}
+
+	return start_bulk_op(dev, 0x01, priv->ep_size_out, src, n, 0, n,
+			     NULL, cb, user_data);
+}
+
+/**
+ * @brief Start a bulk write, common to 'write' and 'write_async'
+ */
+static qiprog_err start_write(struct qiprog_device *dev, uint32_t where,
+			      void *src, uint32_t n, qiprog_transfer_cb cb,
+			      void *user_data)
+{
+	qiprog_err ret;
+	struct usb_master_priv *priv;
+
+	if (!dev)
+		return QIPROG_ERR_ARG;
+	if (!dev->ctx)
+		return QIPROG_ERR_ARG;
+	if (!dev->ctx->libusb_host_ctx)
+		return QIPROG_ERR_ARG;
+	if (!(priv = dev->priv))
+		return QIPROG_ERR_ARG;
+
+	pthread_mutex_lock(&priv->lock);
+	ret = start_write_locked(dev, where, src, n, cb, user_data);
+	pthread_mutex_unlock(&priv->lock);
+
+	return ret;
+}
+
+/**
+ * @brief QiProg driver 'write' member
+ */
+static qiprog_err write(struct qiprog_device *dev, uint32_t where, void *src,
+			uint32_t n)
+{
+	qiprog_err ret;
 
-	ret = do_async_bulk_transfers(dev->ctx->libusb_host_ctx, priv->handle,
-				      0x01, priv->ep_size_in, src, range);
+	ret = start_write(dev, where, src, n, dev->progress_cb,
+			  dev->progress_data);
 	/* Stop here on any error. async handler will print an error message. */
 	if (ret != QIPROG_SUCCESS)
 		return ret;
 
-	/* Update address range to reflect the previously programmed bytes */
-	dev->addr.pwrite += range;
-
-	/*
-	 * Handle leftover transfers
-	 * Unlike bulk reads, we do not need to send endpoint-sized packets, and
-	 * thus the last packet could be smaller than the endpoint size.
-	 * However, we handle leftover packets separately for now.
-	 */
-	left = n % priv->ep_size_in;
-	if (left) {
-		qi_spew("Programming from 0x%.8lx", dev->addr.pwrite);
-		/*
-		 * Try to read a whole packet. If the device sends less data
-		 * (last packet), we will see that
-		 */
-		ret = libusb_bulk_transfer(priv->handle, 0x01, src + n - left,
-					   left, &len, 3000);
-		if (ret != LIBUSB_SUCCESS) {
-			qi_err("Could not complete transfer: %s",
-			       libusb_error_name(ret));
-			return QIPROG_ERR;
-		}
-
-		/* We should have sent at least 'left' bytes of data */
-		if (len < left) {
-			qi_err("Sent less data than expected.");
-			return QIPROG_ERR;
-		}
+	return wait_bulk_op(dev);
+}
 
-		/* Update address range */
-		dev->addr.pwrite += len;
-	}
+/**
+ * @brief QiProg driver 'write_async' member
+ */
+static qiprog_err write_async(struct qiprog_device *dev, uint32_t where,
+			      void *src, uint32_t n, qiprog_transfer_cb cb,
+			      void *user_data)
+{
+	if (!cb)
+		return QIPROG_ERR_ARG;
 
-	return QIPROG_SUCCESS;
+	return start_write(dev, where, src, n, cb, user_data);
 }
 
 /**
@@ -1192,24 +2614,40 @@ static qiprog_err write(struct qiprog_device *dev, uint32_t where, void *src,
  */
 struct qiprog_driver qiprog_usb_master_drv = {
 	.scan = scan,
+	.hotplug = hotplug,
 	.dev_open = dev_open,
+	.dev_close = dev_close,
+	.dev_free = dev_free,
 	.set_bus = set_bus,
+	.set_clock = set_clock,
 	.get_capabilities = get_capabilities,
 	.read_chip_id = read_chip_id,
+	.set_address = set_address,
 	.set_chip_size = set_chip_size,
+	.erase = erase,
+	.checksum = checksum,
 	.set_erase_size = set_erase_size,
 	.set_erase_command = set_erase_command,
 	.set_custom_erase_command = set_custom_erase_command,
 	.set_write_command = set_write_command,
 	.set_custom_write_command = set_custom_write_command,
+	.set_read_command = set_read_command,
+	.set_spi_timing = set_spi_timing,
+	.set_vdd = set_vdd,
 	.read8 = read8,
 	.read16 = read16,
 	.read32 = read32,
 	.write8 = write8,
 	.write16 = write16,
 	.write32 = write32,
+	.exec_batch = exec_batch,
+	.delay_us = delay_us,
+	.run_program = run_program,
+	.get_device_stats = get_device_stats,
 	.read = read,
 	.write = write,
+	.read_async = read_async,
+	.write_async = write_async,
 };
 
 /** @} */
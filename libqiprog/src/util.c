@@ -112,24 +112,61 @@ struct qiprog_device *qiprog_new_device(struct qiprog_context *ctx)
 
 	/* Store the context associated with the device */
 	dev->ctx = ctx;
+	dev->bulk_retries = QI_BULK_RETRIES;
+	dev->retry_delay_ms = QI_BULK_RETRY_DELAY_MS;
+	/* Tell the application about it the next time we get the chance */
+	dev->present = dev->seen = 1;
+	dev->pending = QIPROG_DEVICE_ARRIVED;
 
 	return dev;
 }
 
 /**
  * @brief Free memory for a new qiprog_device
+ *
+ * Whatever the driver allocated for the device is released as well.
  */
 qiprog_err qiprog_free_device(struct qiprog_device *dev)
 {
+	qiprog_shadow_disable(dev);
+	if (dev->drv && dev->drv->dev_free)
+		dev->drv->dev_free(dev);
 	free(dev);
 	return QIPROG_SUCCESS;
 }
 
+/**
+ * @brief Mark a device as gone, to be reported as such
+ */
+void qi_device_left(struct qiprog_device *dev)
+{
+	if (!dev->present)
+		return;
+
+	dev->present = 0;
+	dev->pending |= QIPROG_DEVICE_LEFT;
+}
+
 /*
  * Logging helpers:
  */
-/* Log nothing by default */
-static enum qiprog_log_level loglevel = QIPROG_LOG_NONE;
+/* Log nothing by default. The qi_p* macros check this before calling qi_log */
+enum qiprog_log_level qi_loglevel = QIPROG_LOG_NONE;
+
+/* Where messages go when they do not go to stdout */
+static qiprog_log_cb log_cb = NULL;
+static void *log_cb_data = NULL;
+
+/*
+ * The most recent messages, when a ring is set up. 'head' counts every byte
+ * ever written, so the position in 'buf' is head & (size - 1). Writers reserve
+ * their space with an atomic add, and never wait for each other.
+ */
+static struct {
+	char *buf;
+	size_t size;
+	size_t head;
+} log_ring;
 
 /**
  * @ingroup initialization
@@ -145,36 +182,164 @@ static enum qiprog_log_level loglevel = QIPROG_LOG_NONE;
  * applications. More verbose levels are designed to be used when debugging
  * libqiprog itself.
  *
+ * Messages more verbose than the LOG_MAX_LEVEL libqiprog was built with are
+ * not compiled in, and never printed.
+ *
  * @param[in] level the message verbosity level to use
  */
 void qiprog_set_loglevel(enum qiprog_log_level level)
 {
-	loglevel = level;
+	qi_loglevel = level;
+}
+
+/**
+ * @brief Send messages to a function instead of stdout
+ *
+ * 'cb' gets each message without a trailing newline. It is not used while a
+ * ring is set up with @ref qiprog_set_log_ring().
+ *
+ * @param[in] cb function to call with each message, or NULL for stdout
+ * @param[in] user_data pointer passed to 'cb'
+ */
+void qiprog_set_log_cb(qiprog_log_cb cb, void *user_data)
+{
+	log_cb = cb;
+	log_cb_data = user_data;
+}
+
+/**
+ * @brief Keep the most recent messages in memory instead of printing them
+ *
+ * Keeping messages is much cheaper than printing them. The ring can be read
+ * with @ref qiprog_read_log_ring(), for example when something fails. Set up
+ * the ring before starting any operation, as messages logged while it changes
+ * may be lost.
+ *
+ * @param[in] size size of the ring in bytes, rounded up to a power of two.
+ *		   0 frees the ring, and messages go back to the callback or
+ *		   stdout.
+ *
+ * @return QIPROG_SUCCESS on success, or a QIPROG_ERR code otherwise.
+ */
+qiprog_err qiprog_set_log_ring(size_t size)
+{
+	char *buf = NULL;
+	size_t ring_size = 0;
+
+	if (size) {
+		for (ring_size = 1; ring_size < size; ring_size <<= 1) ;
+		if ((buf = malloc(ring_size)) == NULL)
+			return QIPROG_ERR_MALLOC;
+	}
+
+	free(log_ring.buf);
+	log_ring.buf = buf;
+	log_ring.size = ring_size;
+	log_ring.head = 0;
+
+	return QIPROG_SUCCESS;
+}
+
+/**
+ * @brief Get the most recent messages from the ring
+ *
+ * Messages are separated by newlines, oldest first. When the ring has filled
+ * up, the oldest, partly overwritten message is left out.
+ *
+ * @param[out] buf where to store the messages. It is NUL-terminated.
+ * @param[in] len size of 'buf'
+ *
+ * @return The number of characters stored, without the NUL.
+ */
+size_t qiprog_read_log_ring(char *buf, size_t len)
+{
+	size_t head, n, i, start;
+	const size_t mask = log_ring.size - 1;
+
+	if (!buf || !len)
+		return 0;
+	buf[0] = '\0';
+	if (!log_ring.buf)
+		return 0;
+
+	head = __atomic_load_n(&log_ring.head, __ATOMIC_ACQUIRE);
+	n = MIN(head, log_ring.size);
+	start = head - n;
+	/* Start at a message boundary */
+	if (head > log_ring.size) {
+		while (n && (log_ring.buf[start++ & mask] != '\n'))
+			n--;
+		n -= n ? 1 : 0;
+	}
+	/* Keep the most recent ones if they do not all fit */
+	if (n > len - 1) {
+		start += n - (len - 1);
+		n = len - 1;
+	}
+
+	for (i = 0; i < n; i++)
+		buf[i] = log_ring.buf[(start + i) & mask];
+	buf[n] = '\0';
+
+	return n;
 }
 /** @} */
 
+/**
+ * @brief Put a message in the ring
+ */
+static void ring_put(const char *msg, size_t len)
+{
+	size_t pos, i;
+	const size_t mask = log_ring.size - 1;
+
+	pos = __atomic_fetch_add(&log_ring.head, len, __ATOMIC_ACQ_REL);
+	for (i = 0; i < len; i++)
+		log_ring.buf[(pos + i) & mask] = msg[i];
+}
+
 /**
  * @brief Log messages based on their severity
  *
- * Log to stdout by default
- * TODO: have configurable logfiles?
+ * Log to stdout by default, or wherever the application asked for. Use the
+ * qi_p* macros instead, which skip the call when the message is not wanted.
  */
 void qi_log(enum qiprog_log_level level, const char *fmt, ...)
 {
+	int ret;
+	size_t len;
 	va_list args;
+	char msg[QI_LOG_MSG_MAX];
 
 	/* Passing QIPROG_LOG_NONE for level will not force us to log */
-	if (loglevel == QIPROG_LOG_NONE)
+	if (qi_loglevel == QIPROG_LOG_NONE)
 		return;
 
-	if (level > loglevel)
+	if (level > qi_loglevel)
 		return;
 
+	/* Leave room for the newline */
 	va_start(args, fmt);
-	vfprintf(stdout, fmt, args);
+	ret = vsnprintf(msg, sizeof(msg) - 1, fmt, args);
 	va_end(args);
-	fprintf(stdout, "\n");
+	if (ret < 0)
+		return;
+
+	/* Some messages carry their own newline. Only keep ours. */
+	len = MIN((size_t)ret, sizeof(msg) - 2);
+	while (len && (msg[len - 1] == '\n'))
+		len--;
+	msg[len] = '\n';
 
+	if (log_ring.buf) {
+		ring_put(msg, len + 1);
+	} else if (log_cb) {
+		msg[len] = '\0';
+		log_cb(level, msg, log_cb_data);
+	} else {
+		/* One call, instead of one for the message and one for '\n' */
+		fwrite(msg, 1, len + 1, stdout);
+	}
 }
 
 /** @} */
@@ -0,0 +1,787 @@
+/*
+ * qiprog - Reference implementation of the QiProg protocol
+ *
+ * Copyright (C) 2013 Alexandru Gagniuc <mr.nuke.me@gmail.com>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+/*
+ * qiprog-bench: measure how fast a QiProg device answers and moves data
+ *
+ * Results go to stdout, one record per measurement, as CSV or JSON. Progress
+ * and errors go to stderr, so the output can be piped straight into a file.
+ */
+
+#include "chipdb.h"
+
+#include <qiprog.h>
+#if defined(CONFIG_DRIVER_USB_MASTER) && (CONFIG_DRIVER_USB_MASTER)
+#include <qiprog_usb_host.h>
+#endif
+
+#include <getopt.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#define KiB	(1 << 10)
+#define MiB	(1 << 20)
+
+#define MIN(a, b)	(((a) < (b)) ? (a) : (b))
+
+/* Most values a list option such as --queue-depths takes */
+#define MAX_LIST	16
+
+/* Size of each access when comparing sequential and random reads */
+#define ACCESS_SIZE	(4 * KiB)
+
+enum output_format {
+	FORMAT_CSV,
+	FORMAT_JSON,
+};
+
+struct bench_cfg {
+	enum output_format format;
+	const char *serial;
+	const char *chip_db;
+	uint32_t size;
+	/* --size was given, rather than the default */
+	bool size_given;
+	uint32_t iterations;
+	bool write;
+	uint32_t queue_depths[MAX_LIST];
+	size_t num_queue_depths;
+	uint32_t transfer_sizes[MAX_LIST];
+	size_t num_transfer_sizes;
+	uint32_t chunk_sizes[MAX_LIST];
+	size_t num_chunk_sizes;
+};
+
+/*
+ * One line of output. Fields which do not apply to a measurement are 0.
+ */
+struct bench_result {
+	/* "control", "bulk" or "access" */
+	const char *kind;
+	/* What was measured */
+	const char *name;
+	uint32_t queue_depth;
+	uint32_t transfer_size;
+	uint32_t chunk_size;
+	/* Number of operations timed */
+	uint32_t count;
+	uint64_t bytes;
+	uint64_t time_us;
+	/* Latency of one operation */
+	uint32_t min_us;
+	uint32_t median_us;
+	uint32_t p99_us;
+	uint32_t max_us;
+	/* From qiprog_get_stats(), for this measurement only */
+	uint32_t ctrl_requests;
+	uint32_t set_address_saved;
+	uint32_t short_transfers;
+	/* From qiprog_get_device_stats(), if the device keeps them */
+	uint32_t dev_read_us;
+	uint32_t dev_write_us;
+	uint32_t dev_starved_us;
+	uint32_t dev_tx_retries;
+};
+
+/*
+ * Counters at the start of a measurement
+ */
+struct bench_counters {
+	struct qiprog_stats host;
+	struct qiprog_device_stats dev;
+	bool has_dev;
+};
+
+static bool first_record = true;
+
+static uint64_t time_us(void)
+{
+	struct timespec now;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return (uint64_t)now.tv_sec * 1000000 + now.tv_nsec / 1000;
+}
+
+static void print_header(const struct bench_cfg *cfg)
+{
+	if (cfg->format == FORMAT_JSON) {
+		printf("[\n");
+		return;
+	}
+
+	printf("kind,name,queue_depth,transfer_size,chunk_size,count,bytes,"
+	       "time_us,kib_per_s,min_us,median_us,p99_us,max_us,"
+	       "ctrl_requests,set_address_saved,short_transfers,"
+	       "dev_read_us,dev_write_us,dev_starved_us,dev_tx_retries\n");
+}
+
+static void print_footer(const struct bench_cfg *cfg)
+{
+	if (cfg->format == FORMAT_JSON)
+		printf("\n]\n");
+}
+
+static void print_result(const struct bench_cfg *cfg,
+			 const struct bench_result *res)
+{
+	double kib_per_s = 0;
+
+	if (res->time_us)
+		kib_per_s = (double)res->bytes / KiB * 1E6 / res->time_us;
+
+	if (cfg->format == FORMAT_CSV) {
+		printf("%s,%s,%u,%u,%u,%u,%llu,%llu,%.1f,%u,%u,%u,%u,%u,%u,%u,"
+		       "%u,%u,%u,%u\n",
+		       res->kind, res->name, res->queue_depth,
+		       res->transfer_size, res->chunk_size, res->count,
+		       (unsigned long long)res->bytes,
+		       (unsigned long long)res->time_us, kib_per_s,
+		       res->min_us, res->median_us, res->p99_us, res->max_us,
+		       res->ctrl_requests, res->set_address_saved,
+		       res->short_transfers, res->dev_read_us,
+		       res->dev_write_us, res->dev_starved_us,
+		       res->dev_tx_retries);
+	} else {
+		printf("%s  {\"kind\": \"%s\", \"name\": \"%s\", "
+		       "\"queue_depth\": %u, \"transfer_size\": %u, "
+		       "\"chunk_size\": %u, \"count\": %u, \"bytes\": %llu, "
+		       "\"time_us\": %llu, \"kib_per_s\": %.1f, "
+		       "\"min_us\": %u, \"median_us\": %u, \"p99_us\": %u, "
+		       "\"max_us\": %u, \"ctrl_requests\": %u, "
+		       "\"set_address_saved\": %u, \"short_transfers\": %u, "
+		       "\"dev_read_us\": %u, \"dev_write_us\": %u, "
+		       "\"dev_starved_us\": %u, \"dev_tx_retries\": %u}",
+		       first_record ? "" : ",\n", res->kind, res->name,
+		       res->queue_depth, res->transfer_size, res->chunk_size,
+		       res->count, (unsigned long long)res->bytes,
+		       (unsigned long long)res->time_us, kib_per_s,
+		       res->min_us, res->median_us, res->p99_us, res->max_us,
+		       res->ctrl_requests, res->set_address_saved,
+		       res->short_transfers, res->dev_read_us,
+		       res->dev_write_us, res->dev_starved_us,
+		       res->dev_tx_retries);
+	}
+	first_record = false;
+	fflush(stdout);
+}
+
+static int compare_u32(const void *a, const void *b)
+{
+	const uint32_t x = *(const uint32_t *)a, y = *(const uint32_t *)b;
+
+	return (x > y) - (x < y);
+}
+
+/*
+ * Fill in the latency fields of a result from the time each operation took
+ */
+static void summarize(struct bench_result *res, uint32_t *samples,
+		      uint32_t count)
+{
+	uint32_t i;
+
+	res->count = count;
+	if (count == 0)
+		return;
+
+	qsort(samples, count, sizeof(*samples), compare_u32);
+	for (i = 0, res->time_us = 0; i < count; i++)
+		res->time_us += samples[i];
+	res->min_us = samples[0];
+	res->median_us = samples[count / 2];
+	res->p99_us = samples[(count * 99) / 100];
+	res->max_us = samples[count - 1];
+}
+
+/*
+ * Read the counters at the start of a measurement. The device's counters are
+ * read first, so the requests reading them are not in the host's counters.
+ */
+static void stats_start(struct qiprog_device *dev,
+			struct bench_counters *before)
+{
+	before->has_dev = (qiprog_get_device_stats(dev, &before->dev)
+			   == QIPROG_SUCCESS);
+	qiprog_get_stats(dev, &before->host);
+}
+
+/*
+ * Record the counters of interest which changed since 'before'
+ */
+static void stats_delta(struct qiprog_device *dev,
+			const struct bench_counters *before,
+			struct bench_result *res)
+{
+	struct qiprog_stats now;
+	struct qiprog_device_stats dev_now;
+
+	if (qiprog_get_stats(dev, &now) != QIPROG_SUCCESS)
+		return;
+
+	res->ctrl_requests = now.ctrl_requests - before->host.ctrl_requests;
+	res->set_address_saved =
+	    now.set_address_saved - before->host.set_address_saved;
+	res->short_transfers =
+	    now.short_transfers - before->host.short_transfers;
+
+	if (!before->has_dev ||
+	    (qiprog_get_device_stats(dev, &dev_now) != QIPROG_SUCCESS))
+		return;
+
+	res->dev_read_us = dev_now.read_us - before->dev.read_us;
+	res->dev_write_us = dev_now.write_us - before->dev.write_us;
+	res->dev_starved_us = dev_now.starved_us - before->dev.starved_us;
+	res->dev_tx_retries = dev_now.tx_retries - before->dev.tx_retries;
+}
+
+/*==============================================================================
+ *= Control request latency
+ *----------------------------------------------------------------------------*/
+enum ctrl_test {
+	CTRL_GET_CAPABILITIES,
+	CTRL_READ_DEVICE_ID,
+	CTRL_READ8,
+	CTRL_READ16,
+	CTRL_READ32,
+	CTRL_WRITE8,
+	CTRL_WRITE16,
+	CTRL_WRITE32,
+};
+
+static const struct {
+	enum ctrl_test test;
+	const char *name;
+	/* Changes the state of the chip, so only done with --write */
+	bool writes;
+} ctrl_tests[] = {
+	{CTRL_GET_CAPABILITIES, "get_capabilities", false},
+	{CTRL_READ_DEVICE_ID, "read_device_id", false},
+	{CTRL_READ8, "read8", false},
+	{CTRL_READ16, "read16", false},
+	{CTRL_READ32, "read32", false},
+	{CTRL_WRITE8, "write8", true},
+	{CTRL_WRITE16, "write16", true},
+	{CTRL_WRITE32, "write32", true},
+};
+
+static qiprog_err do_ctrl(struct qiprog_device *dev, enum ctrl_test test)
+{
+	uint8_t reg8;
+	uint16_t reg16;
+	uint32_t reg32;
+	struct qiprog_capabilities caps;
+	struct qiprog_chip_id ids[9];
+
+	switch (test) {
+	case CTRL_GET_CAPABILITIES:
+		return qiprog_get_capabilities(dev, &caps);
+	case CTRL_READ_DEVICE_ID:
+		return qiprog_read_chip_id(dev, ids);
+	case CTRL_READ8:
+		return qiprog_read8(dev, 0, &reg8);
+	case CTRL_READ16:
+		return qiprog_read16(dev, 0, &reg16);
+	case CTRL_READ32:
+		return qiprog_read32(dev, 0, &reg32);
+	/* Writing ones to flash does not change what it holds */
+	case CTRL_WRITE8:
+		return qiprog_write8(dev, 0, 0xff);
+	case CTRL_WRITE16:
+		return qiprog_write16(dev, 0, 0xffff);
+	case CTRL_WRITE32:
+		return qiprog_write32(dev, 0, 0xffffffff);
+	default:
+		return QIPROG_ERR_ARG;
+	}
+}
+
+static int bench_control(struct qiprog_device *dev,
+			 const struct bench_cfg *cfg)
+{
+	size_t t;
+	uint32_t i, *samples;
+	uint64_t start;
+	struct bench_counters before;
+	struct bench_result res;
+
+	if ((samples = malloc(cfg->iterations * sizeof(*samples))) == NULL)
+		return EXIT_FAILURE;
+
+	for (t = 0; t < sizeof(ctrl_tests) / sizeof(ctrl_tests[0]); t++) {
+		if (ctrl_tests[t].writes && !cfg->write)
+			continue;
+
+		fprintf(stderr, "Timing %s\n", ctrl_tests[t].name);
+		memset(&res, 0, sizeof(res));
+		res.kind = "control";
+		res.name = ctrl_tests[t].name;
+		stats_start(dev, &before);
+
+		for (i = 0; i < cfg->iterations; i++) {
+			start = time_us();
+			if (do_ctrl(dev, ctrl_tests[t].test) != QIPROG_SUCCESS)
+				break;
+			samples[i] = time_us() - start;
+		}
+		if (i < cfg->iterations)
+			fprintf(stderr, "%s failed, after %u requests\n",
+				ctrl_tests[t].name, i);
+
+		summarize(&res, samples, i);
+		stats_delta(dev, &before, &res);
+		print_result(cfg, &res);
+	}
+
+	free(samples);
+	return EXIT_SUCCESS;
+}
+
+/*==============================================================================
+ *= Bulk throughput
+ *----------------------------------------------------------------------------*/
+static qiprog_err set_tuning(struct qiprog_device *dev, uint32_t queue_depth,
+			     uint32_t transfer_size)
+{
+#if defined(CONFIG_DRIVER_USB_MASTER) && (CONFIG_DRIVER_USB_MASTER)
+	qiprog_err ret;
+
+	/* Keep what the driver picked, whichever driver that is */
+	if (!queue_depth && !transfer_size)
+		return QIPROG_SUCCESS;
+	if (queue_depth &&
+	    ((ret = qiprog_usb_set_queue_depth(dev, queue_depth))
+	     != QIPROG_SUCCESS))
+		return ret;
+	return qiprog_usb_set_transfer_size(dev, transfer_size);
+#else
+	(void)dev;
+	/* Without the USB host driver there is nothing to tune */
+	if (queue_depth || transfer_size)
+		return QIPROG_ERR_ARG;
+	return QIPROG_SUCCESS;
+#endif
+}
+
+/*
+ * Move 'size' bytes in one direction, 'chunk' bytes per call
+ */
+static int bench_bulk_one(struct qiprog_device *dev,
+			  const struct bench_cfg *cfg, uint8_t *buf,
+			  bool write, struct bench_result *res)
+{
+	uint32_t offset, len;
+	uint64_t start;
+	qiprog_err ret;
+	struct bench_counters before;
+
+	stats_start(dev, &before);
+	start = time_us();
+	for (offset = 0; offset < cfg->size; offset += len) {
+		len = MIN(res->chunk_size, cfg->size - offset);
+		if (write)
+			ret = qiprog_write(dev, offset, buf + offset, len);
+		else
+			ret = qiprog_read(dev, offset, buf + offset, len);
+		if (ret != QIPROG_SUCCESS) {
+			fprintf(stderr, "Bulk %s failed at 0x%.8x\n",
+				write ? "write" : "read", offset);
+			return EXIT_FAILURE;
+		}
+	}
+	res->time_us = time_us() - start;
+	res->bytes = cfg->size;
+	res->count = (cfg->size + res->chunk_size - 1) / res->chunk_size;
+	stats_delta(dev, &before, res);
+
+	return EXIT_SUCCESS;
+}
+
+static int bench_bulk(struct qiprog_device *dev, const struct bench_cfg *cfg)
+{
+	int ret = EXIT_SUCCESS;
+	size_t q, t, c, dir;
+	uint8_t *buf;
+	struct bench_result res;
+
+	if ((buf = malloc(cfg->size)) == NULL) {
+		fprintf(stderr, "Cannot allocate memory\n");
+		return EXIT_FAILURE;
+	}
+	/* What we write is all ones, which programs nothing */
+	memset(buf, 0xff, cfg->size);
+#if defined(CONFIG_DRIVER_USB_MASTER) && (CONFIG_DRIVER_USB_MASTER)
+	/*
+	 * All ones would go out as a few run-length tokens, and writes would
+	 * seem faster than the link. Other drivers do not compress, and refuse.
+	 */
+	qiprog_usb_set_compression(dev, false);
+#endif
+
+	for (q = 0; q < cfg->num_queue_depths; q++) {
+		for (t = 0; t < cfg->num_transfer_sizes; t++) {
+			if (set_tuning(dev, cfg->queue_depths[q],
+				       cfg->transfer_sizes[t])
+			    != QIPROG_SUCCESS) {
+				fprintf(stderr, "Cannot use queue depth %u "
+					"with transfers of %u bytes\n",
+					cfg->queue_depths[q],
+					cfg->transfer_sizes[t]);
+				continue;
+			}
+
+			for (c = 0; c < cfg->num_chunk_sizes; c++) {
+				for (dir = 0; dir < (cfg->write ? 2 : 1);
+				     dir++) {
+					memset(&res, 0, sizeof(res));
+					res.kind = "bulk";
+					res.name = dir ? "write" : "read";
+					res.queue_depth = cfg->queue_depths[q];
+					res.transfer_size =
+					    cfg->transfer_sizes[t];
+					res.chunk_size = cfg->chunk_sizes[c];
+
+					fprintf(stderr, "Bulk %s, depth %u, "
+						"transfers %u, chunks %u\n",
+						res.name, res.queue_depth,
+						res.transfer_size,
+						res.chunk_size);
+					if (bench_bulk_one(dev, cfg, buf, dir,
+							   &res)
+					    != EXIT_SUCCESS) {
+						ret = EXIT_FAILURE;
+						goto cleanup;
+					}
+					print_result(cfg, &res);
+				}
+			}
+		}
+	}
+
+ cleanup:
+	free(buf);
+	return ret;
+}
+
+/*==============================================================================
+ *= Cost of setting the address
+ *----------------------------------------------------------------------------*/
+/*
+ * Read ACCESS_SIZE bytes at a time, either one after the other, or all over the
+ * chip. Random reads need a QIPROG_SET_ADDRESS each, sequential ones may not.
+ */
+static int bench_access(struct qiprog_device *dev,
+			const struct bench_cfg *cfg)
+{
+	int ret = EXIT_SUCCESS;
+	uint8_t buf[ACCESS_SIZE];
+	uint32_t i, count, where, nslots, *samples;
+	uint64_t start;
+	bool random;
+	struct bench_counters before;
+	struct bench_result res;
+
+	nslots = cfg->size / ACCESS_SIZE;
+	count = MIN(cfg->iterations, nslots);
+	if (count == 0)
+		return EXIT_SUCCESS;
+	if ((samples = malloc(count * sizeof(*samples))) == NULL)
+		return EXIT_FAILURE;
+
+	/* Same sequence of addresses every run, so runs can be compared */
+	srand(1);
+
+	for (random = false; ret == EXIT_SUCCESS; random = true) {
+		fprintf(stderr, "Timing %s reads\n",
+			random ? "random" : "sequential");
+		memset(&res, 0, sizeof(res));
+		res.kind = "access";
+		res.name = random ? "random" : "sequential";
+		res.chunk_size = ACCESS_SIZE;
+		stats_start(dev, &before);
+
+		for (i = 0; i < count; i++) {
+			where = (random ? (uint32_t)rand() % nslots : i);
+			where *= ACCESS_SIZE;
+			start = time_us();
+			if (qiprog_read(dev, where, buf, sizeof(buf))
+			    != QIPROG_SUCCESS) {
+				fprintf(stderr, "Read failed at 0x%.8x\n",
+					where);
+				ret = EXIT_FAILURE;
+				break;
+			}
+			samples[i] = time_us() - start;
+		}
+
+		summarize(&res, samples, i);
+		res.bytes = (uint64_t)i * ACCESS_SIZE;
+		stats_delta(dev, &before, &res);
+		print_result(cfg, &res);
+
+		if (random)
+			break;
+	}
+
+	free(samples);
+	return ret;
+}
+
+/*==============================================================================
+ *= Command line
+ *----------------------------------------------------------------------------*/
+static void print_usage(const char *name)
+{
+	fprintf(stderr,
+		"Usage: %s [options]\n"
+		"  -f | --format csv|json      output format, default csv\n"
+		"  -s | --serial <serial>      use the device with this serial\n"
+		"  -z | --size <bytes>         bytes moved per bulk test, up to\n"
+		"                              the size of the chip\n"
+		"  -n | --iterations <n>       requests per latency test\n"
+		"  -q | --queue-depths <list>  comma-separated queue depths\n"
+		"  -t | --transfer-sizes <list> comma-separated transfer sizes\n"
+		"  -c | --chunk-sizes <list>   comma-separated sizes per call\n"
+		"  -w | --write                also time writes. This writes\n"
+		"                              ones to the start of the chip\n"
+		"  -C | --chip-db <file>       load chip descriptions from\n"
+		"                              <file>, besides the built-in ones\n",
+		name);
+}
+
+/*
+ * Parse a number, with an optional k or M suffix
+ */
+static bool parse_size(const char *str, uint32_t *val)
+{
+	char *end;
+	unsigned long num;
+
+	num = strtoul(str, &end, 0);
+	if (end == str)
+		return false;
+	if ((*end == 'k') || (*end == 'K')) {
+		num *= KiB;
+		end++;
+	} else if (*end == 'M') {
+		num *= MiB;
+		end++;
+	}
+	if ((*end != '\0') && (*end != ','))
+		return false;
+
+	*val = num;
+	return true;
+}
+
+static bool parse_list(const char *str, uint32_t *vals, size_t *num)
+{
+	*num = 0;
+	while (*str) {
+		if ((*num == MAX_LIST) || !parse_size(str, &vals[*num]))
+			return false;
+		(*num)++;
+		str = strchr(str, ',');
+		if (str == NULL)
+			break;
+		str++;
+	}
+
+	return *num != 0;
+}
+
+static int parse_args(int argc, char *argv[], struct bench_cfg *cfg)
+{
+	int opt;
+	bool ok;
+
+	const struct option long_options[] = {
+		{"format",		required_argument,	0, 'f'},
+		{"serial",		required_argument,	0, 's'},
+		{"size",		required_argument,	0, 'z'},
+		{"iterations",		required_argument,	0, 'n'},
+		{"queue-depths",	required_argument,	0, 'q'},
+		{"transfer-sizes",	required_argument,	0, 't'},
+		{"chunk-sizes",		required_argument,	0, 'c'},
+		{"write",		no_argument,		0, 'w'},
+		{"chip-db",		required_argument,	0, 'C'},
+		{0, 0, 0, 0}
+	};
+
+	while ((opt = getopt_long(argc, argv, "f:s:z:n:q:t:c:wC:",
+				  long_options, NULL)) != EOF) {
+		switch (opt) {
+		case 'f':
+			ok = true;
+			if (!strcmp(optarg, "csv"))
+				cfg->format = FORMAT_CSV;
+			else if (!strcmp(optarg, "json"))
+				cfg->format = FORMAT_JSON;
+			else
+				ok = false;
+			break;
+		case 's':
+			cfg->serial = optarg;
+			ok = true;
+			break;
+		case 'z':
+			ok = parse_size(optarg, &cfg->size) && cfg->size;
+			cfg->size_given = true;
+			break;
+		case 'n':
+			ok = parse_size(optarg, &cfg->iterations) &&
+			     cfg->iterations;
+			break;
+		case 'q':
+			ok = parse_list(optarg, cfg->queue_depths,
+					&cfg->num_queue_depths);
+			break;
+		case 't':
+			ok = parse_list(optarg, cfg->transfer_sizes,
+					&cfg->num_transfer_sizes);
+			break;
+		case 'c':
+			ok = parse_list(optarg, cfg->chunk_sizes,
+					&cfg->num_chunk_sizes);
+			break;
+		case 'w':
+			cfg->write = true;
+			ok = true;
+			break;
+		case 'C':
+			cfg->chip_db = optarg;
+			ok = true;
+			break;
+		default:
+			ok = false;
+			break;
+		}
+		if (!ok) {
+			print_usage(argv[0]);
+			return EXIT_FAILURE;
+		}
+	}
+
+	return EXIT_SUCCESS;
+}
+
+int main(int argc, char *argv[])
+{
+	int ret = EXIT_FAILURE;
+	size_t i, ndevs;
+	const char *serial;
+	struct qiprog_context *ctx = NULL;
+	struct qiprog_device **devs = NULL;
+	struct qiprog_device *dev = NULL;
+	struct qiprog_chip_id ids[9];
+	const struct flash_chip *chip;
+	struct bench_cfg cfg = {
+		.format = FORMAT_CSV,
+		.size = 1 * MiB,
+		.iterations = 1000,
+		/* 0 keeps the driver's defaults */
+		.queue_depths = {0},
+		.num_queue_depths = 1,
+		.transfer_sizes = {0},
+		.num_transfer_sizes = 1,
+		.chunk_sizes = {64 * KiB, 1 * MiB},
+		.num_chunk_sizes = 2,
+	};
+
+	if (parse_args(argc, argv, &cfg) != EXIT_SUCCESS)
+		return EXIT_FAILURE;
+	if (cfg.chip_db && (chipdb_load(cfg.chip_db) != EXIT_SUCCESS))
+		return EXIT_FAILURE;
+
+	if (qiprog_init(&ctx) != QIPROG_SUCCESS) {
+		fprintf(stderr, "libqiprog initialization failure\n");
+		return EXIT_FAILURE;
+	}
+
+	ndevs = qiprog_get_device_list(ctx, &devs);
+	for (i = 0; i < ndevs; i++) {
+		if (qiprog_open_device(devs[i]) != QIPROG_SUCCESS)
+			continue;
+		serial = qiprog_get_serial(devs[i]);
+		if (!cfg.serial || (serial && !strcmp(serial, cfg.serial))) {
+			dev = devs[i];
+			break;
+		}
+		qiprog_close_device(devs[i]);
+	}
+	if (dev == NULL) {
+		fprintf(stderr, "No matching device found\n");
+		goto cleanup;
+	}
+
+	/* The programmer needs to know what it is talking to */
+	if ((qiprog_read_chip_id(dev, ids) != QIPROG_SUCCESS) ||
+	    (ids[0].id_method == 0)) {
+		fprintf(stderr, "No flash chip connected to programmer\n");
+		goto cleanup;
+	}
+
+	/* The programmer needs the real size, not the size of the tests */
+	chip = chipdb_find(ids[0].vendor_id, ids[0].device_id);
+	if (chip == NULL) {
+		fprintf(stderr, "Chip with ID %x:%x is not known. Describe it "
+			"with --chip-db\n", ids[0].vendor_id,
+			ids[0].device_id);
+		goto cleanup;
+	}
+	if (cfg.size > chip->size) {
+		if (cfg.size_given) {
+			fprintf(stderr, "--size is larger than the %u KiB of "
+				"the %s\n", chip->size / KiB, chip->name);
+			goto cleanup;
+		}
+		cfg.size = chip->size;
+	}
+	qiprog_set_chip_size(dev, 0, chip->size);
+	if (cfg.write) {
+		/* Never erase, so writing ones leaves the chip alone */
+		qiprog_set_erase_command(dev, 0, QIPROG_ERASE_CMD_JEDEC_ISA,
+					 QIPROG_ERASE_SUBCMD_DEFAULT, 0);
+		qiprog_set_write_command(dev, 0, QIPROG_WRITE_CMD_JEDEC_ISA,
+					 QIPROG_WRITE_SUBCMD_DEFAULT);
+	}
+
+	print_header(&cfg);
+	ret = bench_control(dev, &cfg);
+	if (ret == EXIT_SUCCESS)
+		ret = bench_bulk(dev, &cfg);
+	if (ret == EXIT_SUCCESS)
+		ret = bench_access(dev, &cfg);
+	print_footer(&cfg);
+
+ cleanup:
+	if (dev)
+		qiprog_close_device(dev);
+	qiprog_free_device_list(devs);
+	qiprog_exit(ctx);
+	chipdb_free();
+	return ret;
+}
@@ -0,0 +1,538 @@
+/*
+ * qiprog - Reference implementation of the QiProg protocol
+ *
+ * Copyright (C) 2013 Alexandru Gagniuc <mr.nuke.me@gmail.com>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+/*
+ * Chip database
+ *
+ * A few chips are built in. More come from a text file, which can also
+ * override the built-in entries. Each chip is a stanza:
+ *
+ *	chip 0xbf:0x4c SST49LF160C
+ *		size 2M
+ *		clock 33000
+ *		erase-cmd jedec
+ *		write-cmd jedec
+ *		read fast dual quad
+ *		page 1 14us 20us
+ *		erase sector 4k 18ms 25ms
+ *		erase block 64k 18ms 25ms
+ *		erase chip 2M 70ms 100ms
+ *
+ * The clock is the fastest the chip is rated for, in kHz. 'page' is the number
+ * of bytes one program operation writes, and 'erase' gives one erase
+ * granularity. Both take typical and maximum times, with a us, ms or s suffix.
+ * 'read' lists the faster SPI read commands the chip has, besides the normal
+ * one, which every chip has.
+ * Everything after a '#' is a comment.
+ *
+ * When the blocks of an erase type are not all the same size, like on boot
+ * block parts, the layout lists them from the start of the chip, with a count
+ * for repeated sizes:
+ *
+ *		erase block 64k*31,32k,8k*2,16k 18ms 25ms
+ *
+ * Chips are looked up by their IDs in a hash table, built once, after the file
+ * is loaded.
+ */
+
+#include "chipdb.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <string.h>
+
+#define KiB	(1 << 10)
+#define MiB	(1 << 20)
+
+#define CHIPDB_MAX_LINE		256
+#define SEPARATORS		" \t\r\n"
+
+/*
+ * This is a minimal, example, list. It is not meant to be comprehensive. It
+ * lets qiprog work without a database file.
+ */
+static const struct flash_chip builtin_chips[] = {
+	{
+		.vendor_id = 0xbf,
+		.device_id = 0x4c,
+		.size = 2 * MiB,
+		.name = "SST49LF160C",
+		.erase_cmd = QIPROG_ERASE_CMD_JEDEC_ISA,
+		.write_cmd = QIPROG_WRITE_CMD_JEDEC_ISA,
+		.max_clock_khz = 33000,
+		.page_size = 1,
+		.program_typ_us = 14,
+		.program_max_us = 20,
+		.num_erases = 3,
+		.erases = {
+			{QIPROG_ERASE_TYPE_SECTOR, 4 * KiB, 18000, 25000},
+			{QIPROG_ERASE_TYPE_BLOCK, 64 * KiB, 18000, 25000},
+			{QIPROG_ERASE_TYPE_CHIP, 2 * MiB, 70000, 100000},
+		},
+	}, {
+		.vendor_id = 0xbf,
+		.device_id = 0x5b,
+		.size = 1 * MiB,
+		.name = "SST49LF080A",
+		.erase_cmd = QIPROG_ERASE_CMD_JEDEC_ISA,
+		.write_cmd = QIPROG_WRITE_CMD_JEDEC_ISA,
+		.max_clock_khz = 33000,
+		.page_size = 1,
+		.program_typ_us = 14,
+		.program_max_us = 20,
+		.num_erases = 3,
+		.erases = {
+			{QIPROG_ERASE_TYPE_SECTOR, 4 * KiB, 18000, 25000},
+			{QIPROG_ERASE_TYPE_BLOCK, 64 * KiB, 18000, 25000},
+			{QIPROG_ERASE_TYPE_CHIP, 1 * MiB, 70000, 100000},
+		},
+	}, {
+		.vendor_id = 0xbf,
+		.device_id = 0x50,
+		.size = 512 * KiB,
+		.name = "SST49LF040B",
+		.erase_cmd = QIPROG_ERASE_CMD_JEDEC_ISA,
+		.write_cmd = QIPROG_WRITE_CMD_JEDEC_ISA,
+		.max_clock_khz = 33000,
+		.page_size = 1,
+		.program_typ_us = 14,
+		.program_max_us = 20,
+		.num_erases = 3,
+		.erases = {
+			{QIPROG_ERASE_TYPE_SECTOR, 4 * KiB, 18000, 25000},
+			{QIPROG_ERASE_TYPE_BLOCK, 64 * KiB, 18000, 25000},
+			{QIPROG_ERASE_TYPE_CHIP, 512 * KiB, 70000, 100000},
+		},
+	}, {
+		.size = 0,
+	}
+};
+
+/* Chips from the database file */
+static struct flash_chip *loaded_chips;
+static size_t num_loaded;
+
+/* Open addressing, with a power of two number of slots */
+static const struct flash_chip **index_slots;
+static size_t index_mask;
+
+static size_t chip_hash(uint16_t vendor_id, uint32_t device_id)
+{
+	uint64_t key = ((uint64_t)vendor_id << 32) | device_id;
+
+	/* Fibonacci hashing spreads consecutive device IDs over the table */
+	return (size_t)((key * 0x9e3779b97f4a7c15ull) >> 32);
+}
+
+/*
+ * Add a chip to the index, replacing any chip with the same IDs
+ */
+static void index_add(const struct flash_chip *chip)
+{
+	size_t i;
+	const struct flash_chip *slot;
+
+	i = chip_hash(chip->vendor_id, chip->device_id) & index_mask;
+	while ((slot = index_slots[i]) != NULL) {
+		if ((slot->vendor_id == chip->vendor_id) &&
+		    (slot->device_id == chip->device_id))
+			break;
+		i = (i + 1) & index_mask;
+	}
+	index_slots[i] = chip;
+}
+
+static int build_index(void)
+{
+	size_t num_slots, num_chips, i;
+	const struct flash_chip *chip;
+
+	num_chips = num_loaded;
+	for (chip = builtin_chips; chip->size != 0; chip++)
+		num_chips++;
+
+	/* Keep the table at most half full, so probe sequences stay short */
+	for (num_slots = 16; num_slots < 2 * num_chips; num_slots <<= 1) ;
+
+	free(index_slots);
+	index_slots = calloc(num_slots, sizeof(*index_slots));
+	index_mask = num_slots - 1;
+	if (index_slots == NULL)
+		return EXIT_FAILURE;
+
+	/* Entries from the file come last, so they win */
+	for (chip = builtin_chips; chip->size != 0; chip++)
+		index_add(chip);
+	for (i = 0; i < num_loaded; i++)
+		index_add(&loaded_chips[i]);
+
+	return EXIT_SUCCESS;
+}
+
+/*
+ * Look up a chip by its IDs
+ *
+ * Returns NULL if the chip is not known.
+ */
+const struct flash_chip *chipdb_find(uint16_t vendor_id, uint32_t device_id)
+{
+	size_t i;
+	const struct flash_chip *slot;
+
+	if ((index_slots == NULL) && (build_index() != EXIT_SUCCESS))
+		return NULL;
+
+	i = chip_hash(vendor_id, device_id) & index_mask;
+	while ((slot = index_slots[i]) != NULL) {
+		if ((slot->vendor_id == vendor_id) &&
+		    (slot->device_id == device_id))
+			return slot;
+		i = (i + 1) & index_mask;
+	}
+
+	return NULL;
+}
+
+/*
+ * Parse a number of bytes, with an optional k or M suffix
+ */
+static bool parse_size(const char *str, uint32_t *val)
+{
+	char *end;
+	unsigned long num;
+
+	if (str == NULL)
+		return false;
+	num = strtoul(str, &end, 0);
+	if (end == str)
+		return false;
+	if ((*end == 'k') || (*end == 'K')) {
+		num *= KiB;
+		end++;
+	} else if (*end == 'M') {
+		num *= MiB;
+		end++;
+	}
+
+	*val = num;
+	return (*end == '\0');
+}
+
+/*
+ * Parse a time, with a us, ms or s suffix, into microseconds
+ */
+static bool parse_time(const char *str, uint32_t *us)
+{
+	char *end;
+	unsigned long num;
+
+	if (str == NULL)
+		return false;
+	num = strtoul(str, &end, 0);
+	if (end == str)
+		return false;
+	if (strcmp(end, "us") == 0)
+		*us = num;
+	else if (strcmp(end, "ms") == 0)
+		*us = num * 1000;
+	else if (strcmp(end, "s") == 0)
+		*us = num * 1000000;
+	else
+		return false;
+
+	return true;
+}
+
+/*
+ * Parse the size of an erase type, or its layout, if the blocks differ
+ */
+static bool parse_erase_blocks(char *str, struct chip_erase *erase)
+{
+	char *run, *count, *save;
+	uint64_t start = 0;
+	struct qiprog_erase_run *r;
+
+	if (str == NULL)
+		return false;
+	if (!strchr(str, ',') && !strchr(str, '*'))
+		return parse_size(str, &erase->size) && erase->size;
+
+	erase->size = 0;
+	for (run = strtok_r(str, ",", &save); run;
+	     run = strtok_r(NULL, ",", &save)) {
+		if (erase->num_runs == CHIP_MAX_RUNS)
+			return false;
+		r = &erase->runs[erase->num_runs++];
+		r->start = start;
+		r->count = 1;
+		if ((count = strchr(run, '*')) != NULL) {
+			*count++ = '\0';
+			if (!parse_size(count, &r->count) || !r->count)
+				return false;
+		}
+		if (!parse_size(run, &r->size) || !r->size)
+			return false;
+		start += (uint64_t)r->size * r->count;
+		if (start > UINT32_MAX)
+			return false;
+	}
+
+	return true;
+}
+
+static bool parse_erase_type(const char *str, enum qiprog_erase_type *type)
+{
+	if (str == NULL)
+		return false;
+	if (strcmp(str, "chip") == 0)
+		*type = QIPROG_ERASE_TYPE_CHIP;
+	else if (strcmp(str, "block") == 0)
+		*type = QIPROG_ERASE_TYPE_BLOCK;
+	else if (strcmp(str, "sector") == 0)
+		*type = QIPROG_ERASE_TYPE_SECTOR;
+	else
+		return false;
+
+	return true;
+}
+
+/*
+ * Only the JEDEC command sets can be described in the file
+ */
+static bool parse_jedec(const char *str)
+{
+	return (str != NULL) && (strcmp(str, "jedec") == 0);
+}
+
+static bool parse_read_cmd(const char *str, uint16_t *read_cmds)
+{
+	if (strcmp(str, "fast") == 0)
+		*read_cmds |= QIPROG_READ_CMD_BIT(QIPROG_READ_CMD_FAST);
+	else if (strcmp(str, "dual") == 0)
+		*read_cmds |= QIPROG_READ_CMD_BIT(QIPROG_READ_CMD_DUAL_OUTPUT);
+	else if (strcmp(str, "quad") == 0)
+		*read_cmds |= QIPROG_READ_CMD_BIT(QIPROG_READ_CMD_QUAD_IO);
+	else
+		return false;
+
+	return true;
+}
+
+/*
+ * Parse the contents of one line into the chip it describes
+ *
+ * Returns an error message, or NULL if the line is fine.
+ */
+static const char *parse_property(struct flash_chip *chip, const char *key)
+{
+	size_t i, nargs;
+	char *arg[5];
+	struct chip_erase *erase;
+
+	for (nargs = 0; nargs < 5; nargs++)
+		if ((arg[nargs] = strtok(NULL, SEPARATORS)) == NULL)
+			break;
+
+	if (strcmp(key, "size") == 0) {
+		if ((nargs != 1) || !parse_size(arg[0], &chip->size) ||
+		    (chip->size == 0))
+			return "expected 'size <bytes>'";
+	} else if (strcmp(key, "clock") == 0) {
+		if ((nargs != 1) || !parse_size(arg[0], &chip->max_clock_khz))
+			return "expected 'clock <kHz>'";
+	} else if (strcmp(key, "erase-cmd") == 0) {
+		if ((nargs != 1) || !parse_jedec(arg[0]))
+			return "unsupported erase command";
+		chip->erase_cmd = QIPROG_ERASE_CMD_JEDEC_ISA;
+	} else if (strcmp(key, "write-cmd") == 0) {
+		if ((nargs != 1) || !parse_jedec(arg[0]))
+			return "unsupported write command";
+		chip->write_cmd = QIPROG_WRITE_CMD_JEDEC_ISA;
+	} else if (strcmp(key, "read") == 0) {
+		chip->read_cmds = QIPROG_READ_CMD_BIT(QIPROG_READ_CMD_NORMAL);
+		for (i = 0; i < nargs; i++)
+			if (!parse_read_cmd(arg[i], &chip->read_cmds))
+				return "expected 'read fast|dual|quad ...'";
+	} else if (strcmp(key, "page") == 0) {
+		if ((nargs != 3) || !parse_size(arg[0], &chip->page_size) ||
+		    !chip->page_size ||
+		    !parse_time(arg[1], &chip->program_typ_us) ||
+		    !parse_time(arg[2], &chip->program_max_us))
+			return "expected 'page <bytes> <typ> <max>'";
+	} else if (strcmp(key, "erase") == 0) {
+		if (chip->num_erases == CHIP_MAX_ERASES)
+			return "too many erase sizes";
+		erase = &chip->erases[chip->num_erases];
+		if ((nargs != 4) || !parse_erase_type(arg[0], &erase->type) ||
+		    !parse_erase_blocks(arg[1], erase) ||
+		    !parse_time(arg[2], &erase->typ_us) ||
+		    !parse_time(arg[3], &erase->max_us))
+			return "expected 'erase <type> <bytes> <typ> <max>'";
+		chip->num_erases++;
+	} else {
+		return "unknown property";
+	}
+
+	return NULL;
+}
+
+static const char *parse_chip(struct flash_chip *chip)
+{
+	char *ids, *name, *end;
+
+	memset(chip, 0, sizeof(*chip));
+
+	ids = strtok(NULL, SEPARATORS);
+	name = strtok(NULL, SEPARATORS);
+	if ((ids == NULL) || (name == NULL) || strtok(NULL, SEPARATORS))
+		return "expected 'chip <vendor>:<device> <name>'";
+
+	chip->vendor_id = strtoul(ids, &end, 0);
+	if ((end == ids) || (*end != ':'))
+		return "bad chip ID";
+	ids = end + 1;
+	chip->device_id = strtoul(ids, &end, 0);
+	if ((end == ids) || (*end != '\0'))
+		return "bad chip ID";
+
+	if (strlen(name) >= CHIP_NAME_LEN)
+		return "chip name too long";
+	strcpy(chip->name, name);
+
+	return NULL;
+}
+
+/*
+ * Make sure a chip from the file has what we need to program it
+ */
+static const char *check_chip(const struct flash_chip *chip)
+{
+	size_t i;
+	uint64_t end;
+	const struct chip_erase *erase;
+	const struct qiprog_erase_run *run;
+
+	if (chip->size == 0)
+		return "chip has no size";
+	if (chip->num_erases == 0)
+		return "chip has no erase sizes";
+	if (!chip->erase_cmd || !chip->write_cmd)
+		return "chip has no erase or write command";
+	for (i = 0; i < chip->num_erases; i++) {
+		erase = &chip->erases[i];
+		if (erase->size == 0) {
+			run = &erase->runs[erase->num_runs - 1];
+			end = run->start + (uint64_t)run->size * run->count;
+			if (end != chip->size)
+				return "erase layout does not cover the chip";
+			continue;
+		}
+		if (erase->size > chip->size)
+			return "erase size larger than the chip";
+		if (chip->size % erase->size)
+			return "erase size does not divide the chip size";
+	}
+
+	return NULL;
+}
+
+/*
+ * Load chips from a database file, and rebuild the index
+ *
+ * If the file has errors, they are printed, and the database is left as it
+ * was.
+ */
+int chipdb_load(const char *path)
+{
+	FILE *file;
+	char line[CHIPDB_MAX_LINE], *key, *comment;
+	const char *err = NULL;
+	unsigned int lineno = 0, chip_line = 0;
+	struct flash_chip *chips = NULL, *chip = NULL, *tmp;
+	size_t num_chips = 0;
+
+	if ((file = fopen(path, "r")) == NULL) {
+		printf("Cannot open chip database %s\n", path);
+		return EXIT_FAILURE;
+	}
+
+	while ((err == NULL) && fgets(line, sizeof(line), file)) {
+		lineno++;
+		if ((strchr(line, '\n') == NULL) && !feof(file)) {
+			err = "line too long";
+			break;
+		}
+		if ((comment = strchr(line, '#')) != NULL)
+			*comment = '\0';
+		if ((key = strtok(line, SEPARATORS)) == NULL)
+			continue;
+
+		if (strcmp(key, "chip") != 0) {
+			if (chip == NULL)
+				err = "property outside of a chip";
+			else
+				err = parse_property(chip, key);
+			continue;
+		}
+
+		if (chip && (err = check_chip(chip))) {
+			lineno = chip_line;
+			break;
+		}
+		tmp = realloc(chips, (num_chips + 1) * sizeof(*chips));
+		if (tmp == NULL) {
+			err = "out of memory";
+			break;
+		}
+		chips = tmp;
+		chip = &chips[num_chips++];
+		chip_line = lineno;
+		err = parse_chip(chip);
+	}
+	if ((err == NULL) && chip && (err = check_chip(chip)))
+		lineno = chip_line;
+	fclose(file);
+
+	if (err != NULL) {
+		printf("%s:%u: %s\n", path, lineno, err);
+		free(chips);
+		return EXIT_FAILURE;
+	}
+
+	free(loaded_chips);
+	loaded_chips = chips;
+	num_loaded = num_chips;
+
+	return build_index();
+}
+
+void chipdb_free(void)
+{
+	free(index_slots);
+	index_slots = NULL;
+	free(loaded_chips);
+	loaded_chips = NULL;
+	num_loaded = 0;
+}
@@ -0,0 +1,75 @@
+/*
+ * qiprog - Reference implementation of the QiProg protocol
+ *
+ * Copyright (C) 2013 Alexandru Gagniuc <mr.nuke.me@gmail.com>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+#ifndef CHIPDB_H
+#define CHIPDB_H
+
+#include <qiprog.h>
+
+#include <stddef.h>
+#include <stdint.h>
+
+/* As many erase sizes as qiprog_set_erase_size() takes */
+#define CHIP_MAX_ERASES		12
+#define CHIP_NAME_LEN		32
+/* Boot block layouts only need a few runs of blocks of different sizes */
+#define CHIP_MAX_RUNS		8
+
+/*
+ * One erase granularity of a chip, and how long erasing one unit takes
+ */
+struct chip_erase {
+	enum qiprog_erase_type type;
+	/* Size of every block, or 0 if they differ, and 'runs' lists them */
+	uint32_t size;
+	uint32_t typ_us;
+	uint32_t max_us;
+	size_t num_runs;
+	struct qiprog_erase_run runs[CHIP_MAX_RUNS];
+};
+
+struct flash_chip {
+	uint16_t vendor_id;
+	uint32_t device_id;
+	uint32_t size;
+	char name[CHIP_NAME_LEN];
+	enum qiprog_erase_cmd erase_cmd;
+	enum qiprog_write_cmd write_cmd;
+	/* Fastest bus clock the chip is rated for, 0 if unknown */
+	uint32_t max_clock_khz;
+	/* QIPROG_READ_CMD_BIT() of every SPI read command the chip has */
+	uint16_t read_cmds;
+	/* Bytes programmed by one program operation, and how long it takes */
+	uint32_t page_size;
+	uint32_t program_typ_us;
+	uint32_t program_max_us;
+	size_t num_erases;
+	struct chip_erase erases[CHIP_MAX_ERASES];
+};
+
+int chipdb_load(const char *path);
+const struct flash_chip *chipdb_find(uint16_t vendor_id, uint32_t device_id);
+void chipdb_free(void);
+
+#endif				/* CHIPDB_H */
@@ -23,6 +23,7 @@
  *
  */
 
+#include "chipdb.h"
 #include "tests.h"
 
 #include <stdio.h>
@@ -31,12 +32,35 @@
 #include <stdbool.h>
 #include <string.h>
 #include <getopt.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <time.h>
 #include <qiprog.h>
 
 
 #define KiB	(1 << 10)
 #define MiB	(1 << 20)
 
+#define MIN(a, b)	(((a) < (b)) ? (a) : (b))
+
+/* Streaming operations move the chip in chunks, through a ring of buffers */
+#define STREAM_CHUNK_SIZE	(256 * KiB)
+#define STREAM_BUFFERS		2
+
+/* Blank gaps shorter than this are cheaper to send than to skip */
+#define BLANK_MIN_GAP		(4 * KiB)
+
+/* Verification compares digests of blocks this big before reading back */
+#define CHECKSUM_BLOCK_SIZE	(64 * KiB)
+
+/* Times --write --verify programs a block again, before giving up on it */
+#define REWRITE_RETRIES		2
+
+/* libqiprog messages kept for when something fails */
+#define LOG_RING_SIZE		(64 * KiB)
+
 enum qi_action {
 	NONE,
 	ACTION_READ,
@@ -45,68 +69,36 @@ enum qi_action {
 	ACTION_TEST_DEV,
 };
 
-struct flash_chip {
-	uint16_t vendor_id;
-	uint32_t device_id;
-	uint32_t size;
-	const char *name;
-	uint8_t erase_cmd;
-	uint8_t erase_type;
-	uint32_t erase_size;
-	uint8_t write_cmd;
-};
-
-/*
- * This is a minimal, example, list. It is not meant to be comprehensive,
- * neither in terms of chips, nor in terms of chip parameters it stores.
- */
-const struct flash_chip const chip_list[] = {
-	{
-		.vendor_id = 0xbf,
-		.device_id = 0x4c,
-		.size = 2 * MiB,
-		.name = "SST49LF160C",
-		.erase_cmd = QIPROG_ERASE_CMD_JEDEC_ISA,
-		.erase_type = QIPROG_ERASE_TYPE_SECTOR,
-		.erase_size = 4 * KiB,
-		.write_cmd = QIPROG_WRITE_CMD_JEDEC_ISA,
-	}, {
-
-		.vendor_id = 0xbf,
-		.device_id = 0x5b,
-		.size = 1 * MiB,
-		.name = "SST49LF080A",
-		.erase_cmd = QIPROG_ERASE_CMD_JEDEC_ISA,
-		.erase_type = QIPROG_ERASE_TYPE_SECTOR,
-		.erase_size = 4 * KiB,
-		.write_cmd = QIPROG_WRITE_CMD_JEDEC_ISA,
-	}, {
-
-		.vendor_id = 0xbf,
-		.device_id = 0x50,
-		.size = 512 * KiB,
-		.name = "SST49LF040B",
-		.erase_cmd = QIPROG_ERASE_CMD_JEDEC_ISA,
-		.erase_type = QIPROG_ERASE_TYPE_SECTOR,
-		.erase_size = 4 * KiB,
-		.write_cmd = QIPROG_WRITE_CMD_JEDEC_ISA,
-	}, {
-
-		.vendor_id = 0,
-		.device_id = 0,
-		.size = 0,
-		.name = "",
-		.erase_cmd = 0,
-		.erase_type = 0,
-		.erase_size = 0,
-		.write_cmd = 0,
-	}
-};
-
 struct qiprog_cfg {
 	char *filename;
 	enum qi_action action;
+	/* The chip, and the erase size for erase-before-write and ranges */
+	const struct flash_chip *chip;
+	const struct chip_erase *erase;
 	uint32_t chip_size;
+	uint32_t erase_size;
+	/* Only erase and program blocks which changed */
+	bool delta;
+	/* Image known to be on the chip, instead of reading it back */
+	char *base;
+	/* Do not send blank parts of the image */
+	bool skip_blank;
+	/* Stop verifying at the first difference */
+	bool fail_fast;
+	/* Verify what --write programs, as it goes */
+	bool write_verify;
+	/* Print libqiprog messages as they come, instead of on failure */
+	bool verbose;
+	/* Operate on all devices at once */
+	bool gang;
+	/* Comma-separated list of serial numbers of devices to use */
+	char *serials;
+	/* Chip database to load on top of the built-in chips */
+	char *chip_db;
+	/* Operate on every chip of the programmer with the same ID */
+	bool all_chips;
+	uint8_t chips[9];
+	size_t num_chips;
 };
 
 const char license[] =
@@ -151,6 +143,15 @@ int main(int argc, char *argv[])
 		{"write",	required_argument,	0, 'w'},
 		{"verify",	required_argument,	0, 'v'},
 		{"test",	no_argument,		0, 't'},
+		{"gang",	no_argument,		0, 'g'},
+		{"serial",	required_argument,	0, 's'},
+		{"delta",	no_argument,		0, 'd'},
+		{"base",	required_argument,	0, 'b'},
+		{"skip-blank",	no_argument,		0, 'k'},
+		{"fail-fast",	no_argument,		0, 'f'},
+		{"verbose",	no_argument,		0, 'V'},
+		{"chip-db",	required_argument,	0, 'C'},
+		{"all-chips",	no_argument,		0, 'a'},
 		{0, 0, 0, 0}
 	};
 
@@ -161,7 +162,7 @@ int main(int argc, char *argv[])
 	 * Parse arguments
 	 */
 	while (1) {
-		opt = getopt_long(argc, argv, "cr:w:v:st",
+		opt = getopt_long(argc, argv, "cr:w:v:s:b:C:tgdkfVa",
 				  long_options, &option_index);
 
 		if (opt == EOF)
@@ -182,6 +183,12 @@ int main(int argc, char *argv[])
 			config->action = ACTION_READ;
 			break;
 		case 'v':
+			/* --write and --verify of the same file go together */
+			if (has_operation && (config->action == ACTION_WRITE) &&
+			    !strcmp(config->filename, optarg)) {
+				config->write_verify = true;
+				break;
+			}
 			if (has_operation) {
 				printf("More than one operation specified.\n");
 				exit(EXIT_FAILURE);
@@ -191,6 +198,12 @@ int main(int argc, char *argv[])
 			config->action = ACTION_VERIFY;
 			break;
 		case 'w':
+			if (has_operation && (config->action == ACTION_VERIFY) &&
+			    !strcmp(config->filename, optarg)) {
+				config->action = ACTION_WRITE;
+				config->write_verify = true;
+				break;
+			}
 			if (has_operation) {
 				printf("More than one operation specified.\n");
 				exit(EXIT_FAILURE);
@@ -207,6 +220,34 @@ int main(int argc, char *argv[])
 			has_operation = true;
 			config->action = ACTION_TEST_DEV;
 			break;
+		case 'g':
+			config->gang = true;
+			break;
+		case 's':
+			config->serials = strdup(optarg);
+			break;
+		case 'd':
+			config->delta = true;
+			break;
+		case 'b':
+			config->base = strdup(optarg);
+			config->delta = true;
+			break;
+		case 'k':
+			config->skip_blank = true;
+			break;
+		case 'f':
+			config->fail_fast = true;
+			break;
+		case 'V':
+			config->verbose = true;
+			break;
+		case 'C':
+			config->chip_db = strdup(optarg);
+			break;
+		case 'a':
+			config->all_chips = true;
+			break;
 		default:
 			/* Invalid option. getopt will have printed something */
 			exit(EXIT_FAILURE);
@@ -217,6 +258,50 @@ int main(int argc, char *argv[])
 	/*
 	 * Sanity-check arguments
 	 */
+	if (config->delta && (config->action != ACTION_WRITE)) {
+		printf("Delta programming only makes sense with --write.\n");
+		exit(EXIT_FAILURE);
+	}
+	if (config->delta && config->gang) {
+		printf("Delta programming is not supported in gang mode.\n");
+		exit(EXIT_FAILURE);
+	}
+	if (config->skip_blank && (config->action != ACTION_WRITE)) {
+		printf("Skipping blank regions only makes sense with --write.\n");
+		exit(EXIT_FAILURE);
+	}
+	if (config->skip_blank && config->gang) {
+		printf("Skipping blank regions is not supported in gang mode.\n");
+		exit(EXIT_FAILURE);
+	}
+	if (config->fail_fast && (config->action != ACTION_VERIFY)) {
+		printf("Failing fast only makes sense with --verify.\n");
+		exit(EXIT_FAILURE);
+	}
+	if (config->fail_fast && config->gang) {
+		printf("Failing fast is not supported in gang mode.\n");
+		exit(EXIT_FAILURE);
+	}
+	if (config->all_chips && (config->action != ACTION_WRITE) &&
+	    (config->action != ACTION_VERIFY)) {
+		printf("All chips only makes sense with --write or --verify.\n");
+		exit(EXIT_FAILURE);
+	}
+	if (config->all_chips && (config->gang || config->delta ||
+				  config->skip_blank)) {
+		printf("All chips is not supported with --gang, --delta or "
+		       "--skip-blank.\n");
+		exit(EXIT_FAILURE);
+	}
+	if (config->write_verify && (config->gang || config->delta ||
+				     config->skip_blank || config->all_chips)) {
+		printf("--write with --verify is not supported with --gang, "
+		       "--delta, --skip-blank or --all-chips.\n");
+		exit(EXIT_FAILURE);
+	}
+
+	if (config->chip_db && (chipdb_load(config->chip_db) != EXIT_SUCCESS))
+		exit(EXIT_FAILURE);
 
 	/*
 	 * At this point, the arguments are sane.
@@ -232,7 +317,11 @@ int main(int argc, char *argv[])
 	/* Clean up */
 	if (config->filename)
 		free(config->filename);
+	free(config->serials);
+	free(config->base);
+	free(config->chip_db);
 	free(config);
+	chipdb_free();
 
 	return ret;
 }
@@ -287,19 +376,120 @@ static int print_device_info(struct qiprog_device *dev)
 			break;
 		printf("Supported voltage: %imV\n", caps.voltages[i]);
 	}
-	/* Ignore caps.instruction_set and caps.max_direct_data */
+	if (caps.instruction_set & QIPROG_LANG_BUS)
+		printf("Device runs bus programs of up to %u bytes\n",
+		       caps.max_direct_data);
 
 	return EXIT_SUCCESS;
 }
 
+/*
+ * Pick the erase size the programmer uses when not told otherwise
+ *
+ * Sparse writes want the finest granularity, so that as little as possible is
+ * rewritten. Otherwise, the whole chip is rewritten, and the size which erases
+ * the most bytes per unit of time is the fastest. Chip erases are left out of
+ * it, since they cannot describe which blocks of the chip differ, and so are
+ * blocks which are not all the same size.
+ */
+static const struct chip_erase *pick_erase(const struct flash_chip *chip,
+					   bool sparse)
+{
+	size_t i;
+	uint64_t cost, best_cost = 0;
+	const struct chip_erase *erase, *best = NULL;
+
+	for (i = 0; i < chip->num_erases; i++) {
+		erase = &chip->erases[i];
+		if ((erase->type == QIPROG_ERASE_TYPE_CHIP) || !erase->size)
+			continue;
+		/* Microseconds per MiB. Unknown times are never the fastest */
+		cost = erase->typ_us ? ((uint64_t)erase->typ_us << 20) /
+				       erase->size : UINT64_MAX;
+		if (sparse)
+			cost = erase->size;
+		if (best && ((cost > best_cost) ||
+			     ((cost == best_cost) && (erase->size > best->size))))
+			continue;
+		best = erase;
+		best_cost = cost;
+	}
+
+	return best;
+}
+
+/*
+ * Give the programmer every erase size the chip has, with the one it should use
+ * for erasing before writing, and for erases of ranges, first
+ */
+static qiprog_err set_erase_sizes(struct qiprog_device *dev, uint8_t chip_idx,
+				  const struct flash_chip *chip,
+				  const struct chip_erase *primary)
+{
+	size_t i, num_sizes;
+	enum qiprog_erase_type types[CHIP_MAX_ERASES];
+	uint32_t sizes[CHIP_MAX_ERASES];
+
+	types[0] = primary->type;
+	sizes[0] = primary->size;
+	for (i = 0, num_sizes = 1; i < chip->num_erases; i++) {
+		/* Blocks of different sizes cannot be described with one */
+		if ((&chip->erases[i] == primary) || !chip->erases[i].size)
+			continue;
+		types[num_sizes] = chip->erases[i].type;
+		sizes[num_sizes++] = chip->erases[i].size;
+	}
+
+	return qiprog_set_erase_size(dev, chip_idx, types, sizes, num_sizes);
+}
+
+static const char *read_cmd_names[] = {
+	[QIPROG_READ_CMD_NORMAL] = "normal read",
+	[QIPROG_READ_CMD_FAST] = "fast read",
+	[QIPROG_READ_CMD_DUAL_OUTPUT] = "dual output read",
+	[QIPROG_READ_CMD_QUAD_IO] = "quad I/O read",
+};
+
+/*
+ * Pick the fastest read command both the chip and the programmer have
+ *
+ * Each one moves more bits per clock than the one before it.
+ */
+static enum qiprog_read_cmd pick_read_cmd(struct qiprog_device *dev,
+					  const struct flash_chip *chip)
+{
+	int cmd;
+	uint16_t cmds;
+	struct qiprog_capabilities caps;
+
+	if (qiprog_get_capabilities(dev, &caps) != QIPROG_SUCCESS)
+		return QIPROG_READ_CMD_NORMAL;
+
+	cmds = chip->read_cmds & caps.read_cmds;
+	for (cmd = QIPROG_READ_CMD_QUAD_IO; cmd > QIPROG_READ_CMD_NORMAL; cmd--)
+		if (cmds & QIPROG_READ_CMD_BIT(cmd))
+			break;
+
+	return cmd;
+}
+
 /*
  * Identify the flash chip's properties based on the chip ID
+ *
+ * In all chips mode, every other chip with the same ID as the first one is
+ * set up the same way.
  */
 static int identify_chip(struct qiprog_device *dev, struct qiprog_cfg *conf)
 {
+	size_t i;
+	uint8_t idx;
 	qiprog_err ret;
+	uint16_t erase_flags;
+	uint32_t clock_khz;
+	enum qiprog_read_cmd read_cmd;
 	struct qiprog_chip_id ids[9];
 	const struct flash_chip *chip;
+	const struct chip_erase *erase;
 
 	/* Check if a chip is connected */
 	ret = qiprog_read_chip_id(dev, ids);
@@ -317,111 +507,301 @@ static int identify_chip(struct qiprog_device *dev, struct qiprog_cfg *conf)
 	printf("Identified chip with ID %x:%x\n",
 	       ids[0].vendor_id, ids[0].device_id);
 
-	/* Now check our list of known chips */
-	for (chip = chip_list; chip->size != 0; chip++) {
-		if(ids[0].vendor_id != chip->vendor_id)
+	conf->chips[0] = 0;
+	conf->num_chips = 1;
+	for (i = 1; conf->all_chips && (i < 9); i++) {
+		if (ids[i].id_method == 0)
 			continue;
-		if(ids[0].device_id != chip->device_id)
+		if ((ids[i].vendor_id != ids[0].vendor_id) ||
+		    (ids[i].device_id != ids[0].device_id)) {
+			printf("Leaving alone chip %zu, with ID %x:%x\n", i,
+			       ids[i].vendor_id, ids[i].device_id);
 			continue;
-		/* Found it */
-		conf->chip_size = chip->size;
-		printf("Chip is a %s\n", chip->name);
-		break;
+		}
+		conf->chips[conf->num_chips++] = i;
 	}
+	if (conf->all_chips)
+		printf("Found %zu chips with that ID\n", conf->num_chips);
 
-	/* If size is 0, then we do not know enough about this chip */
-	if (conf->chip_size == 0) {
+	/* Now check our database of known chips */
+	chip = chipdb_find(ids[0].vendor_id, ids[0].device_id);
+	erase = chip ? pick_erase(chip, conf->delta) : NULL;
+	if (erase == NULL) {
 		printf ("Chip is not supported by this application\n");
 		return EXIT_FAILURE;
 	}
+	printf("Chip is a %s\n", chip->name);
+	conf->chip = chip;
+	conf->erase = erase;
+	conf->chip_size = chip->size;
+	conf->erase_size = erase->size;
 
-	/* Tell the programmer the chip size */
-	qiprog_set_chip_size(dev, 0, conf->chip_size);
+	/*
+	 * A chip the programmer does not switch stays on the normal read, which
+	 * reads the same data, only slower.
+	 */
+	read_cmd = pick_read_cmd(dev, chip);
+	if (read_cmd && (qiprog_set_read_command(dev, conf->chips[0],
+						 read_cmd) == QIPROG_SUCCESS)) {
+		for (i = 1; i < conf->num_chips; i++)
+			qiprog_set_read_command(dev, conf->chips[i], read_cmd);
+		printf("Reading with the %s command\n",
+		       read_cmd_names[read_cmd]);
+	}
 
-	/* Set erase/write parameters */
-	enum qiprog_erase_type erase = chip->erase_type;
-	uint32_t erase_size = chip->erase_size;
-	qiprog_set_erase_size(dev, 0, &erase, &erase_size, 1);
+	/* Run the bus as fast as the chip allows, if the programmer can */
+	if (chip->max_clock_khz) {
+		clock_khz = chip->max_clock_khz;
+		if (qiprog_set_clock(dev, &clock_khz) == QIPROG_SUCCESS)
+			printf("Bus clock set to %u kHz\n", clock_khz);
+	}
 
-	qiprog_set_erase_command(dev, 0, chip->erase_cmd,
-				 QIPROG_ERASE_SUBCMD_DEFAULT,
-				 QIPROG_ERASE_BEFORE_WRITE);
+	if (erase->typ_us)
+		printf("Erase blocks are %u KiB, %u ms each\n",
+		       erase->size / KiB, erase->typ_us / 1000);
 
-	qiprog_set_write_command(dev, 0, chip->write_cmd,
-				 QIPROG_WRITE_SUBCMD_DEFAULT);
+	/*
+	 * Delta writes only erase the blocks that changed, and skipping blank
+	 * regions only works on a chip which is already erased. Both erase
+	 * explicitly, and so does writing all chips at once.
+	 */
+	erase_flags = QIPROG_ERASE_BEFORE_WRITE;
+	if (conf->delta || conf->skip_blank || conf->all_chips)
+		erase_flags = 0;
+
+	for (i = 0; i < conf->num_chips; i++) {
+		idx = conf->chips[i];
+		/* Tell the programmer the chip size */
+		qiprog_set_chip_size(dev, idx, conf->chip_size);
+		set_erase_sizes(dev, idx, chip, erase);
+		qiprog_set_erase_command(dev, idx, chip->erase_cmd,
+					 QIPROG_ERASE_SUBCMD_DEFAULT,
+					 erase_flags);
+		qiprog_set_write_command(dev, idx, chip->write_cmd,
+					 QIPROG_WRITE_SUBCMD_DEFAULT);
+	}
 
 	return EXIT_SUCCESS;
 }
 
 /*
- * Bulk read the flash chip into memory
+ * Completion state of an asynchronous transfer of one chunk
  */
-static int bulk_read(struct qiprog_device *dev, void *buf, size_t size)
+struct chunk_xfer {
+	bool busy;
+	qiprog_err status;
+};
+
+static void chunk_cb(struct qiprog_device *dev, enum qiprog_transfer_event event,
+		     qiprog_err status, uint32_t done, uint32_t total,
+		     void *user_data)
 {
-	/* Bulk read may take a while, so get ready for it */
-	printf("Attempting to read flash chip...\n");
-	fflush(stdout);
+	struct chunk_xfer *xfer = user_data;
 
-	/* Do the deed */
-	if (qiprog_read(dev, 0, buf, size) != QIPROG_SUCCESS) {
-		printf("Failed to bulk read chip\n");
+	(void)dev;
+	(void)done;
+	(void)total;
+
+	if (event != QIPROG_TRANSFER_COMPLETE)
+		return;
+
+	xfer->status = status;
+	xfer->busy = false;
+}
+
+static qiprog_err start_chunk(struct qiprog_device *dev,
+			      struct chunk_xfer *xfer, bool write,
+			      uint32_t where, void *buf, uint32_t n)
+{
+	qiprog_err ret;
+
+	xfer->busy = true;
+	xfer->status = QIPROG_SUCCESS;
+	if (write)
+		ret = qiprog_write_async(dev, where, buf, n, chunk_cb, xfer);
+	else
+		ret = qiprog_read_async(dev, where, buf, n, chunk_cb, xfer);
+	if (ret != QIPROG_SUCCESS) {
+		xfer->busy = false;
+		xfer->status = ret;
+	}
+	return ret;
+}
+
+static qiprog_err wait_chunk(struct qiprog_context *ctx,
+			     struct chunk_xfer *xfer)
+{
+	while (xfer->busy) {
+		if (qiprog_handle_events_timeout(ctx, 1000) != QIPROG_SUCCESS)
+			return QIPROG_ERR;
+	}
+	return xfer->status;
+}
+
+/*
+ * Wait for a chunk to make it
+ *
+ * If its transfers fail, libqiprog picks up where they stopped, instead of us
+ * starting the chunk over.
+ */
+static qiprog_err finish_chunk(struct qiprog_context *ctx,
+			       struct qiprog_device *dev,
+			       struct chunk_xfer *xfer)
+{
+	if (wait_chunk(ctx, xfer) == QIPROG_SUCCESS)
+		return QIPROG_SUCCESS;
+	/* Still busy, if the events could not be handled */
+	if (xfer->busy)
+		return QIPROG_ERR;
+
+	printf("\nResuming after a failed transfer\n");
+	return qiprog_resume(dev);
+}
+
+/*
+ * Memory-mapped image file
+ */
+struct image_map {
+	uint8_t *data;
+	size_t size;
+};
+
+static int map_image(const char *filename, struct image_map *img)
+{
+	int fd;
+	struct stat st;
+
+	img->data = NULL;
+	img->size = 0;
+
+	if ((fd = open(filename, O_RDONLY)) < 0) {
+		printf("Cannot open file \"%s\"\n", filename);
+		return EXIT_FAILURE;
+	}
+
+	if (fstat(fd, &st) < 0) {
+		printf("Cannot get size of file \"%s\"\n", filename);
+		close(fd);
 		return EXIT_FAILURE;
 	}
 
+	img->size = (size_t) st.st_size;
+	if (img->size == 0) {
+		/* Nothing to map, but not an error in itself */
+		close(fd);
+		return EXIT_SUCCESS;
+	}
+
+	img->data = mmap(NULL, img->size, PROT_READ, MAP_PRIVATE, fd, 0);
+	/* The mapping stays valid after the file is closed */
+	close(fd);
+	if (img->data == MAP_FAILED) {
+		printf("Cannot map file \"%s\"\n", filename);
+		img->data = NULL;
+		return EXIT_FAILURE;
+	}
+
+	/* We go through the image once, front to back */
+	madvise(img->data, img->size, MADV_SEQUENTIAL);
+
 	return EXIT_SUCCESS;
 }
 
+static void unmap_image(struct image_map *img)
+{
+	if (img->data)
+		munmap(img->data, img->size);
+	img->data = NULL;
+}
+
 /*
- * Read chip to a file
+ * Callback for each chunk read by bulk_read()
+ */
+typedef int (*chunk_consumer) (const uint8_t *buf, uint32_t offset,
+			       uint32_t len, void *arg);
+
+/*
+ * Bulk read the flash chip, and hand it over one chunk at a time
+ *
+ * The chip is read in chunks, into two buffers used in turns. While one chunk
+ * is being consumed, the next one is already on its way over USB. Memory use
+ * does not depend on the size of the chip.
  */
-static int read_chip(struct qiprog_device *dev, const struct qiprog_cfg *conf)
+static int bulk_read(struct qiprog_context *ctx, struct qiprog_device *dev,
+		     uint32_t size, chunk_consumer consume, void *arg)
 {
 	int ret;
-	uint8_t *buf;
-	FILE *file = NULL;
+	size_t i;
+	uint32_t offset, len, next_len;
+	uint8_t *bufs[STREAM_BUFFERS] = {NULL};
+	struct chunk_xfer xfer = {.busy = false};
+	const uint32_t chunk = MIN(size, STREAM_CHUNK_SIZE);
 
 	/* Assume the worst */
 	ret = EXIT_FAILURE;
 
-	if ((buf = malloc(conf->chip_size)) == NULL) {
-		printf("Cannot allocate memory\n");
-		goto cleanup;
+	for (i = 0; i < STREAM_BUFFERS; i++) {
+		if ((bufs[i] = malloc(chunk)) == NULL) {
+			printf("Cannot allocate memory\n");
+			goto cleanup;
+		}
 	}
 
-	if ((file = fopen(conf->filename, "w")) == NULL) {
-		printf("Cannot open file \"%s\"\n", conf->filename);
+	/* Bulk read may take a while, so get ready for it */
+	printf("Attempting to read flash chip...\n");
+	fflush(stdout);
+
+	if (start_chunk(dev, &xfer, false, 0, bufs[0], chunk) != QIPROG_SUCCESS) {
+		printf("Failed to bulk read chip\n");
 		goto cleanup;
 	}
 
-	/* Do the deed */
-	if (bulk_read(dev, buf, conf->chip_size) != EXIT_SUCCESS)
-		goto cleanup;
+	for (i = 0, offset = 0; offset < size; i++, offset += len) {
+		len = MIN(chunk, size - offset);
+
+		if (finish_chunk(ctx, dev, &xfer) != QIPROG_SUCCESS) {
+			printf("\nFailed to bulk read chip\n");
+			goto cleanup;
+		}
+
+		/* Get the next chunk going before we touch this one */
+		next_len = MIN(chunk, size - offset - len);
+		if (next_len && (start_chunk(dev, &xfer, false, offset + len,
+					     bufs[(i + 1) % STREAM_BUFFERS],
+					     next_len) != QIPROG_SUCCESS)) {
+			printf("\nFailed to bulk read chip\n");
+			goto cleanup;
+		}
+
+		if (consume(bufs[i % STREAM_BUFFERS], offset, len, arg)
+		    != EXIT_SUCCESS)
+			goto cleanup;
 
-	/* Finish the deed */
-	fwrite(buf, 1, conf->chip_size, file);
+		printf("\rRead %u of %u KiB", (offset + len) / KiB, size / KiB);
+		fflush(stdout);
+	}
+	printf("\n");
 
 	/* All is good */
 	ret = EXIT_SUCCESS;
 
  cleanup:
-	free(buf);
-	if (file)
-		fclose(file);
+	/* Do not free buffers the USB stack may still be writing to */
+	wait_chunk(ctx, &xfer);
+	for (i = 0; i < STREAM_BUFFERS; i++)
+		free(bufs[i]);
 	return ret;
 }
 
-/*
- * Bulk write the flash chip
- */
-static int bulk_write(struct qiprog_device *dev, void *data, size_t size)
+static int save_chunk(const uint8_t *buf, uint32_t offset, uint32_t len,
+		      void *arg)
 {
-	/* Bulk read may take a while, so get ready for it */
-	printf("Attempting to write flash chip...\n");
-	fflush(stdout);
+	FILE *file = arg;
 
-	/* Do the deed */
-	if (qiprog_write(dev, 0, data, size) != QIPROG_SUCCESS) {
-		printf("Failed to bulk write chip\n");
+	(void)offset;
+
+	if (fwrite(buf, 1, len, file) != len) {
+		printf("\nCannot write to file\n");
 		return EXIT_FAILURE;
 	}
 
@@ -429,141 +809,1190 @@ static int bulk_write(struct qiprog_device *dev, void *data, size_t size)
 }
 
 /*
- * Write file contents to chip
+ * Read chip to a file
  */
-static int write_chip(struct qiprog_device *dev, const struct qiprog_cfg *conf)
+static int read_chip(struct qiprog_context *ctx, struct qiprog_device *dev,
+		     const struct qiprog_cfg *conf)
 {
 	int ret;
-	void *buf = NULL;
 	FILE *file;
-	size_t size;
-	long int file_size;
-
-	/* Assume the worst */
-	ret = EXIT_FAILURE;
 
-	if ((file = fopen(conf->filename, "r")) == NULL) {
+	if ((file = fopen(conf->filename, "w")) == NULL) {
 		printf("Cannot open file \"%s\"\n", conf->filename);
-		goto cleanup;
+		return EXIT_FAILURE;
 	}
 
-	/* Use the file size to tell how much to read */
-	fseek(file, 0L, SEEK_END);
-	if ((file_size = ftell(file)) < 0)
-		goto cleanup;
-	rewind(file);
+	ret = bulk_read(ctx, dev, conf->chip_size, save_chunk, file);
 
-	size = (size_t) file_size;
-	if (size != conf->chip_size) {
-		printf("File size of %lu is different than chip size of %lu\n",
-		       (unsigned long)size, (unsigned long)conf->chip_size);
-		goto cleanup;
-	}
+	fclose(file);
+	return ret;
+}
 
-	if ((buf = malloc(size)) == NULL) {
-		printf("Cannot allocate memory\n");
-		goto cleanup;
-	}
+/*
+ * Bulk write 'size' bytes of 'data' to the flash chip, starting at 'where'
+ *
+ * The data is sent one chunk at a time. While a chunk is on the wire, we ask
+ * the kernel to start fetching the next one, and let go of the pages we are
+ * done with. When the data comes from a mapped file, programming starts right
+ * away, and memory use stays flat no matter the size of the image.
+ */
+static int bulk_write(struct qiprog_context *ctx, struct qiprog_device *dev,
+		      uint32_t where, uint8_t *data, uint32_t size)
+{
+	uint32_t offset, len;
+	struct chunk_xfer xfer = {.busy = false};
+	const long page = sysconf(_SC_PAGESIZE);
+	/* madvise() only takes page-aligned addresses */
+	const bool aligned = (page > 0) && !((uintptr_t)data % page);
+
+	for (offset = 0; offset < size; offset += len) {
+		len = MIN(STREAM_CHUNK_SIZE, size - offset);
+
+		if (start_chunk(dev, &xfer, true, where + offset, data + offset,
+				len) != QIPROG_SUCCESS) {
+			printf("\nFailed to bulk write chip\n");
+			return EXIT_FAILURE;
+		}
 
-	/* Get the file contents */
-	fread(buf, 1, size, file);
+		/* Chunks start on a page, since the data does */
+		if (aligned && (offset + len < size))
+			madvise(data + offset + len,
+				MIN(STREAM_CHUNK_SIZE, size - offset - len),
+				MADV_WILLNEED);
 
-	/* Now the chip contents */
-	if (bulk_write(dev, buf, size) != EXIT_SUCCESS)
-		goto cleanup;
+		if (finish_chunk(ctx, dev, &xfer) != QIPROG_SUCCESS) {
+			printf("\nFailed to bulk write chip\n");
+			return EXIT_FAILURE;
+		}
 
-	/* All is good */
-	ret = EXIT_SUCCESS;
+		/* Only drop whole pages, or we may lose part of the next chunk */
+		if (aligned && !(len % page))
+			madvise(data + offset, len, MADV_DONTNEED);
+
+		/* Runs between blank gaps can be shorter than one KiB */
+		if (size < KiB)
+			printf("\rWrote %u of %u bytes", offset + len, size);
+		else
+			printf("\rWrote %u of %u KiB", (offset + len) / KiB,
+			       size / KiB);
+		fflush(stdout);
+	}
+	printf("\n");
 
- cleanup:
-	free(buf);
-	if (file)
-		fclose(file);
-	return ret;
+	return EXIT_SUCCESS;
 }
 
 /*
- * Verify contents of chip against file
+ * Map the image file, and make sure it fits the chip
  */
-static int verify_chip(struct qiprog_device *dev, const struct qiprog_cfg *conf)
+static int open_image(const struct qiprog_cfg *conf, struct image_map *img)
 {
-	int ret;
-	void *buf = NULL, *chip = NULL;
-	FILE *file;
-	size_t size;
-	long int file_size;
-
-	/* Assume the worst */
-	ret = EXIT_FAILURE;
+	if (map_image(conf->filename, img) != EXIT_SUCCESS)
+		return EXIT_FAILURE;
 
-	if ((file = fopen(conf->filename, "r")) == NULL) {
-		printf("Cannot open file \"%s\"\n", conf->filename);
-		goto cleanup;
+	if (img->size != conf->chip_size) {
+		printf("File size of %lu is different than chip size of %lu\n",
+		       (unsigned long)img->size, (unsigned long)conf->chip_size);
+		unmap_image(img);
+		return EXIT_FAILURE;
 	}
 
-	/* Use the file size to tell how much to read */
-	fseek(file, 0L, SEEK_END);
-	if ((file_size = ftell(file)) < 0)
-		goto cleanup;
-	rewind(file);
+	return EXIT_SUCCESS;
+}
 
-	size = (size_t) file_size;
-	if (size != conf->chip_size) {
-		printf("File size of %lu is different than chip size of %lu\n",
-		       (unsigned long)size, (unsigned long)conf->chip_size);
-		goto cleanup;
-	}
+static double get_time(void)
+{
+	struct timespec ts;
 
-	buf = malloc(size);
-	chip = malloc(size);
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
 
-	if (buf == NULL || chip == NULL) {
-		printf("Cannot allocate memory\n");
-		goto cleanup;
+/*
+ * How much of an image was left out for being blank
+ */
+struct blank_stats {
+	uint32_t written;
+	uint32_t skipped;
+	uint32_t gaps;
+	/* Time spent writing what was not blank */
+	double write_time;
+};
+
+/*
+ * Write the parts of data which are not blank, to a range that is erased
+ *
+ * Every blank gap that is skipped is printed, which gives the blank map of the
+ * range.
+ */
+static int write_data_runs(struct qiprog_context *ctx,
+			   struct qiprog_device *dev, uint32_t where,
+			   uint8_t *data, uint32_t size,
+			   struct blank_stats *stats)
+{
+	double start_time;
+	uint32_t offset, start, len;
+
+	for (offset = 0; offset < size; offset = start + len) {
+		len = qiprog_find_data(data + offset, size - offset,
+				       BLANK_MIN_GAP, &start);
+		start += offset;
+		if (len == 0)
+			start = size;
+
+		if (start != offset) {
+			printf("Skipping blank 0x%.8x -> 0x%.8x\n",
+			       where + offset, where + start - 1);
+			stats->skipped += start - offset;
+			stats->gaps++;
+		}
+		if (len == 0)
+			break;
+
+		start_time = get_time();
+		if (bulk_write(ctx, dev, where + start, data + start, len)
+		    != EXIT_SUCCESS)
+			return EXIT_FAILURE;
+		stats->write_time += get_time() - start_time;
+		stats->written += len;
 	}
 
-	/* Get the file contents */
-	fread(buf, 1, size, file);
+	return EXIT_SUCCESS;
+}
 
-	/* Now the chip contents */
-	if (bulk_read(dev, chip, size) != EXIT_SUCCESS)
-		goto cleanup;
+static void print_blank_stats(const struct blank_stats *stats)
+{
+	uint32_t total = stats->written + stats->skipped;
 
-	if (memcmp(chip, buf, size))
-		printf("Verification failed. Contents differ.\n");
-	else
-		printf("Match!!!\n");
+	if (total == 0)
+		return;
 
-	/* All is good */
-	ret = EXIT_SUCCESS;
+	printf("Skipped %u KiB of blank space in %u gaps (%u%% of data)\n",
+	       stats->skipped / KiB, stats->gaps,
+	       (unsigned int)((100ULL * stats->skipped) / total));
 
- cleanup:
-	free(buf);
-	free(chip);
-	if (file)
-		fclose(file);
-	return ret;
+	/* Assume blank space would have gone as fast as the rest */
+	if (stats->written && (stats->write_time > 0))
+		printf("Saved about %.1f seconds of transfer and programming\n",
+		       stats->write_time * stats->skipped / stats->written);
 }
 
 /*
- * Open the first QiProg device to come our way.
+ * Write file contents to chip
  */
-int qiprog_run(struct qiprog_cfg *conf)
+static int write_chip(struct qiprog_context *ctx, struct qiprog_device *dev,
+		      const struct qiprog_cfg *conf)
 {
 	int ret;
-	size_t ndevs;
-	struct qiprog_context *ctx = NULL;
-	struct qiprog_device **devs = NULL;
-	struct qiprog_device *dev = NULL;
+	struct image_map img;
 
-	/* Debug _everything_ */
-	qiprog_set_loglevel(QIPROG_LOG_SPEW);
+	if (open_image(conf, &img) != EXIT_SUCCESS)
+		return EXIT_FAILURE;
 
-	if (qiprog_init(&ctx) != QIPROG_SUCCESS) {
-		printf("libqiprog initialization failure\n");
-		ret = EXIT_FAILURE;
-		goto cleanup;
-	}
+	/* Bulk write may take a while, so get ready for it */
+	printf("Attempting to write flash chip...\n");
+	fflush(stdout);
+
+	if (conf->skip_blank) {
+		struct blank_stats stats = {0};
+
+		printf("Erasing flash chip...\n");
+		fflush(stdout);
+		if (qiprog_erase(dev, 0, 0, img.size) != QIPROG_SUCCESS) {
+			printf("Failed to erase chip\n");
+			ret = EXIT_FAILURE;
+		} else {
+			ret = write_data_runs(ctx, dev, 0, img.data, img.size,
+					      &stats);
+			print_blank_stats(&stats);
+		}
+	} else {
+		ret = bulk_write(ctx, dev, 0, img.data, img.size);
+	}
+
+	unmap_image(&img);
+	return ret;
+}
+
+/*
+ * Which blocks of the chip differ from an image
+ */
+struct delta_state {
+	const uint8_t *image;
+	uint32_t block_size;
+	/* One entry per block, set if the block needs programming */
+	bool *dirty;
+	/* Stop at the first block which differs */
+	bool fail_fast;
+	bool differ;
+	/* We stopped because of fail_fast, not because a read failed */
+	bool aborted;
+};
+
+static int mark_dirty_blocks(const uint8_t *buf, uint32_t offset, uint32_t len,
+			     void *arg)
+{
+	uint32_t pos, n;
+	struct delta_state *delta = arg;
+
+	for (pos = offset; pos < offset + len; pos += n) {
+		/* Never compare across the end of a block */
+		n = delta->block_size - (pos % delta->block_size);
+		n = MIN(n, offset + len - pos);
+		if (!memcmp(buf + (pos - offset), delta->image + pos, n))
+			continue;
+
+		delta->dirty[pos / delta->block_size] = true;
+		delta->differ = true;
+		/* Aborts the read, so we know as soon as possible */
+		if (delta->fail_fast) {
+			delta->aborted = true;
+			return EXIT_FAILURE;
+		}
+	}
+
+	return EXIT_SUCCESS;
+}
+
+/*
+ * Find the blocks of the chip whose digest differs from that of the image
+ *
+ * Fails if the device can not compute digests. Nothing is read back.
+ */
+static int diff_blocks(struct qiprog_device *dev, const uint8_t *image,
+		       uint32_t size, uint32_t block_size, bool *dirty)
+{
+	int ret = EXIT_FAILURE;
+	uint32_t i, n, nblocks, *digests;
+
+	nblocks = (size + block_size - 1) / block_size;
+	if ((digests = malloc(nblocks * sizeof(*digests))) == NULL)
+		return EXIT_FAILURE;
+
+	if (qiprog_checksum(dev, 0, size, block_size, QIPROG_CHECKSUM_CRC32,
+			    digests) != QIPROG_SUCCESS)
+		goto cleanup;
+
+	for (i = 0; i < nblocks; i++) {
+		n = MIN(block_size, size - i * block_size);
+		dirty[i] = (digests[i] !=
+			    qiprog_crc32(0, image + i * block_size, n));
+	}
+	ret = EXIT_SUCCESS;
+
+ cleanup:
+	free(digests);
+	return ret;
+}
+
+/*
+ * Compare the chip to the image by digest, and only read back the blocks which
+ * do not match
+ */
+static int checksum_verify(struct qiprog_device *dev, uint32_t size,
+			   struct delta_state *cmp)
+{
+	int ret = EXIT_FAILURE;
+	uint8_t *buf = NULL;
+	uint32_t i, n, where, nblocks;
+	bool *suspect;
+
+	nblocks = (size + cmp->block_size - 1) / cmp->block_size;
+	if ((suspect = calloc(nblocks, sizeof(*suspect))) == NULL)
+		return EXIT_FAILURE;
+	if ((buf = malloc(cmp->block_size)) == NULL)
+		goto cleanup;
+
+	if (diff_blocks(dev, cmp->image, size, cmp->block_size, suspect)
+	    != EXIT_SUCCESS)
+		goto cleanup;
+
+	/* Assume the chip is fine from here on */
+	ret = EXIT_SUCCESS;
+
+	for (i = 0; i < nblocks; i++) {
+		if (!suspect[i])
+			continue;
+		/* A digest may also mismatch because of a bad transfer */
+		where = i * cmp->block_size;
+		n = MIN(cmp->block_size, size - where);
+		if (qiprog_read(dev, where, buf, n) != QIPROG_SUCCESS) {
+			printf("Failed to read back 0x%.8x\n", where);
+			ret = EXIT_FAILURE;
+			break;
+		}
+		if (mark_dirty_blocks(buf, where, n, cmp) != EXIT_SUCCESS)
+			break;
+	}
+
+ cleanup:
+	free(buf);
+	free(suspect);
+	return ret;
+}
+
+/*
+ * Print the ranges of the chip which differ, merging consecutive blocks
+ */
+static void print_dirty_blocks(const struct delta_state *cmp, uint32_t size)
+{
+	uint32_t first, last, nblocks;
+
+	nblocks = (size + cmp->block_size - 1) / cmp->block_size;
+	for (first = 0; first < nblocks; first = last) {
+		if (!cmp->dirty[first]) {
+			last = first + 1;
+			continue;
+		}
+		for (last = first; (last < nblocks) && cmp->dirty[last]; last++)
+			;
+		printf("Contents differ in 0x%.8x -> 0x%.8x\n",
+		       first * cmp->block_size,
+		       MIN(last * cmp->block_size, size) - 1);
+	}
+}
+
+/*
+ * Verify contents of chip against file
+ *
+ * If the programmer can compute digests, only the blocks whose digest does not
+ * match are read back. Otherwise, the whole chip is, and each chunk is compared
+ * as soon as it arrives. Either way, the result is a map of the erase blocks
+ * which differ, the same one delta programming uses.
+ */
+static int verify_chip(struct qiprog_context *ctx, struct qiprog_device *dev,
+		       const struct qiprog_cfg *conf)
+{
+	int ret;
+	uint32_t nblocks;
+	struct image_map img;
+	struct delta_state cmp;
+
+	if (open_image(conf, &img) != EXIT_SUCCESS)
+		return EXIT_FAILURE;
+
+	cmp.image = img.data;
+	cmp.block_size = conf->erase_size ? conf->erase_size
+					  : CHECKSUM_BLOCK_SIZE;
+	cmp.fail_fast = conf->fail_fast;
+	cmp.differ = false;
+	cmp.aborted = false;
+	nblocks = (img.size + cmp.block_size - 1) / cmp.block_size;
+	if ((cmp.dirty = calloc(nblocks, sizeof(*cmp.dirty))) == NULL) {
+		printf("Cannot allocate memory\n");
+		unmap_image(&img);
+		return EXIT_FAILURE;
+	}
+
+	ret = checksum_verify(dev, img.size, &cmp);
+	if (ret != EXIT_SUCCESS) {
+		memset(cmp.dirty, 0, nblocks * sizeof(*cmp.dirty));
+		cmp.differ = false;
+		cmp.aborted = false;
+		ret = bulk_read(ctx, dev, img.size, mark_dirty_blocks, &cmp);
+		/* An early abort is not a read error */
+		if (cmp.aborted) {
+			printf("\n");
+			ret = EXIT_SUCCESS;
+		}
+	}
+
+	if (ret != EXIT_SUCCESS) {
+		/* What we could not read may differ too, or not */
+		printf("Verification failed. Could not read the chip.\n");
+		if (cmp.differ) {
+			print_dirty_blocks(&cmp, img.size);
+			printf("Contents also differ in what was read.\n");
+		}
+	} else if (cmp.differ) {
+		print_dirty_blocks(&cmp, img.size);
+		printf("Verification failed. Contents differ.\n");
+		ret = EXIT_FAILURE;
+	} else {
+		printf("Match!!!\n");
+	}
+
+	free(cmp.dirty);
+	unmap_image(&img);
+	return ret;
+}
+
+/*
+ * Write file contents to every chip found by identify_chip()
+ *
+ * The chips are not written one after the other. libqiprog erases and writes
+ * them one chunk at a time, in turn, so that a chip is erasing while the others
+ * are being written.
+ */
+static int write_chips(struct qiprog_device *dev, const struct qiprog_cfg *conf)
+{
+	qiprog_err ret;
+	uint32_t chunk;
+	double start_time;
+	struct image_map img;
+
+	if (open_image(conf, &img) != EXIT_SUCCESS)
+		return EXIT_FAILURE;
+
+	/* Every chunk erases whole blocks, and nothing more */
+	chunk = STREAM_CHUNK_SIZE;
+	if (conf->erase_size)
+		chunk = (chunk < conf->erase_size) ? conf->erase_size :
+			chunk - chunk % conf->erase_size;
+
+	printf("Attempting to write %zu flash chips...\n", conf->num_chips);
+	fflush(stdout);
+
+	start_time = get_time();
+	ret = qiprog_write_chips(dev, conf->chips, conf->num_chips, 0,
+				 img.data, img.size, chunk);
+	if (ret == QIPROG_SUCCESS)
+		printf("Wrote %u KiB to each chip in %.1f seconds\n",
+		       (unsigned int)(img.size / KiB), get_time() - start_time);
+	else
+		printf("Failed to write chips\n");
+
+	unmap_image(&img);
+	return (ret == QIPROG_SUCCESS) ? EXIT_SUCCESS : EXIT_FAILURE;
+}
+
+/*
+ * Verify every chip found by identify_chip() against the file
+ */
+static int verify_chips(struct qiprog_context *ctx, struct qiprog_device *dev,
+			const struct qiprog_cfg *conf)
+{
+	size_t i;
+	int ret = EXIT_SUCCESS;
+
+	for (i = 0; (i < conf->num_chips) && (ret == EXIT_SUCCESS); i++) {
+		printf("Chip %u:\n", conf->chips[i]);
+		if (qiprog_select_chip(dev, conf->chips[i]) != QIPROG_SUCCESS) {
+			printf("Could not select chip %u\n", conf->chips[i]);
+			ret = EXIT_FAILURE;
+			break;
+		}
+		ret = verify_chip(ctx, dev, conf);
+	}
+
+	qiprog_select_chip(dev, 0);
+	return ret;
+}
+
+/*
+ * Find the blocks of a chunk which may not have made it to the chip
+ *
+ * Digests are compared when the programmer can compute them. That only takes
+ * control requests, so it can be done while the next chunk is being written.
+ * Without digests, every block of the chunk has to be read back.
+ */
+static void check_chunk(struct qiprog_device *dev, const uint8_t *image,
+			uint32_t offset, uint32_t len, uint32_t block_size,
+			uint32_t *digests, bool *use_digests, bool *suspect)
+{
+	uint32_t i, n, where;
+	const uint32_t first = offset / block_size;
+	const uint32_t nblocks = (len + block_size - 1) / block_size;
+
+	if (*use_digests &&
+	    (qiprog_checksum(dev, offset, len, block_size,
+			     QIPROG_CHECKSUM_CRC32, digests) != QIPROG_SUCCESS))
+		*use_digests = false;
+
+	for (i = 0; i < nblocks; i++) {
+		where = offset + i * block_size;
+		n = MIN(block_size, offset + len - where);
+		suspect[first + i] = !*use_digests ||
+			(digests[i] != qiprog_crc32(0, image + where, n));
+	}
+}
+
+/*
+ * Read back the suspect blocks, and mark the ones which differ as dirty
+ *
+ * A digest may also mismatch because of a bad transfer, so only blocks whose
+ * contents differ are dirty.
+ */
+static int read_back_blocks(struct qiprog_device *dev, uint32_t size,
+			    bool *suspect, uint8_t *buf,
+			    struct delta_state *cmp, uint32_t *nread)
+{
+	uint32_t i, n, where, nblocks;
+
+	nblocks = (size + cmp->block_size - 1) / cmp->block_size;
+	for (i = 0; i < nblocks; i++) {
+		if (!suspect[i])
+			continue;
+		suspect[i] = false;
+
+		where = i * cmp->block_size;
+		n = MIN(cmp->block_size, size - where);
+		if (qiprog_read(dev, where, buf, n) != QIPROG_SUCCESS) {
+			printf("Failed to read back 0x%.8x\n", where);
+			return EXIT_FAILURE;
+		}
+		(*nread)++;
+		/* Blocks which match again are no longer dirty */
+		cmp->dirty[i] = false;
+		mark_dirty_blocks(buf, where, n, cmp);
+	}
+
+	return EXIT_SUCCESS;
+}
+
+/*
+ * Write file contents to chip, and verify them on the way
+ *
+ * While chunk N is being written, the digests of chunk N - 1 are compared. The
+ * blocks whose digest differs are read back at the end. Only the blocks which
+ * really differ are written again, which erases them first. Everything is then
+ * summed up once.
+ */
+static int write_verify_chip(struct qiprog_context *ctx,
+			     struct qiprog_device *dev,
+			     const struct qiprog_cfg *conf)
+{
+	int ret = EXIT_FAILURE;
+	uint32_t i, chunk, offset, len, prev_len, nblocks, where, n;
+	uint32_t nread = 0, rewritten = 0;
+	uint32_t *digests = NULL;
+	uint8_t *buf = NULL;
+	bool *suspect = NULL;
+	bool use_digests = true;
+	double start_time;
+	struct image_map img;
+	struct delta_state cmp = {.dirty = NULL};
+	struct chunk_xfer xfer = {.busy = false};
+
+	if (open_image(conf, &img) != EXIT_SUCCESS)
+		return EXIT_FAILURE;
+
+	cmp.image = img.data;
+	cmp.block_size = conf->erase_size ? conf->erase_size
+					  : CHECKSUM_BLOCK_SIZE;
+	cmp.fail_fast = false;
+	cmp.differ = false;
+
+	/* Chunks hold whole blocks, so that their digests line up */
+	chunk = STREAM_CHUNK_SIZE;
+	chunk = (chunk < cmp.block_size) ? cmp.block_size :
+		chunk - chunk % cmp.block_size;
+
+	nblocks = (img.size + cmp.block_size - 1) / cmp.block_size;
+	cmp.dirty = calloc(nblocks, sizeof(*cmp.dirty));
+	suspect = calloc(nblocks, sizeof(*suspect));
+	digests = malloc((chunk / cmp.block_size) * sizeof(*digests));
+	buf = malloc(cmp.block_size);
+	if (!cmp.dirty || !suspect || !digests || !buf) {
+		printf("Cannot allocate memory\n");
+		goto cleanup;
+	}
+
+	printf("Attempting to write and verify flash chip...\n");
+	fflush(stdout);
+
+	start_time = get_time();
+	for (offset = 0, prev_len = 0; offset < img.size; offset += len) {
+		len = MIN(chunk, img.size - offset);
+
+		if (start_chunk(dev, &xfer, true, offset, img.data + offset,
+				len) != QIPROG_SUCCESS) {
+			printf("\nFailed to bulk write chip\n");
+			goto cleanup;
+		}
+
+		/* The previous chunk is checked while this one is written */
+		if (prev_len)
+			check_chunk(dev, img.data, offset - prev_len, prev_len,
+				    cmp.block_size, digests, &use_digests,
+				    suspect);
+
+		if (finish_chunk(ctx, dev, &xfer) != QIPROG_SUCCESS) {
+			printf("\nFailed to bulk write chip\n");
+			goto cleanup;
+		}
+		prev_len = len;
+
+		printf("\rWrote %u of %u KiB", (offset + len) / KiB,
+		       (uint32_t)img.size / KiB);
+		fflush(stdout);
+	}
+	printf("\n");
+	if (prev_len)
+		check_chunk(dev, img.data, offset - prev_len, prev_len,
+			    cmp.block_size, digests, &use_digests, suspect);
+
+	if (!use_digests)
+		printf("The programmer can not compute digests. "
+		       "Reading everything back.\n");
+
+	if (read_back_blocks(dev, img.size, suspect, buf, &cmp, &nread)
+	    != EXIT_SUCCESS)
+		goto cleanup;
+
+	/*
+	 * Writing a block again erases it first. That only works if we know
+	 * the size of the erase blocks.
+	 */
+	for (n = 0; conf->erase_size && cmp.differ && (n < REWRITE_RETRIES);
+	     n++) {
+		cmp.differ = false;
+		for (i = 0; i < nblocks; i++) {
+			if (!cmp.dirty[i])
+				continue;
+			where = i * cmp.block_size;
+			printf("Writing 0x%.8x again\n", where);
+			if (qiprog_write(dev, where, img.data + where,
+					 MIN(cmp.block_size,
+					     (uint32_t)img.size - where))
+			    != QIPROG_SUCCESS) {
+				printf("Failed to write 0x%.8x\n", where);
+				goto cleanup;
+			}
+			rewritten++;
+			suspect[i] = true;
+		}
+		if (read_back_blocks(dev, img.size, suspect, buf, &cmp, &nread)
+		    != EXIT_SUCCESS)
+			goto cleanup;
+	}
+
+	printf("Wrote %u KiB in %.1f seconds, read back %u of %u blocks, "
+	       "wrote %u blocks again\n", (uint32_t)img.size / KiB,
+	       get_time() - start_time, nread, nblocks, rewritten);
+	if (cmp.differ) {
+		print_dirty_blocks(&cmp, img.size);
+		printf("Verification failed. Contents differ.\n");
+	} else {
+		printf("Match!!!\n");
+		ret = EXIT_SUCCESS;
+	}
+
+ cleanup:
+	/* Do not unmap data the USB stack may still be reading */
+	wait_chunk(ctx, &xfer);
+	free(buf);
+	free(digests);
+	free(suspect);
+	free(cmp.dirty);
+	unmap_image(&img);
+	return ret;
+}
+
+/*
+ * Plan the erases which cover the dirty blocks in the least time
+ *
+ * Erasing a block is about as slow as erasing a sector, so a block erase wins
+ * when enough of its sectors changed, and a chip erase when most of the chip
+ * did. Everything erased is programmed again, and the planner counts that too.
+ */
+static int plan_erases(const struct qiprog_cfg *conf,
+		       const struct delta_state *delta, uint32_t nblocks,
+		       struct qiprog_erase_plan *plan)
+{
+	int ret = EXIT_FAILURE;
+	size_t i, num_dirty = 0;
+	uint32_t first, last, ndirty = 0, program_ns = 0;
+	uint64_t plain_us;
+	const struct flash_chip *chip = conf->chip;
+	const struct chip_erase *erase;
+	struct qiprog_erase_op ops[CHIP_MAX_ERASES];
+	struct qiprog_erase_run uniform[CHIP_MAX_ERASES];
+	struct qiprog_range *dirty;
+
+	for (i = 0; i < chip->num_erases; i++) {
+		erase = &chip->erases[i];
+		ops[i].type = erase->type;
+		ops[i].time_us = erase->typ_us;
+		ops[i].runs = erase->runs;
+		ops[i].num_runs = erase->num_runs;
+		if (erase->size == 0)
+			continue;
+		uniform[i].start = 0;
+		uniform[i].size = erase->size;
+		uniform[i].count = chip->size / erase->size;
+		ops[i].runs = &uniform[i];
+		ops[i].num_runs = 1;
+	}
+	if (chip->page_size)
+		program_ns = (uint64_t)chip->program_typ_us * 1000 /
+			     chip->page_size;
+
+	if ((dirty = malloc(nblocks * sizeof(*dirty))) == NULL) {
+		printf("Cannot allocate memory\n");
+		return EXIT_FAILURE;
+	}
+	for (first = 0; first < nblocks; first = last) {
+		if (!delta->dirty[first]) {
+			last = first + 1;
+			continue;
+		}
+		for (last = first; last < nblocks; last++)
+			if (!delta->dirty[last])
+				break;
+		dirty[num_dirty].start = first * delta->block_size;
+		dirty[num_dirty++].len = (last - first) * delta->block_size;
+		ndirty += last - first;
+	}
+
+	if (qiprog_plan_erase(ops, chip->num_erases, dirty, num_dirty,
+			      program_ns, plan) != QIPROG_SUCCESS) {
+		printf("Cannot plan erases for this chip\n");
+		goto cleanup;
+	}
+
+	plain_us = (uint64_t)ndirty * (conf->erase->typ_us +
+				       (uint64_t)delta->block_size *
+				       program_ns / 1000);
+	printf("Planned %zu erase steps, %llu KiB, about %llu ms, instead of "
+	       "%llu ms\n", plan->num_steps,
+	       (unsigned long long)plan->erased / KiB,
+	       (unsigned long long)plan->time_us / 1000,
+	       (unsigned long long)plain_us / 1000);
+
+	ret = EXIT_SUCCESS;
+ cleanup:
+	free(dirty);
+	return ret;
+}
+
+/*
+ * Write file contents to chip, but only the erase blocks which changed
+ *
+ * The current contents of the chip come from an image the user tells us is
+ * already on the chip, from digests computed by the programmer, or from reading
+ * it back, in that order of preference. Consecutive blocks which differ are
+ * erased and programmed together.
+ */
+static int delta_write_chip(struct qiprog_context *ctx,
+			    struct qiprog_device *dev,
+			    const struct qiprog_cfg *conf)
+{
+	int ret;
+	size_t i;
+	uint32_t first, nblocks, ndirty, where, n, block_size;
+	enum qiprog_erase_type type;
+	struct image_map img, base;
+	struct delta_state delta;
+	struct blank_stats stats = {0};
+	struct qiprog_erase_plan plan = {0};
+	const struct qiprog_erase_step *step;
+
+	if (conf->erase_size == 0) {
+		printf("Erase geometry of chip is unknown\n");
+		return EXIT_FAILURE;
+	}
+
+	if (open_image(conf, &img) != EXIT_SUCCESS)
+		return EXIT_FAILURE;
+
+	/* Assume the worst */
+	ret = EXIT_FAILURE;
+	type = conf->erase->type;
+	block_size = conf->erase->size;
+
+	nblocks = (img.size + conf->erase_size - 1) / conf->erase_size;
+	delta.image = img.data;
+	delta.block_size = conf->erase_size;
+	delta.fail_fast = false;
+	delta.differ = false;
+	if ((delta.dirty = calloc(nblocks, sizeof(*delta.dirty))) == NULL) {
+		printf("Cannot allocate memory\n");
+		goto cleanup;
+	}
+
+	if (conf->base) {
+		if (map_image(conf->base, &base) != EXIT_SUCCESS)
+			goto cleanup;
+		if (base.size != img.size) {
+			printf("Base image is not the same size as the chip\n");
+			unmap_image(&base);
+			goto cleanup;
+		}
+		mark_dirty_blocks(base.data, 0, base.size, &delta);
+		unmap_image(&base);
+	} else if ((diff_blocks(dev, img.data, img.size, conf->erase_size,
+				delta.dirty) != EXIT_SUCCESS) &&
+		   (bulk_read(ctx, dev, img.size, mark_dirty_blocks, &delta)
+		    != EXIT_SUCCESS)) {
+		goto cleanup;
+	}
+
+	for (ndirty = 0, first = 0; first < nblocks; first++)
+		ndirty += delta.dirty[first];
+	printf("%u of %u erase blocks differ\n", ndirty, nblocks);
+
+	if (plan_erases(conf, &delta, nblocks, &plan) != EXIT_SUCCESS)
+		goto cleanup;
+
+	/* Each step erases with blocks of its own size */
+	for (i = 0; i < plan.num_steps; i++) {
+		step = &plan.steps[i];
+		if ((step->type != type) || (step->block_size != block_size)) {
+			type = step->type;
+			block_size = step->block_size;
+			if (qiprog_set_erase_size(dev, 0, &type, &block_size, 1)
+			    != QIPROG_SUCCESS) {
+				printf("Failed to set erase size\n");
+				goto cleanup;
+			}
+		}
+
+		where = step->start;
+		n = MIN(step->len, img.size - where);
+
+		printf("Programming 0x%.8x -> 0x%.8x\n", where, where + n - 1);
+		if (qiprog_erase(dev, 0, where, n) != QIPROG_SUCCESS) {
+			printf("Failed to erase chip\n");
+			goto cleanup;
+		}
+		if (write_data_runs(ctx, dev, where, img.data + where, n,
+				    &stats) != EXIT_SUCCESS)
+			goto cleanup;
+	}
+	/* Nothing to say about blank space unless asked, or some was skipped */
+	if (conf->skip_blank || stats.gaps)
+		print_blank_stats(&stats);
+
+	/* All is good */
+	ret = EXIT_SUCCESS;
+
+ cleanup:
+	if ((type != conf->erase->type) || (block_size != conf->erase->size))
+		set_erase_sizes(dev, 0, conf->chip, conf->erase);
+	qiprog_free_erase_plan(&plan);
+	free(delta.dirty);
+	unmap_image(&img);
+	return ret;
+}
+
+/*
+ * Check if a device's serial number is in a comma-separated list of serials.
+ * An empty list matches every device.
+ */
+static bool serial_wanted(const char *list, const char *serial)
+{
+	size_t len;
+	const char *next;
+
+	if (list == NULL)
+		return true;
+	if (serial == NULL)
+		return false;
+
+	len = strlen(serial);
+	while (*list) {
+		next = strchr(list, ',');
+		if (next == NULL)
+			next = list + strlen(list);
+		if (((size_t)(next - list) == len) && !strncmp(list, serial, len))
+			return true;
+		list = (*next == ',') ? next + 1 : next;
+	}
+
+	return false;
+}
+
+/*==============================================================================
+ *= Gang programming
+ *------------------------------------------------------------------------------
+ * Run the same operation on several devices at once. Every device gets its own
+ * bulk operation, and all of them make progress from a single event loop.
+ */
+struct gang_unit {
+	struct qiprog_device *dev;
+	/* Copy of the configuration, with the chip size of this unit */
+	struct qiprog_cfg conf;
+	/* Contents read from the chip, for read and verify */
+	uint8_t *buf;
+	uint32_t done;
+	uint32_t total;
+	bool busy;
+	/* Why the unit failed, or NULL if it did not */
+	const char *failure;
+};
+
+static const char *gang_serial(struct gang_unit *unit)
+{
+	const char *serial = qiprog_get_serial(unit->dev);
+	return serial ? serial : "no serial";
+}
+
+static void gang_cb(struct qiprog_device *dev, enum qiprog_transfer_event event,
+		    qiprog_err status, uint32_t done, uint32_t total,
+		    void *user_data)
+{
+	struct gang_unit *unit = user_data;
+
+	(void)dev;
+
+	unit->done = done;
+	unit->total = total;
+
+	if (event != QIPROG_TRANSFER_COMPLETE)
+		return;
+
+	unit->busy = false;
+	if (status != QIPROG_SUCCESS)
+		unit->failure = "bulk transfer failed";
+}
+
+static void gang_print_progress(struct gang_unit *units, size_t nunits)
+{
+	size_t i;
+
+	printf("\r");
+	for (i = 0; i < nunits; i++) {
+		if (units[i].failure && !units[i].total)
+			printf(" [%zu] ----", i);
+		else if (units[i].total)
+			printf(" [%zu] %3u%%", i, (unsigned int)
+			       ((100ULL * units[i].done) / units[i].total));
+		else
+			printf(" [%zu]   0%%", i);
+	}
+	fflush(stdout);
+}
+
+/*
+ * Start the bulk operation of every unit, and wait for all of them to finish
+ */
+static void gang_transfer(struct qiprog_context *ctx, struct gang_unit *units,
+			  size_t nunits, void *image)
+{
+	size_t i;
+	bool busy;
+	qiprog_err ret;
+	struct gang_unit *unit;
+
+	for (i = 0; i < nunits; i++) {
+		unit = &units[i];
+		if (unit->failure)
+			continue;
+
+		unit->busy = true;
+		if (unit->conf.action == ACTION_WRITE)
+			ret = qiprog_write_async(unit->dev, 0, image,
+						 unit->conf.chip_size, gang_cb,
+						 unit);
+		else
+			ret = qiprog_read_async(unit->dev, 0, unit->buf,
+						unit->conf.chip_size, gang_cb,
+						unit);
+		if (ret != QIPROG_SUCCESS) {
+			unit->busy = false;
+			unit->failure = "could not start bulk transfer";
+		}
+	}
+
+	do {
+		gang_print_progress(units, nunits);
+		if (qiprog_handle_events_timeout(ctx, 250) != QIPROG_SUCCESS) {
+			printf("\nError handling USB events\n");
+			break;
+		}
+		busy = false;
+		for (i = 0; i < nunits; i++)
+			busy |= units[i].busy;
+	} while (busy);
+
+	gang_print_progress(units, nunits);
+	printf("\n");
+}
+
+/*
+ * Save what was read from each unit to <filename>.<unit number>
+ */
+static void gang_save(struct gang_unit *units, size_t nunits)
+{
+	size_t i;
+	char *name;
+	FILE *file;
+	struct gang_unit *unit;
+
+	for (i = 0; i < nunits; i++) {
+		unit = &units[i];
+		if (unit->failure)
+			continue;
+
+		name = malloc(strlen(unit->conf.filename) + 24);
+		if (name == NULL) {
+			unit->failure = "cannot allocate memory";
+			continue;
+		}
+		sprintf(name, "%s.%zu", unit->conf.filename, i);
+
+		if ((file = fopen(name, "w")) == NULL) {
+			printf("Cannot open file \"%s\"\n", name);
+			unit->failure = "cannot open output file";
+		} else {
+			if (fwrite(unit->buf, 1, unit->conf.chip_size, file)
+			    != unit->conf.chip_size)
+				unit->failure = "cannot write output file";
+			fclose(file);
+		}
+		free(name);
+	}
+}
+
+static int gang_run(struct qiprog_context *ctx, struct qiprog_device **devs,
+		    size_t ndevs, const struct qiprog_cfg *conf)
+{
+	int ret;
+	size_t i, nunits = 0;
+	struct image_map img = {.data = NULL, .size = 0};
+	struct gang_unit *unit, *units;
+
+	if ((units = calloc(ndevs, sizeof(*units))) == NULL) {
+		printf("Cannot allocate memory\n");
+		return EXIT_FAILURE;
+	}
+
+	/* Open every device we are asked to use */
+	for (i = 0; i < ndevs; i++) {
+		if (qiprog_open_device(devs[i]) != QIPROG_SUCCESS) {
+			printf("Error opening device\n");
+			continue;
+		}
+		if (!serial_wanted(conf->serials, qiprog_get_serial(devs[i]))) {
+			qiprog_close_device(devs[i]);
+			continue;
+		}
+
+		unit = &units[nunits];
+		unit->dev = devs[i];
+		unit->conf = *conf;
+		unit->conf.chip_size = 0;
+
+		printf("Device %zu (%s):\n", nunits, gang_serial(unit));
+		if (print_device_info(unit->dev) != EXIT_SUCCESS)
+			unit->failure = "cannot query device";
+		else if (identify_chip(unit->dev, &unit->conf) != EXIT_SUCCESS)
+			unit->failure = "chip not identified";
+		nunits++;
+	}
+
+	if (nunits == 0) {
+		printf("No device found\n");
+		free(units);
+		return EXIT_FAILURE;
+	}
+
+	/* All units work from one copy of the image */
+	if ((conf->action == ACTION_WRITE) || (conf->action == ACTION_VERIFY)) {
+		if (map_image(conf->filename, &img) != EXIT_SUCCESS) {
+			ret = EXIT_FAILURE;
+			goto cleanup;
+		}
+	}
+
+	for (i = 0; i < nunits; i++) {
+		unit = &units[i];
+		if (unit->failure)
+			continue;
+
+		if (conf->action == ACTION_TEST_DEV) {
+			printf("Testing device %zu\n", i);
+			if (run_tests(unit->dev) != EXIT_SUCCESS)
+				unit->failure = "device test failed";
+			continue;
+		}
+
+		if (img.data && (img.size != unit->conf.chip_size)) {
+			printf("File size of %lu is different than chip size of "
+			       "%lu on device %zu\n", (unsigned long)img.size,
+			       (unsigned long)unit->conf.chip_size, i);
+			unit->failure = "image does not match chip size";
+			continue;
+		}
+
+		if (conf->action == ACTION_WRITE)
+			continue;
+
+		if ((unit->buf = malloc(unit->conf.chip_size)) == NULL)
+			unit->failure = "cannot allocate memory";
+	}
+
+	if (conf->action != ACTION_TEST_DEV) {
+		printf("Attempting to %s flash chips...\n",
+		       (conf->action == ACTION_WRITE) ? "write" : "read");
+		fflush(stdout);
+		gang_transfer(ctx, units, nunits, img.data);
+	}
+
+	if (conf->action == ACTION_READ)
+		gang_save(units, nunits);
+
+	if (conf->action == ACTION_VERIFY) {
+		for (i = 0; i < nunits; i++) {
+			unit = &units[i];
+			if (unit->failure)
+				continue;
+			if (memcmp(unit->buf, img.data, img.size))
+				unit->failure = "contents differ";
+		}
+	}
+
+	/* Summary */
+	ret = EXIT_SUCCESS;
+	printf("\n");
+	for (i = 0; i < nunits; i++) {
+		unit = &units[i];
+		printf("Device %zu (%s): %s%s%s\n", i, gang_serial(unit),
+		       unit->failure ? "FAIL (" : "PASS",
+		       unit->failure ? unit->failure : "",
+		       unit->failure ? ")" : "");
+		if (unit->failure)
+			ret = EXIT_FAILURE;
+	}
+
+ cleanup:
+	for (i = 0; i < nunits; i++) {
+		free(units[i].buf);
+		qiprog_close_device(units[i].dev);
+	}
+	free(units);
+	unmap_image(&img);
+	return ret;
+}
+
+/*
+ * Print what libqiprog had to say, after something went wrong
+ */
+static void dump_log(void)
+{
+	char *buf;
+
+	if ((buf = malloc(LOG_RING_SIZE + 1)) == NULL)
+		return;
+
+	if (qiprog_read_log_ring(buf, LOG_RING_SIZE + 1))
+		printf("Last messages from libqiprog:\n%s", buf);
+	free(buf);
+}
+
+/*
+ * Open the first QiProg device to come our way, or all of them in gang mode.
+ */
+int qiprog_run(struct qiprog_cfg *conf)
+{
+	int ret;
+	size_t i, ndevs;
+	struct qiprog_context *ctx = NULL;
+	struct qiprog_device **devs = NULL;
+	struct qiprog_device *dev = NULL;
+
+	/* Debug _everything_ */
+	qiprog_set_loglevel(QIPROG_LOG_SPEW);
+	/* But only print it if asked to, or if something goes wrong */
+	if (!conf->verbose)
+		qiprog_set_log_ring(LOG_RING_SIZE);
+
+	if (qiprog_init(&ctx) != QIPROG_SUCCESS) {
+		printf("libqiprog initialization failure\n");
+		ret = EXIT_FAILURE;
+		goto cleanup;
+	}
 
 	ndevs = qiprog_get_device_list(ctx, &devs);
 	if (!ndevs) {
@@ -572,11 +2001,26 @@ int qiprog_run(struct qiprog_cfg *conf)
 		goto cleanup;
 	}
 
-	/* Choose the first device for now */
-	dev = devs[0];
+	if (conf->gang) {
+		ret = gang_run(ctx, devs, ndevs, conf);
+		goto cleanup;
+	}
 
-	if (qiprog_open_device(dev) != QIPROG_SUCCESS) {
-		printf("Error opening device\n");
+	/* Choose the first device we are allowed to use */
+	for (i = 0; i < ndevs; i++) {
+		if (qiprog_open_device(devs[i]) != QIPROG_SUCCESS) {
+			printf("Error opening device\n");
+			continue;
+		}
+		if (serial_wanted(conf->serials, qiprog_get_serial(devs[i]))) {
+			dev = devs[i];
+			break;
+		}
+		qiprog_close_device(devs[i]);
+	}
+
+	if (dev == NULL) {
+		printf("No matching device found\n");
 		ret = EXIT_FAILURE;
 		goto cleanup;
 	}
@@ -602,13 +2046,23 @@ int qiprog_run(struct qiprog_cfg *conf)
 		ret = run_tests(dev);
 		break;
 	case ACTION_READ:
-		ret = read_chip(dev, conf);
+		ret = read_chip(ctx, dev, conf);
 		break;
 	case ACTION_WRITE:
-		ret = write_chip(dev, conf);
+		if (conf->delta)
+			ret = delta_write_chip(ctx, dev, conf);
+		else if (conf->write_verify)
+			ret = write_verify_chip(ctx, dev, conf);
+		else if (conf->all_chips)
+			ret = write_chips(dev, conf);
+		else
+			ret = write_chip(ctx, dev, conf);
 		break;
 	case ACTION_VERIFY:
-		ret = verify_chip(dev, conf);
+		if (conf->all_chips)
+			ret = verify_chips(ctx, dev, conf);
+		else
+			ret = verify_chip(ctx, dev, conf);
 		break;
 	default:
 		/* Do nothing */
@@ -616,14 +2070,15 @@ int qiprog_run(struct qiprog_cfg *conf)
 	}
 
  cleanup:
-	if (dev) {
-		/* TODO: close device */
-	}
-	if (devs) {
-		/* TODO: clean up device list */
-	}
+	if (dev)
+		qiprog_close_device(dev);
+	qiprog_free_device_list(devs);
 	if (ctx)
 		qiprog_exit(ctx);
 
+	if (ret != EXIT_SUCCESS)
+		dump_log();
+	qiprog_set_log_ring(0);
+
 	return ret;
 }
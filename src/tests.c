@@ -105,10 +105,98 @@ int stress_test_device(struct qiprog_device *dev)
 	return EXIT_SUCCESS;
 }
 
+/*
+ * Do the same accesses in one batch, and check they give the same results
+ */
+int batch_test_device(struct qiprog_device *dev)
+{
+	uint8_t reg8;
+	uint16_t reg16;
+	uint32_t reg32;
+	qiprog_err ret;
+	struct qiprog_op ops[] = {
+		{QIPROG_OP_READ8, 0, 0},
+		{QIPROG_OP_READ16, 0, 0},
+		{QIPROG_OP_READ32, 0, 0},
+		{QIPROG_OP_WRITE8, 0, 0xdb},
+		{QIPROG_OP_WRITE16, 0, 0xd0b1},
+		{QIPROG_OP_WRITE32, 0, 0x00c0ffee},
+	};
+
+	ret = qiprog_exec_batch(dev, ops, sizeof(ops) / sizeof(ops[0]));
+	if (ret != QIPROG_SUCCESS) {
+		printf("batch failure\n");
+		return EXIT_FAILURE;
+	}
+	printf("batch worked\n");
+
+	if ((qiprog_read8(dev, 0, &reg8) != QIPROG_SUCCESS) ||
+	    (qiprog_read16(dev, 0, &reg16) != QIPROG_SUCCESS) ||
+	    (qiprog_read32(dev, 0, &reg32) != QIPROG_SUCCESS)) {
+		printf("read failure after batch\n");
+		return EXIT_FAILURE;
+	}
+
+	if ((ops[0].data != reg8) || (ops[1].data != reg16) ||
+	    (ops[2].data != reg32)) {
+		printf("batch reads differ from single reads\n");
+		return EXIT_FAILURE;
+	}
+	printf("batch reads match\n");
+
+	return EXIT_SUCCESS;
+}
+
+/*
+ * Read the same registers with a program, and check it sees the same values
+ */
+int program_test_device(struct qiprog_device *dev)
+{
+	uint8_t reg8;
+	uint16_t out_len;
+	qiprog_err ret;
+	uint8_t out[8];
+	uint8_t prog[] = {
+		/* r0 = 0; r2 = 4 */
+		QIPROG_ISA_SET, QIPROG_ISA_REGS(0, 0), 0, 0, 0, 0,
+		QIPROG_ISA_SET, QIPROG_ISA_REGS(2, 0), 4, 0, 0, 0,
+		/* do { r1 = read8(r0); out(r1) } while (--r2) */
+		QIPROG_ISA_RD8, QIPROG_ISA_REGS(1, 0),
+		QIPROG_ISA_OUT8, QIPROG_ISA_REGS(1, 0),
+		QIPROG_ISA_DJNZ, QIPROG_ISA_REGS(2, 0), 12, 0,
+		QIPROG_ISA_END,
+	};
+
+	ret = qiprog_run_program(dev, prog, sizeof(prog), out, sizeof(out),
+				 &out_len);
+	if (ret != QIPROG_SUCCESS) {
+		printf("program failure\n");
+		return EXIT_FAILURE;
+	}
+	printf("program worked\n");
+
+	if (qiprog_read8(dev, 0, &reg8) != QIPROG_SUCCESS) {
+		printf("read8 failure after program\n");
+		return EXIT_FAILURE;
+	}
+
+	if ((out_len != 4) || (out[0] != reg8) || (out[3] != reg8)) {
+		printf("program output differs from single reads\n");
+		return EXIT_FAILURE;
+	}
+	printf("program output matches\n");
+
+	return EXIT_SUCCESS;
+}
+
 int run_tests(struct qiprog_device *dev)
 {
 	if (stress_test_device(dev) != EXIT_SUCCESS)
 		return EXIT_FAILURE;
+	if (batch_test_device(dev) != EXIT_SUCCESS)
+		return EXIT_FAILURE;
+	if (program_test_device(dev) != EXIT_SUCCESS)
+		return EXIT_FAILURE;
 
 	return EXIT_SUCCESS;
 }